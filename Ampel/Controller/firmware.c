@@ -22,47 +22,462 @@
 #include <stdint.h>
 
 #include "usitwislave.h"
+#include "i3c_protocol.h"
+
+#define FW_VERSION 0x07
+
+// eine zweite Ampel am selben Bus braucht eine andere Adresse: make ADDR=0x21
+#ifndef AMPEL_ADDR
+#define AMPEL_ADDR I3C_ADDR_AMPEL
+#endif
 
 #define LED_INTERNAL
 //#define LED_EXTERNAL
 
 
-inline void setPortB(char mask) {
-  PORTB = PORTB | mask;
+const uint8_t COLOR_NONE  = AMPEL_VAL_NONE;
+const uint8_t COLOR_RED   = AMPEL_VAL_RED;
+const uint8_t COLOR_GREEN = AMPEL_VAL_GREEN;
+
+///// Scheduler /////
+
+/*
+ * Tickless: Timer0 laeuft im CTC-Modus mit CK/1024 (128 us) und wird nur
+ * bis zur naechsten Frist programmiert, laengstens 256 Zaehlschritte. Ohne
+ * Aufgaben steht der Timer, der Controller schlaeft bis zum naechsten
+ * I2C-Start.
+ *
+ * Die Fristen zaehlen ab dem Beginn des laufenden Intervalls, der
+ * Compare-Interrupt zieht die Laenge des Intervalls ab.
+ */
+#define SCHED_PRESCALER 1024
+#define SCHED_CLOCK ((1 << CS02) | (1 << CS00))
+#define SCHED_COUNTS(ms) ((uint32_t)(ms) * (F_CPU / 1000) / SCHED_PRESCALER)
+
+enum {
+  TASK_FADE,
+  TASK_BLINK,
+  TASK_PATTERN,
+  TASKS
+};
+
+volatile uint32_t task_due[TASKS];
+volatile uint8_t task_active;
+
+/*
+ * Zaehlschritte seit Beginn des Intervalls, auch wenn der Compare-Interrupt
+ * schon ansteht
+ */
+uint16_t schedElapsed() {
+  uint16_t elapsed = TCNT0;
+
+  if (TIFR & (1 << OCF0A))
+    elapsed += OCR0A + 1;
+
+  return elapsed;
+}
+
+void schedProgram() {
+  uint32_t next = 256;
+  uint8_t t;
+
+  for (t = 0; t < TASKS; t++)
+    if ((task_active & (1 << t)) && (task_due[t] < next))
+      next = task_due[t];
+
+  if (!task_active) {
+    TCCR0B = 0;
+    TCNT0  = 0;
+    return;
+  }
+
+  if (!TCCR0B) {
+    TCNT0  = 0;
+    TCCR0B = SCHED_CLOCK;
+  }
+
+  // a pending compare reprograms the timer in its interrupt
+  if (TIFR & (1 << OCF0A))
+    return;
+
+  // the counter must not pass the compare value while we set it
+  if (next < TCNT0 + 2)
+    next = TCNT0 + 2;
+
+  OCR0A = next - 1;
 }
 
-inline void resetPortB(char mask) {
-  PORTB = PORTB & ~mask; 
+/*
+ * Aufgabe nach counts Zaehlschritten ausfuehren, mit gesperrten Interrupts
+ */
+void schedule(uint8_t task, uint32_t counts) {
+  task_due[task] = (TCCR0B ? schedElapsed() : 0) + counts;
+  task_active |= (1 << task);
+  schedProgram();
 }
 
-const uint8_t COLOR_NONE  = 0;
-const uint8_t COLOR_RED   = 1;
-const uint8_t COLOR_GREEN = 2;
+void cancel(uint8_t task) {
+  task_active &= ~(1 << task);
+}
 
+///// Light engine /////
+
+/*
+ * Timer1 PWM mit CK/32 und 250 Stufen: 1 kHz, ohne Interrupts.
+ *
+ * Rot haengt an OC1B (PB4), Gruen am invertierten Ausgang /OC1B (PB3).
+ * Beide teilen sich OCR1B, es leuchtet also immer nur eine Farbe, der
+ * andere Pin wird als Eingang abgeschaltet.
+ */
+#define PWM_TOP   249
+#define PWM_CLOCK ((1 << CS12) | (1 << CS11))
+
+#define LED_RED   (1 << PB4)
+#define LED_GREEN (1 << PB3)
+
+#ifdef LED_EXTERNAL
+// active low
+#define LED_DUTY(d) (PWM_TOP - (d))
+#define LED_OFF     (LED_RED | LED_GREEN)
+#else
+#define LED_DUTY(d) (d)
+#define LED_OFF     0
+#endif
+
+// fades update the PWM every 5 ms
+#define FADE_STEP_MS 5
+#define FADE_STEP    SCHED_COUNTS(FADE_STEP_MS)
+
+// default blink: 640 ms on, 640 ms off
+#define BLINK_PERIOD 1280
+#define BLINK_DUTY   128
+
+// the requested light
 volatile uint8_t current_color;
 volatile uint8_t is_blink;
+volatile uint8_t target_level;
 
-inline void switch_color(uint8_t col) {
-#ifdef LED_INTERNAL
-   resetPortB(0b11000);
-   if (col == COLOR_RED) 
-     setPortB(0b10000);
-   if (col == COLOR_GREEN) 
-     setPortB(0b01000);
-#endif
-#ifdef LED_EXTERNAL
-   setPortB(0b11000);
-   if (col == COLOR_RED)
-       resetPortB(0b10000);
-   if (col == COLOR_GREEN)
-       resetPortB(0b01000);
-   #endif
+// the color on the LEDs, differs from current_color while fading out
+volatile uint8_t light_color;
+// brightness, 8.8 fixed point
+volatile uint16_t level;
+
+volatile uint8_t  fade_target;
+volatile int16_t  fade_step;
+volatile uint16_t fade_steps;
+volatile uint16_t fade_next;	// fade-in time after fading out
+
+// blink phases in scheduler counts
+volatile uint32_t blink_on  = SCHED_COUNTS((uint32_t)BLINK_PERIOD * BLINK_DUTY >> 8);
+volatile uint32_t blink_off = SCHED_COUNTS(BLINK_PERIOD - ((uint32_t)BLINK_PERIOD * BLINK_DUTY >> 8));
+volatile uint8_t  blink_lit;
+
+// the running pattern, 0 for none
+volatile uint8_t pattern_slot;
+volatile uint8_t pattern_wait;
+
+/*
+ * Helligkeit 0..255 mit Gamma 2 auf 0..PWM_TOP abbilden
+ */
+uint8_t pwmDuty(uint8_t brightness) {
+  const uint8_t g = ((uint16_t)brightness * brightness + 255) >> 8;
+
+  return ((uint16_t)g * (PWM_TOP + 1)) >> 8;
+}
+
+void setOutput(uint8_t col, uint8_t brightness) {
+  const uint8_t duty = pwmDuty(brightness);
+  uint8_t pins = 0;
+
+  if (duty) {
+    if (col == COLOR_RED) {
+      OCR1B = LED_DUTY(duty);
+      pins = LED_RED;
+    } else if (col == COLOR_GREEN) {
+      // /OC1B ist PWM_TOP + 1 - OCR1B Zaehlschritte high
+      const uint8_t inv = PWM_TOP + 1 - LED_DUTY(duty);
+      OCR1B = (inv > PWM_TOP) ? PWM_TOP : inv;
+      pins = LED_GREEN;
+    }
+  }
+
+  // only the pins with light are outputs
+  // Die USI-Interrupts schalten SDA im selben Register um.
+  const uint8_t sreg = SREG;
+  cli();
+  DDRB = (DDRB & ~(LED_RED | LED_GREEN)) | pins;
+  SREG = sreg;
 }
 
-inline void setColor(const uint8_t col, const uint8_t blink) {
+void updateLight() {
+  const uint8_t on = !is_blink || blink_lit;
+
+  setOutput(light_color, on ? (level >> 8) : 0);
+}
+
+void fadeTo(uint8_t target, uint16_t ms) {
+  const uint16_t steps = ms / FADE_STEP_MS;
+
+  fade_target = target;
+
+  if (steps < 2) {
+    level = (uint16_t)target << 8;
+    fade_steps = 0;
+    cancel(TASK_FADE);
+    return;
+  }
+
+  fade_step  = ((int32_t)((uint16_t)target << 8) - level) / steps;
+  fade_steps = steps;
+  schedule(TASK_FADE, FADE_STEP);
+}
+
+void fadeTask() {
+  if (--fade_steps) {
+    level += fade_step;
+    schedule(TASK_FADE, FADE_STEP);
+  } else {
+    level = (uint16_t)fade_target << 8;
+
+    // the old color is out, fade in the new one
+    if (light_color != current_color) {
+      light_color = current_color;
+      fadeTo(target_level, fade_next);
+    }
+  }
+
+  updateLight();
+}
+
+void blinkTask() {
+  blink_lit = !blink_lit;
+  schedule(TASK_BLINK, blink_lit ? blink_on : blink_off);
+  updateLight();
+}
+
+void startBlink() {
+  blink_lit = 1;
+
+  if (is_blink)
+    schedule(TASK_BLINK, blink_on);
+  else
+    cancel(TASK_BLINK);
+}
+
+/*
+ * Neue Farbe mit Helligkeit und Ueberblendzeit setzen. Beim Farbwechsel
+ * wird die alte Farbe in der ersten Haelfte der Zeit ausgeblendet.
+ */
+void setLight(uint8_t light, uint8_t brightness, uint16_t ms) {
+  const uint8_t col = light & AMPEL_VAL_COLOR;
+
+  if (col == COLOR_NONE)
+    brightness = 0;
+
   current_color = col;
-  is_blink = blink;
-  //switch_color(col);
+  is_blink      = light & AMPEL_VAL_BLINK;
+  target_level  = brightness;
+  startBlink();
+
+  if ((col != light_color) && (level >> 8) && (ms >= 4 * FADE_STEP_MS)) {
+    // nothing to fade in without a color
+    fade_next = (col == COLOR_NONE) ? 0 : ms / 2;
+    fadeTo(0, ms - fade_next);
+  } else {
+    light_color = col;
+    fadeTo(brightness, ms);
+  }
+
+  updateLight();
+}
+
+/*
+ * Blinkperiode in ms und Anteil der Einschaltzeit (1..255 von 256)
+ */
+uint8_t setBlink(uint16_t period, uint8_t duty) {
+  const uint16_t on = (uint32_t)period * duty >> 8;
+
+  if (!on || (on >= period))
+    return 0;
+
+  blink_on  = SCHED_COUNTS(on);
+  blink_off = SCHED_COUNTS(period - on);
+  startBlink();
+
+  return 1;
+}
+
+///// Pattern sequencer /////
+
+/*
+ * Muster als Bytecode im EEPROM, Format siehe i3c_protocol.h. Der
+ * Sequencer laeuft in der Hauptschleife, Wait ist eine Aufgabe im
+ * Scheduler, die den Controller weckt.
+ */
+#define PATTERN_STEPS 8		// instructions per idle call
+
+uint8_t pattern_pc;
+uint8_t loop_left;
+
+// a step may change the light in the status block
+extern volatile uint8_t status_dirty;
+
+// EEPROM write queue, written byte by byte from EE_RDY_vect
+volatile uint8_t ee_buf[AMPEL_PATTERN_CHUNK];
+volatile uint16_t ee_addr;
+volatile uint8_t ee_next;
+volatile uint8_t ee_pending;
+
+inline uint8_t eepromBusy() {
+  return ee_pending || (EECR & (1 << EEPE));
+}
+
+uint8_t eepromRead(uint16_t addr) {
+  EEAR = addr;
+  EECR |= (1 << EERE);
+
+  return EEDR;
+}
+
+/*
+ * Naechstes Byte des Musters, hinter dem Slot steht End
+ */
+uint8_t patternByte() {
+  if (pattern_pc >= AMPEL_PATTERN_SIZE)
+    return AMPEL_OP_END;
+
+  return eepromRead((pattern_slot - 1) * AMPEL_PATTERN_SIZE + pattern_pc++);
+}
+
+void stepPattern() {
+  const uint8_t op = patternByte();
+
+  switch (op & AMPEL_OP_MASK) {
+    case AMPEL_OP_FADE: {
+      const uint8_t brightness = patternByte();
+      setLight(op & ~AMPEL_OP_MASK, brightness,
+	       patternByte() * AMPEL_PATTERN_TICK_MS);
+      break;
+    }
+    case AMPEL_OP_WAIT: {
+      const uint8_t t = patternByte();
+      if (t) {
+	pattern_wait = 1;
+	schedule(TASK_PATTERN, SCHED_COUNTS(t * AMPEL_PATTERN_TICK_MS));
+      }
+      break;
+    }
+    case AMPEL_OP_LOOP: {
+      const uint8_t count  = patternByte();
+      const uint8_t target = patternByte();
+      // count 0 loops forever
+      if (!count || (loop_left ? --loop_left : (loop_left = count - 1)))
+	pattern_pc = target;
+      break;
+    }
+    default:
+      // End and invalid instructions, the light stays
+      pattern_slot = 0;
+  }
+
+  updateLight();
+  status_dirty = 1;
+}
+
+void runPattern() {
+  uint8_t steps;
+
+  // a loop without Wait must not block the bus
+  for (steps = 0; steps < PATTERN_STEPS; steps++) {
+    cli();
+
+    // the bytecode cannot be read during an EEPROM write
+    if (!pattern_slot || pattern_wait || eepromBusy()) {
+      sei();
+      return;
+    }
+
+    // the wakeup has been consumed
+    cancel(TASK_PATTERN);
+    stepPattern();
+    sei();
+  }
+
+  // continue after the next wakeup
+  cli();
+  pattern_wait = 1;
+  schedule(TASK_PATTERN, 1);
+  sei();
+}
+
+/*
+ * Die Hauptschleife fuehrt das Muster nach dem Aufwachen aus. Hat sie
+ * pattern_wait kurz vor diesem Interrupt geprueft, ginge sie danach
+ * schlafen: der Timer weckt sie deshalb weiter, bis runPattern() den
+ * Schritt ausfuehrt.
+ */
+void patternTask() {
+  pattern_wait = 0;
+  schedule(TASK_PATTERN, 1);
+}
+
+/*
+ * Muster starten, 0 stoppt das laufende Muster
+ */
+uint8_t selectPattern(uint8_t slot) {
+  if (slot > AMPEL_PATTERN_SLOTS)
+    return 0;
+
+  pattern_slot = slot;
+  pattern_pc   = 0;
+  pattern_wait = 0;
+  loop_left    = 0;
+  cancel(TASK_PATTERN);
+
+  return 1;
+}
+
+/*
+ * PatternWrite, gibt 0 zurueck solange der letzte Block geschrieben wird
+ */
+uint8_t writePattern(uint8_t slot, uint8_t offset,
+		     const volatile uint8_t *data, uint8_t len) {
+  uint8_t i;
+
+  if (eepromBusy())
+    return 0;
+
+  // do not run half-written bytecode
+  if (slot == pattern_slot)
+    selectPattern(0);
+
+  for (i = 0; i < len; i++)
+    ee_buf[i] = data[i];
+
+  ee_addr    = (slot - 1) * AMPEL_PATTERN_SIZE + offset;
+  ee_next    = 0;
+  ee_pending = len;
+
+  // the ready interrupt fires as soon as the EEPROM is idle
+  EECR |= (1 << EERIE);
+
+  return 1;
+}
+
+ISR (EE_RDY_vect)
+{
+  if (!ee_pending) {
+    EECR &= ~(1 << EERIE);
+    return;
+  }
+
+  EEAR = ee_addr++;
+  EEDR = ee_buf[ee_next++];
+  ee_pending--;
+
+  // erase and write, EEPE has to follow EEMPE within four cycles
+  EECR = (1 << EERIE) | (1 << EEMPE);
+  EECR |= (1 << EEPE);
 }
 
 //flag state change
@@ -86,7 +501,7 @@ inline uint8_t i3c_state() {
 }
 
 /*
- * I²C Datenformat:
+ * I²C Datenformat: siehe i3c_protocol.h
  * 
  * PCCCDDDD
  * 
@@ -94,6 +509,13 @@ inline uint8_t i3c_state() {
  * command (CCC)
  * 	GetLight 0x01   Aktuellen Datenwert ausgeben
  *      SetLight 0x02   Neuen Datenwert setzen
+ *      GetStatus 0x03  Statusblock ausgeben, Daten: I3C_STATUS_RESET
+ *      Fade 0x04       nur v2: Farbe mit Helligkeit und Ueberblendzeit
+ *      Blink 0x05      nur v2: Blinkperiode und Tastgrad
+ *      Pattern 0x06    Muster aus dem EEPROM starten, Daten: Nummer, 0 stoppt
+ *      PatternWrite 0x08  nur v2: Muster ins EEPROM schreiben
+ *      v2 0x07         Frame mit CRC-8, siehe i3c_protocol.h
+ *      Telemetry 0x09  nur v2: Buszaehler abholen und loeschen
  * 
  * data (DDDD)
  * 	1 bit blink-Status
@@ -101,9 +523,210 @@ inline uint8_t i3c_state() {
  * 			1 rot
  * 			2 grün
  */
-#define CMD_I3C_RESET 0x00
-#define CMD_GETLIGHT  0x01
-#define CMD_SETLIGHT  0x02
+#define CMD_I3C_RESET I3C_CMD_RESET
+#define CMD_GETLIGHT  AMPEL_CMD_GETLIGHT
+#define CMD_SETLIGHT  AMPEL_CMD_SETLIGHT
+#define CMD_GETSTATUS I3C_CMD_GETSTATUS
+#define CMD_FADE      AMPEL_CMD_FADE
+#define CMD_BLINK     AMPEL_CMD_BLINK
+#define CMD_PATTERN   AMPEL_CMD_PATTERN
+#define CMD_PATTERN_WRITE AMPEL_CMD_PATTERN_WRITE
+#define CMD_TELEMETRY I3C_CMD_TELEMETRY
+
+inline uint8_t i3c_pending() {
+  // the INT line is only an output while pulled
+  return (DDRB & (1 << PB1)) ? I3C_STATUS_FLAG_INT : 0;
+}
+
+inline void put16(volatile uint8_t *buf, uint16_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = val >> 8;
+}
+
+inline uint16_t get16(const volatile uint8_t *buf) {
+  return buf[0] | (buf[1] << 8);
+}
+
+/*
+ * Statusblock fuer GetStatus, siehe i3c_protocol.h
+ */
+void fillStatus(volatile uint8_t *buf, uint8_t state) {
+  struct usi_twi_stats stats;
+  // the USI interrupts count while we run
+  usi_twi_stats_get(&stats);
+
+  buf[I3C_STATUS_LENGTH]  = I3C_STATUS_LEN;
+  buf[I3C_STATUS_VERSION] = FW_VERSION;
+  buf[I3C_STATUS_STATE]   = state;
+  buf[I3C_STATUS_FLAGS]   = i3c_pending();
+  put16(buf + I3C_STATUS_FRAMES,    stats.local_frames);
+  put16(buf + I3C_STATUS_ERRORS,    stats.error_conditions);
+  put16(buf + I3C_STATUS_STARTS,    stats.start_conditions);
+  buf[I3C_STATUS_CHECKSUM] = i3c_checksum(buf, I3C_STATUS_CHECKSUM);
+}
+
+inline void put32(volatile uint8_t *buf, uint32_t val) {
+  put16(buf, val & 0xffff);
+  put16(buf + 2, val >> 16);
+}
+
+/*
+ * Telemetry, gibt die Laenge der Buszaehler zurueck und loescht sie
+ */
+uint8_t getTelemetry(volatile uint8_t *buf) {
+  struct usi_twi_stats stats;
+  usi_twi_stats_take(&stats);
+
+  put32(buf + I3C_TELEMETRY_STARTS,    stats.start_conditions);
+  put32(buf + I3C_TELEMETRY_STOPS,     stats.stop_conditions);
+  put32(buf + I3C_TELEMETRY_REPEATED,  stats.repeated_starts);
+  put32(buf + I3C_TELEMETRY_ERRORS,    stats.error_conditions);
+  put32(buf + I3C_TELEMETRY_OVERFLOWS, stats.overflow_conditions);
+  put32(buf + I3C_TELEMETRY_FRAMES,    stats.local_frames);
+
+  return I3C_TELEMETRY_LEN;
+}
+
+inline uint8_t getLight() {
+  const uint8_t state = (is_blink == 0 ? 0 : AMPEL_LIGHT_BLINK) + current_color;
+
+  // set msb to avoid error state
+  return state + AMPEL_LIGHT_VALID;
+}
+
+/*
+ * GetStatus, gibt die Laenge des Statusblocks zurueck
+ */
+uint8_t getStatus(volatile uint8_t *buf, uint8_t data) {
+  fillStatus(buf, getLight());
+
+  // reset after the snapshot, a change from now on pulls INT again
+  if (data & I3C_STATUS_RESET)
+    i3c_tristate();
+
+  return I3C_STATUS_LEN;
+}
+
+/*
+ * Vorberechneter Statusblock fuer Lesezugriffe ohne Anfrage. Der Master
+ * liest eine Seite, waehrend die andere neu gefuellt wird.
+ */
+volatile uint8_t status_reply[2][I3C_STATUS_LEN];
+uint8_t status_page;
+// set by frames and pattern steps, the idle callback refills the block
+volatile uint8_t status_dirty = 1;
+
+void refreshStatus() {
+  status_dirty = 0;
+
+  status_page ^= 1;
+  fillStatus(status_reply[status_page], getLight());
+
+  cli();
+  usi_twi_preload(status_reply[status_page], I3C_STATUS_LEN);
+  sei();
+}
+
+/*
+ * v1 Kommandos mit einem Antwortbyte, 0 zeigt einen Fehler an
+ */
+uint8_t command(uint8_t cmd, uint8_t data) {
+  // some dummy output value, as 0 states an error
+  uint8_t output=0;
+
+  switch (cmd) {
+    case CMD_I3C_RESET: {
+      i3c_tristate();
+      output = 1;
+      break;
+    }
+    case CMD_GETLIGHT: {
+      output = getLight();
+      break;
+    }
+    case CMD_SETLIGHT: {
+      selectPattern(0);
+      setLight(data, 255, 0);
+      output = 1;
+      break;
+    }
+    case CMD_PATTERN: {
+      output = selectPattern(data);
+      break;
+    }
+  }
+
+  return output;
+}
+
+static struct i3c_v2_state v2_state;
+
+/*
+ * v2 Kommandos, siehe i3c_protocol.h
+ */
+static uint8_t v2_command(uint8_t cmd,
+                          const volatile uint8_t *payload, uint8_t plen,
+                          volatile uint8_t *reply, uint8_t *len) {
+  const uint8_t data = plen ? payload[0] : 0;
+
+  switch (cmd) {
+    case CMD_GETSTATUS: {
+      *len = getStatus(reply, data);
+      return I3C_V2_OK;
+    }
+    case CMD_TELEMETRY: {
+      *len = getTelemetry(reply);
+      return I3C_V2_OK;
+    }
+    case CMD_FADE: {
+      if (plen < AMPEL_FADE_LEN)
+	return I3C_V2_ERR_ARG;
+
+      selectPattern(0);
+      setLight(payload[AMPEL_FADE_LIGHT], payload[AMPEL_FADE_LEVEL],
+	       get16(payload + AMPEL_FADE_TIME));
+      reply[0] = 1;
+      *len = 1;
+      return I3C_V2_OK;
+    }
+    case CMD_BLINK: {
+      if ((plen < AMPEL_BLINK_LEN) ||
+	  !setBlink(get16(payload + AMPEL_BLINK_PERIOD), payload[AMPEL_BLINK_DUTY]))
+	return I3C_V2_ERR_ARG;
+
+      updateLight();
+      reply[0] = 1;
+      *len = 1;
+      return I3C_V2_OK;
+    }
+    case CMD_PATTERN_WRITE: {
+      const uint8_t slot   = payload[AMPEL_PATTERN_WRITE_SLOT];
+      const uint8_t offset = payload[AMPEL_PATTERN_WRITE_OFFSET];
+      const uint8_t n      = plen - AMPEL_PATTERN_WRITE_DATA;
+
+      if ((plen <= AMPEL_PATTERN_WRITE_DATA) ||
+	  (slot < 1) || (slot > AMPEL_PATTERN_SLOTS) ||
+	  (offset >= AMPEL_PATTERN_SIZE) || (n > AMPEL_PATTERN_SIZE - offset))
+	return I3C_V2_ERR_ARG;
+
+      reply[0] = writePattern(slot, offset,
+			      payload + AMPEL_PATTERN_WRITE_DATA, n);
+      *len = 1;
+      return I3C_V2_OK;
+    }
+    case CMD_I3C_RESET:
+    case CMD_GETLIGHT:
+    case CMD_SETLIGHT:
+    case CMD_PATTERN:
+    {
+      reply[0] = command(cmd, data);
+      *len = 1;
+      return reply[0] ? I3C_V2_OK : I3C_V2_ERR_ARG;
+    }
+  }
+
+  return I3C_V2_ERR_CMD;
+}
 
 static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t input_buffer_length, 
@@ -112,41 +735,30 @@ static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t *output_buffer) {
   
   if (input_buffer_length) {
-    const uint8_t parity = (input_buffer[0] & 0x80) >> 7;
-    const uint8_t cmd  = (input_buffer[0] & 0x70) >> 4;
-    const uint8_t data = input_buffer[0] & 0x0F;
+    const uint8_t request = input_buffer[0];
+    const uint8_t cmd  = I3C_REQUEST_CMD(request);
+    const uint8_t data = I3C_REQUEST_DATA(request);
     
-    // check parity
-    uint8_t v = input_buffer[0] & 0x7F;
-    uint8_t c;
-    for (c = 0; v; c++)
-      v &= v-1;
-    c &= 1;
-    
-    // some dummy output value, as 0 states an error
     uint8_t output=0;
+
+    // counters, light and INT may change with every frame
+    status_dirty = 1;
     
     // only check if parity matches
-    if (parity == c)
+    if (I3C_REQUEST_VALID(request))
     switch (cmd) {
-      case CMD_I3C_RESET: {
-	i3c_tristate();
-	break;
+      case I3C_CMD_V2: {
+	*output_buffer_length = i3c_v2_request(&v2_state, v2_command,
+					       input_buffer_length, input_buffer,
+					       output_buffer);
+	return;
       }
-      case CMD_GETLIGHT: {
-	const uint8_t state = ((is_blink == 0 ? 0 : 1) << 4) + current_color;
-	output = state;
-
-	// set msb to avoid error state
-	output += 0x80;
-	
-	break;
-      }
-      case CMD_SETLIGHT: {
-	setColor(data&0x7, data&0x8);
-	output = 1;
-	break;
+      case CMD_GETSTATUS: {
+	*output_buffer_length = getStatus(output_buffer, data);
+	return;
       }
+      default:
+	output = command(cmd, data);
     }
 
     *output_buffer_length = 2;
@@ -156,7 +768,10 @@ static void twi_callback(uint8_t buffer_size,
 }
 
 static void twi_idle_callback(void) {
-  // void
+  runPattern();
+
+  if (status_dirty)
+    refreshStatus();
 }
 
 void init(void) {
@@ -165,17 +780,12 @@ void init(void) {
    *   PB0: I2C SDA
    *   PB1: I3C INT
    *   PB2: I2C SDC
-   *   PB3: Rt (Out)
-   *   PB4: Gn (Out)
+   *   PB3: Gn (OC1B invertiert)
+   *   PB4: Rt (OC1B)
    */
-  DDRB  = 0b1111010;
-  // PullUp für Eingänge
-  PORTB = 0b11111010;
-
-  /*
-   * Set state: no color
-   */
-  setColor(COLOR_NONE, 0);
+  DDRB  = 0;
+  // PullUp für unbenutzte Eingänge, die LEDs sind aus
+  PORTB = 0b11100010 | LED_OFF;
 
    
    /*  disable interrupts  */
@@ -186,14 +796,24 @@ void init(void) {
   CLKPR = (1 << CLKPCE);  /*  enable clock prescaler update       */
   CLKPR = 0;              /*  set clock to maximum                */
 
-  /*  timer init  */
-  TIFR &= ~(1 << TOV0);   /*  clear timer0 overflow interrupt flag    */
-  TIMSK |= (1 << TOIE0);  /*  enable timer0 overflow interrupt        */
+  /*  Timer1 PWM on OC1B and /OC1B, 1 kHz  */
+  OCR1C = PWM_TOP;
+  GTCCR = (1 << PWM1B) | (1 << COM1B0);
+  TCCR1 = PWM_CLOCK;
+
+  /*  Timer0 is the scheduler, CTC mode, stopped until there is a task  */
+  TCCR0A = (1 << WGM01);
+  TIFR   = (1 << OCF0A);  /*  clear timer0 compare interrupt flag */
+  TIMSK |= (1 << OCIE0A); /*  enable timer0 compare interrupt     */
 
-  /*  start timer0 by setting last 3 bits in timer0 control register B
-   *  to any clock source */
-  //TCCR0B = (1 << CS02) | (1 << CS00);
-  TCCR0B = (1 << CS00);
+  /*  the ADC and the comparator are not used  */
+  PRR  = (1 << PRADC);
+  ACSR |= (1 << ACD);
+
+  /*
+   * Set state: no color
+   */
+  setLight(COLOR_NONE, 0, 0);
 
     
   // Global Interrupts aktivieren
@@ -207,23 +827,42 @@ int main(void)
   // initialisieren
   init();
 
-  // start TWI (I²C) slave mode
-  usi_twi_slave(0x20, 0, &twi_callback, &twi_idle_callback);
+  // bus statistics for GetStatus
+  usi_twi_enable_stats(1);
+  // wait for complete v2 frames
+  usi_twi_frame_length(&i3c_frame_length);
+  // a read without request gets the status block
+  refreshStatus();
+
+  // start TWI (I²C) slave mode, sleep while the bus is idle
+  usi_twi_slave(AMPEL_ADDR, 1, &twi_callback, &twi_idle_callback);
 
   return 0;
 }
 
-const int TCOUNT_MAX = 20000;
-volatile uint16_t tcount = 0;
-volatile uint8_t blink = 0;
-
-ISR (TIMER0_OVF_vect)
+/*
+ * Compare-Interrupt am Ende des Intervalls. Er laeuft mit gesperrten
+ * Interrupts: bei einem Repeated Start fuehrt der Start-Interrupt den
+ * Befehl aus und aendert dabei die Aufgaben und das Licht. Die USI haelt
+ * SCL bis dahin fest, der Bus wartet also nur.
+ */
+ISR (TIM0_COMPA_vect)
 {
-  // TODO be a bit more fancy at this point
-  tcount++;
-  if (tcount > TCOUNT_MAX) {
-    tcount = 0;
-    blink = !blink;
-    switch_color(is_blink && !blink ? COLOR_NONE : current_color);
-  }
+  const uint16_t elapsed = OCR0A + 1;
+  uint8_t t;
+
+  for (t = 0; t < TASKS; t++)
+    task_due[t] = (task_due[t] > elapsed) ? task_due[t] - elapsed : 0;
+
+  for (t = 0; t < TASKS; t++)
+    if ((task_active & (1 << t)) && !task_due[t]) {
+      cancel(t);
+      switch (t) {
+	case TASK_FADE:    fadeTask();    break;
+	case TASK_BLINK:   blinkTask();   break;
+	case TASK_PATTERN: patternTask(); break;
+      }
+    }
+
+  schedProgram();
 }
@@ -34,12 +34,14 @@ enum
 };
 
 static void (*idle_callback)(void);
+static uint8_t (*frame_length)(uint8_t first_byte);
 static void	(*data_callback)(uint8_t buffer_size,
                              uint8_t volatile input_buffer_length, const volatile uint8_t *input_buffer,
                              uint8_t volatile *output_buffer_length, uint8_t volatile *output_buffer);
 
 static volatile	uint8_t of_state;
 static volatile uint8_t ss_state;
+static volatile uint8_t	bus_idle;
 
 static volatile uint8_t	slave_address;
 
@@ -49,13 +51,23 @@ static volatile uint8_t	output_buffer[buffer_size];
 static volatile uint8_t	output_buffer_length;
 static volatile uint8_t	output_buffer_current;
 
+// the reply to a read without a request in the same transaction
+static const volatile uint8_t	*preload_buffer;
+static volatile uint8_t	preload_length;
+
+// the buffer the master reads from
+static const volatile uint8_t	*reply_buffer;
+static volatile uint8_t	reply_length;
+static volatile uint8_t	request_received;
+
 static			uint8_t		stats_enabled;
-static volatile uint16_t	start_conditions_count;
-static volatile uint16_t	stop_conditions_count;
-static volatile uint16_t	error_conditions_count;
-static volatile uint16_t	overflow_conditions_count;
-static volatile uint16_t	local_frames_count;
-static volatile uint16_t	idle_call_count;
+static volatile uint32_t	start_conditions_count;
+static volatile uint32_t	stop_conditions_count;
+static volatile uint32_t	error_conditions_count;
+static volatile uint32_t	overflow_conditions_count;
+static volatile uint32_t	local_frames_count;
+static volatile uint32_t	repeated_starts_count;
+static volatile uint32_t	idle_call_count;
 
 static always_inline void set_sda_to_input(void)
 {
@@ -114,6 +126,20 @@ static always_inline void twi_reset_state(void)
   (0 << USITC);									// don't toggle clock-port pin
 }
 
+/*
+ * Clear the overflow flag, which releases SCL, and let the counter run
+ * for 8 bits (0x00, 16 edges) or 1 bit (0x0e, 2 edges).
+ */
+static always_inline void release_scl(uint8_t set_counter)
+{
+  USISR =
+  (0				<< USISIF)	|		// don't clear start condition flag
+  (1				<< USIOIF)	|		// clear overflow condition flag
+  (0				<< USIPF)	|		// don't clear stop condition flag
+  (1				<< USIDC)	|		// clear arbitration error flag
+  (set_counter	<< USICNT0);		// set counter to 8 or 1 bits
+}
+
 static always_inline void twi_reset(void)
 {
   // make sure no sda/scl remains pulled up or down
@@ -145,6 +171,25 @@ static always_inline void twi_init(void)
   twi_reset();
 }
 
+/*
+ * Run the data callback on the received frame, with interrupts disabled.
+ */
+static void process_frame(void)
+{
+  if(!input_buffer_length)
+    return;
+
+  if(stats_enabled)
+    local_frames_count++;
+
+  output_buffer_length	= 0;
+  output_buffer_current	= 0;
+
+  data_callback(buffer_size, input_buffer_length, input_buffer, &output_buffer_length, output_buffer);
+
+  input_buffer_length		= 0;
+}
+
 ISR(USI_START_vect)
 {
   set_sda_to_input();
@@ -176,6 +221,30 @@ ISR(USI_START_vect)
     if(stats_enabled)
       start_conditions_count++;
 
+    /*
+     * A stop since the last start belongs to the last transaction, it must
+     * not reset this one. Without it this is a repeated start, usually the
+     * read phase of a write-then-read exchange.
+     */
+    if(USISR & _BV(USIPF))
+    {
+      USISR = _BV(USIPF);
+
+      if(stats_enabled)
+        stop_conditions_count++;
+
+      request_received = 0;
+    }
+    else if(!bus_idle)
+    {
+      if(stats_enabled)
+        repeated_starts_count++;
+    }
+    else
+      request_received = 0;
+
+    bus_idle = 0;
+
     of_state = of_state_check_address;
     ss_state = ss_state_after_start;
 
@@ -194,6 +263,14 @@ ISR(USI_START_vect)
     (0		<< USIPF)	|		// don't clear stop condition flag
     (1		<< USIDC)	|		// clear arbitration error flag
     (0x00	<< USICNT0);		// set counter to "8" bits
+
+    /*
+     * The reply has to be ready before the master reads. Clearing the start
+     * flag has released SCL already, so the address byte comes in while the
+     * frame is processed; the overflow interrupt waits for this one and
+     * holds SCL meanwhile.
+     */
+    process_frame();
 }
 
 ISR(USI_OVERFLOW_VECTOR)
@@ -201,13 +278,12 @@ ISR(USI_OVERFLOW_VECTOR)
   // bit shift register overflow condition occured
   // scl forced low until overflow condition is cleared!
 
-  uint8_t data		= USIDR;
-  uint8_t set_counter = 0x00;		// send 8 bits (16 edges)
+  // Every state first sets up USIDR, SDA and the counter for the next bits
+  // and releases SCL, the bookkeeping follows while the master clocks.
+  // This keeps the clock stretch short enough for fast mode (400 kHz).
 
-  if(stats_enabled)
-    overflow_conditions_count++;
+  const uint8_t data = USIDR;
 
-  again:
   switch(of_state)
   {
     // start condition occured and succeed
@@ -216,50 +292,79 @@ ISR(USI_OVERFLOW_VECTOR)
 
     case(of_state_check_address):
     {
-      uint8_t address;
-      uint8_t direction;
-
-      direction	= data & 0x01;
-      address		= (data & 0xfe) >> 1;
-
-      if(address == slave_address)
+      if((data >> 1) == slave_address)
       {
+        USIDR = 0x00;
+        set_sda_to_output();			// initiate send ack
+        release_scl(0x0e);				// send 1 bit (2 edges)
+
         ss_state = ss_state_address_selected;
 
-        if(direction)					// read request from master
+        if(data & 0x01)					// read request from master
+        {
           of_state = of_state_send_data;
+
+          // a read on its own gets the preloaded reply
+          if(request_received || !preload_buffer)
+          {
+            reply_buffer = output_buffer;
+            reply_length = output_buffer_length;
+          }
+          else
+          {
+            reply_buffer = preload_buffer;
+            reply_length = preload_length;
+          }
+          output_buffer_current = 0;
+        }
         else							// write request from master
           of_state = of_state_receive_data;
-
-        USIDR		= 0x00;
-        set_counter = 0x0e;				// send 1 bit (2 edges)
-        set_sda_to_output();			// initiate send ack
       }
       else
       {
-        USIDR		= 0x00;
-        set_counter = 0x00;
+        USIDR = 0x00;
         twi_reset_state();
+        release_scl(0x00);
         ss_state = ss_state_address_not_selected;
       }
 
       break;
     }
 
+    // ack/nack from master received
+
+    case(of_state_check_ack):
+    {
+      if(data)	// if NACK, the master does not want more data
+      {
+        twi_reset();
+        release_scl(0x00);
+        of_state = of_state_check_address;
+
+        break;
+      }
+
+      // from here we just drop straight into state_send_data,
+      // don't wait for another overflow interrupt
+    }
+    /* fall through */
+
     // process read request from master
 
     case(of_state_send_data):
     {
-      ss_state = ss_state_data_processed;
-      of_state = of_state_request_ack;
-
-      if(output_buffer_current < output_buffer_length)
-        USIDR = output_buffer[output_buffer_current++];
-      else
-        USIDR = 0xfe;
+      const uint8_t current = output_buffer_current;
+      const uint8_t more = current < reply_length;
 
-      set_counter = 0x00;
+      USIDR = more ? reply_buffer[current] : 0xfe;
       set_sda_to_output();				// initiate send data
+      release_scl(0x00);
+
+      if(more)
+        output_buffer_current = current + 1;
+
+      ss_state = ss_state_data_processed;
+      of_state = of_state_request_ack;
 
       break;
     }
@@ -268,30 +373,11 @@ ISR(USI_OVERFLOW_VECTOR)
 
     case(of_state_request_ack):
     {
-      of_state = of_state_check_ack;
-
-      USIDR		= 0x00;
-      set_counter = 0x0e;					//	receive 1 bit (2 edges)
+      USIDR = 0x00;
       set_sda_to_input();					//	initiate receive ack
+      release_scl(0x0e);					//	receive 1 bit (2 edges)
 
-      break;
-    }
-
-    // ack/nack from master received
-
-    case(of_state_check_ack):
-    {
-      if(data)	// if NACK, the master does not want more data
-      {
-        of_state = of_state_check_address;
-        set_counter = 0x00;
-        twi_reset();
-      }
-      else
-      {
-        of_state = of_state_send_data;
-        goto again;	// from here we just drop straight into state_send_data
-      }				// don't wait for another overflow interrupt
+      of_state = of_state_check_ack;
 
       break;
     }
@@ -300,13 +386,12 @@ ISR(USI_OVERFLOW_VECTOR)
 
     case(of_state_receive_data):
     {
-      ss_state = ss_state_data_processed;
+      set_sda_to_input();					// initiate receive data
+      release_scl(0x00);					// receive 8 bits (16 edges)
 
+      ss_state = ss_state_data_processed;
       of_state = of_state_store_data_and_send_ack;
 
-      set_counter = 0x00;					// receive 1 bit (2 edges)
-      set_sda_to_input();					// initiate receive data
-
       break;
     }
 
@@ -314,25 +399,38 @@ ISR(USI_OVERFLOW_VECTOR)
 
     case(of_state_store_data_and_send_ack):
     {
-      of_state = of_state_receive_data;
+      USIDR = 0x00;
+      set_sda_to_output();				// initiate send ack
+      release_scl(0x0e);					// send 1 bit (2 edges)
 
       if(input_buffer_length < (buffer_size - 1))
         input_buffer[input_buffer_length++] = data;
 
-      USIDR		= 0x00;
-      set_counter = 0x0e;					// send 1 bit (2 edges)
-      set_sda_to_output();				// initiate send ack
+      request_received = 1;
+      of_state = of_state_receive_data;
 
       break;
     }
+
+    default:
+      release_scl(0x00);
   }
 
-  USISR =
-  (0				<< USISIF)	|		// don't clear start condition flag
-  (1				<< USIOIF)	|		// clear overflow condition flag
-  (0				<< USIPF)	|		// don't clear stop condition flag
-  (1				<< USIDC)	|		// clear arbitration error flag
-  (set_counter	<< USICNT0);		// set counter to 8 or 1 bits
+  if(stats_enabled)
+    overflow_conditions_count++;
+}
+
+static uint8_t frame_complete(void)
+{
+  const uint8_t length = input_buffer_length;
+
+  if(!length)
+    return 0;
+
+  if(!frame_length)
+    return 1;
+
+  return length >= frame_length(input_buffer[0]);
 }
 
 void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
@@ -349,6 +447,7 @@ void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
   output_buffer_length	= 0;
   output_buffer_current	= 0;
   ss_state				= ss_state_before_start;
+  bus_idle				= 1;
 
   if(use_sleep)
     set_sleep_mode(SLEEP_MODE_IDLE);
@@ -359,25 +458,51 @@ void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
 
   for(;;)
   {
-    if(use_sleep && (ss_state == ss_state_before_start))
-      sleep_mode();
+    /*
+     * Only sleep after a stop condition, it does not wake the controller.
+     * After a frame has been processed early the loop has to watch for it.
+     * Interrupts are enabled right before sleep_cpu(), so a start condition
+     * cannot slip in between the check and going to sleep.
+     */
+    if(use_sleep)
+    {
+      cli();
+
+      if((ss_state == ss_state_before_start) && bus_idle)
+      {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+      }
+
+      sei();
+    }
 
     /*
-     * This library cannot detect repeated starts and will execute the callback only
-     * after a stop condition.
-     *
-     * Start processing when there is a byte in the input buffer
+     * Start processing when there is a byte in the input buffer, or the
+     * complete frame if a frame length callback has been set.
      *
-     * WARNING: This means that we process data after one byte sent on I2C!
+     * A repeated start processes a pending frame in the start interrupt, so
+     * a write-then-read exchange always reads the reply to its own request.
+     * Without a frame length callback this means that we process data after
+     * one byte sent on I2C!
      */
-    if((USISR & _BV(USIPF)) || (input_buffer_length > 0))
+    // the start interrupt may take the frame or the stop right before this
+    cli();
+
+    if((USISR & _BV(USIPF)) || frame_complete())
     {
-      cli();
+      bus_idle = (USISR & _BV(USIPF)) ? 1 : 0;
 
-      if(stats_enabled)
-        stop_conditions_count++;
+      if(bus_idle)
+      {
+        if(stats_enabled)
+          stop_conditions_count++;
 
-      USISR |= _BV(USIPF);	// clear stop condition flag
+        // clear stop condition flag only, a pending start must stay
+        USISR = (USISR & 0x0f) | _BV(USIPF);
+      }
 
       switch(ss_state)
       {
@@ -389,26 +514,17 @@ void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
 
         case(ss_state_data_processed):
         {
-          if(stats_enabled)
-            local_frames_count++;
-
-          output_buffer_length	= 0;
-          output_buffer_current	= 0;
-
-          data_callback(buffer_size, input_buffer_length, input_buffer, &output_buffer_length, output_buffer);
-
-          input_buffer_length		= 0;
-
+          process_frame();
           break;
         }
 
       }
 
       ss_state = ss_state_before_start;
-
-      sei();
     }
 
+    sei();
+
     if(idle_callback)
     {
       idle_callback();
@@ -419,6 +535,17 @@ void usi_twi_slave(uint8_t slave_address_in, uint8_t use_sleep,
   }
 }
 
+void usi_twi_preload(const volatile uint8_t *buffer, uint8_t length)
+{
+  preload_buffer = buffer;
+  preload_length = length;
+}
+
+void usi_twi_frame_length(uint8_t (*frame_length_in)(uint8_t first_byte))
+{
+  frame_length = frame_length_in;
+}
+
 void usi_twi_enable_stats(uint8_t onoff)
 {
   stats_enabled				= onoff;
@@ -427,35 +554,80 @@ void usi_twi_enable_stats(uint8_t onoff)
   error_conditions_count		= 0;
   overflow_conditions_count	= 0;
   local_frames_count			= 0;
+  repeated_starts_count		= 0;
   idle_call_count				= 0;
 }
 
-uint16_t usi_twi_stats_start_conditions(void)
+uint32_t usi_twi_stats_start_conditions(void)
 {
   return(start_conditions_count);
 }
 
-uint16_t usi_twi_stats_stop_conditions(void)
+uint32_t usi_twi_stats_stop_conditions(void)
 {
   return(stop_conditions_count);
 }
 
-uint16_t usi_twi_stats_error_conditions(void)
+uint32_t usi_twi_stats_error_conditions(void)
 {
   return(error_conditions_count);
 }
 
-uint16_t usi_twi_stats_overflow_conditions(void)
+uint32_t usi_twi_stats_overflow_conditions(void)
 {
   return(overflow_conditions_count);
 }
 
-uint16_t usi_twi_stats_local_frames(void)
+uint32_t usi_twi_stats_local_frames(void)
 {
   return(local_frames_count);
 }
 
-uint16_t usi_twi_stats_idle_calls(void)
+uint32_t usi_twi_stats_idle_calls(void)
 {
   return(idle_call_count);
 }
+
+uint32_t usi_twi_stats_repeated_starts(void)
+{
+  return(repeated_starts_count);
+}
+
+void usi_twi_stats_get(struct usi_twi_stats *stats)
+{
+  const uint8_t sreg = SREG;
+
+  cli();
+
+  stats->start_conditions		= start_conditions_count;
+  stats->stop_conditions		= stop_conditions_count;
+  stats->repeated_starts		= repeated_starts_count;
+  stats->error_conditions		= error_conditions_count;
+  stats->overflow_conditions	= overflow_conditions_count;
+  stats->local_frames			= local_frames_count;
+
+  SREG = sreg;
+}
+
+void usi_twi_stats_take(struct usi_twi_stats *stats)
+{
+  const uint8_t sreg = SREG;
+
+  cli();
+
+  stats->start_conditions		= start_conditions_count;
+  stats->stop_conditions		= stop_conditions_count;
+  stats->repeated_starts		= repeated_starts_count;
+  stats->error_conditions		= error_conditions_count;
+  stats->overflow_conditions	= overflow_conditions_count;
+  stats->local_frames			= local_frames_count;
+
+  start_conditions_count		= 0;
+  stop_conditions_count		= 0;
+  repeated_starts_count		= 0;
+  error_conditions_count		= 0;
+  overflow_conditions_count	= 0;
+  local_frames_count			= 0;
+
+  SREG = sreg;
+}
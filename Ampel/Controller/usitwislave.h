@@ -11,12 +11,49 @@ void		usi_twi_slave(uint8_t slave_address, uint8_t use_sleep,
                                             volatile uint8_t *output_buffer_length, volatile uint8_t *output_buffer),
                     void (*idle_callback)(void));
 
+/*
+ * Frames with more than one byte: the callback returns the frame length
+ * from the first byte, the data callback is held back until the frame is
+ * complete, the master sends a stop condition or a repeated start.
+ */
+void		usi_twi_frame_length(uint8_t (*frame_length)(uint8_t first_byte));
+
+/*
+ * The reply to a read without a request before it in the same transaction.
+ * Set with interrupts disabled; a read that has started keeps the buffer
+ * it began with, so switch between two buffers to update the reply.
+ */
+void		usi_twi_preload(const volatile uint8_t *buffer, uint8_t length);
+
 void		usi_twi_enable_stats(uint8_t onoff);
-uint16_t	usi_twi_stats_start_conditions(void);
-uint16_t	usi_twi_stats_stop_conditions(void);
-uint16_t	usi_twi_stats_error_conditions(void);
-uint16_t	usi_twi_stats_overflow_conditions(void);
-uint16_t	usi_twi_stats_local_frames(void);
-uint16_t	usi_twi_stats_idle_calls(void);
+uint32_t	usi_twi_stats_start_conditions(void);
+uint32_t	usi_twi_stats_stop_conditions(void);
+uint32_t	usi_twi_stats_error_conditions(void);
+uint32_t	usi_twi_stats_overflow_conditions(void);
+uint32_t	usi_twi_stats_local_frames(void);
+uint32_t	usi_twi_stats_idle_calls(void);
+uint32_t	usi_twi_stats_repeated_starts(void);
+
+struct usi_twi_stats
+{
+  uint32_t	start_conditions;
+  uint32_t	stop_conditions;
+  uint32_t	repeated_starts;
+  uint32_t	error_conditions;
+  uint32_t	overflow_conditions;
+  uint32_t	local_frames;
+};
+
+/*
+ * Copy the bus counters with interrupts disabled, so no counter is read
+ * halfway through an update by the USI interrupts.
+ */
+void		usi_twi_stats_get(struct usi_twi_stats *stats);
+
+/*
+ * Copy the bus counters and clear them in one step, no condition is lost
+ * or counted twice. The idle calls are not cleared.
+ */
+void		usi_twi_stats_take(struct usi_twi_stats *stats);
 
 #endif
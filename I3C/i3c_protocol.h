@@ -0,0 +1,464 @@
+/*
+ * I³C protocol definitions
+ *
+ * Shared by the controller firmwares (Schalter, Ampel/Controller) and the
+ * host library on the Raspberry Pi, so both sides use the same command
+ * codes and framing. Keep this file plain C, it is built with avr-gcc too.
+ *
+ * I²C Datenformat (Anfrage):
+ *
+ * PCCCDDDD
+ *
+ * parity (P)	gerade Parität über CCCDDDD
+ * command (CCC)
+ * data (DDDD)
+ *
+ * Antwort: zwei Bytes, Wert und invertierter Wert. Ein Wert von 0 zeigt
+ * einen Fehler an.
+ */
+
+#ifndef _I3C_PROTOCOL_H_
+#define _I3C_PROTOCOL_H_
+
+#include <stdint.h>
+
+#ifdef __AVR__
+#include <util/crc16.h>
+#endif
+
+///// Framing /////
+
+#define I3C_CMD_MAX		0x07
+#define I3C_DATA_MAX		0x0f
+
+/**
+ * Parity of the lower 7 bits, a constant expression for constant arguments.
+ */
+#define I3C_PARITY7(b) \
+  ((((b) >> 0) ^ ((b) >> 1) ^ ((b) >> 2) ^ ((b) >> 3) ^ \
+    ((b) >> 4) ^ ((b) >> 5) ^ ((b) >> 6)) & 1)
+
+/**
+ * Build the request byte PCCCDDDD for command and data.
+ */
+#define I3C_REQUEST(cmd, data) \
+  ((uint8_t)((I3C_PARITY7(((cmd) << 4) | (data)) << 7) | ((cmd) << 4) | (data)))
+
+#define I3C_REQUEST_CMD(req)	(((req) & 0x70) >> 4)
+#define I3C_REQUEST_DATA(req)	((req) & 0x0f)
+
+/**
+ * Check the parity bit of a received request byte.
+ */
+#define I3C_REQUEST_VALID(req) \
+  ((((req) & 0x80) >> 7) == I3C_PARITY7((req) & 0x7f))
+
+/**
+ * Check a two byte reply: the second byte is the inverted first byte.
+ */
+#define I3C_REPLY_VALID(val, inv) \
+  ((uint8_t)(inv) == (uint8_t)~(val))
+
+///// Common commands /////
+
+#define I3C_CMD_RESET		0x00	// Reset I³C state, release INT
+#define I3C_CMD_GETSTATUS	0x03	// Statusblock ausgeben
+
+/*
+ * GetStatus: one transaction returns a status block instead of one value
+ * byte and its inverse. With data flag I3C_STATUS_RESET the I³C state is
+ * reset after the snapshot has been taken, which saves the extra RESET.
+ *
+ * Status block:
+ *	0	length of the block, I3C_STATUS_LEN
+ *	1	firmware version
+ *	2	state (lever: LEVER_STATE_*, Ampel: GetLight reply)
+ *	3	flags, see I3C_STATUS_FLAG_*
+ *	4..5	TWI frames addressed to the device (little endian)
+ *	6..7	TWI error conditions
+ *	8..9	TWI start conditions on the bus
+ *	10	checksum, inverted sum of bytes 0..9
+ */
+#define I3C_STATUS_RESET	0x01
+
+#define I3C_STATUS_LENGTH	0
+#define I3C_STATUS_VERSION	1
+#define I3C_STATUS_STATE	2
+#define I3C_STATUS_FLAGS	3
+#define I3C_STATUS_FRAMES	4
+#define I3C_STATUS_ERRORS	6
+#define I3C_STATUS_STARTS	8
+#define I3C_STATUS_CHECKSUM	10
+#define I3C_STATUS_LEN		11
+
+#define I3C_STATUS_FLAG_INT	0x01	// INT line was pulled
+
+/*
+ * Preloaded status: from firmware 6 on, a read without a request in the
+ * same transaction returns the status block. The controller refills it
+ * after every frame and on state changes, so the reply is ready before
+ * the master asks and never needs clock stretching. The counters are
+ * those of the last refill.
+ */
+#define I3C_PRELOAD_MIN_VERSION	0x06
+
+/*
+ * Telemetry: v2 only, from firmware 7 on. The reply holds the TWI
+ * counters of the controller since the last Telemetry command, which
+ * are cleared in the same step with interrupts disabled. The reply is
+ * kept for retries, so a retry does not lose a snapshot. The GetStatus
+ * counters are the low 16 bits of the same counters.
+ *
+ * Payload, 32 bit little endian each:
+ *	0	start conditions on the bus
+ *	4	stop conditions
+ *	8	repeated starts
+ *	12	error conditions (stop right after start)
+ *	16	USI overflows, one per byte and per ACK bit
+ *	20	frames addressed to the device
+ */
+#define I3C_CMD_TELEMETRY	0x09	// nur v2: Buszaehler abholen und loeschen
+#define I3C_TELEMETRY_MIN_VERSION 0x07
+
+#define I3C_TELEMETRY_STARTS	0
+#define I3C_TELEMETRY_STOPS	4
+#define I3C_TELEMETRY_REPEATED	8
+#define I3C_TELEMETRY_ERRORS	12
+#define I3C_TELEMETRY_OVERFLOWS	16
+#define I3C_TELEMETRY_FRAMES	20
+#define I3C_TELEMETRY_LEN	24
+
+/**
+ * Inverted 8 bit sum, the checksum of multi-byte replies.
+ */
+static inline uint8_t i3c_checksum(const volatile uint8_t *buf, uint8_t len) {
+  uint8_t sum = 0;
+  while (len--)
+    sum += *buf++;
+  return ~sum;
+}
+
+///// Protocol v2 /////
+
+/*
+ * Protokoll v2: Frames mit CRC-8 und Sequenznummer
+ *
+ * Anfrage:
+ *	0	I3C_V2_HEADER(n), v1 request with command I3C_CMD_V2 and the
+ *		number n of following bytes as data
+ *	1	sequence number
+ *	2	command, the v1 command codes plus v2-only commands
+ *	3..n-1	payload, for v1 commands the data value
+ *	n	CRC-8 over bytes 0..n-1
+ *
+ * Antwort:
+ *	0	status I3C_V2_OK or I3C_V2_ERR_*, ored with I3C_V2_REPLAYED
+ *	1	sequence number of the request
+ *	2	payload length m
+ *	3..	payload, for v1 commands the reply value
+ *	3+m	CRC-8 over bytes 0..2+m
+ *
+ * The controller keeps the reply to the last sequence number. A request
+ * repeated with the same sequence number is answered from there without
+ * running the command again, so the host can retry SetLight or SetState
+ * blindly. Sequence number 0 disables this and drops the kept reply.
+ *
+ * v1 firmware answers the header byte with the error value 0. The host
+ * only tries v2 with firmware that reports version 2 or later in its
+ * status block, because v1 firmware would take the following bytes for
+ * further requests.
+ */
+#define I3C_CMD_V2		0x07
+#define I3C_V2_HEADER(n)	I3C_REQUEST(I3C_CMD_V2, n)
+#define I3C_V2_MIN_VERSION	0x02	// first firmware version with v2
+
+// request offsets
+#define I3C_V2_SEQ		1
+#define I3C_V2_CMD		2
+#define I3C_V2_PAYLOAD		3
+// reply offsets
+#define I3C_V2_STATUS		0
+#define I3C_V2_LEN		2
+#define I3C_V2_DATA		3
+
+#define I3C_V2_OVERHEAD		4	// header/status, seq, cmd/len, CRC
+#define I3C_V2_REQUEST_MAX	(I3C_DATA_MAX + 1)
+#define I3C_V2_PAYLOAD_MAX	(I3C_V2_REQUEST_MAX - I3C_V2_OVERHEAD)
+#define I3C_V2_REPLY_MAX	32	// usitwislave buffer size
+
+#define I3C_V2_OK		0x01
+#define I3C_V2_ERR_CRC		0x02	// request damaged or incomplete
+#define I3C_V2_ERR_CMD		0x03	// unknown command
+#define I3C_V2_ERR_ARG		0x04	// command failed, v1 error value 0
+#define I3C_V2_REPLAYED		0x80	// reply kept from the first request
+#define I3C_V2_STATUS_MASK	0x7f
+
+/**
+ * CRC-8 with polynomial x^8 + x^2 + x + 1 (0x07) and initial value 0.
+ */
+static inline uint8_t i3c_crc8(const volatile uint8_t *buf, uint8_t len) {
+  uint8_t crc = 0;
+  while (len--) {
+#ifdef __AVR__
+    crc = _crc8_ccitt_update(crc, *buf++);
+#else
+    crc ^= *buf++;
+    uint8_t i;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+#endif
+  }
+  return crc;
+}
+
+/**
+ * Length of the frame starting with the given request byte, for
+ * usi_twi_frame_length.
+ */
+static inline uint8_t i3c_frame_length(uint8_t request) {
+  if (I3C_REQUEST_VALID(request) && (I3C_REQUEST_CMD(request) == I3C_CMD_V2))
+    return 1 + I3C_REQUEST_DATA(request);
+
+  return 1;
+}
+
+/**
+ * Fill in status, sequence number, length and CRC of a v2 reply whose
+ * payload is already in place.
+ *
+ * @return The reply length
+ */
+static inline uint8_t i3c_v2_reply(volatile uint8_t *out, uint8_t status,
+                                   uint8_t seq, uint8_t len) {
+  out[I3C_V2_STATUS] = status;
+  out[I3C_V2_SEQ]    = seq;
+  out[I3C_V2_LEN]    = len;
+  out[I3C_V2_DATA + len] = i3c_crc8(out, I3C_V2_DATA + len);
+
+  return len + I3C_V2_OVERHEAD;
+}
+
+/*
+ * Controller side of v2: replay detection and dispatch to the command
+ * handler of the firmware.
+ */
+// longer replies are not kept, the telemetry snapshot must be
+#define I3C_V2_KEEP_MAX		(I3C_V2_OVERHEAD + I3C_TELEMETRY_LEN)
+
+struct i3c_v2_state {
+  uint8_t seq;				// 0 if no reply is kept
+  uint8_t len;
+  uint8_t reply[I3C_V2_KEEP_MAX];
+};
+
+/**
+ * Command handler of the firmware.
+ *
+ * @param reply Space for the reply payload
+ * @param len Set to the reply payload length
+ * @return I3C_V2_OK or I3C_V2_ERR_*
+ */
+typedef uint8_t (*i3c_v2_handler)(uint8_t cmd,
+                                  const volatile uint8_t *payload, uint8_t plen,
+                                  volatile uint8_t *reply, uint8_t *len);
+
+/**
+ * Handle a v2 request.
+ *
+ * @return The reply length
+ */
+static inline uint8_t i3c_v2_request(struct i3c_v2_state *st,
+                                     i3c_v2_handler handler,
+                                     uint8_t in_len,
+                                     const volatile uint8_t *in,
+                                     volatile uint8_t *out) {
+  const uint8_t n = I3C_REQUEST_DATA(in[0]);
+
+  // the kept reply stays, the retry of a damaged replay must still find it
+  if ((n < I3C_V2_PAYLOAD) || (in_len != n + 1) || (i3c_crc8(in, n) != in[n]))
+    return i3c_v2_reply(out, I3C_V2_ERR_CRC, (in_len > 1) ? in[I3C_V2_SEQ] : 0, 0);
+
+  const uint8_t seq = in[I3C_V2_SEQ];
+  uint8_t i;
+
+  if (seq && (seq == st->seq)) {
+    for (i = 0; i < st->len; i++)
+      out[i] = st->reply[i];
+    return i3c_v2_reply(out, out[I3C_V2_STATUS] | I3C_V2_REPLAYED,
+                        seq, out[I3C_V2_LEN]);
+  }
+
+  uint8_t len = 0;
+  const uint8_t status = handler(in[I3C_V2_CMD],
+                                 in + I3C_V2_PAYLOAD, n - I3C_V2_PAYLOAD,
+                                 out + I3C_V2_DATA, &len);
+  const uint8_t out_len = i3c_v2_reply(out, status, seq, len);
+
+  st->seq = 0;
+  if (seq && (out_len <= I3C_V2_KEEP_MAX)) {
+    for (i = 0; i < out_len; i++)
+      st->reply[i] = out[i];
+    st->seq = seq;
+    st->len = out_len;
+  }
+
+  return out_len;
+}
+
+///// Schalter (status lever) /////
+
+#define I3C_ADDR_LEVER		0x24
+
+#define LEVER_CMD_GETSTATE	0x01	// Aktuelle Schalterstellung ausgeben
+#define LEVER_CMD_SETSTATE	0x02	// Status Schalterstellung setzen
+#define LEVER_CMD_EVENTS	0x04	// Schalterereignisse abholen
+#define LEVER_CMD_DEBOUNCE	0x05	// Abtastintervall der Entprellung setzen
+
+/*
+ * Debounce: the inputs are sampled every data ticks (1..15, v2 1..255)
+ * and switch after four equal samples, so the debounce time is four
+ * times the sampling period. Firmware version 4 and later.
+ */
+#define LEVER_DEBOUNCE_MIN_VERSION 0x04
+#define LEVER_DEBOUNCE_SAMPLES	4
+
+#define LEVER_STATE_CLOSED	0x01
+#define LEVER_STATE_OPEN	0x02
+#define LEVER_STATE_UNKNOWN	0x03
+
+/*
+ * Events: the controller records every debounced lever transition with a
+ * millisecond tick in a FIFO and pulls INT. The data value is the sequence
+ * number of the next event the host wants (v1: the lower 4 bits), which
+ * acknowledges and removes all earlier events. Asking again with the same
+ * number is harmless, so the command may be retried. INT is released once
+ * all events are acknowledged.
+ *
+ * From firmware version 5 on the tick only advances while an input is
+ * settling or events are waiting, so only the age of waiting events
+ * (current tick - event tick) is meaningful.
+ *
+ * Events block, always LEVER_EVENTS_LEN bytes:
+ *	0	length of the block, LEVER_EVENTS_LEN
+ *	1	sequence number of the first event in the block
+ *	2	events lost because the FIFO was full, wraps around
+ *	3..4	current tick (little endian)
+ *	5	number n of events in the block
+ *	6..	LEVER_EVENTS_MAX events: state (LEVER_STATE_*), tick; only the
+ *		first n are valid
+ *	27	checksum, inverted sum of bytes 0..26
+ */
+#define LEVER_EVENTS_MIN_VERSION 0x03	// first firmware version with events
+#define LEVER_TICK_MS		1
+
+#define LEVER_EVENTS_LENGTH	0
+#define LEVER_EVENTS_FIRST	1
+#define LEVER_EVENTS_LOST	2
+#define LEVER_EVENTS_TICK	3
+#define LEVER_EVENTS_COUNT	5
+#define LEVER_EVENTS_DATA	6
+#define LEVER_EVENT_SIZE	3
+#define LEVER_EVENTS_MAX	7
+#define LEVER_EVENTS_CHECKSUM	(LEVER_EVENTS_DATA + LEVER_EVENTS_MAX * LEVER_EVENT_SIZE)
+#define LEVER_EVENTS_LEN	(LEVER_EVENTS_CHECKSUM + 1)
+
+///// Ampel /////
+
+#define I3C_ADDR_AMPEL		0x20
+
+#define AMPEL_CMD_GETLIGHT	0x01	// Aktuellen Datenwert ausgeben
+#define AMPEL_CMD_SETLIGHT	0x02	// Neuen Datenwert setzen
+#define AMPEL_CMD_FADE		0x04	// nur v2: Farbe mit Helligkeit ueberblenden
+#define AMPEL_CMD_BLINK		0x05	// nur v2: Blinkperiode und Tastgrad setzen
+#define AMPEL_CMD_PATTERN	0x06	// Muster starten, Daten: Nummer, 0 stoppt
+#define AMPEL_CMD_PATTERN_WRITE	0x08	// nur v2: Muster ins EEPROM schreiben
+
+/*
+ * The light engine drives the LEDs with gamma-corrected PWM. Firmware
+ * version 3 and later, SetLight is a fade to full brightness in 0 ms.
+ *
+ * Fade payload, AMPEL_FADE_LEN bytes:
+ *	0	light value as for SetLight
+ *	1	brightness 0..255
+ *	2..3	fade time in ms (little endian), a color change fades out
+ *		the old color in the first half
+ *
+ * Blink payload, AMPEL_BLINK_LEN bytes:
+ *	0..1	blink period in ms (little endian), at least 2
+ *	2	on time in 1/256 of the period, at least 1
+ *
+ * Both reply with one byte, 1.
+ */
+#define AMPEL_LIGHT_MIN_VERSION	0x03
+
+#define AMPEL_FADE_LIGHT	0
+#define AMPEL_FADE_LEVEL	1
+#define AMPEL_FADE_TIME		2
+#define AMPEL_FADE_LEN		4
+
+#define AMPEL_BLINK_PERIOD	0
+#define AMPEL_BLINK_DUTY	2
+#define AMPEL_BLINK_LEN		3
+
+/*
+ * Patterns run on the controller from bytecode in EEPROM, in
+ * AMPEL_PATTERN_SLOTS slots of AMPEL_PATTERN_SIZE bytes. Firmware version
+ * 4 and later. Instructions, the high nibble is the opcode:
+ *	0x00		End, the light stays
+ *	0x1L b t	Fade to light L (as SetLight) with brightness b in
+ *			t * AMPEL_PATTERN_TICK_MS, continues right away
+ *	0x20 t		Wait t * AMPEL_PATTERN_TICK_MS
+ *	0x30 n a	Loop: jump to offset a until the block ran n times,
+ *			0 loops forever, loops do not nest
+ * Other opcodes end the pattern, so an erased slot (0xff) is empty.
+ * Reading past the slot reads End.
+ *
+ * Pattern data: slot 1..AMPEL_PATTERN_SLOTS, 0 stops the running pattern.
+ * SetLight and Fade stop it as well.
+ *
+ * PatternWrite payload:
+ *	0	slot 1..AMPEL_PATTERN_SLOTS
+ *	1	offset in the slot
+ *	2..	up to AMPEL_PATTERN_CHUNK bytecode bytes
+ * The reply is one byte: 1 if the chunk was taken, 0 while the previous
+ * chunk is still being written, which takes AMPEL_PATTERN_WRITE_MS per
+ * byte. Writing the running slot stops the pattern.
+ */
+#define AMPEL_PATTERN_MIN_VERSION 0x04
+#define AMPEL_PATTERN_SLOTS	8
+#define AMPEL_PATTERN_SIZE	64
+#define AMPEL_PATTERN_TICK_MS	10
+#define AMPEL_PATTERN_WRITE_MS	4
+
+#define AMPEL_OP_END		0x00
+#define AMPEL_OP_FADE		0x10
+#define AMPEL_OP_WAIT		0x20
+#define AMPEL_OP_LOOP		0x30
+#define AMPEL_OP_MASK		0xf0
+
+#define AMPEL_PATTERN_WRITE_SLOT	0
+#define AMPEL_PATTERN_WRITE_OFFSET	1
+#define AMPEL_PATTERN_WRITE_DATA	2
+#define AMPEL_PATTERN_CHUNK	(I3C_V2_PAYLOAD_MAX - AMPEL_PATTERN_WRITE_DATA)
+
+/*
+ * SetLight data:
+ *	1 bit blink-Status
+ *	3 bit Farbe:	0 keine
+ *			1 rot
+ *			2 grün
+ */
+#define AMPEL_VAL_NONE		0x0
+#define AMPEL_VAL_RED		0x1
+#define AMPEL_VAL_GREEN		0x2
+#define AMPEL_VAL_COLOR		0x7
+#define AMPEL_VAL_BLINK		0x8
+
+/*
+ * GetLight reply: 1000BCCC with blink bit B and color CCC,
+ * the msb avoids the error value 0.
+ */
+#define AMPEL_LIGHT_VALID	0x80
+#define AMPEL_LIGHT_BLINK	0x10
+
+#endif
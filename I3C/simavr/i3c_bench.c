@@ -0,0 +1,878 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <libelf.h>
+#include <gelf.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_irq.h>
+#include <sim_interrupts.h>
+#include <sim_cycle_timers.h>
+#include <avr_ioport.h>
+
+#include "i3c_protocol.h"
+
+/*
+ * Cycle-accurate benchmark of the I3C controller firmware in simavr.
+ *
+ * Loads the firmware.elf of the lever (Schalter) or the Ampel controller,
+ * runs a fixed set of scenarios against a simulated I2C master and writes
+ * one JSON object to stdout:
+ *   - flash and RAM footprint
+ *   - ISR entries per second for each scenario
+ *   - entries, mean and worst-case duration for each interrupt vector
+ *   - bus time and clock stretching for each transaction type
+ *   - worst-case clock stretch for the start interrupt and for each state
+ *     of the overflow interrupt (of_state in usitwislave.c)
+ *   - debounce latency from a lever contact to the INT line (lever only)
+ *
+ * simavr's ATtiny85 core has no USI. The master therefore acts on the USI
+ * registers itself: it shifts the bits through USIDR, sets the start,
+ * overflow and stop flags as the USI would and keeps SCL low while a flag
+ * holds the clock.
+ *
+ * The bus rate is set with -f, standard mode (100 kHz) by default. At fast
+ * mode (400 kHz) the master keeps SCL low for only ten CPU cycles, so the
+ * stretch per state shows which USI state is too slow.
+ *
+ * The exit status is 1 if a transaction failed or a lever change did not
+ * reach the INT line.
+ */
+
+#define F_CPU		8000000UL
+#define I2C_HZ		100000UL
+#define BIT_CYCLES	(F_CPU / i2c_hz)
+#define US_CYCLES	(F_CPU / 1000000UL)
+#define MS_CYCLES	(F_CPU / 1000UL)
+
+// ATtiny85 data space addresses
+#define ADDR_PINB	0x36
+#define ADDR_DDRB	0x37
+#define ADDR_PORTB	0x38
+#define ADDR_USICR	0x2d
+#define ADDR_USISR	0x2e
+#define ADDR_USIDR	0x2f
+
+#define USISIF		7
+#define USIOIF		6
+#define USIPF		5
+#define USISIE		7
+#define USIOIE		6
+#define USIWM0		4
+#define USI_FLAGS	0xf0	// write one to clear
+#define USI_COUNTER	0x0f
+
+#define PIN_SDA		0
+#define PIN_INT		1
+#define PIN_SCL		2
+#define PIN_CLOSED	3
+#define PIN_OPEN	4
+
+// symbol of the overflow state in the firmware
+#define OF_STATE_SYMBOL	"of_state"
+
+#define VECTOR_USI_START	13
+#define VECTOR_USI_OVF		14
+#define VECTORS			15
+
+static const char *vector_names[VECTORS] = {
+  "RESET", "INT0", "PCINT0", "TIMER1_COMPA", "TIMER1_OVF",
+  "TIMER0_OVF", "EE_RDY", "ANA_COMP", "ADC", "TIMER1_COMPB",
+  "TIMER0_COMPA", "TIMER0_COMPB", "WDT", "USI_START", "USI_OVF"
+};
+
+unsigned long i2c_hz = I2C_HZ;
+
+///// Interrupts /////
+
+struct isr_stats {
+  uint64_t entries;
+  uint64_t cycles;
+  uint64_t max_cycles;
+  avr_cycle_count_t entered;
+};
+
+struct isr_stats isr[VECTORS];
+
+///// Board /////
+
+struct bench {
+  avr_t *avr;
+  avr_irq_t *pins[8];		// port B, driven from outside
+
+  // INT line, pulled by the controller
+  bool int_pulled;
+  avr_cycle_count_t int_changed;
+};
+
+struct bench bench;
+
+/**
+ * The running IRQ of a vector: 1 on entry, 0 on reti.
+ */
+static void isr_notify(struct avr_irq_t *irq, uint32_t value, void *param) {
+  struct isr_stats *s = param;
+  const avr_cycle_count_t now = bench.avr->cycle;
+
+  if (value) {
+    s->entries++;
+    s->entered = now;
+  } else {
+    const uint64_t d = now - s->entered;
+    s->cycles += d;
+    if (d > s->max_cycles)
+      s->max_cycles = d;
+  }
+}
+
+static uint64_t isr_entries(void) {
+  uint64_t n = 0;
+  int v;
+  for (v = 1; v < VECTORS; v++)
+    n += isr[v].entries;
+  return n;
+}
+
+static void pin_drive(uint8_t pin, uint8_t level) {
+  avr_raise_irq(bench.pins[pin], level);
+}
+
+static void int_poll(void) {
+  const uint8_t ddr = bench.avr->data[ADDR_DDRB];
+  const uint8_t port = bench.avr->data[ADDR_PORTB];
+  const bool pulled = (ddr & (1 << PIN_INT)) && !(port & (1 << PIN_INT));
+
+  if (pulled != bench.int_pulled) {
+    bench.int_pulled = pulled;
+    bench.int_changed = bench.avr->cycle;
+  }
+}
+
+/**
+ * @return false if the core stopped
+ */
+static bool run_cycles(avr_cycle_count_t cycles) {
+  const avr_cycle_count_t end = bench.avr->cycle + cycles;
+
+  while (bench.avr->cycle < end) {
+    const int state = avr_run(bench.avr);
+    if ((state == cpu_Done) || (state == cpu_Crashed))
+      return false;
+    int_poll();
+  }
+
+  return true;
+}
+
+// simavr sleeps in real time by default
+static void no_sleep(struct avr_t *avr, avr_cycle_count_t how_long) {
+}
+
+///// I2C master /////
+
+#define MASTER_BITS	(2 * 9 * (1 + I3C_V2_REPLY_MAX))
+
+struct master {
+  avr_int_vector_t start_vector;
+  avr_int_vector_t ovf_vector;
+
+  // the transaction as a bit stream: what the master drives and what is
+  // on the bus; a segment starts with a (repeated) start condition
+  uint8_t drive[MASTER_BITS];
+  uint8_t bus[MASTER_BITS];
+  int     bits;
+  int     pos;
+  int     segment_end[2];
+  int     segments;
+  int     segment;
+
+  bool    holding;		// a USI flag holds SCL low
+  bool    hold_start;		// ... the start flag
+  avr_cycle_count_t hold_since;
+
+  avr_cycle_count_t started;
+  avr_cycle_count_t stretch;
+  bool    done;
+};
+
+struct master master;
+
+/*
+ * Clock stretch by the USI state that holds SCL: the start interrupt, or
+ * the overflow interrupt in the state it dispatches on. Same order as the
+ * of_state enum in usitwislave.c, after the start.
+ */
+#define HOLD_START	0
+#define HOLD_STATES	8
+#define HOLD_UNKNOWN	(HOLD_STATES - 1)
+
+struct hold_stats {
+  const char *name;
+  uint64_t holds;
+  uint64_t stretch;
+  uint64_t max_stretch;
+};
+
+struct hold_stats holds[HOLD_STATES] = {
+  { .name = "start" },
+  { .name = "check_address" },
+  { .name = "send_data" },
+  { .name = "request_ack" },
+  { .name = "check_ack" },
+  { .name = "receive_data" },
+  { .name = "store_data_and_send_ack" },
+  { .name = "overflow" }		// of_state not found or out of range
+};
+
+int of_state_addr = -1;		// data space address of of_state
+int hold_state;
+
+static void master_byte(uint8_t byte, bool master_sends, uint8_t ack) {
+  int i;
+  for (i = 7; i >= 0; i--)
+    master.drive[master.bits++] = master_sends ? (byte >> i) & 1 : 1;
+
+  // the receiver drives the ack bit
+  master.drive[master.bits++] = master_sends ? 1 : ack;
+}
+
+static avr_cycle_count_t master_overflow(struct avr_t *avr,
+                                         avr_cycle_count_t when, void *param);
+static avr_cycle_count_t master_condition(struct avr_t *avr,
+                                          avr_cycle_count_t when, void *param);
+
+static void master_hold(bool start) {
+  master.holding = true;
+  master.hold_start = start;
+  master.hold_since = bench.avr->cycle;
+
+  // the overflow interrupt has not run yet, of_state is the one it takes
+  if (start)
+    hold_state = HOLD_START;
+  else if (of_state_addr < 0)
+    hold_state = HOLD_UNKNOWN;
+  else {
+    const uint8_t state = bench.avr->data[of_state_addr];
+    hold_state = (state < HOLD_UNKNOWN - 1) ? state + 1 : HOLD_UNKNOWN;
+  }
+}
+
+/**
+ * The USI let go of SCL: clock the bits the counter asks for, or end the
+ * segment.
+ */
+static void master_release(void) {
+  avr_t *avr = bench.avr;
+  const avr_cycle_count_t held = avr->cycle - master.hold_since;
+  struct hold_stats *h = &holds[hold_state];
+
+  // the master keeps SCL low for half a bit anyway
+  const uint64_t stretch = (held > BIT_CYCLES / 2) ? held - BIT_CYCLES / 2 : 0;
+  master.stretch += stretch;
+
+  h->holds++;
+  h->stretch += stretch;
+  if (stretch > h->max_stretch)
+    h->max_stretch = stretch;
+
+  if (master.hold_start) {
+    avr->data[ADDR_PORTB] |= (1 << PIN_SCL);
+    pin_drive(PIN_SCL, 1);
+  }
+
+  master.holding = false;
+
+  if (master.pos < master.segment_end[master.segment]) {
+    const uint8_t count = avr->data[ADDR_USISR] & USI_COUNTER;
+    const int bits = (16 - count) / 2;
+    avr_cycle_timer_register(avr, bits * BIT_CYCLES, master_overflow, NULL);
+  } else
+    avr_cycle_timer_register(avr, BIT_CYCLES / 2, master_condition, NULL);
+}
+
+static void usisr_write(struct avr_t *avr, avr_io_addr_t addr,
+                        uint8_t v, void *param) {
+  const uint8_t old = avr->data[ADDR_USISR];
+  const uint8_t cleared = old & v & USI_FLAGS;
+
+  avr->data[ADDR_USISR] = ((old & ~v) & USI_FLAGS) | (v & USI_COUNTER);
+
+  if (cleared & (1 << USISIF))
+    avr_clear_interrupt(avr, &master.start_vector);
+  if (cleared & (1 << USIOIF))
+    avr_clear_interrupt(avr, &master.ovf_vector);
+
+  if (master.holding &&
+      !(avr->data[ADDR_USISR] & ((1 << USISIF) | (1 << USIOIF))))
+    master_release();
+}
+
+static void usicr_write(struct avr_t *avr, avr_io_addr_t addr,
+                        uint8_t v, void *param) {
+  avr->data[ADDR_USICR] = v;
+
+  // a flag raised while its interrupt was off
+  const uint8_t flags = avr->data[ADDR_USISR];
+  if ((flags & (1 << USISIF)) && (v & (1 << USISIE)))
+    avr_raise_interrupt(avr, &master.start_vector);
+  if ((flags & (1 << USIOIF)) && (v & (1 << USIOIE)))
+    avr_raise_interrupt(avr, &master.ovf_vector);
+}
+
+static avr_cycle_count_t master_overflow(struct avr_t *avr,
+                                         avr_cycle_count_t when, void *param) {
+  const uint8_t count = avr->data[ADDR_USISR] & USI_COUNTER;
+  const int end = master.segment_end[master.segment];
+  int bits = (16 - count) / 2;
+
+  // SDA is the wired AND of the master and the MSB of USIDR
+  for (; bits && (master.pos < end); bits--) {
+    const uint8_t slave = (avr->data[ADDR_DDRB] & (1 << PIN_SDA)) ?
+                          avr->data[ADDR_USIDR] >> 7 : 1;
+    const uint8_t sda = master.drive[master.pos] & slave;
+
+    master.bus[master.pos++] = sda;
+    avr->data[ADDR_USIDR] = (avr->data[ADDR_USIDR] << 1) | sda;
+  }
+
+  avr->data[ADDR_USISR] &= ~USI_COUNTER;
+  avr_raise_interrupt(avr, &master.ovf_vector);
+
+  // two-wire mode with the counter overflow hold
+  if ((avr->data[ADDR_USICR] & (3 << USIWM0)) == (3 << USIWM0))
+    master_hold(false);
+  else if (master.pos < end)
+    avr_cycle_timer_register(avr, 8 * BIT_CYCLES, master_overflow, NULL);
+  else
+    avr_cycle_timer_register(avr, BIT_CYCLES / 2, master_condition, NULL);
+
+  return 0;
+}
+
+/**
+ * Start condition for the next segment, or the stop condition.
+ */
+static avr_cycle_count_t master_condition(struct avr_t *avr,
+                                          avr_cycle_count_t when, void *param) {
+  if (master.pos && (++master.segment >= master.segments)) {
+    // SDA rises while SCL is high
+    pin_drive(PIN_SDA, 1);
+    avr->data[ADDR_USISR] |= (1 << USIPF);
+    master.done = true;
+    return 0;
+  }
+
+  // SDA falls while SCL is high, then SCL goes low and the USI holds it
+  pin_drive(PIN_SDA, 0);
+  pin_drive(PIN_SCL, 0);
+  avr->data[ADDR_PORTB] &= ~(1 << PIN_SCL);
+  avr_raise_interrupt(avr, &master.start_vector);
+  master_hold(true);
+
+  return 0;
+}
+
+struct xfer_stats {
+  const char *name;
+  uint32_t count;
+  uint32_t failed;
+  uint64_t cycles;
+  uint64_t max_cycles;
+  uint64_t stretch;
+  uint64_t max_stretch;
+};
+
+/**
+ * Run one transaction: write, repeated start, read.
+ *
+ * @return true if every byte was acknowledged
+ */
+static bool master_transfer(struct xfer_stats *st, uint8_t addr,
+                            const uint8_t *wbuf, uint8_t wlen,
+                            uint8_t *rbuf, uint8_t rlen) {
+  int i;
+
+  memset(&master.drive, 1, sizeof(master.drive));
+  master.bits = 0;
+  master.segments = 0;
+
+  if (wlen) {
+    master_byte(addr << 1, true, 0);
+    for (i = 0; i < wlen; i++)
+      master_byte(wbuf[i], true, 0);
+    master.segment_end[master.segments++] = master.bits;
+  }
+  if (rlen) {
+    master_byte((addr << 1) | 1, true, 0);
+    for (i = 0; i < rlen; i++)
+      master_byte(0xff, false, i == rlen - 1);	// NACK ends the read
+    master.segment_end[master.segments++] = master.bits;
+  }
+
+  master.pos = 0;
+  master.segment = 0;
+  master.stretch = 0;
+  master.done = false;
+  master.started = bench.avr->cycle;
+
+  avr_cycle_timer_register(bench.avr, 1, master_condition, NULL);
+
+  bool ok = true;
+  const avr_cycle_count_t timeout = bench.avr->cycle + 50 * MS_CYCLES;
+  while (ok && !master.done && (bench.avr->cycle < timeout))
+    ok = run_cycles(1);
+
+  const uint64_t cycles = bench.avr->cycle - master.started;
+
+  // every ack the slave drives must be low
+  int pos = 0, seg;
+  for (seg = 0; ok && (seg < master.segments); seg++) {
+    const bool reading = rlen && (seg == master.segments - 1);
+    int byte = 0;
+
+    for (; pos < master.segment_end[seg]; pos += 9, byte++) {
+      uint8_t v = 0;
+      for (i = 0; i < 8; i++)
+        v = (v << 1) | master.bus[pos + i];
+
+      if (reading && byte)
+        rbuf[byte - 1] = v;
+      else if (master.bus[pos + 8])
+        ok = false;
+    }
+  }
+  ok = ok && master.done;
+
+  st->count++;
+  if (!ok)
+    st->failed++;
+  st->cycles += cycles;
+  if (cycles > st->max_cycles)
+    st->max_cycles = cycles;
+  st->stretch += master.stretch;
+  if (master.stretch > st->max_stretch)
+    st->max_stretch = master.stretch;
+
+  // the main loop picks up the stop condition
+  run_cycles(BIT_CYCLES);
+
+  return ok;
+}
+
+static void master_init(avr_t *avr) {
+  master.start_vector.vector = VECTOR_USI_START;
+  master.start_vector.enable = (avr_regbit_t)AVR_IO_REGBIT(ADDR_USICR, USISIE);
+  master.start_vector.raised = (avr_regbit_t)AVR_IO_REGBIT(ADDR_USISR, USISIF);
+  master.start_vector.raise_sticky = 1;
+
+  master.ovf_vector.vector = VECTOR_USI_OVF;
+  master.ovf_vector.enable = (avr_regbit_t)AVR_IO_REGBIT(ADDR_USICR, USIOIE);
+  master.ovf_vector.raised = (avr_regbit_t)AVR_IO_REGBIT(ADDR_USISR, USIOIF);
+  master.ovf_vector.raise_sticky = 1;
+
+  avr_register_vector(avr, &master.start_vector);
+  avr_register_vector(avr, &master.ovf_vector);
+
+  avr_register_io_write(avr, ADDR_USISR, usisr_write, NULL);
+  avr_register_io_write(avr, ADDR_USICR, usicr_write, NULL);
+}
+
+///// Scenarios /////
+
+struct scenario {
+  const char *name;
+  double seconds;
+  double isr_per_s;
+};
+
+#define SCENARIOS_MAX	8
+#define XFER_TYPES	2
+
+struct scenario scenarios[SCENARIOS_MAX];
+int scenario_count;
+
+struct xfer_stats xfers[XFER_TYPES] = {
+  { .name = "status" },
+  { .name = "request" }
+};
+
+struct debounce_stats {
+  uint32_t flips;
+  uint32_t detected;
+  uint64_t cycles;
+  uint64_t max_cycles;
+} debounce;
+
+bool failed;
+
+/**
+ * Run the board for the given time and record the ISR rate.
+ */
+static void scenario_run(const char *name, uint32_t ms) {
+  struct scenario *s = &scenarios[scenario_count++];
+  const uint64_t entries = isr_entries();
+
+  if (!run_cycles((avr_cycle_count_t)ms * MS_CYCLES))
+    failed = true;
+
+  s->name = name;
+  s->seconds = ms / 1000.0;
+  s->isr_per_s = (isr_entries() - entries) / s->seconds;
+}
+
+/**
+ * One v1 request with its two byte reply.
+ */
+static bool request(uint8_t addr, uint8_t cmd, uint8_t data, uint8_t *value) {
+  const uint8_t req = I3C_REQUEST(cmd, data);
+  uint8_t rep[2];
+
+  if (!master_transfer(&xfers[1], addr, &req, 1, rep, 2) ||
+      !I3C_REPLY_VALID(rep[0], rep[1])) {
+    failed = true;
+    return false;
+  }
+  if (value)
+    *value = rep[0];
+  return true;
+}
+
+/**
+ * A plain read of the preloaded status block.
+ */
+static bool status(uint8_t addr) {
+  uint8_t blk[I3C_STATUS_LEN];
+
+  if (!master_transfer(&xfers[0], addr, NULL, 0, blk, I3C_STATUS_LEN) ||
+      (blk[I3C_STATUS_CHECKSUM] != i3c_checksum(blk, I3C_STATUS_CHECKSUM))) {
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Status reads and v1 requests, one per millisecond.
+ */
+static void transactions(uint8_t addr, uint8_t cmd, int rounds) {
+  struct scenario *s = &scenarios[scenario_count++];
+  const uint64_t entries = isr_entries();
+  const avr_cycle_count_t start = bench.avr->cycle;
+
+  int i;
+  for (i = 0; i < rounds; i++) {
+    status(addr);
+    run_cycles(MS_CYCLES / 2);
+    request(addr, cmd, 0, NULL);
+    run_cycles(MS_CYCLES / 2);
+  }
+
+  s->name = "transactions";
+  s->seconds = (double)(bench.avr->cycle - start) / F_CPU;
+  s->isr_per_s = (isr_entries() - entries) / s->seconds;
+}
+
+/**
+ * Move the lever with contact bounce and measure until the controller
+ * pulls the INT line, then release it with a Reset request.
+ */
+static void lever_flip(uint8_t pin, uint8_t other) {
+  const avr_cycle_count_t start = bench.avr->cycle;
+  int i;
+
+  debounce.flips++;
+
+  // the INT line of the last change has to be released first
+  if (bench.int_pulled)
+    request(I3C_ADDR_LEVER, I3C_CMD_RESET, 0, NULL);
+
+  pin_drive(other, 1);
+  for (i = 0; i < 3; i++) {
+    pin_drive(pin, 0);
+    run_cycles(200 * US_CYCLES);
+    pin_drive(pin, 1);
+    run_cycles(100 * US_CYCLES);
+  }
+  pin_drive(pin, 0);
+
+  const avr_cycle_count_t timeout = start + 100 * MS_CYCLES;
+  while (!bench.int_pulled && (bench.avr->cycle < timeout))
+    if (!run_cycles(US_CYCLES))
+      break;
+
+  if (!bench.int_pulled) {
+    failed = true;
+    return;
+  }
+
+  const uint64_t d = bench.int_changed - start;
+  debounce.detected++;
+  debounce.cycles += d;
+  if (d > debounce.max_cycles)
+    debounce.max_cycles = d;
+
+  request(I3C_ADDR_LEVER, I3C_CMD_RESET, 0, NULL);
+  run_cycles(50 * MS_CYCLES);
+}
+
+static void bench_lever(void) {
+  scenario_run("boot", 100);
+  scenario_run("idle", 1000);
+
+  transactions(I3C_ADDR_LEVER, LEVER_CMD_GETSTATE, 200);
+
+  const uint64_t entries = isr_entries();
+  const avr_cycle_count_t start = bench.avr->cycle;
+  int i;
+  for (i = 0; i < 10; i++) {
+    lever_flip(PIN_CLOSED, PIN_OPEN);
+    lever_flip(PIN_OPEN, PIN_CLOSED);
+  }
+
+  struct scenario *s = &scenarios[scenario_count++];
+  s->name = "lever";
+  s->seconds = (double)(bench.avr->cycle - start) / F_CPU;
+  s->isr_per_s = (isr_entries() - entries) / s->seconds;
+
+  scenario_run("settled", 1000);
+}
+
+static void bench_ampel(void) {
+  scenario_run("boot", 100);
+  scenario_run("idle", 1000);
+
+  request(I3C_ADDR_AMPEL, AMPEL_CMD_SETLIGHT, AMPEL_VAL_RED, NULL);
+  scenario_run("light", 1000);
+
+  request(I3C_ADDR_AMPEL, AMPEL_CMD_SETLIGHT, AMPEL_VAL_RED | AMPEL_VAL_BLINK, NULL);
+  scenario_run("blink", 2000);
+
+  transactions(I3C_ADDR_AMPEL, AMPEL_CMD_GETLIGHT, 200);
+}
+
+///// Output /////
+
+static void print_xfer(const struct xfer_stats *x, const char *sep) {
+  const double n = x->count ? x->count : 1;
+
+  printf("    { \"name\": \"%s\", \"count\": %u, \"failed\": %u, "
+         "\"mean_us\": %.1f, \"max_us\": %.1f, "
+         "\"stretch_mean_us\": %.2f, \"stretch_max_us\": %.2f }%s\n",
+         x->name, x->count, x->failed,
+         x->cycles / n / US_CYCLES, (double)x->max_cycles / US_CYCLES,
+         x->stretch / n / US_CYCLES, (double)x->max_stretch / US_CYCLES, sep);
+}
+
+static void print_json(const char *board, const char *elf,
+                       const elf_firmware_t *fw) {
+  const double seconds = (double)bench.avr->cycle / F_CPU;
+  int i;
+
+  printf("{\n");
+  printf("  \"board\": \"%s\",\n", board);
+  printf("  \"elf\": \"%s\",\n", elf);
+  printf("  \"f_cpu\": %lu,\n", F_CPU);
+  printf("  \"i2c_hz\": %lu,\n", i2c_hz);
+  printf("  \"flash_bytes\": %u,\n", fw->flashsize);
+  printf("  \"ram_bytes\": %u,\n", fw->datasize + fw->bsssize);
+  printf("  \"seconds\": %.3f,\n", seconds);
+
+  printf("  \"scenarios\": [\n");
+  for (i = 0; i < scenario_count; i++)
+    printf("    { \"name\": \"%s\", \"seconds\": %.3f, \"isr_per_s\": %.1f }%s\n",
+           scenarios[i].name, scenarios[i].seconds, scenarios[i].isr_per_s,
+           (i < scenario_count - 1) ? "," : "");
+  printf("  ],\n");
+
+  printf("  \"isr\": [\n");
+  int last = 0;
+  for (i = 1; i < VECTORS; i++)
+    if (isr[i].entries)
+      last = i;
+  for (i = 1; i < VECTORS; i++) {
+    const struct isr_stats *s = &isr[i];
+    if (!s->entries)
+      continue;
+    printf("    { \"vector\": \"%s\", \"entries\": %llu, \"per_s\": %.1f, "
+           "\"mean_cycles\": %.1f, \"max_cycles\": %llu }%s\n",
+           vector_names[i], (unsigned long long)s->entries, s->entries / seconds,
+           (double)s->cycles / s->entries, (unsigned long long)s->max_cycles,
+           (i < last) ? "," : "");
+  }
+  printf("  ],\n");
+
+  printf("  \"transactions\": [\n");
+  for (i = 0; i < XFER_TYPES; i++)
+    print_xfer(&xfers[i], (i < XFER_TYPES - 1) ? "," : "");
+  printf("  ],\n");
+
+  printf("  \"stretch\": [\n");
+  last = 0;
+  for (i = 0; i < HOLD_STATES; i++)
+    if (holds[i].holds)
+      last = i;
+  for (i = 0; i < HOLD_STATES; i++) {
+    const struct hold_stats *h = &holds[i];
+    if (!h->holds)
+      continue;
+    printf("    { \"state\": \"%s\", \"holds\": %llu, "
+           "\"mean_cycles\": %.1f, \"max_cycles\": %llu, \"max_us\": %.2f }%s\n",
+           h->name, (unsigned long long)h->holds, (double)h->stretch / h->holds,
+           (unsigned long long)h->max_stretch, (double)h->max_stretch / US_CYCLES,
+           (i < last) ? "," : "");
+  }
+  printf("  ]");
+
+  if (debounce.flips) {
+    const double n = debounce.detected ? debounce.detected : 1;
+    printf(",\n  \"debounce\": { \"flips\": %u, \"detected\": %u, "
+           "\"mean_ms\": %.3f, \"max_ms\": %.3f }",
+           debounce.flips, debounce.detected,
+           debounce.cycles / n / MS_CYCLES, (double)debounce.max_cycles / MS_CYCLES);
+  }
+
+  printf("\n}\n");
+}
+
+///// Main /////
+
+/**
+ * Look up a variable in the symbol table of the firmware.
+ *
+ * @return Its data space address, -1 if not found
+ */
+static int elf_data_symbol(const char *elf, const char *name) {
+  int addr = -1;
+
+  if (elf_version(EV_CURRENT) == EV_NONE)
+    return -1;
+
+  const int fd = open(elf, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  Elf *e = elf_begin(fd, ELF_C_READ, NULL);
+  Elf_Scn *scn = NULL;
+
+  while (e && (addr < 0) && (scn = elf_nextscn(e, scn))) {
+    GElf_Shdr shdr;
+    if (!gelf_getshdr(scn, &shdr) || (shdr.sh_type != SHT_SYMTAB))
+      continue;
+
+    Elf_Data *data = elf_getdata(scn, NULL);
+    const int count = shdr.sh_entsize ? shdr.sh_size / shdr.sh_entsize : 0;
+    int i;
+
+    for (i = 0; data && (i < count); i++) {
+      GElf_Sym sym;
+      const char *n;
+
+      if (gelf_getsym(data, i, &sym) && (GELF_ST_TYPE(sym.st_info) == STT_OBJECT) &&
+          (n = elf_strptr(e, shdr.sh_link, sym.st_name)) && !strcmp(n, name)) {
+        // avr-gcc puts the data space at 0x800000
+        addr = sym.st_value & 0xffff;
+        break;
+      }
+    }
+  }
+
+  if (e)
+    elf_end(e);
+  close(fd);
+
+  return addr;
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-f i2c_hz] lever|ampel firmware.elf\n"
+          "  Runs the benchmark and writes the results as JSON to stdout.\n"
+          "  -f  I2C bus rate, default %lu Hz\n",
+          name, I2C_HZ);
+}
+
+int main(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:h")) != -1) {
+    switch (opt) {
+      case 'f': i2c_hz = strtoul(optarg, NULL, 0); break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+
+  // the master needs at least two cycles per SCL phase
+  if ((argc - optind != 2) || !i2c_hz || (BIT_CYCLES < 4)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  const char *board = argv[optind];
+  const char *elf = argv[optind + 1];
+  const bool lever = strcmp(board, "lever") == 0;
+  if (!lever && strcmp(board, "ampel")) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  elf_firmware_t fw;
+  memset(&fw, 0, sizeof(fw));
+  if (elf_read_firmware(elf, &fw)) {
+    fprintf(stderr, "Cannot read %s\n", elf);
+    return -1;
+  }
+
+  of_state_addr = elf_data_symbol(elf, OF_STATE_SYMBOL);
+  if (of_state_addr < 0)
+    fprintf(stderr, "No %s in %s, the overflow stretch is not split by state\n",
+            OF_STATE_SYMBOL, elf);
+
+  avr_t *avr = avr_make_mcu_by_name("attiny85");
+  if (!avr) {
+    fprintf(stderr, "simavr has no attiny85 core\n");
+    return -1;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &fw);
+  avr->frequency = F_CPU;
+  avr->sleep = no_sleep;
+
+  bench.avr = avr;
+
+  int i;
+  for (i = 0; i < 8; i++)
+    bench.pins[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i);
+
+  master_init(avr);
+
+  for (i = 1; i < VECTORS; i++) {
+    avr_irq_t *irq = avr_get_interrupt_irq(avr, i);
+    if (irq)
+      avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, isr_notify, &isr[i]);
+  }
+
+  // the bus and the INT line are pulled up, the lever is in between
+  pin_drive(PIN_SDA, 1);
+  pin_drive(PIN_SCL, 1);
+  pin_drive(PIN_INT, 1);
+  pin_drive(PIN_CLOSED, 1);
+  pin_drive(PIN_OPEN, 1);
+
+  if (lever)
+    bench_lever();
+  else
+    bench_ampel();
+
+  print_json(board, elf, &fw);
+
+  return failed ? 1 : 0;
+}
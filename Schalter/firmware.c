@@ -22,6 +22,9 @@
 #include <stdint.h>
 
 #include "usitwislave.h"
+#include "i3c_protocol.h"
+
+#define FW_VERSION 0x07
 
 
 inline void setPortB(char mask) {
@@ -33,9 +36,9 @@ inline void resetPortB(char mask) {
 }
 
 // internal space state
-#define STATE_CLOSED  1
-#define STATE_OPEN    2
-#define STATE_UNKNOWN 3
+#define STATE_CLOSED  LEVER_STATE_CLOSED
+#define STATE_OPEN    LEVER_STATE_OPEN
+#define STATE_UNKNOWN LEVER_STATE_UNKNOWN
 volatile uint8_t switch_state=STATE_UNKNOWN;
 
 inline uint8_t getState() {
@@ -46,20 +49,28 @@ inline void setState(uint8_t _state) {
   switch_state = _state;
 }
 
-// switch readout
-uint8_t getSwitch(uint8_t state) {
-  switch (state) {
-    case STATE_CLOSED:
-      return (PINB & (1<<PB3)) ? 0 : 1;
-      break;
-    case STATE_OPEN: 
-      return (PINB & (1<<PB4)) ? 0 : 1;
-      break;
+// Timer0 im CTC-Modus, Prescaler 64: 1 ms bei 8 MHz
+#define TICK_PRESCALER 64
+#define TICK_OCR (F_CPU / TICK_PRESCALER / 1000 - 1)
+#define TICK_CLOCK ((1 << CS01) | (1 << CS00))
+
+// Der Timer laeuft nur, solange ein Eingang einschwingt oder Ereignisse
+// abzuholen sind, sonst weckt ein Pin-Change-Interrupt den Controller.
+inline void startTick() {
+  if (!TCCR0B) {
+    TCNT0 = 0;
+    TCCR0B = TICK_CLOCK;
   }
-  
-  return 0;
 }
 
+inline void stopTick() {
+  TCCR0B = 0;
+}
+
+// debounce sampling period in ticks, 8 ms debounce time
+#define DEBOUNCE_PERIOD 2
+extern volatile uint8_t debounce_period;
+
 
 //flag state change
 inline void i3c_stateChange() {
@@ -82,7 +93,7 @@ inline uint8_t i3c_state() {
 }
 
 /*
- * I²C Datenformat:
+ * I²C Datenformat: siehe i3c_protocol.h
  * 
  * PCCCDDDD
  * 
@@ -91,13 +102,258 @@ inline uint8_t i3c_state() {
  *      Reset	 0x0	Reset I³C state
  * 	GetState 0x01   Aktuelle Schalterstellung ausgeben
  * 	SetState 0x02   Status Schalterstellung setzen
+ * 	GetStatus 0x03  Statusblock ausgeben
+ * 	Events 0x04     Schalterereignisse abholen
+ * 	Debounce 0x05   Abtastintervall der Entprellung setzen
+ * 	v2 0x07         Frame mit CRC-8, siehe i3c_protocol.h
+ * 	Telemetry 0x09  nur v2: Buszaehler abholen und loeschen
  * 
  * data (DDDD)
- * 	nicht verwendet
+ * 	SetState: neuer Status
+ * 	GetStatus: I3C_STATUS_RESET
+ * 	Events: naechste gewuenschte Ereignisnummer
+ * 	Debounce: Abtastintervall in ms, Entprellzeit ist das Vierfache
+ */
+#define CMD_I3C_RESET I3C_CMD_RESET
+#define CMD_GETSTATE  LEVER_CMD_GETSTATE
+#define CMD_SETSTATE  LEVER_CMD_SETSTATE
+#define CMD_GETSTATUS I3C_CMD_GETSTATUS
+#define CMD_EVENTS    LEVER_CMD_EVENTS
+#define CMD_DEBOUNCE  LEVER_CMD_DEBOUNCE
+#define CMD_TELEMETRY I3C_CMD_TELEMETRY
+
+inline uint8_t i3c_pending() {
+  // the INT line is only an output while pulled
+  return (DDRB & (1 << PB1)) ? I3C_STATUS_FLAG_INT : 0;
+}
+
+inline void put16(volatile uint8_t *buf, uint16_t val) {
+  buf[0] = val & 0xff;
+  buf[1] = val >> 8;
+}
+
+/*
+ * Statusblock fuer GetStatus, siehe i3c_protocol.h
  */
-#define CMD_I3C_RESET 0x00
-#define CMD_GETSTATE  0x01
-#define CMD_SETSTATE  0x02
+void fillStatus(volatile uint8_t *buf, uint8_t state) {
+  struct usi_twi_stats stats;
+  // the USI interrupts count while we run
+  usi_twi_stats_get(&stats);
+
+  buf[I3C_STATUS_LENGTH]  = I3C_STATUS_LEN;
+  buf[I3C_STATUS_VERSION] = FW_VERSION;
+  buf[I3C_STATUS_STATE]   = state;
+  buf[I3C_STATUS_FLAGS]   = i3c_pending();
+  put16(buf + I3C_STATUS_FRAMES,    stats.local_frames);
+  put16(buf + I3C_STATUS_ERRORS,    stats.error_conditions);
+  put16(buf + I3C_STATUS_STARTS,    stats.start_conditions);
+  buf[I3C_STATUS_CHECKSUM] = i3c_checksum(buf, I3C_STATUS_CHECKSUM);
+}
+
+inline void put32(volatile uint8_t *buf, uint32_t val) {
+  put16(buf, val & 0xffff);
+  put16(buf + 2, val >> 16);
+}
+
+/*
+ * Telemetry, gibt die Laenge der Buszaehler zurueck und loescht sie
+ */
+uint8_t getTelemetry(volatile uint8_t *buf) {
+  struct usi_twi_stats stats;
+  usi_twi_stats_take(&stats);
+
+  put32(buf + I3C_TELEMETRY_STARTS,    stats.start_conditions);
+  put32(buf + I3C_TELEMETRY_STOPS,     stats.stop_conditions);
+  put32(buf + I3C_TELEMETRY_REPEATED,  stats.repeated_starts);
+  put32(buf + I3C_TELEMETRY_ERRORS,    stats.error_conditions);
+  put32(buf + I3C_TELEMETRY_OVERFLOWS, stats.overflow_conditions);
+  put32(buf + I3C_TELEMETRY_FRAMES,    stats.local_frames);
+
+  return I3C_TELEMETRY_LEN;
+}
+
+/*
+ * Vorberechneter Statusblock fuer Lesezugriffe ohne Anfrage. Der Master
+ * liest eine Seite, waehrend die andere neu gefuellt wird.
+ */
+volatile uint8_t status_reply[2][I3C_STATUS_LEN];
+uint8_t status_page;
+// set on state and INT changes, the idle callback refills the block
+volatile uint8_t status_dirty = 1;
+
+void refreshStatus() {
+  // a change while filling marks the block again
+  status_dirty = 0;
+
+  status_page ^= 1;
+  fillStatus(status_reply[status_page], getState());
+
+  cli();
+  usi_twi_preload(status_reply[status_page], I3C_STATUS_LEN);
+  sei();
+}
+
+///// Ereignis-FIFO /////
+
+// Groesse muss eine Zweierpotenz sein
+#define EVENTS_SIZE 8
+
+struct event {
+  uint8_t  state;
+  uint16_t tick;
+};
+
+volatile struct event events[EVENTS_SIZE];
+volatile uint8_t events_first;	// Nummer des aeltesten Ereignisses
+volatile uint8_t events_count;
+volatile uint8_t events_lost;
+
+// millisecond ticks for the event timestamps
+volatile uint16_t ticks;
+
+/*
+ * Ereignis speichern, wird im Timer-Interrupt aufgerufen
+ */
+void pushEvent(uint8_t state) {
+  // keep the older events, the current state can always be read
+  if (events_count == EVENTS_SIZE) {
+    events_lost++;
+    return;
+  }
+
+  volatile struct event *e = &events[(events_first + events_count) & (EVENTS_SIZE - 1)];
+  e->state = state;
+  e->tick  = ticks;
+  events_count++;
+}
+
+/*
+ * Events, gibt die Laenge des Ereignisblocks zurueck
+ *
+ * next: naechste gewuenschte Ereignisnummer, mask: gueltige Bits davon
+ */
+uint8_t getEvents(volatile uint8_t *buf, uint8_t next, uint8_t mask) {
+  // acknowledge, numbers outside of the FIFO are stale and ignored
+  const uint8_t acked = (next - events_first) & mask;
+  if (acked <= events_count) {
+    events_first += acked;
+    events_count -= acked;
+  }
+
+  const uint8_t n = (events_count < LEVER_EVENTS_MAX) ? events_count
+                                                      : LEVER_EVENTS_MAX;
+
+  buf[LEVER_EVENTS_LENGTH] = LEVER_EVENTS_LEN;
+  buf[LEVER_EVENTS_FIRST]  = events_first;
+  buf[LEVER_EVENTS_LOST]   = events_lost;
+  put16(buf + LEVER_EVENTS_TICK, ticks);
+  buf[LEVER_EVENTS_COUNT]  = n;
+
+  uint8_t i;
+  volatile uint8_t *p = buf + LEVER_EVENTS_DATA;
+  for (i = 0; i < LEVER_EVENTS_MAX; i++, p += LEVER_EVENT_SIZE) {
+    if (i < n) {
+      const volatile struct event *e = &events[(events_first + i) & (EVENTS_SIZE - 1)];
+      p[0] = e->state;
+      put16(p + 1, e->tick);
+    } else
+      p[0] = p[1] = p[2] = 0;
+  }
+
+  buf[LEVER_EVENTS_CHECKSUM] = i3c_checksum(buf, LEVER_EVENTS_CHECKSUM);
+
+  // everything has been picked up
+  if (!events_count)
+    i3c_tristate();
+
+  return LEVER_EVENTS_LEN;
+}
+
+/*
+ * GetStatus, gibt die Laenge des Statusblocks zurueck
+ */
+uint8_t getStatus(volatile uint8_t *buf, uint8_t data) {
+  fillStatus(buf, getState());
+
+  // reset after the snapshot, a change from now on pulls INT again
+  if (data & I3C_STATUS_RESET)
+    i3c_tristate();
+
+  return I3C_STATUS_LEN;
+}
+
+/*
+ * v1 Kommandos mit einem Antwortbyte, 0 zeigt einen Fehler an
+ */
+uint8_t command(uint8_t cmd, uint8_t data) {
+  // some dummy output value, as 0 states an error
+  uint8_t output=0;
+
+  switch (cmd) {
+    case CMD_I3C_RESET: {
+      i3c_tristate();
+      output = 1;
+      break;
+    }
+    case CMD_GETSTATE: {
+      output = getState();
+      break;
+    }
+    case CMD_SETSTATE: {
+      if (data >= 1 && data <= 3) { 
+	setState(data);
+	output = 1;
+      }
+      break;
+    }
+    case CMD_DEBOUNCE: {
+      if (data >= 1) {
+	debounce_period = data;
+	output = 1;
+      }
+      break;
+    }
+  }
+
+  return output;
+}
+
+static struct i3c_v2_state v2_state;
+
+/*
+ * v2 Kommandos, siehe i3c_protocol.h
+ */
+static uint8_t v2_command(uint8_t cmd,
+                          const volatile uint8_t *payload, uint8_t plen,
+                          volatile uint8_t *reply, uint8_t *len) {
+  const uint8_t data = plen ? payload[0] : 0;
+
+  switch (cmd) {
+    case CMD_GETSTATUS: {
+      *len = getStatus(reply, data);
+      return I3C_V2_OK;
+    }
+    case CMD_EVENTS: {
+      *len = getEvents(reply, data, 0xff);
+      return I3C_V2_OK;
+    }
+    case CMD_TELEMETRY: {
+      *len = getTelemetry(reply);
+      return I3C_V2_OK;
+    }
+    case CMD_I3C_RESET:
+    case CMD_GETSTATE:
+    case CMD_SETSTATE:
+    case CMD_DEBOUNCE:
+    {
+      reply[0] = command(cmd, data);
+      *len = 1;
+      return reply[0] ? I3C_V2_OK : I3C_V2_ERR_ARG;
+    }
+  }
+
+  return I3C_V2_ERR_CMD;
+}
 
 static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t input_buffer_length, 
@@ -106,39 +362,34 @@ static void twi_callback(uint8_t buffer_size,
                          volatile uint8_t *output_buffer) {
   
   if (input_buffer_length) {
-    const uint8_t parity = (input_buffer[0] & 0x80) >> 7;
-    const uint8_t cmd  = (input_buffer[0] & 0x70) >> 4;
-    const uint8_t data = input_buffer[0] & 0x0F;
+    const uint8_t request = input_buffer[0];
+    const uint8_t cmd  = I3C_REQUEST_CMD(request);
+    const uint8_t data = I3C_REQUEST_DATA(request);
     
-    // check parity
-    uint8_t v = input_buffer[0] & 0x7F;
-    uint8_t c;
-    for (c = 0; v; c++)
-      v &= v-1;
-    c &= 1;
-    
-    // some dummy output value, as 0 states an error
     uint8_t output=0;
+
+    // counters, state and INT may change with every frame
+    status_dirty = 1;
     
     // only check if parity matches
-    if (parity == c)
+    if (I3C_REQUEST_VALID(request))
     switch (cmd) {
-      case CMD_I3C_RESET: {
-	i3c_tristate();
-	output = 1;
-	break;
+      case I3C_CMD_V2: {
+	*output_buffer_length = i3c_v2_request(&v2_state, v2_command,
+					       input_buffer_length, input_buffer,
+					       output_buffer);
+	return;
       }
-      case CMD_GETSTATE: {
-	output = getState();
-	break;
+      case CMD_GETSTATUS: {
+	*output_buffer_length = getStatus(output_buffer, data);
+	return;
       }
-      case CMD_SETSTATE: {
-	if (data >= 1 && data <= 3) { 
-	  setState(data);
-	  output = 1;
-	}
-	break;
+      case CMD_EVENTS: {
+	*output_buffer_length = getEvents(output_buffer, data, I3C_DATA_MAX);
+	return;
       }
+      default:
+	output = command(cmd, data);
     }
 
     *output_buffer_length = 2;
@@ -148,7 +399,8 @@ static void twi_callback(uint8_t buffer_size,
 }
 
 static void twi_idle_callback(void) {
-  // void
+  if (status_dirty)
+    refreshStatus();
 }
 
 void init(void) {
@@ -169,10 +421,21 @@ void init(void) {
   
   CLKPR = (1 << CLKPCE);  /*  enable clock prescaler update       */
   CLKPR = 0;              /*  set clock to maximum                */
-  TIFR &= ~(1 << TOV0);   /*  clear timer0 overflow interrupt flag    */
-  TIMSK |= (1 << TOIE0);  /*  enable timer0 overflow interrupt        */
-  //TCCR0B = (1 << CS02) | (1 << CS00);
-  TCCR0B = (1 << CS00);
+  TCCR0A = (1 << WGM01);  /*  CTC mode, 1 ms tick                 */
+  OCR0A  = TICK_OCR;
+  TIFR   = (1 << OCF0A);  /*  clear timer0 compare interrupt flag */
+  TIMSK |= (1 << OCIE0A); /*  enable timer0 compare interrupt     */
+
+  /*  wake up on lever changes  */
+  PCMSK = (1 << PCINT3) | (1 << PCINT4);
+  GIMSK |= (1 << PCIE);
+
+  /*  Timer1, ADC and the comparator are not used  */
+  PRR  = (1 << PRTIM1) | (1 << PRADC);
+  ACSR |= (1 << ACD);
+
+  /*  debounce the initial lever position  */
+  startTick();
 
   sei();
   
@@ -185,57 +448,84 @@ int main(void)
   // initialisieren
   init();
 
-  // start TWI (I²C) slave mode
-  usi_twi_slave(0x24, 0, &twi_callback, &twi_idle_callback);
+  // bus statistics for GetStatus
+  usi_twi_enable_stats(1);
+  // wait for complete v2 frames
+  usi_twi_frame_length(&i3c_frame_length);
+  // a read without request gets the status block
+  refreshStatus();
+
+  // start TWI (I²C) slave mode, sleep while the bus is idle
+  usi_twi_slave(0x24, 1, &twi_callback, &twi_idle_callback);
 
   return 0;
 }
 
 
 void switchState(uint8_t _state) {
-  if (_state != getState())
+  if (_state != getState()) {
+    pushEvent(_state);
     i3c_stateChange();
+    status_dirty = 1;
+  }
   setState(_state);
 }
 
 
-// nach http://www.mikrocontroller.net/articles/Entprellung#Softwareentprellung
-#define DECHATTER_COUNTER 50
-
-uint8_t key_state;
-uint8_t key_counter;
-
-void dechatterKey() {
-  // adjust manual key chatter
-  uint8_t input = (getSwitch(STATE_CLOSED) << 1) +
-                  (getSwitch(STATE_OPEN));
-		  
-  if( input != key_state ) {
-    key_counter--;
-    if( key_counter == 0 ) {
-      key_counter = DECHATTER_COUNTER;
-      key_state = input;
-      if( input ) {
-        // set the new state
-        if (input & 0x02)
-	  switchState(STATE_CLOSED);
-	else if (input & 0x01)
-	  switchState(STATE_OPEN);
-      }
-    }
+// nach http://www.mikrocontroller.net/articles/Entprellung#Komfortroutine_.28C_f.C3.BCr_AVR.29
+// Vertikalzaehler: alle Pins von Port B werden parallel entprellt, ein
+// Pin gilt nach vier gleichen Abtastungen als umgeschaltet.
+#define KEY_CLOSED (1 << PB3)
+#define KEY_OPEN   (1 << PB4)
+
+uint8_t key_state;		// entprellter Zustand, 1 = Schalter aktiv
+uint8_t key_ct0 = 0xff;
+uint8_t key_ct1 = 0xff;
+
+// Abtastintervall in Ticks, Entprellzeit ist das Vierfache
+volatile uint8_t debounce_period = DEBOUNCE_PERIOD;
+uint8_t debounce_count;
+
+/*
+ * Gibt die Eingaenge zurueck, die noch nicht eingeschwungen sind
+ */
+uint8_t dechatterKey() {
+  // inputs are active low
+  uint8_t changed = key_state ^ ~PINB;
+
+  // count the changed bits down, reset the others
+  key_ct0 = ~(key_ct0 & changed);
+  key_ct1 = key_ct0 ^ (key_ct1 & changed);
+  changed &= key_ct0 & key_ct1;
+  key_state ^= changed;
+
+  // set the new state
+  if (changed & (KEY_CLOSED | KEY_OPEN)) {
+    if (key_state & KEY_CLOSED)
+      switchState(STATE_CLOSED);
+    else if (key_state & KEY_OPEN)
+      switchState(STATE_OPEN);
   }
-  else
-    key_counter = DECHATTER_COUNTER;
+
+  // counters of stable bits are reset to 11
+  return ~(key_ct0 & key_ct1) & (KEY_CLOSED | KEY_OPEN);
 }
 
-ISR (TIM0_OVF_vect)
+ISR (TIM0_COMPA_vect)
 {
-  // store state and disable interrupts
-  const uint8_t _sreg = SREG;
-  cli();
-  
-  dechatterKey();
+  ticks++;
+
+  if (++debounce_count >= debounce_period) {
+    debounce_count = 0;
+
+    // the event ticks are only needed until the events are picked up
+    if (!dechatterKey() && !events_count)
+      stopTick();
+  }
+}
 
-  // restore state
-  SREG = _sreg;
+ISR (PCINT0_vect)
+{
+  // a lever input changed, sample until it has settled
+  startTick();
 }
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include <mosquitto.h>
+
+#include "bus_telemetry.h"
+#include "latency.h"
+
+#define BUS_TELEMETRY_MAXLEN	320
+
+static double ratio(uint32_t n, uint32_t total) {
+  return total ? (double)n / total : 0.0;
+}
+
+/**
+ * Host errors that corrupted a reply, as opposed to a missing ACK
+ */
+static uint32_t data_errors(const struct i3c_stats *s) {
+  return s->zero_replies + s->inversion_errors + s->checksum_errors +
+         s->crc_errors + s->sequence_errors + s->request_errors;
+}
+
+void bus_telemetry_poll(struct bus_telemetry *t) {
+  struct i3c_telemetry tm;
+
+  // the counters keep running, the next poll covers a longer period
+  const int ret = i3c_telemetry(t->dev, &tm);
+  if (ret != I3C_OK) {
+    syslog(LOG_DEBUG, "Cannot read the telemetry of %s: %s",
+                      t->dev->name, i3c_strerror(ret));
+    return;
+  }
+
+  const uint64_t now = latency_now_us();
+  const struct i3c_stats *s = &t->dev->stats;
+  const struct i3c_stats *h = &t->host;
+
+  const uint32_t commands = s->commands - h->commands;
+  const uint32_t retries  = s->retries  - h->retries;
+
+  char payload[BUS_TELEMETRY_MAXLEN];
+  snprintf(payload, sizeof(payload),
+           "{\"period_ms\":%llu,"
+           "\"starts\":%u,\"stops\":%u,\"repeated_starts\":%u,"
+           "\"errors\":%u,\"overflows\":%u,\"frames\":%u,"
+           "\"bus_error_rate\":%.4f,"
+           "\"commands\":%u,\"attempts\":%u,\"retries\":%u,\"give_ups\":%u,"
+           "\"host_bus_errors\":%u,\"host_data_errors\":%u,"
+           "\"retry_rate\":%.4f}",
+           (unsigned long long)(now - t->last_us) / 1000,
+           tm.starts, tm.stops, tm.repeated_starts,
+           tm.errors, tm.overflows, tm.frames,
+           ratio(tm.errors, tm.starts),
+           commands, s->attempts - h->attempts, retries,
+           s->give_ups - h->give_ups,
+           s->bus_errors - h->bus_errors, data_errors(s) - data_errors(h),
+           ratio(retries, commands));
+
+  t->host    = *s;
+  t->last_us = now;
+
+  syslog(LOG_DEBUG, "Telemetry of %s: %s", t->dev->name, payload);
+  if (!t->mosq)
+    return;
+
+  const int pub = mosquitto_publish(t->mosq, NULL, t->topic,
+                                    strlen(payload), payload,
+                                    0, /* qos */
+                                    false /* don't retain */);
+  if (pub != MOSQ_ERR_SUCCESS)
+    syslog(LOG_ERR, "MQTT error on telemetry of %s: %d (%s)",
+                    t->dev->name, pub, mosquitto_strerror(pub));
+}
+
+static void bus_telemetry_cb(struct evloop *loop, int fd,
+                             uint32_t events, void *arg) {
+  bus_telemetry_poll(arg);
+}
+
+int bus_telemetry_attach(struct bus_telemetry *t, struct evloop *loop,
+                         struct i3c_device *dev, struct mosquitto *mosq,
+                         const char *topic, unsigned int interval_ms) {
+  struct i3c_telemetry tm;
+
+  t->dev   = dev;
+  t->mosq  = mosq;
+  t->topic = topic;
+
+  if (!interval_ms)
+    return 0;
+
+  if (!i3c_has_telemetry(dev)) {
+    syslog(LOG_INFO, "Device %s has no telemetry.", dev->name);
+    return 0;
+  }
+
+  // start the first period with cleared counters
+  i3c_telemetry(dev, &tm);
+  t->host    = dev->stats;
+  t->last_us = latency_now_us();
+
+  const int ret = evloop_add_timer(loop, interval_ms, bus_telemetry_cb, t);
+  if (ret < 0)
+    return ret;
+
+  syslog(LOG_INFO, "Publishing the telemetry of %s every %u s to %s.",
+                   dev->name, interval_ms / 1000, topic);
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef _BUS_TELEMETRY_H_
+#define _BUS_TELEMETRY_H_
+
+#include <stdint.h>
+
+#include <mosquitto.h>
+
+#include "evloop.h"
+#include "i3c.h"
+
+/*
+ * Poll the TWI counters of a controller at a low rate and publish them
+ * together with the host counters of the same period. Errors counted by
+ * the controller point to noise on the bus, host retries and give-ups
+ * without them point to the host side.
+ *
+ * The message is one JSON object per period, e.g.
+ *	{"period_ms":60000,"starts":62,"stops":62,"repeated_starts":60,
+ *	 "errors":0,"overflows":250,"frames":61,"bus_error_rate":0.0000,
+ *	 "commands":61,"attempts":61,"retries":0,"give_ups":0,
+ *	 "host_bus_errors":0,"host_data_errors":0,"retry_rate":0.0000}
+ */
+
+#define BUS_TELEMETRY_MS	60000
+
+struct bus_telemetry {
+  struct i3c_device *dev;
+  struct mosquitto  *mosq;	// only logged without a session
+  const char        *topic;
+
+  struct i3c_stats   host;	// host counters at the last poll
+  uint64_t           last_us;	// time of the last poll
+};
+
+/**
+ * Clear the controller counters and poll them periodically. Nothing is
+ * attached if the firmware has no Telemetry command.
+ *
+ * @param interval_ms The poll period, 0 disables the telemetry
+ * @return 0 on success or if there is nothing to poll, -errno on failure
+ */
+int bus_telemetry_attach(struct bus_telemetry *t, struct evloop *loop,
+                         struct i3c_device *dev, struct mosquitto *mosq,
+                         const char *topic, unsigned int interval_ms);
+
+/**
+ * Take the counters now and publish the period since the last poll.
+ */
+void bus_telemetry_poll(struct bus_telemetry *t);
+
+#endif
@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "evloop.h"
+
+static struct evloop_handler *evloop_find(struct evloop *loop, int fd) {
+  int i;
+  for (i = 0; i < EVLOOP_HANDLERS_MAX; i++)
+    if (loop->handlers[i].fd == fd)
+      return &loop->handlers[i];
+
+  return NULL;
+}
+
+int evloop_init(struct evloop *loop) {
+  memset(loop, 0, sizeof(*loop));
+
+  int i;
+  for (i = 0; i < EVLOOP_HANDLERS_MAX; i++)
+    loop->handlers[i].fd = -1;
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0)
+    return -errno;
+
+  return 0;
+}
+
+void evloop_close(struct evloop *loop) {
+  int i;
+  for (i = 0; i < EVLOOP_HANDLERS_MAX; i++) {
+    struct evloop_handler *h = &loop->handlers[i];
+    // timers and signals are owned by the loop
+    if ((h->fd >= 0) && (h->type != EVLOOP_FD))
+      close(h->fd);
+    h->fd = -1;
+  }
+
+  close(loop->epfd);
+  loop->epfd = -1;
+}
+
+static int evloop_add_type(struct evloop *loop, int fd, uint8_t type,
+                           uint32_t events, evloop_cb cb, void *arg) {
+  struct evloop_handler *h = evloop_find(loop, -1);
+  if (!h)
+    return -ENOSPC;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = h;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return -errno;
+
+  h->fd = fd;
+  h->type = type;
+  h->events = events;
+  h->cb = cb;
+  h->arg = arg;
+
+  return 0;
+}
+
+int evloop_add(struct evloop *loop, int fd, uint32_t events,
+               evloop_cb cb, void *arg) {
+  return evloop_add_type(loop, fd, EVLOOP_FD, events, cb, arg);
+}
+
+int evloop_mod(struct evloop *loop, int fd, uint32_t events) {
+  struct evloop_handler *h = evloop_find(loop, fd);
+  if (!h)
+    return -ENOENT;
+
+  if (h->events == events)
+    return 0;
+
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = h;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    return -errno;
+
+  h->events = events;
+  return 0;
+}
+
+int evloop_del(struct evloop *loop, int fd) {
+  struct evloop_handler *h = evloop_find(loop, fd);
+  if (!h)
+    return -ENOENT;
+
+  // fails if the descriptor has already been closed, which is fine
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  h->fd = -1;
+  return 0;
+}
+
+int evloop_add_timer(struct evloop *loop, unsigned int interval_ms,
+                     evloop_cb cb, void *arg) {
+  const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  struct itimerspec its;
+  its.it_interval.tv_sec  = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+    const int err = errno;
+    close(fd);
+    return -err;
+  }
+
+  const int ret = evloop_add_type(loop, fd, EVLOOP_TIMER, EPOLLIN, cb, arg);
+  if (ret < 0) {
+    close(fd);
+    return ret;
+  }
+
+  return fd;
+}
+
+int evloop_timer_set(int fd, unsigned int delay_ms, unsigned int interval_ms) {
+  struct itimerspec its;
+  its.it_value.tv_sec     = delay_ms / 1000;
+  its.it_value.tv_nsec    = (delay_ms % 1000) * 1000000L;
+  its.it_interval.tv_sec  = interval_ms / 1000;
+  its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+  return (timerfd_settime(fd, 0, &its, NULL) < 0) ? -errno : 0;
+}
+
+int evloop_add_signals(struct evloop *loop, const int *signals,
+                       evloop_cb cb, void *arg) {
+  sigset_t mask;
+  sigemptyset(&mask);
+  for (; *signals; signals++)
+    sigaddset(&mask, *signals);
+
+  // the signals must not be delivered the usual way anymore
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
+    return -errno;
+
+  const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  const int ret = evloop_add_type(loop, fd, EVLOOP_SIGNAL, EPOLLIN, cb, arg);
+  if (ret < 0) {
+    close(fd);
+    return ret;
+  }
+
+  return 0;
+}
+
+void evloop_set_prepare(struct evloop *loop,
+                        evloop_prepare_cb prepare, void *arg) {
+  loop->prepare = prepare;
+  loop->prepare_arg = arg;
+}
+
+/**
+ * Consume the readiness of loop-owned descriptors and dispatch.
+ */
+static void evloop_dispatch(struct evloop *loop, struct evloop_handler *h,
+                            uint32_t events) {
+  // copy, the callback may remove the handler
+  const struct evloop_handler handler = *h;
+
+  switch (handler.type) {
+    case EVLOOP_FD: {
+      handler.cb(loop, handler.fd, events, handler.arg);
+      break;
+    }
+    case EVLOOP_TIMER: {
+      uint64_t expirations;
+      if (read(handler.fd, &expirations, sizeof(expirations)) > 0)
+        handler.cb(loop, handler.fd, events, handler.arg);
+      break;
+    }
+    case EVLOOP_SIGNAL: {
+      struct signalfd_siginfo si;
+      while (read(handler.fd, &si, sizeof(si)) == sizeof(si))
+        handler.cb(loop, handler.fd, si.ssi_signo, handler.arg);
+      break;
+    }
+  }
+}
+
+int evloop_run(struct evloop *loop) {
+  struct epoll_event events[EVLOOP_HANDLERS_MAX];
+
+  loop->run = true;
+  while (loop->run) {
+    if (loop->prepare)
+      loop->prepare(loop, loop->prepare_arg);
+
+    const int n = epoll_wait(loop->epfd, events, EVLOOP_HANDLERS_MAX, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+      struct evloop_handler *h = events[i].data.ptr;
+      // skip handlers removed by an earlier callback in this round
+      if (h->fd >= 0)
+        evloop_dispatch(loop, h, events[i].events);
+    }
+  }
+
+  return 0;
+}
+
+void evloop_stop(struct evloop *loop) {
+  loop->run = false;
+}
@@ -0,0 +1,116 @@
+#ifndef _EVLOOP_H_
+#define _EVLOOP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <sys/epoll.h>
+
+/*
+ * A minimal epoll based event loop. Every source (sockets, GPIO event lines,
+ * timers, signals) is a file descriptor with a callback, so the process
+ * sleeps in epoll_wait until there is actual work to do.
+ */
+
+#define EVLOOP_HANDLERS_MAX	16
+
+struct evloop;
+
+/**
+ * Event callback.
+ *
+ * @param loop The event loop
+ * @param fd The descriptor that became ready
+ * @param events The epoll events
+ * @param arg The argument given on registration
+ */
+typedef void (*evloop_cb)(struct evloop *loop, int fd,
+                          uint32_t events, void *arg);
+
+/**
+ * Called before the loop goes to sleep, e.g. to update the interest set.
+ */
+typedef void (*evloop_prepare_cb)(struct evloop *loop, void *arg);
+
+enum evloop_type {
+  EVLOOP_FD,		// descriptor owned by the caller
+  EVLOOP_TIMER,		// timerfd owned by the loop
+  EVLOOP_SIGNAL		// signalfd owned by the loop
+};
+
+struct evloop_handler {
+  int       fd;
+  uint8_t   type;
+  uint32_t  events;
+  evloop_cb cb;
+  void     *arg;
+};
+
+struct evloop {
+  int  epfd;
+  bool run;
+
+  evloop_prepare_cb prepare;
+  void             *prepare_arg;
+
+  struct evloop_handler handlers[EVLOOP_HANDLERS_MAX];
+};
+
+/**
+ * @return 0 on success, -errno on failure
+ */
+int evloop_init(struct evloop *loop);
+void evloop_close(struct evloop *loop);
+
+/**
+ * Register a descriptor.
+ *
+ * @param events The epoll events (EPOLLIN, EPOLLOUT)
+ * @return 0 on success, -errno on failure
+ */
+int evloop_add(struct evloop *loop, int fd, uint32_t events,
+               evloop_cb cb, void *arg);
+int evloop_mod(struct evloop *loop, int fd, uint32_t events);
+int evloop_del(struct evloop *loop, int fd);
+
+/**
+ * Create a periodic timer (timerfd). The timer is removed and closed
+ * with the loop.
+ *
+ * @param interval_ms The timer period in milliseconds
+ * @return The timer descriptor, -errno on failure
+ */
+int evloop_add_timer(struct evloop *loop, unsigned int interval_ms,
+                     evloop_cb cb, void *arg);
+
+/**
+ * Re-arm a timer of evloop_add_timer.
+ *
+ * @param delay_ms Time to the next expiry, 0 disarms the timer
+ * @param interval_ms The period after that, 0 for a one-shot timer
+ * @return 0 on success, -errno on failure
+ */
+int evloop_timer_set(int fd, unsigned int delay_ms, unsigned int interval_ms);
+
+/**
+ * Handle the given signals synchronously via signalfd. The callback
+ * receives the signal number instead of the events.
+ *
+ * @param signals Zero-terminated list of signal numbers
+ * @return 0 on success, -errno on failure
+ */
+int evloop_add_signals(struct evloop *loop, const int *signals,
+                       evloop_cb cb, void *arg);
+
+void evloop_set_prepare(struct evloop *loop,
+                        evloop_prepare_cb prepare, void *arg);
+
+/**
+ * Dispatch events until evloop_stop is called.
+ *
+ * @return 0 after stop, -errno on failure
+ */
+int evloop_run(struct evloop *loop);
+void evloop_stop(struct evloop *loop);
+
+#endif
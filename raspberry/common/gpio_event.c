@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/gpio.h>
+
+#include "gpio_event.h"
+
+#define GPIO_CHIPS_MAX	32
+#define GPIO_EVENTS_MAX	16
+
+///// Character device backend /////
+
+/**
+ * Open the GPIO chip given by path, gpiochipN name or chip label.
+ *
+ * The label lookup allows to address gpio-sim chips, which get an arbitrary
+ * chip number but a well-known label.
+ */
+static int cdev_open_chip(const char *chip) {
+  char path[32];
+
+  if (chip[0] == '/')
+    return open(chip, O_RDWR | O_CLOEXEC);
+
+  if (strncmp(chip, "gpiochip", 8) == 0) {
+    snprintf(path, sizeof(path), "/dev/%s", chip);
+    return open(path, O_RDWR | O_CLOEXEC);
+  }
+
+  int i;
+  for (i = 0; i < GPIO_CHIPS_MAX; i++) {
+    snprintf(path, sizeof(path), "/dev/gpiochip%d", i);
+    const int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+
+    struct gpiochip_info info;
+    memset(&info, 0, sizeof(info));
+    if ((ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info) == 0) &&
+        (strncmp(info.label, chip, sizeof(info.label)) == 0))
+      return fd;
+
+    close(fd);
+  }
+
+  errno = ENODEV;
+  return -1;
+}
+
+static int cdev_open(struct gpio_line *line, const char *consumer) {
+  const int chip_fd = cdev_open_chip(line->chip);
+  if (chip_fd < 0)
+    return -errno;
+
+  struct gpio_v2_line_request req;
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = line->offset;
+  req.num_lines = 1;
+  // the controllers only pull the line low, so we have to provide the pull-up
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+                     GPIO_V2_LINE_FLAG_EDGE_FALLING |
+                     GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+  strncpy(req.consumer, consumer, sizeof(req.consumer) - 1);
+
+  const int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  const int err = errno;
+  close(chip_fd);
+
+  if (ret < 0)
+    return -err;
+
+  line->fd = req.fd;
+  return 0;
+}
+
+static int cdev_read_events(struct gpio_line *line) {
+  struct gpio_v2_line_event ev[GPIO_EVENTS_MAX];
+  int edges = 0;
+
+  for (;;) {
+    const ssize_t len = read(line->fd, ev, sizeof(ev));
+    if (len < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    const int n = len / sizeof(ev[0]);
+    int i;
+    for (i = 0; i < n; i++)
+      if (ev[i].id == GPIO_V2_LINE_EVENT_FALLING_EDGE) {
+        line->last_event_ns = ev[i].timestamp_ns;
+        edges++;
+      }
+
+    // a short read means the kernel queue is empty
+    if (n < GPIO_EVENTS_MAX)
+      break;
+  }
+
+  return edges;
+}
+
+static int cdev_get_value(struct gpio_line *line) {
+  struct gpio_v2_line_values values;
+  values.mask = 1;
+  values.bits = 0;
+
+  if (ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+    return -errno;
+
+  return values.bits & 1;
+}
+
+static void cdev_close(struct gpio_line *line) {
+  close(line->fd);
+}
+
+const struct gpio_backend gpio_backend_cdev = {
+  .name        = "cdev",
+  .open        = cdev_open,
+  .read_events = cdev_read_events,
+  .get_value   = cdev_get_value,
+  .close       = cdev_close,
+};
+
+///// No-op backend /////
+
+static int none_open(struct gpio_line *line, const char *consumer) {
+  return 0;
+}
+
+static int none_read_events(struct gpio_line *line) {
+  return 0;
+}
+
+static int none_get_value(struct gpio_line *line) {
+  // the INT line is active low, report it as released
+  return 1;
+}
+
+static void none_close(struct gpio_line *line) {
+}
+
+const struct gpio_backend gpio_backend_none = {
+  .name        = "none",
+  .open        = none_open,
+  .read_events = none_read_events,
+  .get_value   = none_get_value,
+  .close       = none_close,
+};
+
+///// Public interface /////
+
+static const struct gpio_backend *gpio_backends[] = {
+  &gpio_backend_cdev,
+  &gpio_backend_none,
+  NULL
+};
+
+const struct gpio_backend *gpio_backend_by_name(const char *name) {
+  const struct gpio_backend **b;
+  for (b = gpio_backends; *b; b++)
+    if (strcmp((*b)->name, name) == 0)
+      return *b;
+
+  return NULL;
+}
+
+int gpio_line_open(struct gpio_line *line,
+                   const struct gpio_backend *backend,
+                   const char *chip, unsigned int offset,
+                   const char *consumer) {
+  line->backend = backend;
+  line->chip = chip;
+  line->offset = offset;
+  line->fd = -1;
+  line->last_event_ns = 0;
+
+  const int ret = backend->open(line, consumer);
+  if (ret < 0)
+    return ret;
+
+  if (line->fd >= 0) {
+    // we drain the events until EAGAIN
+    const int flags = fcntl(line->fd, F_GETFL);
+    fcntl(line->fd, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  return 0;
+}
+
+int gpio_line_events(struct gpio_line *line) {
+  return line->backend->read_events(line);
+}
+
+int gpio_line_value(struct gpio_line *line) {
+  return line->backend->get_value(line);
+}
+
+void gpio_line_close(struct gpio_line *line) {
+  line->backend->close(line);
+  line->fd = -1;
+}
@@ -0,0 +1,73 @@
+#ifndef _GPIO_EVENT_H_
+#define _GPIO_EVENT_H_
+
+#include <stdint.h>
+
+/*
+ * Edge event handling for single GPIO input lines, e.g. the I3C INT line
+ * which is pulled low by a controller on state changes.
+ *
+ * The backend is pluggable: "cdev" uses the Linux GPIO character device
+ * (and therefore works with real chips as well as the gpio-sim module),
+ * "none" provides no events and makes the caller fall back to polling.
+ */
+
+struct gpio_line;
+
+struct gpio_backend {
+  const char *name;
+  int  (*open)(struct gpio_line *line, const char *consumer);
+  int  (*read_events)(struct gpio_line *line);
+  int  (*get_value)(struct gpio_line *line);
+  void (*close)(struct gpio_line *line);
+};
+
+struct gpio_line {
+  const struct gpio_backend *backend;
+  const char   *chip;		// device path, gpiochipN or chip label
+  unsigned int  offset;		// line offset on the chip
+  int           fd;		// pollable descriptor, -1 if none
+  uint64_t      last_event_ns;	// kernel timestamp of the last edge
+};
+
+extern const struct gpio_backend gpio_backend_cdev;
+extern const struct gpio_backend gpio_backend_none;
+
+/**
+ * Look up a backend by its name.
+ *
+ * @param name The backend name ("cdev" or "none")
+ * @return The backend or NULL if there is no such backend.
+ */
+const struct gpio_backend *gpio_backend_by_name(const char *name);
+
+/**
+ * Request a GPIO line as pulled-up input with falling edge detection.
+ *
+ * @param line The line record to initialize
+ * @param backend The backend to use
+ * @param chip Device path, gpiochipN or chip label
+ * @param offset Line offset on the chip
+ * @param consumer Consumer name shown by the kernel
+ * @return 0 on success, -errno on failure
+ */
+int gpio_line_open(struct gpio_line *line,
+                   const struct gpio_backend *backend,
+                   const char *chip, unsigned int offset,
+                   const char *consumer);
+
+/**
+ * Drain all pending edge events from the line.
+ *
+ * @return Number of falling edges read, 0 if none, -errno on failure
+ */
+int gpio_line_events(struct gpio_line *line);
+
+/**
+ * @return The current line level (0 or 1), -errno on failure
+ */
+int gpio_line_value(struct gpio_line *line);
+
+void gpio_line_close(struct gpio_line *line);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef _I2C_ARBITER_H_
+#define _I2C_ARBITER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "i2c_transport.h"
+
+/*
+ * Wire format between the I2C bus arbiter and its clients.
+ *
+ * Clients talk to the arbiter over a SOCK_SEQPACKET Unix socket. Each
+ * message is one batch of transfers with a priority; the arbiter runs the
+ * batch on the bus without interleaving and answers with one reply message
+ * carrying a result per transfer. Only the used entries are sent.
+ */
+
+#define I2C_ARBITER_SOCKET	"/run/i2carbiter.sock"
+#define I2C_ARBITER_BATCH_MAX	8
+
+struct i2c_arbiter_xfer {
+  uint8_t addr;
+  uint8_t wlen;
+  uint8_t rlen;
+  uint8_t reserved;
+  uint8_t wbuf[I2C_TRANSFER_MAX];
+};
+
+struct i2c_arbiter_request {
+  uint8_t prio;		// I2C_PRIO_*
+  uint8_t count;	// number of transfers
+  uint8_t reserved[2];
+  struct i2c_arbiter_xfer xfers[I2C_ARBITER_BATCH_MAX];
+};
+
+struct i2c_arbiter_result {
+  int16_t status;	// 0 or -errno
+  uint8_t rlen;
+  uint8_t reserved;
+  uint8_t rbuf[I2C_TRANSFER_MAX];
+};
+
+struct i2c_arbiter_reply {
+  uint8_t count;
+  uint8_t reserved[3];
+  struct i2c_arbiter_result results[I2C_ARBITER_BATCH_MAX];
+};
+
+#define I2C_ARBITER_REQUEST_SIZE(n) \
+  (offsetof(struct i2c_arbiter_request, xfers) + (n) * sizeof(struct i2c_arbiter_xfer))
+#define I2C_ARBITER_REPLY_SIZE(n) \
+  (offsetof(struct i2c_arbiter_reply, results) + (n) * sizeof(struct i2c_arbiter_result))
+
+#endif
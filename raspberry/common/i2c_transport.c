@@ -0,0 +1,482 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "i2c_transport.h"
+#include "i2c_arbiter.h"
+#include "i3c_fake.h"
+
+// how long to wait for the arbiter before giving up a batch
+#define ARBITER_TIMEOUT_MS	1000
+
+///// /dev/i2c-N /////
+
+static int dev_set_slave(struct i2c_transport *t, uint8_t addr) {
+  if (t->slave == addr)
+    return 0;
+
+  if (ioctl(t->fd, I2C_SLAVE, addr) < 0)
+    return -errno;
+
+  t->slave = addr;
+  return 0;
+}
+
+/**
+ * Combined transaction: one START, the write, a repeated START, the read
+ * and one STOP, all in a single system call.
+ */
+static int dev_xfer_rdwr(struct i2c_transport *t, uint8_t addr,
+                         const uint8_t *wbuf, uint8_t wlen,
+                         uint8_t *rbuf, uint8_t rlen) {
+  struct i2c_msg msgs[2];
+  int n = 0;
+
+  if (wlen) {
+    msgs[n].addr  = addr;
+    msgs[n].flags = 0;
+    msgs[n].len   = wlen;
+    msgs[n].buf   = (uint8_t *)wbuf;
+    n++;
+  }
+  if (rlen) {
+    msgs[n].addr  = addr;
+    msgs[n].flags = I2C_M_RD;
+    msgs[n].len   = rlen;
+    msgs[n].buf   = rbuf;
+    n++;
+  }
+
+  struct i2c_rdwr_ioctl_data data;
+  data.msgs  = msgs;
+  data.nmsgs = n;
+
+  if (ioctl(t->fd, I2C_RDWR, &data) < 0)
+    return -errno;
+
+  return 0;
+}
+
+static int dev_smbus(struct i2c_transport *t, uint8_t read_write,
+                     uint8_t command, uint32_t size,
+                     union i2c_smbus_data *data) {
+  struct i2c_smbus_ioctl_data args;
+  args.read_write = read_write;
+  args.command    = command;
+  args.size       = size;
+  args.data       = data;
+
+  if (ioctl(t->fd, I2C_SMBUS, &args) < 0)
+    return -errno;
+
+  return 0;
+}
+
+/**
+ * SMBus fallback for adapters without plain I2C, like i2c-stub. A one byte
+ * write followed by a read maps to the SMBus read with command byte.
+ */
+static int dev_xfer_smbus(struct i2c_transport *t, uint8_t addr,
+                          const uint8_t *wbuf, uint8_t wlen,
+                          uint8_t *rbuf, uint8_t rlen) {
+  union i2c_smbus_data data;
+  int ret;
+
+  ret = dev_set_slave(t, addr);
+  if (ret < 0)
+    return ret;
+
+  if ((wlen != 1) && rlen)
+    return -EOPNOTSUPP;
+
+  if (!rlen) {
+    if (wlen == 1)
+      return dev_smbus(t, I2C_SMBUS_WRITE, wbuf[0], I2C_SMBUS_BYTE, NULL);
+
+    if ((wlen < 2) || (wlen - 1 > I2C_SMBUS_BLOCK_MAX))
+      return -EINVAL;
+    data.block[0] = wlen - 1;
+    memcpy(&data.block[1], &wbuf[1], wlen - 1);
+    return dev_smbus(t, I2C_SMBUS_WRITE, wbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data);
+  }
+
+  switch (rlen) {
+    case 1:
+      ret = dev_smbus(t, I2C_SMBUS_READ, wbuf[0], I2C_SMBUS_BYTE_DATA, &data);
+      rbuf[0] = data.byte;
+      break;
+    case 2:
+      // SMBus words are little endian, the first byte on the wire is the lsb
+      ret = dev_smbus(t, I2C_SMBUS_READ, wbuf[0], I2C_SMBUS_WORD_DATA, &data);
+      rbuf[0] = data.word & 0xff;
+      rbuf[1] = data.word >> 8;
+      break;
+    default:
+      if (rlen > I2C_SMBUS_BLOCK_MAX)
+        return -EINVAL;
+      data.block[0] = rlen;
+      ret = dev_smbus(t, I2C_SMBUS_READ, wbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data);
+      memcpy(rbuf, &data.block[1], rlen);
+      break;
+  }
+
+  return ret;
+}
+
+static int dev_xfer(struct i2c_transport *t, uint8_t addr,
+                    const uint8_t *wbuf, uint8_t wlen,
+                    uint8_t *rbuf, uint8_t rlen) {
+  if (t->funcs & I2C_FUNC_I2C)
+    return dev_xfer_rdwr(t, addr, wbuf, wlen, rbuf, rlen);
+
+  return dev_xfer_smbus(t, addr, wbuf, wlen, rbuf, rlen);
+}
+
+static void dev_close(struct i2c_transport *t) {
+  close(t->fd);
+  t->fd = -1;
+}
+
+static const struct i2c_transport_ops dev_ops = {
+  .xfer  = dev_xfer,
+  .close = dev_close,
+};
+
+int i2c_transport_open_dev(struct i2c_transport *t, int bus) {
+  char path[32];
+  snprintf(path, sizeof(path), "/dev/i2c-%d", bus);
+
+  memset(t, 0, sizeof(*t));
+  t->ops = &dev_ops;
+  t->prio = I2C_PRIO_NORMAL;
+  t->slave = -1;
+  snprintf(t->name, sizeof(t->name), "i2c-%d", bus);
+
+  t->fd = open(path, O_RDWR | O_CLOEXEC);
+  if (t->fd < 0)
+    return -errno;
+
+  if (ioctl(t->fd, I2C_FUNCS, &t->funcs) < 0) {
+    const int err = errno;
+    dev_close(t);
+    return -err;
+  }
+
+  return 0;
+}
+
+///// Fake transport /////
+
+static int fake_xfer(struct i2c_transport *t, uint8_t addr,
+                     const uint8_t *wbuf, uint8_t wlen,
+                     uint8_t *rbuf, uint8_t rlen) {
+  const int ret = t->handler(t->handler_arg, addr, wbuf, wlen, rbuf, rlen);
+  if (ret < 0)
+    return ret;
+
+  // like a real slave, the fake sends 0xff when it has nothing to say
+  if (ret < rlen)
+    memset(&rbuf[ret], 0xff, rlen - ret);
+
+  return 0;
+}
+
+static void fake_close(struct i2c_transport *t) {
+}
+
+static const struct i2c_transport_ops fake_ops = {
+  .xfer  = fake_xfer,
+  .close = fake_close,
+};
+
+void i2c_transport_open_fake(struct i2c_transport *t,
+                             i2c_fake_handler handler, void *arg) {
+  memset(t, 0, sizeof(*t));
+  t->ops = &fake_ops;
+  t->prio = I2C_PRIO_NORMAL;
+  t->fd = -1;
+  t->slave = -1;
+  t->handler = handler;
+  t->handler_arg = arg;
+  snprintf(t->name, sizeof(t->name), "fake");
+}
+
+///// Arbiter client /////
+
+static int arbiter_connect(struct i2c_transport *t) {
+  t->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (t->fd < 0)
+    return -errno;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", t->path);
+
+  struct timeval tv;
+  tv.tv_sec  = ARBITER_TIMEOUT_MS / 1000;
+  tv.tv_usec = (ARBITER_TIMEOUT_MS % 1000) * 1000;
+
+  if ((setsockopt(t->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) ||
+      (connect(t->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)) {
+    const int err = errno;
+    close(t->fd);
+    t->fd = -1;
+    return -err;
+  }
+
+  return 0;
+}
+
+static int arbiter_roundtrip(struct i2c_transport *t,
+                             const struct i2c_arbiter_request *req,
+                             struct i2c_arbiter_reply *rep) {
+  const size_t len = I2C_ARBITER_REQUEST_SIZE(req->count);
+
+  // reconnect once if the arbiter has been restarted
+  if ((t->fd < 0) || (send(t->fd, req, len, MSG_NOSIGNAL) < 0)) {
+    if (t->fd >= 0)
+      close(t->fd);
+
+    int ret = arbiter_connect(t);
+    if (ret < 0)
+      return ret;
+    if (send(t->fd, req, len, MSG_NOSIGNAL) < 0)
+      return -errno;
+  }
+
+  const ssize_t rlen = recv(t->fd, rep, sizeof(*rep), 0);
+  if (rlen < 0) {
+    // a late reply would be taken for the next request
+    const int err = (errno == EAGAIN) ? ETIMEDOUT : errno;
+    close(t->fd);
+    t->fd = -1;
+    return -err;
+  }
+
+  if ((rlen < I2C_ARBITER_REPLY_SIZE(0)) ||
+      (rep->count != req->count) ||
+      (rlen < I2C_ARBITER_REPLY_SIZE(rep->count)))
+    return -EPROTO;
+
+  return 0;
+}
+
+static int arbiter_batch(struct i2c_transport *t,
+                         struct i2c_xfer *xfers, int count) {
+  struct i2c_arbiter_request req;
+  struct i2c_arbiter_reply rep;
+
+  if ((count < 1) || (count > I2C_ARBITER_BATCH_MAX))
+    return -EINVAL;
+
+  memset(&req, 0, I2C_ARBITER_REQUEST_SIZE(count));
+  req.prio = t->prio;
+  req.count = count;
+
+  int i;
+  for (i = 0; i < count; i++) {
+    if ((xfers[i].wlen > I2C_TRANSFER_MAX) || (xfers[i].rlen > I2C_TRANSFER_MAX))
+      return -EINVAL;
+
+    req.xfers[i].addr = xfers[i].addr;
+    req.xfers[i].wlen = xfers[i].wlen;
+    req.xfers[i].rlen = xfers[i].rlen;
+    // plain reads have no write buffer
+    if (xfers[i].wlen)
+      memcpy(req.xfers[i].wbuf, xfers[i].wbuf, xfers[i].wlen);
+  }
+
+  const int ret = arbiter_roundtrip(t, &req, &rep);
+  if (ret < 0) {
+    for (i = 0; i < count; i++)
+      xfers[i].status = ret;
+    return ret;
+  }
+
+  int first = 0;
+  for (i = 0; i < count; i++) {
+    xfers[i].status = rep.results[i].status;
+    if (!xfers[i].status)
+      memcpy(xfers[i].rbuf, rep.results[i].rbuf, xfers[i].rlen);
+    else if (!first)
+      first = xfers[i].status;
+  }
+
+  return first;
+}
+
+static int arbiter_xfer(struct i2c_transport *t, uint8_t addr,
+                        const uint8_t *wbuf, uint8_t wlen,
+                        uint8_t *rbuf, uint8_t rlen) {
+  struct i2c_xfer x = {
+    .addr = addr, .wbuf = wbuf, .wlen = wlen, .rbuf = rbuf, .rlen = rlen
+  };
+
+  return arbiter_batch(t, &x, 1);
+}
+
+static void arbiter_close(struct i2c_transport *t) {
+  if (t->fd >= 0)
+    close(t->fd);
+  t->fd = -1;
+}
+
+static const struct i2c_transport_ops arbiter_ops = {
+  .xfer  = arbiter_xfer,
+  .batch = arbiter_batch,
+  .close = arbiter_close,
+};
+
+int i2c_transport_open_arbiter(struct i2c_transport *t, const char *path) {
+  memset(t, 0, sizeof(*t));
+  t->ops = &arbiter_ops;
+  t->prio = I2C_PRIO_NORMAL;
+  t->slave = -1;
+  snprintf(t->name, sizeof(t->name), "arbiter");
+  strncpy(t->path, path, sizeof(t->path) - 1);
+
+  return arbiter_connect(t);
+}
+
+///// Fault injection /////
+
+static int fault_xfer(struct i2c_transport *t, uint8_t addr,
+                      const uint8_t *wbuf, uint8_t wlen,
+                      uint8_t *rbuf, uint8_t rlen) {
+  // the priority is set after opening
+  t->inner->prio = t->prio;
+
+  const bool fault = (random() % 1000) < t->fault_permille;
+  if (!fault)
+    return i2c_transfer(t->inner, addr, wbuf, wlen, rbuf, rlen);
+
+  t->faults++;
+
+  const int kind = random() % 4;
+  if (kind == 0)
+    // no ACK or arbitration lost
+    return -EIO;
+
+  const int ret = i2c_transfer(t->inner, addr, wbuf, wlen, rbuf, rlen);
+  if ((ret < 0) || !rlen)
+    return ret;
+
+  switch (kind) {
+    case 1:
+      // the device did not accept the request
+      rbuf[0] = 0x00;
+      if (rlen > 1)
+        rbuf[1] = 0xff;
+      break;
+    case 2:
+      // read before the reply was ready
+      memset(rbuf, 0xfe, rlen);
+      break;
+    case 3:
+      // noise on the line
+      rbuf[random() % rlen] ^= 1 << (random() % 8);
+      break;
+  }
+
+  return 0;
+}
+
+static void fault_close(struct i2c_transport *t) {
+  i2c_transport_close(t->inner);
+  free(t->inner);
+  t->inner = NULL;
+}
+
+static const struct i2c_transport_ops fault_ops = {
+  .xfer  = fault_xfer,
+  .close = fault_close,
+};
+
+void i2c_transport_open_fault(struct i2c_transport *t,
+                              struct i2c_transport *inner,
+                              uint16_t permille) {
+  memset(t, 0, sizeof(*t));
+  t->ops = &fault_ops;
+  t->prio = inner->prio;
+  t->fd = -1;
+  t->slave = -1;
+  t->inner = inner;
+  t->fault_permille = permille;
+  snprintf(t->name, sizeof(t->name), "fault");
+}
+
+///// Public interface /////
+
+int i2c_transport_open(struct i2c_transport *t, const char *spec) {
+  if (strcmp(spec, "fake") == 0) {
+    i2c_transport_open_fake(t, i3c_fake_handler, i3c_fake_bus());
+    return 0;
+  }
+
+  if (strcmp(spec, "arbiter") == 0)
+    return i2c_transport_open_arbiter(t, I2C_ARBITER_SOCKET);
+
+  if (strncmp(spec, "unix:", 5) == 0)
+    return i2c_transport_open_arbiter(t, spec + 5);
+
+  if (strncmp(spec, "fault:", 6) == 0) {
+    char *end;
+    const double percent = strtod(spec + 6, &end);
+    if ((*end != ':') || (percent < 0) || (percent > 100))
+      return -EINVAL;
+
+    struct i2c_transport *inner = malloc(sizeof(*inner));
+    if (!inner)
+      return -ENOMEM;
+
+    const int ret = i2c_transport_open(inner, end + 1);
+    if (ret < 0) {
+      free(inner);
+      return ret;
+    }
+
+    i2c_transport_open_fault(t, inner, percent * 10);
+    return 0;
+  }
+
+  char *end;
+  const long bus = strtol(spec, &end, 10);
+  if (*end || (bus < 0))
+    return -EINVAL;
+
+  return i2c_transport_open_dev(t, bus);
+}
+
+int i2c_transfer_batch(struct i2c_transport *t,
+                       struct i2c_xfer *xfers, int count) {
+  if (t->ops->batch)
+    return t->ops->batch(t, xfers, count);
+
+  int first = 0;
+  int i;
+  for (i = 0; i < count; i++) {
+    xfers[i].status = i2c_transfer(t, xfers[i].addr,
+                                   xfers[i].wbuf, xfers[i].wlen,
+                                   xfers[i].rbuf, xfers[i].rlen);
+    if (xfers[i].status && !first)
+      first = xfers[i].status;
+  }
+
+  return first;
+}
+
+void i2c_transport_close(struct i2c_transport *t) {
+  t->ops->close(t);
+}
@@ -0,0 +1,155 @@
+#ifndef _I2C_TRANSPORT_H_
+#define _I2C_TRANSPORT_H_
+
+#include <stdint.h>
+
+/*
+ * I2C transport layer: a write followed by a read to one device address.
+ *
+ * The "dev" transport uses /dev/i2c-N. If the adapter supports plain I2C,
+ * the write and read go out as one combined I2C_RDWR transaction with a
+ * repeated start. Otherwise (e.g. the i2c-stub module) the transfer is
+ * mapped to the matching SMBus read.
+ *
+ * The "fake" transport hands every transfer to a callback in the process.
+ *
+ * The "arbiter" transport sends transfers to the i2carbiter daemon, which
+ * owns the bus and schedules the transfers of all clients by priority.
+ *
+ * The "fault" transport wraps another transport and injects errors at a
+ * given rate, to see how the retry policy copes with a noisy bus.
+ */
+
+#define I2C_TRANSFER_MAX	32
+
+/**
+ * Transfer priorities, only used by the arbiter
+ */
+enum i2c_prio {
+  I2C_PRIO_LOW    = 0,	// cosmetic, e.g. light updates
+  I2C_PRIO_NORMAL = 1,
+  I2C_PRIO_HIGH   = 2,	// state reads, e.g. the lever
+};
+
+/**
+ * One transfer of a batch
+ */
+struct i2c_xfer {
+  uint8_t        addr;
+  const uint8_t *wbuf;
+  uint8_t        wlen;
+  uint8_t       *rbuf;
+  uint8_t        rlen;
+  int            status;	// 0 or -errno after the transfer
+};
+
+struct i2c_transport;
+
+/**
+ * Handler for the fake transport.
+ *
+ * @return Number of bytes put into rbuf, -errno on failure
+ */
+typedef int (*i2c_fake_handler)(void *arg, uint8_t addr,
+                                const uint8_t *wbuf, uint8_t wlen,
+                                uint8_t *rbuf, uint8_t rlen);
+
+struct i2c_transport_ops {
+  int  (*xfer)(struct i2c_transport *t, uint8_t addr,
+               const uint8_t *wbuf, uint8_t wlen,
+               uint8_t *rbuf, uint8_t rlen);
+  // optional, transfers one by one if not set
+  int  (*batch)(struct i2c_transport *t, struct i2c_xfer *xfers, int count);
+  void (*close)(struct i2c_transport *t);
+};
+
+struct i2c_transport {
+  const struct i2c_transport_ops *ops;
+  char name[16];
+  uint8_t prio;			// I2C_PRIO_*, default normal
+
+  // dev transport
+  int           fd;
+  unsigned long funcs;		// adapter functionality, see I2C_FUNCS
+  int           slave;		// address set with I2C_SLAVE, -1 if none
+
+  // fake transport
+  i2c_fake_handler handler;
+  void            *handler_arg;
+
+  // arbiter transport
+  char path[108];		// socket path for reconnects
+
+  // fault transport
+  struct i2c_transport *inner;
+  uint16_t fault_permille;	// share of faulty transfers
+  uint32_t faults;		// number of injected faults
+};
+
+/**
+ * Open /dev/i2c-N.
+ *
+ * @param bus The bus number N
+ * @return 0 on success, -errno on failure
+ */
+int i2c_transport_open_dev(struct i2c_transport *t, int bus);
+
+/**
+ * Set up an in-process transport.
+ */
+void i2c_transport_open_fake(struct i2c_transport *t,
+                             i2c_fake_handler handler, void *arg);
+
+/**
+ * Connect to the i2carbiter daemon.
+ *
+ * @param path The socket path
+ * @return 0 on success, -errno on failure
+ */
+int i2c_transport_open_arbiter(struct i2c_transport *t, const char *path);
+
+/**
+ * Wrap a transport with fault injection. Faulty transfers either fail on
+ * the bus, return a zero reply, return the 0xfe filler or get a flipped bit.
+ *
+ * @param inner The transport to wrap, closed with this transport
+ * @param permille Share of faulty transfers in 1/1000
+ */
+void i2c_transport_open_fault(struct i2c_transport *t,
+                              struct i2c_transport *inner,
+                              uint16_t permille);
+
+/**
+ * Open a transport given by name: a bus number, "fake", which uses the
+ * built-in I3C device models (see i3c_fake.h), "arbiter" for the arbiter
+ * at its default socket, "unix:<path>" for an arbiter socket or
+ * "fault:<percent>:<spec>" to inject errors into another transport.
+ *
+ * @return 0 on success, -errno on failure
+ */
+int i2c_transport_open(struct i2c_transport *t, const char *spec);
+
+/**
+ * Write wlen bytes, then read rlen bytes from the device at addr.
+ *
+ * @return 0 on success, -errno on failure
+ */
+static inline int i2c_transfer(struct i2c_transport *t, uint8_t addr,
+                               const uint8_t *wbuf, uint8_t wlen,
+                               uint8_t *rbuf, uint8_t rlen) {
+  return t->ops->xfer(t, addr, wbuf, wlen, rbuf, rlen);
+}
+
+/**
+ * Run several transfers. The arbiter runs them back to back without
+ * transfers of other clients in between.
+ *
+ * @return 0 if all transfers succeeded, the first error otherwise. The
+ *         result of each transfer is in its status.
+ */
+int i2c_transfer_batch(struct i2c_transport *t,
+                       struct i2c_xfer *xfers, int count);
+
+void i2c_transport_close(struct i2c_transport *t);
+
+#endif
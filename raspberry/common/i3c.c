@@ -0,0 +1,721 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "i3c.h"
+
+#define I3C_ROW(c) { \
+  I3C_REQUEST(c, 0x0), I3C_REQUEST(c, 0x1), I3C_REQUEST(c, 0x2), I3C_REQUEST(c, 0x3), \
+  I3C_REQUEST(c, 0x4), I3C_REQUEST(c, 0x5), I3C_REQUEST(c, 0x6), I3C_REQUEST(c, 0x7), \
+  I3C_REQUEST(c, 0x8), I3C_REQUEST(c, 0x9), I3C_REQUEST(c, 0xa), I3C_REQUEST(c, 0xb), \
+  I3C_REQUEST(c, 0xc), I3C_REQUEST(c, 0xd), I3C_REQUEST(c, 0xe), I3C_REQUEST(c, 0xf) }
+
+const uint8_t i3c_request_table[I3C_CMD_MAX + 1][I3C_DATA_MAX + 1] = {
+  I3C_ROW(0), I3C_ROW(1), I3C_ROW(2), I3C_ROW(3),
+  I3C_ROW(4), I3C_ROW(5), I3C_ROW(6), I3C_ROW(7)
+};
+
+const struct i3c_retry_policy i3c_default_policy = {
+  .max_attempts      = 8,
+  .backoff_us        = 200,
+  .backoff_max_us    = 5000,
+  .breaker_threshold = 3,
+  .breaker_open_ms   = 5000,
+};
+
+const char *i3c_strerror(int err) {
+  switch (err) {
+    case I3C_OK:                  return "success";
+    case I3C_ERR_INVALIDARGUMENT: return "invalid argument";
+    case I3C_ERR_SETUP:           return "I2C setup failed";
+    case I3C_ERR_NORESPONSE:      return "no valid response";
+    case I3C_ERR_BREAKER:         return "device disabled by circuit breaker";
+  }
+
+  return "unknown error";
+}
+
+int i3c_bus_open(struct i2c_transport *bus, const char *spec) {
+  // for the backoff jitter
+  srandom(time(NULL) ^ getpid());
+
+  const int ret = i2c_transport_open(bus, spec);
+  if (ret < 0) {
+    syslog(LOG_EMERG, "Error on I2C initialization of bus %s: %s!",
+                      spec, strerror(-ret));
+    return I3C_ERR_SETUP;
+  }
+
+  return I3C_OK;
+}
+
+int i3c_open(struct i3c_device *dev, struct i2c_transport *bus,
+             uint8_t addr, const char *name) {
+  memset(dev, 0, sizeof(*dev));
+  dev->bus    = bus;
+  dev->addr   = addr;
+  dev->name   = name;
+  dev->policy = &i3c_default_policy;
+
+  return I3C_OK;
+}
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Count one attempt and update the error rate.
+ */
+static void i3c_count_attempt(struct i3c_device *dev, bool valid) {
+  dev->stats.attempts++;
+
+  // error rate with a weight of 1/16 for the new sample
+  const uint32_t sample = valid ? 0 : 0xffff;
+  dev->error_rate = (15 * (uint32_t)dev->error_rate + sample) / 16;
+}
+
+/**
+ * Check and count the outcome of one attempt.
+ *
+ * @param status The transport status
+ * @param rlen The number of bytes read
+ * @return true if the reply is valid
+ */
+typedef bool (*i3c_check_cb)(struct i3c_device *dev, int status,
+                             const uint8_t *result, uint8_t rlen);
+
+/**
+ * Value byte and inverted value byte
+ */
+static bool i3c_check_reply(struct i3c_device *dev, int status,
+                            const uint8_t *result, uint8_t rlen) {
+  bool valid = false;
+
+  if (status < 0)
+    dev->stats.bus_errors++;
+  // check for transmission errors: 2nd byte is inverted 1st byte
+  else if (!I3C_REPLY_VALID(result[0], result[1]))
+    dev->stats.inversion_errors++;
+  else if (!result[0])
+    dev->stats.zero_replies++;
+  else
+    valid = true;
+
+  i3c_count_attempt(dev, valid);
+  return valid;
+}
+
+/**
+ * Status or events block: length byte first, checksummed as a whole
+ */
+static bool i3c_check_block(struct i3c_device *dev, int status,
+                            const uint8_t *result, uint8_t rlen) {
+  bool valid = false;
+
+  if (status < 0)
+    dev->stats.bus_errors++;
+  // an error reply looks like a v1 reply
+  else if (!result[0] && (result[1] == 0xff))
+    dev->stats.zero_replies++;
+  else if ((result[0] != rlen) ||
+           (result[rlen - 1] != i3c_checksum(result, rlen - 1)))
+    dev->stats.checksum_errors++;
+  else
+    valid = true;
+
+  i3c_count_attempt(dev, valid);
+  return valid;
+}
+
+/**
+ * v2 reply with CRC-8 over the whole frame and the sequence number of the
+ * request. Replies with a command error are valid, the command is not
+ * retried.
+ */
+static bool i3c_check_v2(struct i3c_device *dev, int status,
+                         const uint8_t *result, uint8_t rlen) {
+  bool valid = false;
+
+  if (status < 0)
+    dev->stats.bus_errors++;
+  // v1 error reply, e.g. the controller has been reset
+  else if (!result[0] && (result[1] == 0xff))
+    dev->stats.zero_replies++;
+  // a damaged length moves the CRC, so a successful reply must also
+  // have the expected length
+  else if ((result[I3C_V2_LEN] > rlen - I3C_V2_OVERHEAD) ||
+           (((result[I3C_V2_STATUS] & I3C_V2_STATUS_MASK) == I3C_V2_OK) &&
+            (result[I3C_V2_LEN] != rlen - I3C_V2_OVERHEAD)) ||
+           (result[I3C_V2_DATA + result[I3C_V2_LEN]] !=
+            i3c_crc8(result, I3C_V2_DATA + result[I3C_V2_LEN])))
+    dev->stats.crc_errors++;
+  else if (result[I3C_V2_SEQ] != dev->seq)
+    dev->stats.sequence_errors++;
+  // the controller got a damaged request
+  else if ((result[I3C_V2_STATUS] & I3C_V2_STATUS_MASK) == I3C_V2_ERR_CRC)
+    dev->stats.request_errors++;
+  else
+    valid = true;
+
+  if (valid && (result[I3C_V2_STATUS] & I3C_V2_REPLAYED))
+    dev->stats.replays++;
+
+  i3c_count_attempt(dev, valid);
+  return valid;
+}
+
+/**
+ * Wait before the next attempt.
+ *
+ * @param attempt The number of failed attempts so far
+ */
+static void i3c_backoff(struct i3c_device *dev, int attempt) {
+  const struct i3c_retry_policy *p = dev->policy;
+
+  // the first retry goes out right away, most errors are single glitches
+  if (attempt < 2)
+    return;
+
+  uint64_t backoff = (uint64_t)p->backoff_us << (attempt - 2);
+  // scale by 1 + 3 * error rate: a noisy bus needs more time to settle
+  backoff += (backoff * 3 * dev->error_rate) >> 16;
+  if (backoff > p->backoff_max_us)
+    backoff = p->backoff_max_us;
+
+  const uint64_t delay = random() % (backoff + 1);
+  const struct timespec ts = {
+    .tv_sec  = delay / 1000000,
+    .tv_nsec = (delay % 1000000) * 1000
+  };
+  nanosleep(&ts, NULL);
+}
+
+/**
+ * @return true if the circuit breaker lets a command through
+ */
+static bool i3c_breaker_allows(struct i3c_device *dev) {
+  if (!dev->breaker_until_us)
+    return true;
+
+  // half-open: let the next command probe the device
+  if (now_us() >= dev->breaker_until_us)
+    return true;
+
+  dev->stats.breaker_rejects++;
+  return false;
+}
+
+static void i3c_breaker_result(struct i3c_device *dev, bool success) {
+  if (success) {
+    if (dev->breaker_until_us)
+      syslog(LOG_INFO, "Device %s is responding again.", dev->name);
+    dev->failures = 0;
+    dev->breaker_until_us = 0;
+    return;
+  }
+
+  dev->stats.give_ups++;
+  if (dev->failures < 0xff)
+    dev->failures++;
+
+  if (dev->failures >= dev->policy->breaker_threshold) {
+    if (!dev->breaker_until_us) {
+      dev->stats.breaker_trips++;
+      syslog(LOG_WARNING, "Device %s is not responding, disabled for %u ms.",
+                          dev->name, dev->policy->breaker_open_ms);
+    }
+    dev->breaker_until_us = now_us() + dev->policy->breaker_open_ms * 1000ULL;
+  }
+}
+
+/**
+ * Retry a request until there is a valid reply.
+ *
+ * @param result Buffer for rlen reply bytes
+ * @param attempt The number of failed attempts so far
+ */
+static int i3c_retry(struct i3c_device *dev,
+                     const uint8_t *request, uint8_t wlen,
+                     uint8_t *result, uint8_t rlen, i3c_check_cb check,
+                     int attempt) {
+  for (; attempt < dev->policy->max_attempts; attempt++) {
+    if (attempt)
+      dev->stats.retries++;
+    i3c_backoff(dev, attempt);
+
+    const int status = i2c_transfer(dev->bus, dev->addr, request, wlen,
+                                    result, rlen);
+    if (check(dev, status, result, rlen))
+      return I3C_OK;
+  }
+
+  syslog(LOG_DEBUG, "Giving up transmission to %s!", dev->name);
+  return I3C_ERR_NORESPONSE;
+}
+
+/**
+ * Send a request with breaker handling and retries.
+ */
+static int i3c_exchange(struct i3c_device *dev,
+                        const uint8_t *request, uint8_t wlen,
+                        uint8_t *result, uint8_t rlen, i3c_check_cb check) {
+  dev->stats.commands++;
+
+  if (!i3c_breaker_allows(dev))
+    return I3C_ERR_BREAKER;
+
+  const int ret = i3c_retry(dev, request, wlen, result, rlen, check, 0);
+  i3c_breaker_result(dev, ret == I3C_OK);
+
+  return ret;
+}
+
+int i3c_transfer(struct i3c_device *dev, uint8_t request, uint8_t *value) {
+  uint8_t result[2];
+
+  // send command, read value and inverted value
+  const int ret = i3c_exchange(dev, &request, 1, result, 2, i3c_check_reply);
+  if (ret == I3C_OK)
+    *value = result[0];
+
+  return ret;
+}
+
+/**
+ * Build a v2 request frame.
+ *
+ * @return The frame length
+ */
+static uint8_t i3c_v2_frame(uint8_t *frame, uint8_t seq, uint8_t cmd,
+                            const uint8_t *payload, uint8_t plen) {
+  const uint8_t n = I3C_V2_PAYLOAD + plen;
+
+  frame[0]          = I3C_V2_HEADER(n);
+  frame[I3C_V2_SEQ] = seq;
+  frame[I3C_V2_CMD] = cmd;
+  if (plen)
+    memcpy(frame + I3C_V2_PAYLOAD, payload, plen);
+  frame[n] = i3c_crc8(frame, n);
+
+  return n + 1;
+}
+
+int i3c_v2_command(struct i3c_device *dev, uint8_t cmd,
+                   const uint8_t *payload, uint8_t plen,
+                   uint8_t *reply, uint8_t len) {
+  uint8_t frame[I3C_V2_REQUEST_MAX];
+  uint8_t result[I3C_V2_REPLY_MAX];
+
+  if ((plen > I3C_V2_PAYLOAD_MAX) || (len > I3C_V2_REPLY_MAX - I3C_V2_OVERHEAD))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  // retries keep the sequence number, so the controller can detect them
+  if (!++dev->seq)
+    dev->seq = 1;
+
+  const uint8_t wlen = i3c_v2_frame(frame, dev->seq, cmd, payload, plen);
+  const int ret = i3c_exchange(dev, frame, wlen,
+                               result, I3C_V2_OVERHEAD + len, i3c_check_v2);
+  if (ret != I3C_OK)
+    return ret;
+
+  if ((result[I3C_V2_STATUS] & I3C_V2_STATUS_MASK) != I3C_V2_OK)
+    return I3C_ERR_INVALIDARGUMENT;
+
+  memcpy(reply, result + I3C_V2_DATA, len);
+  return I3C_OK;
+}
+
+static uint16_t get16(const uint8_t *buf) {
+  return buf[0] | (buf[1] << 8);
+}
+
+/**
+ * Check and decode a status block.
+ */
+static bool i3c_status_decode(const uint8_t *block, struct i3c_status *status) {
+  if ((block[I3C_STATUS_LENGTH] != I3C_STATUS_LEN) ||
+      (block[I3C_STATUS_CHECKSUM] != i3c_checksum(block, I3C_STATUS_CHECKSUM)))
+    return false;
+
+  status->version = block[I3C_STATUS_VERSION];
+  status->state   = block[I3C_STATUS_STATE];
+  status->flags   = block[I3C_STATUS_FLAGS];
+  status->frames  = get16(block + I3C_STATUS_FRAMES);
+  status->errors  = get16(block + I3C_STATUS_ERRORS);
+  status->starts  = get16(block + I3C_STATUS_STARTS);
+
+  return true;
+}
+
+int i3c_status(struct i3c_device *dev, bool reset, struct i3c_status *status) {
+  static const uint8_t requests[2] = {
+    I3C_REQUEST(I3C_CMD_GETSTATUS, 0),
+    I3C_REQUEST(I3C_CMD_GETSTATUS, I3C_STATUS_RESET)
+  };
+  uint8_t block[I3C_STATUS_LEN];
+  int ret;
+
+  i3c_probe(dev);
+
+  // the preloaded block is ready without a request, it cannot reset
+  if (dev->preload && !reset)
+    ret = i3c_exchange(dev, NULL, 0, block, I3C_STATUS_LEN, i3c_check_block);
+  else if (dev->proto >= 2) {
+    const uint8_t data = reset ? I3C_STATUS_RESET : 0;
+    ret = i3c_v2_command(dev, I3C_CMD_GETSTATUS, &data, 1,
+                         block, I3C_STATUS_LEN);
+  } else
+    ret = i3c_exchange(dev, &requests[reset], 1, block, I3C_STATUS_LEN,
+                       i3c_check_block);
+  if (ret != I3C_OK)
+    return ret;
+
+  // the v2 CRC has been checked already, the block checksum must match too
+  if (!i3c_status_decode(block, status)) {
+    dev->stats.checksum_errors++;
+    return I3C_ERR_NORESPONSE;
+  }
+
+  return I3C_OK;
+}
+
+#define I3C_PROBE_ATTEMPTS	3
+
+/**
+ * Probe GetStatus support and the firmware version with v1 framing.
+ *
+ * @return true if the device has answered
+ */
+static bool i3c_probe_status(struct i3c_device *dev) {
+  const uint8_t request = I3C_REQUEST(I3C_CMD_GETSTATUS, 0);
+  uint8_t result[I3C_STATUS_LEN];
+  struct i3c_status status;
+  int zero_replies = 0;
+
+  // no breaker here: old firmware answers every probe with an error
+  int attempt;
+  for (attempt = 0; attempt < I3C_PROBE_ATTEMPTS; attempt++) {
+    i3c_backoff(dev, attempt);
+
+    if (i2c_transfer(dev->bus, dev->addr, &request, 1,
+                     result, I3C_STATUS_LEN) < 0)
+      continue;
+
+    if (!result[0] && (result[1] == 0xff)) {
+      // a single error reply may be a parity error, ask again
+      if (++zero_replies < 2)
+        continue;
+
+      dev->version = 0;
+      return true;
+    }
+
+    if (i3c_status_decode(result, &status)) {
+      dev->version = status.version;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Confirm v2 support with a GetStatus frame. Sequence number 0 also drops
+ * a reply the controller may have kept from an earlier run of the host.
+ */
+static bool i3c_probe_v2(struct i3c_device *dev) {
+  const uint8_t data = 0;
+  uint8_t frame[I3C_V2_REQUEST_MAX];
+  uint8_t result[I3C_V2_OVERHEAD + I3C_STATUS_LEN];
+
+  dev->seq = 0;
+  const uint8_t wlen = i3c_v2_frame(frame, 0, I3C_CMD_GETSTATUS, &data, 1);
+
+  int attempt;
+  for (attempt = 0; attempt < I3C_PROBE_ATTEMPTS; attempt++) {
+    i3c_backoff(dev, attempt);
+
+    const int status = i2c_transfer(dev->bus, dev->addr, frame, wlen,
+                                    result, sizeof(result));
+    if (i3c_check_v2(dev, status, result, sizeof(result)) &&
+        ((result[I3C_V2_STATUS] & I3C_V2_STATUS_MASK) == I3C_V2_OK))
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * Confirm that a plain read returns the status block. The SMBus fallback
+ * cannot read without a command byte.
+ */
+static bool i3c_probe_preload(struct i3c_device *dev) {
+  uint8_t result[I3C_STATUS_LEN];
+  struct i3c_status status;
+
+  int attempt;
+  for (attempt = 0; attempt < I3C_PROBE_ATTEMPTS; attempt++) {
+    i3c_backoff(dev, attempt);
+
+    const int ret = i2c_transfer(dev->bus, dev->addr, NULL, 0,
+                                 result, I3C_STATUS_LEN);
+    if (ret == -EOPNOTSUPP)
+      return false;
+
+    if (!ret && i3c_status_decode(result, &status))
+      return true;
+  }
+
+  return false;
+}
+
+void i3c_probe(struct i3c_device *dev) {
+  // no probing while the device is known to be gone
+  if (dev->probed || dev->breaker_until_us)
+    return;
+
+  // not answering at all, ask again next time
+  if (!i3c_probe_status(dev))
+    return;
+
+  dev->probed = true;
+  dev->proto = 1;
+
+  if (!dev->version) {
+    syslog(LOG_INFO, "Device %s does not support GetStatus, using protocol v1.",
+                     dev->name);
+    return;
+  }
+
+  if ((dev->version >= I3C_V2_MIN_VERSION) && i3c_probe_v2(dev))
+    dev->proto = 2;
+
+  dev->preload = (dev->version >= I3C_PRELOAD_MIN_VERSION) &&
+                 i3c_probe_preload(dev);
+
+  syslog(LOG_INFO, "Device %s has firmware version %u, using protocol v%u%s.",
+                   dev->name, dev->version, dev->proto,
+                   dev->preload ? " and the preloaded status" : "");
+}
+
+bool i3c_has_status(struct i3c_device *dev) {
+  i3c_probe(dev);
+
+  return dev->probed && (dev->version != 0);
+}
+
+bool i3c_has_preload(struct i3c_device *dev) {
+  i3c_probe(dev);
+
+  return dev->preload;
+}
+
+int i3c_batch(struct i3c_device *dev, const uint8_t *requests,
+              uint8_t *values, int count) {
+  struct i2c_xfer xfers[I3C_BATCH_MAX];
+  uint8_t results[I3C_BATCH_MAX][2];
+
+  if ((count < 1) || (count > I3C_BATCH_MAX))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  dev->stats.commands += count;
+
+  if (!i3c_breaker_allows(dev))
+    return I3C_ERR_BREAKER;
+
+  int i;
+  for (i = 0; i < count; i++) {
+    xfers[i].addr = dev->addr;
+    xfers[i].wbuf = &requests[i];
+    xfers[i].wlen = 1;
+    xfers[i].rbuf = results[i];
+    xfers[i].rlen = 2;
+  }
+
+  i2c_transfer_batch(dev->bus, xfers, count);
+
+  // requests without a valid reply are retried one by one
+  int ret = I3C_OK;
+  for (i = 0; i < count; i++) {
+    if (!i3c_check_reply(dev, xfers[i].status, results[i], 2) &&
+        (i3c_retry(dev, &requests[i], 1, results[i], 2,
+                   i3c_check_reply, 1) != I3C_OK)) {
+      ret = I3C_ERR_NORESPONSE;
+      continue;
+    }
+
+    values[i] = results[i][0];
+  }
+
+  i3c_breaker_result(dev, ret == I3C_OK);
+
+  return ret;
+}
+
+void i3c_stats_log(struct i3c_device *dev) {
+  const struct i3c_stats *s = &dev->stats;
+
+  // attempts per command in 1/100, 100 means no retries at all
+  const unsigned per_command = s->commands ? s->attempts * 100ULL / s->commands : 0;
+
+  syslog(LOG_INFO, "Device %s: %u commands, %u attempts (%u.%02u per command), %u retries, %u give-ups.",
+                   dev->name, s->commands, s->attempts,
+                   per_command / 100, per_command % 100, s->retries, s->give_ups);
+  syslog(LOG_INFO, "Device %s: %u bus errors, %u zero replies, %u inversion errors, %u checksum errors.",
+                   dev->name, s->bus_errors, s->zero_replies, s->inversion_errors,
+                   s->checksum_errors);
+  if (dev->proto >= 2)
+    syslog(LOG_INFO, "Device %s: %u CRC errors, %u sequence errors, %u damaged requests, %u replays.",
+                     dev->name, s->crc_errors, s->sequence_errors,
+                     s->request_errors, s->replays);
+  syslog(LOG_INFO, "Device %s: breaker %s, %u trips, %u rejects, error rate %u%%.",
+                   dev->name, dev->breaker_until_us ? "open" : "closed",
+                   s->breaker_trips, s->breaker_rejects,
+                   (dev->error_rate * 100) >> 16);
+
+  struct i3c_status status;
+  if (i3c_has_status(dev) && (i3c_status(dev, false, &status) == I3C_OK))
+    syslog(LOG_INFO, "Device %s: firmware %u, INT %s, %u frames, %u errors, %u starts.",
+                     dev->name, status.version,
+                     (status.flags & I3C_STATUS_FLAG_INT) ? "pulled" : "released",
+                     status.frames, status.errors, status.starts);
+}
+
+static uint32_t get32(const uint8_t *buf) {
+  return get16(buf) | ((uint32_t)get16(buf + 2) << 16);
+}
+
+bool i3c_has_telemetry(struct i3c_device *dev) {
+  return i3c_has_status(dev) && (dev->proto == 2) &&
+         (dev->version >= I3C_TELEMETRY_MIN_VERSION);
+}
+
+int i3c_telemetry(struct i3c_device *dev, struct i3c_telemetry *tm) {
+  uint8_t block[I3C_TELEMETRY_LEN];
+
+  if (!i3c_has_telemetry(dev))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  // a retry gets the kept snapshot, the counters are cleared only once
+  const int ret = i3c_v2_command(dev, I3C_CMD_TELEMETRY, NULL, 0,
+                                 block, I3C_TELEMETRY_LEN);
+  if (ret != I3C_OK)
+    return ret;
+
+  tm->starts          = get32(block + I3C_TELEMETRY_STARTS);
+  tm->stops           = get32(block + I3C_TELEMETRY_STOPS);
+  tm->repeated_starts = get32(block + I3C_TELEMETRY_REPEATED);
+  tm->errors          = get32(block + I3C_TELEMETRY_ERRORS);
+  tm->overflows       = get32(block + I3C_TELEMETRY_OVERFLOWS);
+  tm->frames          = get32(block + I3C_TELEMETRY_FRAMES);
+
+  return I3C_OK;
+}
+
+///// Status lever /////
+
+int i3c_lever_events(struct i3c_lever *lever, uint8_t next,
+                     struct i3c_lever_events *events) {
+  struct i3c_device *dev = &lever->dev;
+  uint8_t block[LEVER_EVENTS_LEN];
+  int ret;
+
+  i3c_probe(dev);
+
+  if (dev->proto >= 2)
+    ret = i3c_v2_command(dev, LEVER_CMD_EVENTS, &next, 1,
+                         block, LEVER_EVENTS_LEN);
+  else
+    ret = i3c_exchange(dev, &i3c_request_table[LEVER_CMD_EVENTS][next & I3C_DATA_MAX], 1,
+                       block, LEVER_EVENTS_LEN, i3c_check_block);
+  if (ret != I3C_OK)
+    return ret;
+
+  if ((block[LEVER_EVENTS_LENGTH] != LEVER_EVENTS_LEN) ||
+      (block[LEVER_EVENTS_CHECKSUM] != i3c_checksum(block, LEVER_EVENTS_CHECKSUM)) ||
+      (block[LEVER_EVENTS_COUNT] > LEVER_EVENTS_MAX)) {
+    dev->stats.checksum_errors++;
+    return I3C_ERR_NORESPONSE;
+  }
+
+  const uint16_t tick = get16(block + LEVER_EVENTS_TICK);
+
+  events->first = block[LEVER_EVENTS_FIRST];
+  events->lost  = block[LEVER_EVENTS_LOST];
+  events->count = block[LEVER_EVENTS_COUNT];
+
+  int i;
+  for (i = 0; i < events->count; i++) {
+    const uint8_t *e = block + LEVER_EVENTS_DATA + i * LEVER_EVENT_SIZE;
+    events->events[i].state  = e[0];
+    // the tick wraps after about a minute, the age stays right until then
+    events->events[i].age_ms = (uint16_t)(tick - get16(e + 1)) * LEVER_TICK_MS;
+  }
+
+  return I3C_OK;
+}
+
+int i3c_command(struct i3c_device *dev, uint8_t cmd, uint8_t data,
+                uint8_t *value) {
+  // check parameter range
+  if ((cmd > I3C_CMD_MAX) || (data > I3C_DATA_MAX))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  i3c_probe(dev);
+
+  if (dev->proto >= 2)
+    return i3c_v2_command(dev, cmd, &data, 1, value, 1);
+
+  return i3c_transfer(dev, i3c_request_table[cmd][data], value);
+}
+
+///// Ampel /////
+
+int i3c_ampel_pattern_write(struct i3c_ampel *ampel, uint8_t slot,
+                            const uint8_t *code, size_t len) {
+  uint8_t payload[I3C_V2_PAYLOAD_MAX];
+  size_t offset;
+
+  if (!i3c_ampel_has_pattern(ampel) ||
+      (slot < 1) || (slot > AMPEL_PATTERN_SLOTS) ||
+      (len < 1) || (len > AMPEL_PATTERN_SIZE))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  for (offset = 0; offset < len; ) {
+    const uint8_t n = (len - offset < AMPEL_PATTERN_CHUNK) ? len - offset
+                                                           : AMPEL_PATTERN_CHUNK;
+    uint8_t taken = 0;
+    int tries;
+
+    payload[AMPEL_PATTERN_WRITE_SLOT]   = slot;
+    payload[AMPEL_PATTERN_WRITE_OFFSET] = offset;
+    memcpy(payload + AMPEL_PATTERN_WRITE_DATA, code + offset, n);
+
+    // the controller takes the next chunk once the last one is in EEPROM
+    for (tries = 0; !taken && (tries < I3C_PATTERN_WRITE_TRIES); tries++) {
+      const int ret = i3c_v2_command(&ampel->dev, AMPEL_CMD_PATTERN_WRITE,
+                                     payload, AMPEL_PATTERN_WRITE_DATA + n,
+                                     &taken, 1);
+      if (ret != I3C_OK)
+        return ret;
+      if (!taken)
+        usleep(AMPEL_PATTERN_CHUNK * AMPEL_PATTERN_WRITE_MS * 1000);
+    }
+    if (!taken)
+      return I3C_ERR_NORESPONSE;
+
+    offset += n;
+  }
+
+  return I3C_OK;
+}
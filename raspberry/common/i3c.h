@@ -0,0 +1,483 @@
+#ifndef _I3C_H_
+#define _I3C_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "i3c_protocol.h"
+#include "i2c_transport.h"
+
+/*
+ * Host side of the I³C protocol, shared by statusswitch and ledcontrol.
+ *
+ * Devices are accessed through typed handles, so a lever command cannot be
+ * sent to the Ampel by accident. Request bytes including their parity are
+ * constant expressions (I3C_REQUEST) or come from a precomputed table.
+ *
+ * The protocol version is negotiated with the first command: devices with
+ * v2 firmware get CRC-8 framed requests with sequence numbers, all others
+ * the v1 request byte.
+ */
+
+enum i3c_err {
+  I3C_OK                  =  0,
+  I3C_ERR_INVALIDARGUMENT = -2,	// command or data out of range
+  I3C_ERR_SETUP           = -3,	// the I2C bus could not be opened
+  I3C_ERR_NORESPONSE      = -4,	// no valid reply after all retries
+  I3C_ERR_BREAKER         = -5,	// device disabled by the circuit breaker
+};
+
+/**
+ * Retry policy: after a failed attempt the next one is delayed by a random
+ * time up to a backoff that doubles with each attempt ("full jitter"). The
+ * backoff is scaled up with the recent error rate of the device.
+ *
+ * After breaker_threshold consecutive give-ups the circuit breaker opens
+ * and commands fail fast for breaker_open_ms. Then a single probe command
+ * is let through; it closes the breaker on success.
+ */
+struct i3c_retry_policy {
+  uint8_t  max_attempts;
+  uint32_t backoff_us;		// backoff before the second retry
+  uint32_t backoff_max_us;
+  uint8_t  breaker_threshold;
+  uint32_t breaker_open_ms;
+};
+
+extern const struct i3c_retry_policy i3c_default_policy;
+
+/**
+ * Health counters per device
+ */
+struct i3c_stats {
+  uint32_t commands;		// commands issued
+  uint32_t attempts;		// transmissions on the bus
+  uint32_t retries;		// attempts after the first
+  uint32_t bus_errors;		// transport failed, e.g. no ACK
+  uint32_t zero_replies;	// device answered 0: parity error or not ready
+  uint32_t inversion_errors;	// 2nd reply byte not the inverted 1st
+  uint32_t checksum_errors;	// status block with bad length or checksum
+  uint32_t crc_errors;		// v2 reply with bad length or CRC
+  uint32_t sequence_errors;	// v2 reply to another request
+  uint32_t request_errors;	// v2 request damaged on the way
+  uint32_t replays;		// retried v2 command already applied
+  uint32_t give_ups;		// commands failed after all attempts
+  uint32_t breaker_trips;	// circuit breaker opened
+  uint32_t breaker_rejects;	// commands failed fast while open
+};
+
+/**
+ * Maximal number of requests in one batch
+ */
+#define I3C_BATCH_MAX		8
+
+/**
+ * Decoded GetStatus block, see i3c_protocol.h
+ */
+struct i3c_status {
+  uint8_t  version;		// firmware version
+  uint8_t  state;		// LEVER_STATE_* or GetLight reply
+  uint8_t  flags;		// I3C_STATUS_FLAG_*
+  uint16_t frames;		// TWI counters of the controller
+  uint16_t errors;
+  uint16_t starts;
+};
+
+/**
+ * Decoded Telemetry reply: the TWI counters of the controller since the
+ * last snapshot, see i3c_protocol.h
+ */
+struct i3c_telemetry {
+  uint32_t starts;
+  uint32_t stops;
+  uint32_t repeated_starts;
+  uint32_t errors;
+  uint32_t overflows;
+  uint32_t frames;
+};
+
+struct i3c_device {
+  struct i2c_transport *bus;
+  uint8_t     addr;
+  const char *name;
+
+  const struct i3c_retry_policy *policy;
+  struct i3c_stats stats;
+
+  bool     probed;		// GetStatus support is known
+  uint8_t  version;		// firmware version, 0 without GetStatus
+  uint8_t  proto;		// protocol version, 1 or 2
+  bool     preload;		// status block readable without a request
+  uint8_t  seq;			// last v2 sequence number
+
+  uint16_t error_rate;		// failed attempts, EWMA in 1/65536
+  uint8_t  failures;		// consecutive give-ups
+  uint64_t breaker_until_us;	// breaker open until, 0 if closed
+};
+
+struct i3c_lever {
+  struct i3c_device dev;
+};
+
+/**
+ * Lever transitions read from the controller FIFO
+ */
+struct i3c_lever_event {
+  uint8_t  state;		// LEVER_STATE_*
+  uint32_t age_ms;		// time since the transition
+};
+
+struct i3c_lever_events {
+  uint8_t first;		// sequence number of events[0]
+  uint8_t lost;			// lost events counter of the controller
+  uint8_t count;
+  struct i3c_lever_event events[LEVER_EVENTS_MAX];
+};
+
+struct i3c_ampel {
+  struct i3c_device dev;
+};
+
+/**
+ * Request bytes for all commands and data values, computed at compile time.
+ */
+extern const uint8_t i3c_request_table[I3C_CMD_MAX + 1][I3C_DATA_MAX + 1];
+
+/**
+ * @return A readable message for an i3c_err value
+ */
+const char *i3c_strerror(int err);
+
+/**
+ * Open the I2C bus given by spec, see i2c_transport_open.
+ *
+ * @return I3C_OK or I3C_ERR_SETUP
+ */
+int i3c_bus_open(struct i2c_transport *bus, const char *spec);
+
+/**
+ * Attach a device on the bus. The device uses the default retry policy.
+ *
+ * @param addr The target address.
+ * @param name Device name for log messages
+ * @return I3C_OK
+ */
+int i3c_open(struct i3c_device *dev, struct i2c_transport *bus,
+             uint8_t addr, const char *name);
+
+/**
+ * Send a request byte and read the checked reply value.
+ *
+ * @param request The complete request byte including parity
+ * @param value The reply value, only set on success
+ * @return I3C_OK, I3C_ERR_NORESPONSE or I3C_ERR_BREAKER
+ */
+int i3c_transfer(struct i3c_device *dev, uint8_t request, uint8_t *value);
+
+/**
+ * Send several request bytes in one batch and read the checked reply
+ * values. Requests without a valid reply are retried one by one.
+ *
+ * @param count Number of requests, at most I3C_BATCH_MAX
+ * @return I3C_OK or an error code
+ */
+int i3c_batch(struct i3c_device *dev, const uint8_t *requests,
+              uint8_t *values, int count);
+
+/**
+ * Find out the firmware version, GetStatus support and the protocol
+ * version. Nothing happens once the device has answered or while the
+ * circuit breaker is open.
+ */
+void i3c_probe(struct i3c_device *dev);
+
+/**
+ * Send a v2 command. Retries use the same sequence number, so the device
+ * runs the command at most once.
+ *
+ * @param payload Request payload, at most I3C_V2_PAYLOAD_MAX bytes
+ * @param reply The reply payload, only set on success
+ * @param len The expected reply payload length
+ * @return I3C_OK, I3C_ERR_INVALIDARGUMENT if the device rejected the
+ *         command, or another error code
+ */
+int i3c_v2_command(struct i3c_device *dev, uint8_t cmd,
+                   const uint8_t *payload, uint8_t plen,
+                   uint8_t *reply, uint8_t len);
+
+/**
+ * Read the status block of the device in one transaction.
+ *
+ * @param reset Reset the I³C state after the snapshot
+ * @return I3C_OK or an error code
+ */
+int i3c_status(struct i3c_device *dev, bool reset, struct i3c_status *status);
+
+/**
+ * Find out if the firmware supports GetStatus. Firmware without it answers
+ * with the error value 0. The result is kept once the device has answered.
+ *
+ * @return true if i3c_status can be used
+ */
+bool i3c_has_status(struct i3c_device *dev);
+
+/**
+ * Find out if the status block can be read without sending a request, see
+ * I3C_PRELOAD_MIN_VERSION. Needs a bus with plain I2C reads.
+ *
+ * @return true if i3c_status reads the preloaded block
+ */
+bool i3c_has_preload(struct i3c_device *dev);
+
+/**
+ * Write the health counters of the device to syslog. With GetStatus
+ * support the firmware version and the controller counters are read and
+ * logged as well.
+ */
+void i3c_stats_log(struct i3c_device *dev);
+
+/**
+ * @return true if the firmware has the Telemetry command
+ */
+bool i3c_has_telemetry(struct i3c_device *dev);
+
+/**
+ * Take the TWI counters of the controller, which clears them.
+ *
+ * @return I3C_OK or an error code
+ */
+int i3c_telemetry(struct i3c_device *dev, struct i3c_telemetry *tm);
+
+/**
+ * Send a command with data, in a v2 frame if the device supports it.
+ *
+ * @return I3C_OK or an error code
+ */
+int i3c_command(struct i3c_device *dev, uint8_t cmd, uint8_t data,
+                uint8_t *value);
+
+///// Status lever /////
+
+static inline int i3c_lever_open(struct i3c_lever *lever,
+                                 struct i2c_transport *bus) {
+  return i3c_open(&lever->dev, bus, I3C_ADDR_LEVER, "lever");
+}
+
+static inline int i3c_lever_reset(struct i3c_lever *lever) {
+  uint8_t value;
+  return i3c_command(&lever->dev, I3C_CMD_RESET, 0, &value);
+}
+
+/**
+ * @param state The lever state, see LEVER_STATE_*
+ */
+static inline int i3c_lever_getstate(struct i3c_lever *lever, uint8_t *state) {
+  if (i3c_has_preload(&lever->dev)) {
+    struct i3c_status status;
+    const int ret = i3c_status(&lever->dev, false, &status);
+    if (ret == I3C_OK)
+      *state = status.state;
+
+    return ret;
+  }
+
+  return i3c_command(&lever->dev, LEVER_CMD_GETSTATE, 0, state);
+}
+
+/**
+ * Reset and read the state in one transaction, or in one batch of two on
+ * firmware without GetStatus. The controller resets right after taking
+ * the snapshot, so a change after the read pulls the INT line again.
+ */
+static inline int i3c_lever_reset_getstate(struct i3c_lever *lever,
+                                           uint8_t *state) {
+  if (i3c_has_status(&lever->dev)) {
+    struct i3c_status status;
+    const int ret = i3c_status(&lever->dev, true, &status);
+    if (ret == I3C_OK)
+      *state = status.state;
+
+    return ret;
+  }
+
+  static const uint8_t requests[2] = {
+    I3C_REQUEST(I3C_CMD_RESET, 0),
+    I3C_REQUEST(LEVER_CMD_GETSTATE, 0)
+  };
+  uint8_t values[2];
+
+  const int ret = i3c_batch(&lever->dev, requests, values, 2);
+  if (ret == I3C_OK)
+    *state = values[1];
+
+  return ret;
+}
+
+/**
+ * Set the debounce time of the lever inputs.
+ *
+ * @param ms The debounce time in milliseconds, rounded up to a multiple of
+ *        LEVER_DEBOUNCE_SAMPLES ticks
+ * @return I3C_OK, I3C_ERR_INVALIDARGUMENT if out of range or not supported
+ *         by the firmware, or another error code
+ */
+static inline int i3c_lever_setdebounce(struct i3c_lever *lever,
+                                        unsigned int ms) {
+  const unsigned int period =
+    (ms / LEVER_TICK_MS + LEVER_DEBOUNCE_SAMPLES - 1) / LEVER_DEBOUNCE_SAMPLES;
+  uint8_t value;
+
+  if (!i3c_has_status(&lever->dev) ||
+      (lever->dev.version < LEVER_DEBOUNCE_MIN_VERSION) ||
+      (period < 1) || (period > I3C_DATA_MAX))
+    return I3C_ERR_INVALIDARGUMENT;
+
+  return i3c_command(&lever->dev, LEVER_CMD_DEBOUNCE, period, &value);
+}
+
+/**
+ * @return true if the lever firmware records transitions
+ */
+static inline bool i3c_lever_has_events(struct i3c_lever *lever) {
+  return i3c_has_status(&lever->dev) &&
+         (lever->dev.version >= LEVER_EVENTS_MIN_VERSION);
+}
+
+/**
+ * Read the next events from the transition FIFO. All events before next
+ * are acknowledged and removed; the command can be repeated safely. Read
+ * until there are no more events, this also releases the INT line.
+ *
+ * @param next Sequence number of the next wanted event, usually
+ *        first + count of the last read
+ * @return I3C_OK or an error code
+ */
+int i3c_lever_events(struct i3c_lever *lever, uint8_t next,
+                     struct i3c_lever_events *events);
+
+///// Ampel /////
+
+static inline int i3c_ampel_open(struct i3c_ampel *ampel,
+                                 struct i2c_transport *bus) {
+  return i3c_open(&ampel->dev, bus, I3C_ADDR_AMPEL, "ampel");
+}
+
+/**
+ * Attach an Ampel controller at another address, e.g. a second light.
+ */
+static inline int i3c_ampel_open_at(struct i3c_ampel *ampel,
+                                    struct i2c_transport *bus,
+                                    uint8_t addr, const char *name) {
+  return i3c_open(&ampel->dev, bus, addr, name);
+}
+
+static inline int i3c_ampel_reset(struct i3c_ampel *ampel) {
+  uint8_t value;
+  return i3c_command(&ampel->dev, I3C_CMD_RESET, 0, &value);
+}
+
+/**
+ * @param light The light value, see AMPEL_VAL_*
+ */
+static inline int i3c_ampel_setlight(struct i3c_ampel *ampel, uint8_t light) {
+  uint8_t value;
+  return i3c_command(&ampel->dev, AMPEL_CMD_SETLIGHT, light, &value);
+}
+
+/**
+ * @param light The GetLight reply, see AMPEL_LIGHT_*
+ */
+static inline int i3c_ampel_getlight(struct i3c_ampel *ampel, uint8_t *light) {
+  if (i3c_has_preload(&ampel->dev)) {
+    struct i3c_status status;
+    const int ret = i3c_status(&ampel->dev, false, &status);
+    if (ret == I3C_OK)
+      *light = status.state;
+
+    return ret;
+  }
+
+  return i3c_command(&ampel->dev, AMPEL_CMD_GETLIGHT, 0, light);
+}
+
+/**
+ * @return true if the Ampel firmware has the PWM light engine
+ */
+static inline bool i3c_ampel_has_fade(struct i3c_ampel *ampel) {
+  return i3c_has_status(&ampel->dev) && (ampel->dev.proto == 2) &&
+         (ampel->dev.version >= AMPEL_LIGHT_MIN_VERSION);
+}
+
+/**
+ * Fade to a new light in one command.
+ *
+ * @param light The light value, see AMPEL_VAL_*
+ * @param brightness 0..255, gamma-corrected by the firmware
+ * @param ms The fade time
+ */
+static inline int i3c_ampel_fade(struct i3c_ampel *ampel, uint8_t light,
+                                 uint8_t brightness, uint16_t ms) {
+  const uint8_t payload[AMPEL_FADE_LEN] = {
+    [AMPEL_FADE_LIGHT]    = light,
+    [AMPEL_FADE_LEVEL]    = brightness,
+    [AMPEL_FADE_TIME]     = ms & 0xff,
+    [AMPEL_FADE_TIME + 1] = ms >> 8,
+  };
+  uint8_t value;
+
+  return i3c_v2_command(&ampel->dev, AMPEL_CMD_FADE,
+                        payload, sizeof(payload), &value, 1);
+}
+
+/**
+ * @param period_ms The blink period, at least 2 ms
+ * @param duty The on time in 1/256 of the period, at least 1
+ */
+static inline int i3c_ampel_blink(struct i3c_ampel *ampel,
+                                  uint16_t period_ms, uint8_t duty) {
+  const uint8_t payload[AMPEL_BLINK_LEN] = {
+    [AMPEL_BLINK_PERIOD]     = period_ms & 0xff,
+    [AMPEL_BLINK_PERIOD + 1] = period_ms >> 8,
+    [AMPEL_BLINK_DUTY]       = duty,
+  };
+  uint8_t value;
+
+  return i3c_v2_command(&ampel->dev, AMPEL_CMD_BLINK,
+                        payload, sizeof(payload), &value, 1);
+}
+
+/**
+ * @return true if the Ampel firmware runs patterns from EEPROM
+ */
+static inline bool i3c_ampel_has_pattern(struct i3c_ampel *ampel) {
+  return i3c_has_status(&ampel->dev) && (ampel->dev.proto == 2) &&
+         (ampel->dev.version >= AMPEL_PATTERN_MIN_VERSION);
+}
+
+/**
+ * Start a pattern from the controller EEPROM.
+ *
+ * @param slot 1..AMPEL_PATTERN_SLOTS, 0 stops the running pattern
+ */
+static inline int i3c_ampel_pattern(struct i3c_ampel *ampel, uint8_t slot) {
+  uint8_t value;
+  return i3c_command(&ampel->dev, AMPEL_CMD_PATTERN, slot, &value);
+}
+
+#define I3C_PATTERN_WRITE_TRIES	5
+
+/**
+ * Write pattern bytecode to the controller EEPROM, in chunks that fit a
+ * v2 frame. Blocks while the controller writes the EEPROM, about
+ * AMPEL_PATTERN_WRITE_MS per byte.
+ *
+ * @param slot 1..AMPEL_PATTERN_SLOTS
+ * @param code The bytecode, see AMPEL_OP_*, at most AMPEL_PATTERN_SIZE bytes
+ * @return I3C_OK, I3C_ERR_INVALIDARGUMENT if out of range or not supported
+ *         by the firmware, or another error code
+ */
+int i3c_ampel_pattern_write(struct i3c_ampel *ampel, uint8_t slot,
+                            const uint8_t *code, size_t len);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * Transaction benchmark for the I3C library, see "make bench". Runs the
+ * lever and Ampel calls of the daemons through i2c_transport, i.e. the
+ * framing, checks and retry policy of i3c.c plus the transport, and
+ * reports calls and bus transactions per second for each.
+ *
+ * The bus is given like to the daemons: "fake" for the built-in device
+ * models, unix:<socket> for the emulator running the real firmware (or
+ * the arbiter in front of it), or a bus number.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "i3c.h"
+#include "latency.h"
+
+#define ROUNDS		2000
+
+struct i2c_transport bus;
+struct i3c_lever lever;
+struct i3c_ampel ampel;
+
+unsigned int round_no;
+
+static int lever_getstate(void) {
+  uint8_t state;
+  return i3c_lever_getstate(&lever, &state);
+}
+
+static int lever_reset_getstate(void) {
+  uint8_t state;
+  return i3c_lever_reset_getstate(&lever, &state);
+}
+
+static int lever_events(void) {
+  struct i3c_lever_events ev;
+  return i3c_lever_events(&lever, 0, &ev);
+}
+
+static int ampel_setlight(void) {
+  return i3c_ampel_setlight(&ampel, (round_no & 1) ? AMPEL_VAL_RED : AMPEL_VAL_GREEN);
+}
+
+static int ampel_getlight(void) {
+  uint8_t light;
+  return i3c_ampel_getlight(&ampel, &light);
+}
+
+static int ampel_fade(void) {
+  return i3c_ampel_fade(&ampel, (round_no & 1) ? AMPEL_VAL_RED : AMPEL_VAL_GREEN,
+                        255, 0);
+}
+
+static bool lever_has_events(void) {
+  return i3c_lever_has_events(&lever);
+}
+
+static bool ampel_has_fade(void) {
+  return i3c_ampel_has_fade(&ampel);
+}
+
+struct bench_op {
+  const char *name;
+  int  (*call)(void);
+  bool (*supported)(void);	// NULL if every firmware has it
+  struct i3c_device *dev;
+};
+
+static struct bench_op ops[] = {
+  { "lever getstate",       lever_getstate,       NULL,             &lever.dev },
+  { "lever reset+getstate", lever_reset_getstate, NULL,             &lever.dev },
+  { "lever events",         lever_events,         lever_has_events, &lever.dev },
+  { "ampel setlight",       ampel_setlight,       NULL,             &ampel.dev },
+  { "ampel getlight",       ampel_getlight,       NULL,             &ampel.dev },
+  { "ampel fade",           ampel_fade,           ampel_has_fade,   &ampel.dev },
+};
+
+/**
+ * @return Number of failed calls
+ */
+static unsigned int bench_bus(const char *spec, unsigned int rounds) {
+  unsigned int failed_total = 0;
+  unsigned int i;
+
+  if (i3c_bus_open(&bus, spec) != I3C_OK)
+    return 1;
+  i3c_lever_open(&lever, &bus);
+  i3c_ampel_open(&ampel, &bus);
+  i3c_probe(&lever.dev);
+  i3c_probe(&ampel.dev);
+
+  printf("bus %s: lever firmware %u v%u, Ampel firmware %u v%u\n", spec,
+         lever.dev.version, lever.dev.proto, ampel.dev.version, ampel.dev.proto);
+  printf("  %-22s %9s %9s %8s %8s %8s %6s\n", "call", "calls/s", "xfers/s",
+         "avg us", "p99 us", "max us", "failed");
+
+  for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    const struct bench_op *op = &ops[i];
+    struct latency_hist h;
+    unsigned int failed = 0;
+
+    if (op->supported && !op->supported()) {
+      printf("  %-22s not supported by the firmware\n", op->name);
+      continue;
+    }
+
+    latency_reset(&h);
+    const uint32_t attempts = op->dev->stats.attempts;
+    const uint64_t start = latency_now_us();
+
+    for (round_no = 0; round_no < rounds; round_no++) {
+      const uint64_t t = latency_now_us();
+      if (op->call() != I3C_OK)
+        failed++;
+      latency_record(&h, latency_now_us() - t);
+    }
+
+    const double s = (latency_now_us() - start) / 1e6;
+    printf("  %-22s %9.0f %9.0f %8.1f %8llu %8llu %6u\n", op->name,
+           rounds / s, (op->dev->stats.attempts - attempts) / s,
+           (double)h.sum_us / h.count,
+           (unsigned long long)latency_quantile(&h, 0.99),
+           (unsigned long long)h.max_us, failed);
+    failed_total += failed;
+  }
+
+  i2c_transport_close(&bus);
+  return failed_total;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int rounds = ROUNDS;
+  unsigned int failed = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "r:h")) != -1) {
+    switch (opt) {
+      case 'r': rounds = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-r rounds] [bus]...\n"
+                        "  bus: \"fake\" (default), unix:<socket> or a bus number\n",
+                argv[0]);
+        return (opt == 'h') ? 0 : 2;
+    }
+  }
+
+  // the library reports give-ups to syslog, show them
+  openlog("i3c_bench", LOG_PERROR, LOG_USER);
+
+  if (optind == argc)
+    failed = bench_bus("fake", rounds);
+  for (; optind < argc; optind++)
+    failed += bench_bus(argv[optind], rounds);
+
+  closelog();
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "i3c_protocol.h"
+#include "i3c_fake.h"
+
+struct i3c_fake_bus *i3c_fake_bus(void) {
+  static struct i3c_fake_bus bus = {
+    .lever_state = LEVER_STATE_UNKNOWN,
+    .version     = I3C_TELEMETRY_MIN_VERSION,
+  };
+
+  return &bus;
+}
+
+static uint8_t fake_lever(struct i3c_fake_bus *bus, uint8_t cmd, uint8_t data) {
+  switch (cmd) {
+    case I3C_CMD_RESET:
+      return 1;
+    case LEVER_CMD_GETSTATE:
+      return bus->lever_state;
+    case LEVER_CMD_SETSTATE:
+      if (data >= 1 && data <= 3) {
+        bus->lever_state = data;
+        return 1;
+      }
+      break;
+    case LEVER_CMD_DEBOUNCE:
+      // the fake lever does not bounce
+      if (data && (bus->version >= LEVER_DEBOUNCE_MIN_VERSION))
+        return 1;
+      break;
+  }
+
+  return 0;
+}
+
+/**
+ * The controller tick, milliseconds
+ */
+static uint16_t fake_tick(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void i3c_fake_lever_flip(struct i3c_fake_bus *bus, uint8_t state) {
+  if (state == bus->lever_state)
+    return;
+
+  bus->lever_state = state;
+
+  if (bus->events_count == I3C_FAKE_EVENTS) {
+    bus->events_lost++;
+    return;
+  }
+
+  struct i3c_fake_event *e =
+    &bus->events[(bus->events_first + bus->events_count) % I3C_FAKE_EVENTS];
+  e->state = state;
+  e->tick  = fake_tick();
+  bus->events_count++;
+}
+
+static uint8_t fake_events(struct i3c_fake_bus *bus, uint8_t next, uint8_t mask,
+                           volatile uint8_t *block) {
+  const uint8_t acked = (next - bus->events_first) & mask;
+  if (acked <= bus->events_count) {
+    bus->events_first += acked;
+    bus->events_count -= acked;
+  }
+
+  const uint8_t n = (bus->events_count < LEVER_EVENTS_MAX) ? bus->events_count
+                                                           : LEVER_EVENTS_MAX;
+  const uint16_t tick = fake_tick();
+
+  memset((uint8_t *)block, 0, LEVER_EVENTS_LEN);
+  block[LEVER_EVENTS_LENGTH]   = LEVER_EVENTS_LEN;
+  block[LEVER_EVENTS_FIRST]    = bus->events_first;
+  block[LEVER_EVENTS_LOST]     = bus->events_lost;
+  block[LEVER_EVENTS_TICK]     = tick & 0xff;
+  block[LEVER_EVENTS_TICK + 1] = tick >> 8;
+  block[LEVER_EVENTS_COUNT]    = n;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    const struct i3c_fake_event *e =
+      &bus->events[(uint8_t)(bus->events_first + i) % I3C_FAKE_EVENTS];
+    volatile uint8_t *p = block + LEVER_EVENTS_DATA + i * LEVER_EVENT_SIZE;
+    p[0] = e->state;
+    p[1] = e->tick & 0xff;
+    p[2] = e->tick >> 8;
+  }
+
+  block[LEVER_EVENTS_CHECKSUM] = i3c_checksum(block, LEVER_EVENTS_CHECKSUM);
+
+  return LEVER_EVENTS_LEN;
+}
+
+static bool fake_is_ampel(uint8_t addr) {
+  return (addr >= I3C_ADDR_AMPEL) && (addr < I3C_ADDR_AMPEL + I3C_FAKE_AMPELS) &&
+         (addr != I3C_ADDR_LEVER);
+}
+
+static uint8_t fake_ampel_light(struct i3c_fake_bus *bus, uint8_t addr) {
+  const uint8_t light = bus->ampel_light[addr - I3C_ADDR_AMPEL];
+
+  return AMPEL_LIGHT_VALID +
+         ((light & AMPEL_VAL_BLINK) ? AMPEL_LIGHT_BLINK : 0) +
+         (light & AMPEL_VAL_COLOR);
+}
+
+static uint8_t fake_ampel(struct i3c_fake_bus *bus, uint8_t addr,
+                          uint8_t cmd, uint8_t data) {
+  switch (cmd) {
+    case I3C_CMD_RESET:
+      return 1;
+    case AMPEL_CMD_GETLIGHT:
+      return fake_ampel_light(bus, addr);
+    case AMPEL_CMD_SETLIGHT:
+      bus->ampel_light[addr - I3C_ADDR_AMPEL] = data;
+      return 1;
+    case AMPEL_CMD_PATTERN:
+      // patterns are not played, the light stays
+      if ((bus->version >= AMPEL_PATTERN_MIN_VERSION) &&
+          (data <= AMPEL_PATTERN_SLOTS))
+        return 1;
+      break;
+  }
+
+  return 0;
+}
+
+/**
+ * Fill the GetStatus block. There is no INT line and no bus to count
+ * errors on.
+ *
+ * @return The block length
+ */
+static uint8_t fake_status(struct i3c_fake_bus *bus, uint8_t addr,
+                           volatile uint8_t *block) {
+  block[I3C_STATUS_LENGTH]  = I3C_STATUS_LEN;
+  block[I3C_STATUS_VERSION] = bus->version;
+  block[I3C_STATUS_STATE]   = (addr == I3C_ADDR_LEVER) ? bus->lever_state
+                                                       : fake_ampel_light(bus, addr);
+  block[I3C_STATUS_FLAGS]   = 0;
+  // every frame is a start condition on the fake bus
+  block[I3C_STATUS_FRAMES]     = block[I3C_STATUS_STARTS]     = bus->frames & 0xff;
+  block[I3C_STATUS_FRAMES + 1] = block[I3C_STATUS_STARTS + 1] = bus->frames >> 8;
+  block[I3C_STATUS_ERRORS]     = block[I3C_STATUS_ERRORS + 1] = 0;
+  block[I3C_STATUS_CHECKSUM] = i3c_checksum(block, I3C_STATUS_CHECKSUM);
+
+  return I3C_STATUS_LEN;
+}
+
+static void fake_put32(volatile uint8_t *p, uint32_t val) {
+  p[0] = val & 0xff;
+  p[1] = (val >> 8) & 0xff;
+  p[2] = (val >> 16) & 0xff;
+  p[3] = val >> 24;
+}
+
+/**
+ * Fill the Telemetry reply. Every frame has its own start and stop, there
+ * are no errors on the fake bus.
+ *
+ * @return The reply length
+ */
+static uint8_t fake_telemetry(struct i3c_fake_bus *bus, volatile uint8_t *reply) {
+  const uint16_t frames = bus->frames - bus->frames_taken;
+  bus->frames_taken = bus->frames;
+
+  memset((uint8_t *)reply, 0, I3C_TELEMETRY_LEN);
+  fake_put32(reply + I3C_TELEMETRY_STARTS, frames);
+  fake_put32(reply + I3C_TELEMETRY_STOPS,  frames);
+  // an address byte, a request byte and their ACK bits
+  fake_put32(reply + I3C_TELEMETRY_OVERFLOWS, 4 * (uint32_t)frames);
+  fake_put32(reply + I3C_TELEMETRY_FRAMES, frames);
+
+  return I3C_TELEMETRY_LEN;
+}
+
+static uint8_t fake_command(struct i3c_fake_bus *bus, uint8_t addr,
+                            uint8_t cmd, uint8_t data) {
+  return (addr == I3C_ADDR_LEVER) ? fake_lever(bus, cmd, data)
+                                  : fake_ampel(bus, addr, cmd, data);
+}
+
+///// Protocol v2 /////
+
+/*
+ * The v2 handlers have no argument, they work on the process-wide bus.
+ */
+static uint8_t fake_v2(uint8_t addr, uint8_t cmd,
+                       const volatile uint8_t *payload, uint8_t plen,
+                       volatile uint8_t *reply, uint8_t *len) {
+  struct i3c_fake_bus *bus = i3c_fake_bus();
+  const uint8_t data = plen ? payload[0] : 0;
+
+  if (cmd == I3C_CMD_GETSTATUS) {
+    *len = fake_status(bus, addr, reply);
+    return I3C_V2_OK;
+  }
+
+  if ((cmd == LEVER_CMD_EVENTS) && (addr == I3C_ADDR_LEVER) &&
+      (bus->version >= LEVER_EVENTS_MIN_VERSION)) {
+    *len = fake_events(bus, data, 0xff, reply);
+    return I3C_V2_OK;
+  }
+
+  if ((cmd == I3C_CMD_TELEMETRY) && (bus->version >= I3C_TELEMETRY_MIN_VERSION)) {
+    *len = fake_telemetry(bus, reply);
+    return I3C_V2_OK;
+  }
+
+  if ((cmd == LEVER_CMD_DEBOUNCE) && (addr == I3C_ADDR_LEVER) &&
+      (bus->version >= LEVER_DEBOUNCE_MIN_VERSION)) {
+    reply[0] = fake_lever(bus, cmd, data);
+    *len = 1;
+    return reply[0] ? I3C_V2_OK : I3C_V2_ERR_ARG;
+  }
+
+  if (fake_is_ampel(addr) && (bus->version >= AMPEL_LIGHT_MIN_VERSION)) {
+    if ((cmd == AMPEL_CMD_FADE) && (plen >= AMPEL_FADE_LEN)) {
+      bus->ampel_light[addr - I3C_ADDR_AMPEL] = payload[AMPEL_FADE_LIGHT];
+      reply[0] = 1;
+      *len = 1;
+      return I3C_V2_OK;
+    }
+    if ((cmd == AMPEL_CMD_BLINK) && (plen >= AMPEL_BLINK_LEN)) {
+      reply[0] = 1;
+      *len = 1;
+      return I3C_V2_OK;
+    }
+    if ((cmd == AMPEL_CMD_FADE) || (cmd == AMPEL_CMD_BLINK))
+      return I3C_V2_ERR_ARG;
+  }
+
+  if ((cmd == AMPEL_CMD_PATTERN_WRITE) && fake_is_ampel(addr) &&
+      (bus->version >= AMPEL_PATTERN_MIN_VERSION)) {
+    if (plen <= AMPEL_PATTERN_WRITE_DATA)
+      return I3C_V2_ERR_ARG;
+    // the fake EEPROM is written at once
+    reply[0] = 1;
+    *len = 1;
+    return I3C_V2_OK;
+  }
+
+  if ((cmd > I3C_CMD_GETSTATUS) &&
+      ((cmd != AMPEL_CMD_PATTERN) || !fake_is_ampel(addr)))
+    return I3C_V2_ERR_CMD;
+
+  reply[0] = fake_command(bus, addr, cmd, data);
+  *len = 1;
+  return reply[0] ? I3C_V2_OK : I3C_V2_ERR_ARG;
+}
+
+static uint8_t fake_v2_lever(uint8_t cmd,
+                             const volatile uint8_t *payload, uint8_t plen,
+                             volatile uint8_t *reply, uint8_t *len) {
+  return fake_v2(I3C_ADDR_LEVER, cmd, payload, plen, reply, len);
+}
+
+// the Ampel addressed by the current request
+static uint8_t fake_v2_addr;
+
+static uint8_t fake_v2_ampel(uint8_t cmd,
+                             const volatile uint8_t *payload, uint8_t plen,
+                             volatile uint8_t *reply, uint8_t *len) {
+  return fake_v2(fake_v2_addr, cmd, payload, plen, reply, len);
+}
+
+int i3c_fake_handler(void *arg, uint8_t addr,
+                     const uint8_t *wbuf, uint8_t wlen,
+                     uint8_t *rbuf, uint8_t rlen) {
+  static struct i3c_v2_state lever_v2, ampel_v2[I3C_FAKE_AMPELS];
+  struct i3c_fake_bus *bus = arg;
+  uint8_t out[I3C_V2_REPLY_MAX];
+  uint8_t out_len = 2;
+
+  if ((addr != I3C_ADDR_LEVER) && !fake_is_ampel(addr))
+    // no ACK on the address
+    return -ENXIO;
+
+  if (!wlen) {
+    // a plain read gets the preloaded status, it is not a frame
+    if (bus->version < I3C_PRELOAD_MIN_VERSION)
+      return 0;
+
+    out_len = fake_status(bus, addr, out);
+    const uint8_t len = (rlen < out_len) ? rlen : out_len;
+    memcpy(rbuf, out, len);
+
+    return len;
+  }
+
+  // the error reply for a parity error
+  out[0] = 0;
+  out[1] = 0xff;
+
+  if (I3C_REQUEST_VALID(wbuf[0])) {
+    const uint8_t cmd  = I3C_REQUEST_CMD(wbuf[0]);
+    const uint8_t data = I3C_REQUEST_DATA(wbuf[0]);
+
+    bus->frames++;
+
+    if ((cmd == I3C_CMD_V2) && (bus->version >= I3C_V2_MIN_VERSION)) {
+      const int lever = (addr == I3C_ADDR_LEVER);
+      fake_v2_addr = addr;
+      out_len = i3c_v2_request(lever ? &lever_v2 : &ampel_v2[addr - I3C_ADDR_AMPEL],
+                               lever ? fake_v2_lever : fake_v2_ampel,
+                               wlen, wbuf, out);
+    } else if ((cmd == I3C_CMD_GETSTATUS) && bus->version)
+      out_len = fake_status(bus, addr, out);
+    else if ((cmd == LEVER_CMD_EVENTS) && (addr == I3C_ADDR_LEVER) &&
+             (bus->version >= LEVER_EVENTS_MIN_VERSION))
+      out_len = fake_events(bus, data, I3C_DATA_MAX, out);
+    else {
+      out[0] = fake_command(bus, addr, cmd, data);
+      out[1] = ~out[0];
+    }
+  }
+
+  const uint8_t len = (rlen < out_len) ? rlen : out_len;
+  memcpy(rbuf, out, len);
+
+  return len;
+}
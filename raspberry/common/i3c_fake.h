@@ -0,0 +1,55 @@
+#ifndef _I3C_FAKE_H_
+#define _I3C_FAKE_H_
+
+#include <stdint.h>
+
+/*
+ * Minimal in-process models of the lever and Ampel controllers, answering
+ * like their firmwares do. Used with the fake I2C transport to run the
+ * daemons on any Linux box.
+ */
+
+#define I3C_FAKE_EVENTS	8
+
+/**
+ * Ampel controllers answer from I3C_ADDR_AMPEL on, skipping the lever
+ */
+#define I3C_FAKE_AMPELS	64
+
+struct i3c_fake_event {
+  uint8_t  state;
+  uint16_t tick;
+};
+
+struct i3c_fake_bus {
+  uint8_t lever_state;	// LEVER_STATE_*
+  uint8_t ampel_light[I3C_FAKE_AMPELS];	// SetLight data by address
+  uint8_t version;	// firmware version, 0 without GetStatus, 1 without v2
+  uint16_t frames;	// requests answered
+  uint16_t frames_taken;	// frames at the last Telemetry command
+
+  // lever transition FIFO
+  struct i3c_fake_event events[I3C_FAKE_EVENTS];
+  uint8_t events_first;
+  uint8_t events_count;
+  uint8_t events_lost;
+};
+
+/**
+ * @return The process-wide fake bus
+ */
+struct i3c_fake_bus *i3c_fake_bus(void);
+
+/**
+ * Move the lever like a user would: record the transition in the FIFO.
+ */
+void i3c_fake_lever_flip(struct i3c_fake_bus *bus, uint8_t state);
+
+/**
+ * Transfer handler for i2c_transport_open_fake, arg is the fake bus.
+ */
+int i3c_fake_handler(void *arg, uint8_t addr,
+                     const uint8_t *wbuf, uint8_t wlen,
+                     uint8_t *rbuf, uint8_t rlen);
+
+#endif
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+
+#include "latency.h"
+
+uint64_t latency_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void latency_reset(struct latency_hist *h) {
+  memset(h, 0, sizeof(*h));
+}
+
+void latency_record(struct latency_hist *h, uint64_t us) {
+  int b = 0;
+  while (us >> b && b < LATENCY_BUCKETS - 1)
+    b++;
+
+  h->buckets[b]++;
+  h->count++;
+  h->sum_us += us;
+  if (us > h->max_us)
+    h->max_us = us;
+}
+
+uint64_t latency_quantile(const struct latency_hist *h, double q) {
+  const uint32_t rank = q * h->count;
+  uint32_t seen = 0;
+
+  int b;
+  for (b = 0; b < LATENCY_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank)
+      return (b == LATENCY_BUCKETS - 1) ? h->max_us : (1ULL << b);
+  }
+
+  return h->max_us;
+}
+
+void latency_log(const struct latency_hist *h, const char *name) {
+  if (!h->count) {
+    syslog(LOG_INFO, "%s: no samples.", name);
+    return;
+  }
+
+  syslog(LOG_INFO, "%s: %u samples, avg %llu us, p50 < %llu us, p99 < %llu us, max %llu us.",
+                   name, h->count,
+                   (unsigned long long)(h->sum_us / h->count),
+                   (unsigned long long)latency_quantile(h, 0.5),
+                   (unsigned long long)latency_quantile(h, 0.99),
+                   (unsigned long long)h->max_us);
+
+  int b;
+  for (b = 0; b < LATENCY_BUCKETS - 1; b++)
+    if (h->buckets[b])
+      syslog(LOG_INFO, "%s:  < %8llu us: %u", name,
+                       (unsigned long long)(1ULL << b), h->buckets[b]);
+  if (h->buckets[b])
+    syslog(LOG_INFO, "%s: >= %8llu us: %u", name,
+                     (unsigned long long)(1ULL << (b - 1)), h->buckets[b]);
+}
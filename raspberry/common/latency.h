@@ -0,0 +1,42 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+
+/*
+ * Latency histogram with power-of-two buckets in microseconds.
+ * Bucket i counts samples in [2^(i-1), 2^i) us, bucket 0 counts < 1 us,
+ * the last bucket collects everything above.
+ */
+
+#define LATENCY_BUCKETS	24
+
+struct latency_hist {
+  uint32_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+};
+
+/**
+ * @return Microseconds on the monotonic clock
+ */
+uint64_t latency_now_us(void);
+
+void latency_reset(struct latency_hist *h);
+void latency_record(struct latency_hist *h, uint64_t us);
+
+/**
+ * @param q Quantile between 0 and 1
+ * @return Upper bound of the bucket containing the quantile
+ */
+uint64_t latency_quantile(const struct latency_hist *h, double q);
+
+/**
+ * Write the histogram to syslog.
+ *
+ * @param name Name of the measured value
+ */
+void latency_log(const struct latency_hist *h, const char *name);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <syslog.h>
+
+#include <mosquitto.h>
+
+#include "mqtt_evloop.h"
+#include "latency.h"
+
+static void mqtt_evloop_reconnect(struct mqtt_evloop *m, int ret) {
+  syslog(LOG_ERR, "MQTT error %d (%s), reconnect.",
+                  ret, mosquitto_strerror(ret));
+
+  if (m->fd >= 0) {
+    evloop_del(m->loop, m->fd);
+    m->fd = -1;
+  }
+
+  mosquitto_reconnect(m->mosq);
+  mqtt_evloop_update(m);
+}
+
+static void mqtt_evloop_socket_cb(struct evloop *loop, int fd,
+                                  uint32_t events, void *arg) {
+  struct mqtt_evloop *m = arg;
+  int ret = MOSQ_ERR_SUCCESS;
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+    // message callbacks may use this to measure their latency
+    m->wakeup_us = latency_now_us();
+    ret = mosquitto_loop_read(m->mosq, 1);
+  }
+  if ((ret == MOSQ_ERR_SUCCESS) && (events & EPOLLOUT))
+    ret = mosquitto_loop_write(m->mosq, 1);
+
+  if (ret != MOSQ_ERR_SUCCESS)
+    mqtt_evloop_reconnect(m, ret);
+}
+
+static void mqtt_evloop_timer_cb(struct evloop *loop, int fd,
+                                 uint32_t events, void *arg) {
+  struct mqtt_evloop *m = arg;
+
+  const int ret = mosquitto_loop_misc(m->mosq);
+  if ((ret != MOSQ_ERR_SUCCESS) || (mosquitto_socket(m->mosq) < 0))
+    mqtt_evloop_reconnect(m, ret);
+}
+
+static void mqtt_evloop_prepare_cb(struct evloop *loop, void *arg) {
+  mqtt_evloop_update(arg);
+}
+
+void mqtt_evloop_update(struct mqtt_evloop *m) {
+  const int fd = mosquitto_socket(m->mosq);
+
+  // the socket changes on reconnect
+  if (fd != m->fd) {
+    if (m->fd >= 0)
+      evloop_del(m->loop, m->fd);
+    m->fd = -1;
+
+    if ((fd >= 0) &&
+        (evloop_add(m->loop, fd, EPOLLIN, mqtt_evloop_socket_cb, m) == 0))
+      m->fd = fd;
+  }
+
+  if (m->fd >= 0)
+    evloop_mod(m->loop, m->fd,
+               EPOLLIN | (mosquitto_want_write(m->mosq) ? EPOLLOUT : 0));
+}
+
+int mqtt_evloop_attach(struct mqtt_evloop *m, struct evloop *loop,
+                       struct mosquitto *mosq, unsigned int misc_ms) {
+  m->loop = loop;
+  m->mosq = mosq;
+  m->fd = -1;
+  m->wakeup_us = 0;
+
+  const int ret = evloop_add_timer(loop, misc_ms, mqtt_evloop_timer_cb, m);
+  if (ret < 0)
+    return ret;
+
+  evloop_set_prepare(loop, mqtt_evloop_prepare_cb, m);
+  mqtt_evloop_update(m);
+
+  return 0;
+}
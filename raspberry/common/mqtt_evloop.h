@@ -0,0 +1,39 @@
+#ifndef _MQTT_EVLOOP_H_
+#define _MQTT_EVLOOP_H_
+
+#include <stdint.h>
+
+#include <mosquitto.h>
+
+#include "evloop.h"
+
+/*
+ * Drive a mosquitto session from the event loop: the socket is read as soon
+ * as bytes arrive, written only while mosquitto wants to write, and a timer
+ * takes care of keep-alive and reconnects.
+ */
+
+struct mqtt_evloop {
+  struct evloop    *loop;
+  struct mosquitto *mosq;
+  int               fd;		// socket currently registered, -1 if none
+  uint64_t          wakeup_us;	// time the socket became readable
+};
+
+/**
+ * Attach the mosquitto session to the event loop.
+ *
+ * @param misc_ms Period for keep-alive handling and reconnect attempts
+ * @return 0 on success, -errno on failure
+ */
+int mqtt_evloop_attach(struct mqtt_evloop *m, struct evloop *loop,
+                       struct mosquitto *mosq, unsigned int misc_ms);
+
+/**
+ * Update the registration after the socket may have changed or
+ * mosquitto wants to write, e.g. after a publish. This is also done
+ * automatically before the loop sleeps.
+ */
+void mqtt_evloop_update(struct mqtt_evloop *m);
+
+#endif
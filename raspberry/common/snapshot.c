@@ -0,0 +1,139 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+
+/*
+ * One copy in the file: the header, then the payload padded to 8 bytes.
+ */
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t size;
+  uint32_t seq;			// 0 marks an unused copy
+  uint32_t checksum;		// FNV-1a over size, seq and payload
+};
+
+static size_t copy_size(size_t size) {
+  return sizeof(struct snapshot_header) + ((size + 7) & ~(size_t)7);
+}
+
+static struct snapshot_header *copy_at(const struct snapshot *s, unsigned int i) {
+  return (struct snapshot_header *)(s->map + i * copy_size(s->size));
+}
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len) {
+  const uint8_t *p = data;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t checksum(const struct snapshot_header *hdr, const void *payload) {
+  uint32_t h = 2166136261u;
+
+  h = fnv1a(h, &hdr->size, sizeof(hdr->size));
+  h = fnv1a(h, &hdr->seq, sizeof(hdr->seq));
+  return fnv1a(h, payload, hdr->size);
+}
+
+static bool copy_valid(const struct snapshot *s, unsigned int i) {
+  const struct snapshot_header *hdr = copy_at(s, i);
+
+  return hdr->magic == s->magic && hdr->size == s->size && hdr->seq &&
+         hdr->checksum == checksum(hdr, hdr + 1);
+}
+
+int snapshot_open(struct snapshot *s, const char *path, uint32_t magic, size_t size) {
+  struct stat st;
+
+  memset(s, 0, sizeof(*s));
+  s->fd       = -1;
+  s->magic    = magic;
+  s->size     = size;
+  s->map_size = 2 * copy_size(size);
+  s->current  = 2;
+
+  s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (s->fd < 0)
+    return -errno;
+
+  // a file left by another layout starts over
+  if (fstat(s->fd, &st) < 0 || (size_t)st.st_size != s->map_size) {
+    if (ftruncate(s->fd, 0) < 0 || ftruncate(s->fd, s->map_size) < 0) {
+      int err = -errno;
+      snapshot_close(s);
+      return err;
+    }
+  }
+
+  s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    int err = -errno;
+    s->map = NULL;
+    snapshot_close(s);
+    return err;
+  }
+
+  for (unsigned int i = 0; i < 2; i++) {
+    if (!copy_valid(s, i))
+      continue;
+    // sequence numbers wrap, compare by difference
+    uint32_t seq = copy_at(s, i)->seq;
+    if (s->current == 2 || (int32_t)(seq - s->seq) > 0) {
+      s->current = i;
+      s->seq     = seq;
+    }
+  }
+
+  return 0;
+}
+
+void snapshot_close(struct snapshot *s) {
+  if (s->map)
+    munmap(s->map, s->map_size);
+  if (s->fd >= 0)
+    close(s->fd);
+  s->map = NULL;
+  s->fd  = -1;
+}
+
+const void *snapshot_load(const struct snapshot *s) {
+  if (!s->map || s->current == 2)
+    return NULL;
+  return copy_at(s, s->current) + 1;
+}
+
+void snapshot_save(struct snapshot *s, const void *data) {
+  if (!s->map)
+    return;
+
+  const unsigned int next = (s->current == 0) ? 1 : 0;
+  struct snapshot_header *hdr = copy_at(s, next);
+  uint32_t seq = s->seq + 1;
+
+  if (!seq)
+    seq = 1;
+
+  // invalidate the copy, fill it, then commit it by the checksum
+  __atomic_store_n(&hdr->seq, 0, __ATOMIC_RELEASE);
+  hdr->magic = s->magic;
+  hdr->size  = s->size;
+  memcpy(hdr + 1, data, s->size);
+
+  struct snapshot_header tmp = *hdr;
+  tmp.seq = seq;
+  hdr->checksum = checksum(&tmp, hdr + 1);
+  __atomic_store_n(&hdr->seq, seq, __ATOMIC_RELEASE);
+
+  s->current = next;
+  s->seq     = seq;
+}
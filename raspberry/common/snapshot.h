@@ -0,0 +1,53 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Small state file mapped into memory, so a daemon can save what it last
+ * applied or observed with a plain memcpy and find it again right after
+ * a restart, before any network connection is up.
+ *
+ * The file holds two copies. A save goes to the older one and is
+ * committed by its checksum and sequence number, which are written last;
+ * a save torn by a crash therefore leaves the previous copy intact. The
+ * kernel writes the dirty page back on its own, a crash of the process
+ * loses nothing, a power cut at most the last seconds.
+ */
+
+struct snapshot {
+  int       fd;
+  uint8_t  *map;
+  size_t    map_size;
+  size_t    size;		// payload size
+  uint32_t  magic;		// identifies the owner and payload layout
+  uint32_t  seq;		// sequence number of the newest copy
+  unsigned  current;		// index of the newest valid copy, 2 if none
+};
+
+/**
+ * Open or create a snapshot file and map it.
+ *
+ * A file of another size or with another magic is reset to empty.
+ *
+ * @param path The file, the directory must exist
+ * @param magic Owner and layout tag, change it when the payload changes
+ * @param size Payload size in bytes
+ * @return 0 on success, -errno on failure
+ */
+int snapshot_open(struct snapshot *s, const char *path, uint32_t magic, size_t size);
+void snapshot_close(struct snapshot *s);
+
+/**
+ * @return The newest valid payload or NULL if the file had none
+ */
+const void *snapshot_load(const struct snapshot *s);
+
+/**
+ * Save a payload of the size given to snapshot_open.
+ */
+void snapshot_save(struct snapshot *s, const void *data);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "spsc_ring.h"
+
+int spsc_ring_init(struct spsc_ring *r, size_t record_size, unsigned int capacity) {
+  if (!capacity || (capacity & (capacity - 1)))
+    return -EINVAL;
+
+  memset(r, 0, sizeof(*r));
+  r->record_size = record_size;
+  r->slot_size   = sizeof(uint64_t) + ((record_size + 7) & ~(size_t)7);
+  r->mask        = capacity - 1;
+
+  r->slots = calloc(capacity, r->slot_size);
+  if (!r->slots)
+    return -ENOMEM;
+
+  latency_reset(&r->wait);
+  return 0;
+}
+
+void spsc_ring_free(struct spsc_ring *r) {
+  free(r->slots);
+  r->slots = NULL;
+}
+
+bool spsc_ring_push(struct spsc_ring *r, const void *record) {
+  const uint32_t head = r->head;
+  const uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  const uint32_t depth = head - tail;
+
+  if (depth > r->mask) {
+    r->full++;
+    return false;
+  }
+
+  uint8_t *slot = r->slots + (head & r->mask) * r->slot_size;
+  const uint64_t now = latency_now_us();
+  memcpy(slot, &now, sizeof(now));
+  memcpy(slot + sizeof(uint64_t), record, r->record_size);
+
+  // the record must be complete before the consumer sees the new head
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+  r->pushed++;
+  if (depth + 1 > r->max_depth)
+    r->max_depth = depth + 1;
+
+  return true;
+}
+
+bool spsc_ring_pop(struct spsc_ring *r, void *record) {
+  const uint32_t tail = r->tail;
+  const uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail)
+    return false;
+
+  const uint8_t *slot = r->slots + (tail & r->mask) * r->slot_size;
+  uint64_t pushed_us;
+  memcpy(&pushed_us, slot, sizeof(pushed_us));
+  memcpy(record, slot + sizeof(uint64_t), r->record_size);
+
+  // the slot may be reused as soon as the producer sees the new tail
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+  r->popped++;
+  r->depth_sum += head - tail;
+  latency_record(&r->wait, latency_now_us() - pushed_us);
+
+  return true;
+}
+
+unsigned int spsc_ring_depth(const struct spsc_ring *r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+void spsc_ring_log(const struct spsc_ring *r, const char *name) {
+  syslog(LOG_INFO, "%s: %u pushed, %u popped, %u rejected (full), "
+                   "depth %u of %u, max %u, avg %.1f at pop.",
+                   name, r->pushed, r->popped, r->full,
+                   spsc_ring_depth(r), r->mask + 1, r->max_depth,
+                   r->popped ? (double)r->depth_sum / r->popped : 0.0);
+
+  char wait_name[64];
+  snprintf(wait_name, sizeof(wait_name), "%s time in queue", name);
+  latency_log(&r->wait, wait_name);
+}
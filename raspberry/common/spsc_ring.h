@@ -0,0 +1,75 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "latency.h"
+
+/*
+ * Lock-free ring of fixed-size records between exactly one producer and
+ * one consumer thread. The producer only writes head, the consumer only
+ * tail, each published with release and read with acquire ordering.
+ *
+ * Every record carries the time of its push, so the consumer sees how
+ * long it waited. The counters are written by one side each and may be
+ * read by the other for logging.
+ */
+
+#define SPSC_CACHELINE	64
+
+struct spsc_ring {
+  uint8_t  *slots;
+  size_t    slot_size;		// push time and record, 8-byte aligned
+  size_t    record_size;
+  uint32_t  mask;		// capacity - 1
+
+  // producer side
+  uint32_t  head __attribute__((aligned(SPSC_CACHELINE)));
+  uint32_t  pushed;
+  uint32_t  full;		// pushes rejected for lack of space
+  uint32_t  max_depth;
+
+  // consumer side
+  uint32_t  tail __attribute__((aligned(SPSC_CACHELINE)));
+  uint32_t  popped;
+  uint64_t  depth_sum;		// depth at each pop, for the average
+  struct latency_hist wait;	// time in queue
+};
+
+/**
+ * @param record_size Size of one record in bytes
+ * @param capacity Number of records, a power of two
+ * @return 0 on success, -errno on failure
+ */
+int spsc_ring_init(struct spsc_ring *r, size_t record_size, unsigned int capacity);
+void spsc_ring_free(struct spsc_ring *r);
+
+/**
+ * Producer: copy a record into the ring.
+ *
+ * @return false if the ring is full
+ */
+bool spsc_ring_push(struct spsc_ring *r, const void *record);
+
+/**
+ * Consumer: take the oldest record.
+ *
+ * @return false if the ring is empty
+ */
+bool spsc_ring_pop(struct spsc_ring *r, void *record);
+
+/**
+ * @return Number of records in the ring, exact only on either side
+ */
+unsigned int spsc_ring_depth(const struct spsc_ring *r);
+
+/**
+ * Write the depth and time-in-queue metrics to syslog.
+ *
+ * @param name Name of the ring
+ */
+void spsc_ring_log(const struct spsc_ring *r, const char *name);
+
+#endif
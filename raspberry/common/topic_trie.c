@@ -0,0 +1,284 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "topic_trie.h"
+
+#define TOPIC_TRIE_ROOT	0
+
+static uint32_t edge_hash(uint32_t parent, const char *level, size_t len) {
+  // FNV-1a over the parent and the level name
+  uint32_t h = 2166136261u ^ parent;
+  h *= 16777619u;
+
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (uint8_t)level[i];
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+static const struct topic_edge *edge_find(const struct topic_trie *t,
+                                          uint32_t parent,
+                                          const char *level, size_t len) {
+  uint32_t i = edge_hash(parent, level, len) & t->edge_mask;
+
+  for (;; i = (i + 1) & t->edge_mask) {
+    const struct topic_edge *e = &t->edges[i];
+
+    if (!e->child)
+      return NULL;
+    if ((e->parent == parent) && (e->len == len) &&
+        !memcmp(t->strings + e->key, level, len))
+      return e;
+  }
+}
+
+///// Building /////
+
+static int grow(void **array, uint32_t *max, size_t size) {
+  const uint32_t n = *max ? 2 * *max : 16;
+  void *p = realloc(*array, n * size);
+  if (!p)
+    return -ENOMEM;
+
+  *array = p;
+  *max = n;
+  return 0;
+}
+
+static int node_new(struct topic_trie *t, uint32_t *node) {
+  if (t->node_count == t->node_max)
+    if (grow((void **)&t->nodes, &t->node_max, sizeof(*t->nodes)) < 0)
+      return -ENOMEM;
+
+  memset(&t->nodes[t->node_count], 0, sizeof(*t->nodes));
+  *node = t->node_count++;
+  return 0;
+}
+
+static void edge_insert(struct topic_edge *edges, uint32_t mask,
+                        const char *strings, const struct topic_edge *e) {
+  uint32_t i = edge_hash(e->parent, strings + e->key, e->len) & mask;
+
+  while (edges[i].child)
+    i = (i + 1) & mask;
+  edges[i] = *e;
+}
+
+/**
+ * Keep the table at most half full.
+ */
+static int edges_reserve(struct topic_trie *t) {
+  if (2 * (t->edge_count + 1) <= t->edge_mask + 1)
+    return 0;
+
+  const uint32_t size = 2 * (t->edge_mask + 1);
+  struct topic_edge *edges = calloc(size, sizeof(*edges));
+  if (!edges)
+    return -ENOMEM;
+
+  uint32_t i;
+  for (i = 0; i <= t->edge_mask; i++)
+    if (t->edges[i].child)
+      edge_insert(edges, size - 1, t->strings, &t->edges[i]);
+
+  free(t->edges);
+  t->edges = edges;
+  t->edge_mask = size - 1;
+  return 0;
+}
+
+/**
+ * @return The child for the level, created if needed
+ */
+static int child_get(struct topic_trie *t, uint32_t parent,
+                     const char *level, size_t len, uint32_t *child) {
+  const struct topic_edge *found = edge_find(t, parent, level, len);
+  if (found) {
+    *child = found->child;
+    return 0;
+  }
+
+  if (edges_reserve(t) < 0)
+    return -ENOMEM;
+
+  if (t->strings_len + len > t->strings_max) {
+    const size_t n = 2 * (t->strings_max + len);
+    char *p = realloc(t->strings, n);
+    if (!p)
+      return -ENOMEM;
+    t->strings = p;
+    t->strings_max = n;
+  }
+
+  struct topic_edge e = {
+    .parent = parent,
+    .key    = t->strings_len,
+    .len    = len,
+  };
+  if (node_new(t, &e.child) < 0)
+    return -ENOMEM;
+
+  memcpy(t->strings + t->strings_len, level, len);
+  t->strings_len += len;
+  edge_insert(t->edges, t->edge_mask, t->strings, &e);
+  t->edge_count++;
+
+  *child = e.child;
+  return 0;
+}
+
+int topic_trie_init(struct topic_trie *t) {
+  memset(t, 0, sizeof(*t));
+
+  t->edges = calloc(16, sizeof(*t->edges));
+  if (!t->edges)
+    return -ENOMEM;
+  t->edge_mask = 15;
+
+  uint32_t root;
+  return node_new(t, &root);
+}
+
+void topic_trie_free(struct topic_trie *t) {
+  free(t->nodes);
+  free(t->edges);
+  free(t->strings);
+  free(t->routes);
+  memset(t, 0, sizeof(*t));
+}
+
+int topic_trie_add(struct topic_trie *t, const char *pattern, void *value) {
+  if (t->compiled)
+    return -EINVAL;
+
+  uint32_t node = TOPIC_TRIE_ROOT;
+  bool hash = false;
+  const char *p = pattern;
+
+  for (;;) {
+    const char *end = strchr(p, '/');
+    const size_t len = end ? (size_t)(end - p) : strlen(p);
+
+    if (memchr(p, '#', len)) {
+      // '#' alone and last
+      if ((len != 1) || end)
+        return -EINVAL;
+      hash = true;
+      break;
+    }
+
+    if (memchr(p, '+', len)) {
+      if (len != 1)
+        return -EINVAL;
+      if (!t->nodes[node].plus) {
+        uint32_t plus;
+        if (node_new(t, &plus) < 0)
+          return -ENOMEM;
+        t->nodes[node].plus = plus;
+      }
+      node = t->nodes[node].plus;
+    } else {
+      uint32_t child;
+      if (child_get(t, node, p, len, &child) < 0)
+        return -ENOMEM;
+      node = child;
+    }
+
+    if (!end)
+      break;
+    p = end + 1;
+  }
+
+  if (t->route_count == t->route_max)
+    if (grow((void **)&t->routes, &t->route_max, sizeof(*t->routes)) < 0)
+      return -ENOMEM;
+
+  struct topic_route *r = &t->routes[t->route_count++];
+  r->node  = node;
+  r->hash  = hash;
+  r->value = value;
+  return 0;
+}
+
+static int route_cmp(const void *a, const void *b) {
+  const struct topic_route *ra = a, *rb = b;
+
+  if (ra->node != rb->node)
+    return (ra->node < rb->node) ? -1 : 1;
+  return (int)ra->hash - (int)rb->hash;
+}
+
+void topic_trie_compile(struct topic_trie *t) {
+  // the values of a node and kind become one run
+  qsort(t->routes, t->route_count, sizeof(*t->routes), route_cmp);
+
+  uint32_t i;
+  for (i = 0; i < t->route_count; i++) {
+    struct topic_node *n = &t->nodes[t->routes[i].node];
+
+    if (t->routes[i].hash) {
+      if (!n->hash_count++)
+        n->hash = i;
+    } else {
+      if (!n->exact_count++)
+        n->exact = i;
+    }
+  }
+
+  t->compiled = true;
+}
+
+///// Matching /////
+
+static unsigned int report(const struct topic_trie *t, uint32_t first,
+                           uint32_t count, topic_trie_cb cb, void *arg) {
+  uint32_t i;
+  for (i = first; i < first + count; i++)
+    cb(t->routes[i].value, arg);
+
+  return count;
+}
+
+/**
+ * @param level Start of the next level, NULL after the last one
+ */
+static unsigned int match(const struct topic_trie *t, uint32_t node,
+                          const char *level, const char *end, bool wild,
+                          topic_trie_cb cb, void *arg) {
+  const struct topic_node *n = &t->nodes[node];
+  unsigned int found = 0;
+
+  // '#' also matches the parent level
+  if (wild)
+    found += report(t, n->hash, n->hash_count, cb, arg);
+
+  if (!level)
+    return found + report(t, n->exact, n->exact_count, cb, arg);
+
+  const char *next = memchr(level, '/', end - level);
+  const size_t len = (next ? next : end) - level;
+  if (next)
+    next++;
+
+  const struct topic_edge *e = edge_find(t, node, level, len);
+  if (e)
+    found += match(t, e->child, next, end, true, cb, arg);
+  if (n->plus && wild)
+    found += match(t, n->plus, next, end, true, cb, arg);
+
+  return found;
+}
+
+unsigned int topic_trie_match(const struct topic_trie *t,
+                              const char *topic, size_t len,
+                              topic_trie_cb cb, void *arg) {
+  // no wildcard in the first level for $SYS and the like
+  const bool wild = !len || (topic[0] != '$');
+
+  return match(t, TOPIC_TRIE_ROOT, topic, topic + len, wild, cb, arg);
+}
@@ -0,0 +1,92 @@
+#ifndef _TOPIC_TRIE_H_
+#define _TOPIC_TRIE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Route MQTT topics to the subscriptions matching them. The subscription
+ * patterns, with the wildcards '+' and '#', are compiled into a trie of
+ * topic levels. The children of all nodes live in one hash table keyed
+ * by parent and level, so a topic costs one lookup per level and per
+ * '+' branch taken, however many patterns there are.
+ *
+ * Topics starting with '$' are not matched by a wildcard in the first
+ * level, as in MQTT.
+ */
+
+struct topic_node {
+  uint32_t plus;		// child for '+', 0 if none
+  uint32_t exact;		// first value of patterns ending here
+  uint32_t exact_count;
+  uint32_t hash;		// first value of patterns with '#' here
+  uint32_t hash_count;
+};
+
+struct topic_edge {
+  uint32_t parent;
+  uint32_t child;		// 0 for a free slot, the root is no child
+  uint32_t key;			// offset of the level in strings
+  uint32_t len;
+};
+
+struct topic_route {
+  uint32_t node;
+  bool     hash;		// '#' at the end
+  void    *value;
+};
+
+struct topic_trie {
+  struct topic_node *nodes;
+  uint32_t           node_count, node_max;
+
+  struct topic_edge *edges;	// open addressing, a power of two
+  uint32_t           edge_count, edge_mask;
+
+  char              *strings;	// level names of the edges
+  size_t             strings_len, strings_max;
+
+  struct topic_route *routes;	// sorted by node when compiled
+  uint32_t           route_count, route_max;
+  bool               compiled;
+};
+
+/**
+ * Called for each matching subscription.
+ */
+typedef void (*topic_trie_cb)(void *value, void *arg);
+
+/**
+ * @return 0 on success, -errno on failure
+ */
+int topic_trie_init(struct topic_trie *t);
+void topic_trie_free(struct topic_trie *t);
+
+/**
+ * Add a subscription before the trie is compiled. A pattern may be
+ * given several times, with the same or with different values.
+ *
+ * @param pattern Topic pattern, '+' and '#' only as whole levels and
+ *        '#' only at the end
+ * @return 0 on success, -EINVAL for an invalid pattern, -ENOMEM
+ */
+int topic_trie_add(struct topic_trie *t, const char *pattern, void *value);
+
+/**
+ * Lay out the values for matching. No subscriptions can be added after.
+ */
+void topic_trie_compile(struct topic_trie *t);
+
+/**
+ * Find the subscriptions matching a topic. A value subscribed with
+ * several matching patterns is reported for each of them.
+ *
+ * @param topic The topic, need not be NUL-terminated
+ * @return Number of matches
+ */
+unsigned int topic_trie_match(const struct topic_trie *t,
+                              const char *topic, size_t len,
+                              topic_trie_cb cb, void *arg);
+
+#endif
@@ -0,0 +1,456 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <avr/io.h>
+
+#include "usitwislave.h"
+#include "emu_board.h"
+
+/*
+ * Board model, compiled once per firmware with EMU_BOARD set to the name
+ * of the board descriptor (see Makefile).
+ */
+
+#ifndef EMU_BOARD
+#error EMU_BOARD must name the board descriptor
+#endif
+
+int firmware_main(void);
+
+// the vectors the firmware does not define stay NULL
+void TIM0_COMPA_vect(void) __attribute__((weak));
+void TIM0_OVF_vect(void) __attribute__((weak));
+void PCINT0_vect(void) __attribute__((weak));
+void EE_RDY_vect(void) __attribute__((weak));
+
+///// Registers /////
+
+volatile uint8_t PINB, DDRB, PORTB;
+volatile uint8_t SREG, CLKPR, PRR, ACSR, MCUCR;
+volatile uint8_t GIMSK, GIFR, PCMSK, TIMSK, TIFR, GTCCR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, OCR0B;
+volatile uint8_t TCCR1, TCNT1, OCR1A, OCR1B, OCR1C;
+volatile uint8_t USIDR, USISR, USICR;
+volatile uint8_t EECR;
+volatile uint16_t EEAR;
+
+volatile uint8_t emu_eeprom[EMU_EEPROM_SIZE];
+
+// 3.4 ms per EEPROM byte
+#define EMU_EEPROM_WRITE_CYCLES	27200
+
+static uint8_t  eeprom_valid;	// the EEPROM keeps its content over a restart
+static uint8_t  eeprom_writing;
+static uint32_t eeprom_left;
+
+static uint16_t timer0_cycles;	// cycles since the last timer count
+
+static uint8_t  drive_mask;	// inputs pulled low from outside
+
+///// USI slave /////
+
+/*
+ * The USI slave of usitwislave.c on transaction level: the same buffers,
+ * reply selection and counters, without the bit level state machine.
+ */
+
+enum {
+  buffer_size = 32
+};
+
+static struct {
+  uint8_t address;
+  void (*data_callback)(uint8_t buffer_size,
+                        volatile uint8_t input_buffer_length, volatile const uint8_t *input_buffer,
+                        volatile uint8_t *output_buffer_length, volatile uint8_t *output_buffer);
+  void (*idle_callback)(void);
+  uint8_t (*frame_length)(uint8_t first_byte);
+
+  volatile uint8_t input_buffer[buffer_size];
+  volatile uint8_t input_buffer_length;
+  volatile uint8_t output_buffer[buffer_size];
+  volatile uint8_t output_buffer_length;
+
+  const volatile uint8_t *preload_buffer;
+  uint8_t preload_length;
+
+  uint8_t request_received;
+  uint8_t stop_pending;
+
+  uint8_t  stats_enabled;
+  uint32_t start_conditions;
+  uint32_t stop_conditions;
+  uint32_t repeated_starts;
+  uint32_t error_conditions;
+  uint32_t overflow_conditions;
+  uint32_t local_frames;
+  uint32_t idle_calls;
+} usi;
+
+static void process_frame(void) {
+  if (!usi.input_buffer_length)
+    return;
+
+  if (usi.stats_enabled)
+    usi.local_frames++;
+
+  usi.output_buffer_length = 0;
+  usi.data_callback(buffer_size, usi.input_buffer_length, usi.input_buffer,
+                    &usi.output_buffer_length, usi.output_buffer);
+
+  usi.input_buffer_length = 0;
+}
+
+static void usi_start(uint8_t repeated) {
+  if (usi.stats_enabled) {
+    usi.start_conditions++;
+    if (repeated)
+      usi.repeated_starts++;
+  }
+
+  if (!repeated)
+    usi.request_received = 0;
+
+  process_frame();
+}
+
+static void usi_overflows(uint32_t count) {
+  if (usi.stats_enabled)
+    usi.overflow_conditions += count;
+}
+
+void usi_twi_slave(uint8_t slave_address, uint8_t use_sleep,
+                   void (*data_callback)(uint8_t buffer_size,
+                                         volatile uint8_t input_buffer_length, volatile const uint8_t *input_buffer,
+                                         volatile uint8_t *output_buffer_length, volatile uint8_t *output_buffer),
+                   void (*idle_callback)(void)) {
+  // the board runs the main loop, see main_loop()
+  usi.address = slave_address;
+  usi.data_callback = data_callback;
+  usi.idle_callback = idle_callback;
+  usi.input_buffer_length = 0;
+  usi.output_buffer_length = 0;
+}
+
+void usi_twi_frame_length(uint8_t (*frame_length)(uint8_t first_byte)) {
+  usi.frame_length = frame_length;
+}
+
+void usi_twi_preload(const volatile uint8_t *buffer, uint8_t length) {
+  usi.preload_buffer = buffer;
+  usi.preload_length = length;
+}
+
+void usi_twi_enable_stats(uint8_t onoff) {
+  usi.stats_enabled = onoff;
+  usi.start_conditions = 0;
+  usi.stop_conditions = 0;
+  usi.repeated_starts = 0;
+  usi.error_conditions = 0;
+  usi.overflow_conditions = 0;
+  usi.local_frames = 0;
+  usi.idle_calls = 0;
+}
+
+uint32_t usi_twi_stats_start_conditions(void) {
+  return usi.start_conditions;
+}
+
+uint32_t usi_twi_stats_stop_conditions(void) {
+  return usi.stop_conditions;
+}
+
+uint32_t usi_twi_stats_error_conditions(void) {
+  return usi.error_conditions;
+}
+
+uint32_t usi_twi_stats_overflow_conditions(void) {
+  return usi.overflow_conditions;
+}
+
+uint32_t usi_twi_stats_local_frames(void) {
+  return usi.local_frames;
+}
+
+uint32_t usi_twi_stats_idle_calls(void) {
+  return usi.idle_calls;
+}
+
+uint32_t usi_twi_stats_repeated_starts(void) {
+  return usi.repeated_starts;
+}
+
+void usi_twi_stats_get(struct usi_twi_stats *stats) {
+  stats->start_conditions = usi.start_conditions;
+  stats->stop_conditions = usi.stop_conditions;
+  stats->repeated_starts = usi.repeated_starts;
+  stats->error_conditions = usi.error_conditions;
+  stats->overflow_conditions = usi.overflow_conditions;
+  stats->local_frames = usi.local_frames;
+}
+
+void usi_twi_stats_take(struct usi_twi_stats *stats) {
+  usi_twi_stats_get(stats);
+
+  usi.start_conditions = 0;
+  usi.stop_conditions = 0;
+  usi.repeated_starts = 0;
+  usi.error_conditions = 0;
+  usi.overflow_conditions = 0;
+  usi.local_frames = 0;
+}
+
+/**
+ * One round of the loop in usi_twi_slave() after a wake-up.
+ */
+static void main_loop(void) {
+  if (usi.stop_pending) {
+    usi.stop_pending = 0;
+
+    if (usi.stats_enabled)
+      usi.stop_conditions++;
+
+    process_frame();
+  }
+
+  if (usi.idle_callback) {
+    usi.idle_callback();
+
+    if (usi.stats_enabled)
+      usi.idle_calls++;
+  }
+}
+
+///// Pins /////
+
+static void pins_update(void) {
+  // outputs read back, inputs float high unless driven low
+  const uint8_t pins = (DDRB & PORTB) | (~DDRB & ~drive_mask);
+  const uint8_t changed = (PINB ^ pins) & PCMSK;
+
+  PINB = pins;
+
+  if (changed)
+    GIFR |= (1 << PCIF);
+}
+
+static void drive(uint8_t mask) {
+  drive_mask = mask;
+  pins_update();
+}
+
+static void io(struct emu_io *io) {
+  pins_update();
+
+  io->ddrb = DDRB;
+  io->portb = PORTB;
+  io->pinb = PINB;
+  io->ocr1b = OCR1B;
+  io->int_line = (DDRB & (1 << PB1)) && !(PORTB & (1 << PB1));
+}
+
+///// Peripherals /////
+
+/**
+ * @return CPU cycles per Timer0 count, 0 if stopped
+ */
+static uint16_t timer0_prescale(void) {
+  static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+  return prescale[TCCR0B & 0x07];
+}
+
+static void timer0_count(void) {
+  if (TCCR0A & (1 << WGM01)) {
+    // CTC: clear on compare match
+    if (TCNT0 == OCR0A) {
+      TCNT0 = 0;
+      TIFR |= (1 << OCF0A);
+      return;
+    }
+  } else if (TCNT0 == OCR0A)
+    TIFR |= (1 << OCF0A);
+
+  if (!++TCNT0)
+    TIFR |= (1 << TOV0);
+}
+
+static void eeprom_step(uint32_t cycles) {
+  if (!eeprom_writing) {
+    if (!(EECR & (1 << EEPE)))
+      return;
+
+    eeprom_writing = 1;
+    eeprom_left = EMU_EEPROM_WRITE_CYCLES;
+  }
+
+  if (cycles < eeprom_left) {
+    eeprom_left -= cycles;
+    return;
+  }
+
+  eeprom_writing = 0;
+  EECR &= ~((1 << EEPE) | (1 << EEMPE) | (1 << EERE));
+}
+
+/**
+ * Run the pending interrupts, one pass in priority order.
+ *
+ * @return The number of interrupts run
+ */
+static uint8_t interrupts(void) {
+  uint8_t count = 0;
+
+  pins_update();
+
+  if ((GIFR & (1 << PCIF)) && (GIMSK & (1 << PCIE)) && PCINT0_vect) {
+    GIFR &= ~(1 << PCIF);
+    PCINT0_vect();
+    count++;
+  }
+
+  if ((EECR & (1 << EERIE)) && !(EECR & (1 << EEPE)) && EE_RDY_vect) {
+    EE_RDY_vect();
+    count++;
+  }
+
+  if ((TIFR & (1 << OCF0A)) && (TIMSK & (1 << OCIE0A)) && TIM0_COMPA_vect) {
+    TIFR &= ~(1 << OCF0A);
+    TIM0_COMPA_vect();
+    count++;
+  }
+
+  if ((TIFR & (1 << TOV0)) && (TIMSK & (1 << TOIE0)) && TIM0_OVF_vect) {
+    TIFR &= ~(1 << TOV0);
+    TIM0_OVF_vect();
+    count++;
+  }
+
+  pins_update();
+
+  return count;
+}
+
+static void run(uint32_t cycles) {
+  while (cycles) {
+    const uint16_t prescale = timer0_prescale();
+    uint32_t step = cycles;
+
+    if (prescale) {
+      if (timer0_cycles >= prescale)
+        timer0_cycles = 0;
+      if (step > (uint32_t)(prescale - timer0_cycles))
+        step = prescale - timer0_cycles;
+    }
+    if (eeprom_writing && (step > eeprom_left))
+      step = eeprom_left;
+
+    cycles -= step;
+
+    if (prescale) {
+      timer0_cycles += step;
+      if (timer0_cycles == prescale) {
+        timer0_cycles = 0;
+        timer0_count();
+      }
+    }
+    eeprom_step(step);
+
+    // every interrupt wakes the main loop
+    if (interrupts())
+      main_loop();
+  }
+}
+
+///// Board /////
+
+static int transfer(uint8_t addr, const uint8_t *wbuf, uint8_t wlen,
+                    uint8_t *rbuf, uint8_t rlen) {
+  const uint8_t selected = (addr == usi.address);
+  uint8_t i;
+
+  // the slave sees every transaction on the bus
+  usi_start(0);
+
+  if (wlen) {
+    // address and ack, then a byte and its ack each
+    usi_overflows(selected ? 2 + 2 * wlen : 1);
+
+    if (selected) {
+      for (i = 0; i < wlen; i++)
+        if (usi.input_buffer_length < (buffer_size - 1))
+          usi.input_buffer[usi.input_buffer_length++] = wbuf[i];
+      usi.request_received = 1;
+    }
+
+    if (rlen)
+      usi_start(1);
+  }
+
+  if (rlen) {
+    usi_overflows(selected ? 2 + 2 * rlen : 1);
+
+    if (selected) {
+      // a read on its own gets the preloaded reply
+      const volatile uint8_t *reply = usi.output_buffer;
+      uint8_t reply_length = usi.output_buffer_length;
+
+      if (!usi.request_received && usi.preload_buffer) {
+        reply = usi.preload_buffer;
+        reply_length = usi.preload_length;
+      }
+
+      for (i = 0; i < rlen; i++)
+        rbuf[i] = (i < reply_length) ? reply[i] : 0xfe;
+    }
+  }
+
+  // the stop condition wakes the main loop
+  usi.stop_pending = 1;
+  main_loop();
+  interrupts();
+
+  return selected ? 0 : -ENXIO;
+}
+
+static void start(void) {
+  if (!eeprom_valid) {
+    memset((void *)emu_eeprom, 0xff, sizeof(emu_eeprom));
+    eeprom_valid = 1;
+  }
+  eeprom_writing = 0;
+  timer0_cycles = 0;
+
+  PINB = DDRB = PORTB = 0;
+  SREG = CLKPR = PRR = ACSR = MCUCR = 0;
+  GIMSK = GIFR = PCMSK = TIMSK = TIFR = GTCCR = 0;
+  TCCR0A = TCCR0B = TCNT0 = OCR0A = OCR0B = 0;
+  TCCR1 = TCNT1 = OCR1A = OCR1B = 0;
+  OCR1C = 0xff;
+  USIDR = USISR = USICR = 0;
+  EECR = 0;
+  EEAR = 0;
+
+  memset(&usi, 0, sizeof(usi));
+  pins_update();
+
+  // init() and the setup in main() up to usi_twi_slave()
+  firmware_main();
+
+  // the flags init() has cleared, see avr/io.h
+  TIFR = 0;
+  GIFR = 0;
+  pins_update();
+
+  main_loop();
+}
+
+const struct emu_board EMU_BOARD = {
+  .name = EMU_NAME,
+  .start = start,
+  .transfer = transfer,
+  .run = run,
+  .drive = drive,
+  .io = io
+};
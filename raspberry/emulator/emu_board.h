@@ -0,0 +1,68 @@
+#ifndef _EMU_BOARD_H_
+#define _EMU_BOARD_H_
+
+#include <stdint.h>
+
+/*
+ * A controller board with its firmware compiled for the host.
+ *
+ * emu_board.c is built once per firmware and linked with it into one
+ * object, in which only the board descriptor stays global. The board
+ * replaces the USI slave with a transaction level model of the same
+ * semantics and steps Timer0, the EEPROM and the pin change interrupt
+ * between the calls into the firmware.
+ */
+
+// the AVR clock, cycles per millisecond
+#define EMU_CYCLES_MS	8000
+
+/**
+ * Port B as seen from outside the board
+ */
+struct emu_io {
+  uint8_t ddrb;
+  uint8_t portb;
+  uint8_t pinb;
+  uint8_t ocr1b;	// PWM duty of the lights
+  uint8_t int_line;	// 1 while the board pulls the I3C INT line
+};
+
+struct emu_board {
+  const char *name;
+
+  /**
+   * Reset the registers and run the firmware up to its main loop.
+   */
+  void (*start)(void);
+
+  /**
+   * One I2C transaction: write, repeated start, read. Either part may be
+   * empty.
+   *
+   * @param addr 7-bit slave address
+   * @return 0 on success, -ENXIO if the address is not the board's
+   */
+  int (*transfer)(uint8_t addr, const uint8_t *wbuf, uint8_t wlen,
+                  uint8_t *rbuf, uint8_t rlen);
+
+  /**
+   * Advance the peripherals and run the interrupts and the main loop.
+   *
+   * @param cycles CPU cycles
+   */
+  void (*run)(uint32_t cycles);
+
+  /**
+   * Drive port B inputs low from outside, e.g. the lever contacts.
+   *
+   * @param mask The pins pulled low, the others float to their pull-up
+   */
+  void (*drive)(uint8_t mask);
+
+  void (*io)(struct emu_io *io);
+};
+
+extern const struct emu_board emu_lever;
+extern const struct emu_board emu_ampel;
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2c_arbiter.h"
+#include "i3c_protocol.h"
+#include "evloop.h"
+#include "latency.h"
+#include "emu_board.h"
+
+/*
+ * The I3C controllers on a virtual bus: the Schalter and the Ampel
+ * firmware, compiled for the host, answer the batches of the I2C bus
+ * arbiter protocol on a Unix socket. The daemons run unmodified against
+ * it with "-d unix:<socket>". The boards run in 1 ms steps with the
+ * monotonic clock.
+ *
+ * Commands on stdin:
+ *   open, closed, neutral	move the lever
+ *   flip <n> [ms]		flip the lever n times, every ms (default 100)
+ *   io				show the port B of both boards
+ *   stats			log the metrics
+ *   quit
+ */
+
+const char* EMULATOR_SOCKET	= "/tmp/i3c_emulator.sock";
+
+#define EMULATOR_CLIENTS_MAX	8
+#define EMULATOR_FLIP_MS	100
+
+// lever contacts, active low
+#define LEVER_PIN_CLOSED	(1 << 3)	// PB3
+#define LEVER_PIN_OPEN		(1 << 4)	// PB4
+
+static const struct emu_board *boards[] = { &emu_lever, &emu_ampel };
+#define BOARDS	(sizeof(boards) / sizeof(boards[0]))
+
+///// Metrics /////
+
+struct emulator_metrics {
+  uint64_t start_us;
+  uint32_t batches;
+  uint32_t transfers;
+  uint32_t nacks;
+  uint32_t flips;
+  struct latency_hist transfer;	// host time of one transaction
+};
+
+struct emulator_metrics metrics;
+
+void metrics_log(void) {
+  const double s = (latency_now_us() - metrics.start_us) / 1e6;
+
+  syslog(LOG_INFO, "%u batches, %u transfers (%u not acknowledged), %u lever flips in %.1f s.",
+                   metrics.batches, metrics.transfers, metrics.nacks, metrics.flips, s);
+  if (s > 0)
+    syslog(LOG_INFO, "Throughput: %.1f transfers/s.", metrics.transfers / s);
+  latency_log(&metrics.transfer, "Transfer");
+}
+
+///// Bus /////
+
+/**
+ * Run one transaction, every board sees it.
+ *
+ * @return 0 on success, -ENXIO if no board has the address
+ */
+int bus_transfer(uint8_t addr, const uint8_t *wbuf, uint8_t wlen,
+                 uint8_t *rbuf, uint8_t rlen) {
+  const uint64_t start = latency_now_us();
+  int status = -ENXIO;
+
+  // nobody drives the bus on a read without slave
+  memset(rbuf, 0xff, rlen);
+
+  unsigned int i;
+  for (i = 0; i < BOARDS; i++)
+    if (!boards[i]->transfer(addr, wbuf, wlen, rbuf, rlen))
+      status = 0;
+
+  metrics.transfers++;
+  if (status)
+    metrics.nacks++;
+  latency_record(&metrics.transfer, latency_now_us() - start);
+
+  return status;
+}
+
+///// Board time /////
+
+uint64_t board_ms;	// emulated time since start
+
+struct lever_flips {
+  uint32_t left;
+  uint32_t interval_ms;
+  uint32_t next_ms;
+  bool     open;
+} flips;
+
+void lever_set(uint8_t pins) {
+  emu_lever.drive(pins);
+}
+
+void boards_advance(uint64_t now_ms) {
+  while (board_ms < now_ms) {
+    board_ms++;
+
+    if (flips.left && (board_ms >= flips.next_ms)) {
+      flips.open = !flips.open;
+      lever_set(flips.open ? LEVER_PIN_OPEN : LEVER_PIN_CLOSED);
+      flips.next_ms = board_ms + flips.interval_ms;
+      flips.left--;
+      metrics.flips++;
+    }
+
+    unsigned int i;
+    for (i = 0; i < BOARDS; i++)
+      boards[i]->run(EMU_CYCLES_MS);
+  }
+}
+
+void tick_callback(struct evloop *loop, int fd,
+                   uint32_t events, void *arg) {
+  boards_advance((latency_now_us() - metrics.start_us) / 1000);
+}
+
+///// Client connections /////
+
+int clients[EMULATOR_CLIENTS_MAX];
+
+void client_close(struct evloop *loop, int idx) {
+  evloop_del(loop, clients[idx]);
+  close(clients[idx]);
+  clients[idx] = -1;
+}
+
+void client_callback(struct evloop *loop, int fd,
+                     uint32_t events, void *arg) {
+  const int idx = (intptr_t)arg;
+  struct i2c_arbiter_request req;
+  struct i2c_arbiter_reply rep;
+
+  const ssize_t len = recv(fd, &req, sizeof(req), MSG_DONTWAIT);
+  if (len < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR))
+      client_close(loop, idx);
+    return;
+  }
+  if (len == 0) {
+    // orderly shutdown
+    client_close(loop, idx);
+    return;
+  }
+
+  // a malformed batch gets an empty reply
+  if ((len < I2C_ARBITER_REQUEST_SIZE(1)) ||
+      (req.count < 1) ||
+      (req.count > I2C_ARBITER_BATCH_MAX) ||
+      (len < I2C_ARBITER_REQUEST_SIZE(req.count)))
+    req.count = 0;
+
+  // the boards catch up before the batch, as on the real bus
+  boards_advance((latency_now_us() - metrics.start_us) / 1000);
+
+  memset(&rep, 0, I2C_ARBITER_REPLY_SIZE(req.count));
+  rep.count = req.count;
+
+  int i;
+  for (i = 0; i < req.count; i++) {
+    const struct i2c_arbiter_xfer *x = &req.xfers[i];
+    const uint8_t wlen = (x->wlen > I2C_TRANSFER_MAX) ? I2C_TRANSFER_MAX : x->wlen;
+    const uint8_t rlen = (x->rlen > I2C_TRANSFER_MAX) ? I2C_TRANSFER_MAX : x->rlen;
+
+    rep.results[i].rlen = rlen;
+    rep.results[i].status = bus_transfer(x->addr & 0x7f, x->wbuf, wlen,
+                                         rep.results[i].rbuf, rlen);
+  }
+  metrics.batches++;
+
+  send(fd, &rep, I2C_ARBITER_REPLY_SIZE(rep.count), MSG_NOSIGNAL);
+}
+
+void listen_callback(struct evloop *loop, int fd,
+                     uint32_t events, void *arg) {
+  const int cfd = accept(fd, NULL, NULL);
+  if (cfd < 0)
+    return;
+
+  int idx;
+  for (idx = 0; idx < EMULATOR_CLIENTS_MAX; idx++)
+    if (clients[idx] < 0)
+      break;
+
+  if ((idx == EMULATOR_CLIENTS_MAX) ||
+      (evloop_add(loop, cfd, EPOLLIN, client_callback, (void *)(intptr_t)idx) < 0)) {
+    syslog(LOG_WARNING, "Too many clients, connection refused.");
+    close(cfd);
+    return;
+  }
+
+  clients[idx] = cfd;
+}
+
+int listen_socket(const char *path) {
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  // remove a stale socket of an earlier run
+  unlink(path);
+
+  if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+      (listen(fd, EMULATOR_CLIENTS_MAX) < 0)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+///// Console /////
+
+void io_print(void) {
+  unsigned int i;
+  for (i = 0; i < BOARDS; i++) {
+    struct emu_io io;
+    boards[i]->io(&io);
+    printf("%s: DDRB %02x PORTB %02x PINB %02x OCR1B %3u INT %s\n",
+           boards[i]->name, io.ddrb, io.portb, io.pinb, io.ocr1b,
+           io.int_line ? "pulled" : "released");
+  }
+  fflush(stdout);
+}
+
+void stdin_callback(struct evloop *loop, int fd,
+                    uint32_t events, void *arg) {
+  char line[64];
+  char cmd[16];
+  unsigned int n = 0, ms = EMULATOR_FLIP_MS;
+
+  if (!fgets(line, sizeof(line), stdin)) {
+    // no console, keep serving
+    evloop_del(loop, fd);
+    return;
+  }
+
+  if (sscanf(line, "%15s %u %u", cmd, &n, &ms) < 1)
+    return;
+
+  if (strcmp(cmd, "open") == 0)
+    lever_set(LEVER_PIN_OPEN);
+  else if (strcmp(cmd, "closed") == 0)
+    lever_set(LEVER_PIN_CLOSED);
+  else if (strcmp(cmd, "neutral") == 0)
+    lever_set(0);
+  else if (strcmp(cmd, "flip") == 0) {
+    flips.left = n;
+    flips.interval_ms = ms ? ms : 1;
+    flips.next_ms = board_ms;
+  } else if (strcmp(cmd, "io") == 0)
+    io_print();
+  else if (strcmp(cmd, "stats") == 0)
+    metrics_log();
+  else if (strcmp(cmd, "quit") == 0)
+    evloop_stop(loop);
+  else
+    fprintf(stderr, "Unknown command %s\n", cmd);
+}
+
+///// Benchmark /////
+
+/**
+ * Read the lever status block and the light in turns, as fast as the
+ * boards answer, and log the throughput.
+ *
+ * @return 0 if all replies were valid
+ */
+int benchmark(unsigned int rounds) {
+  const uint8_t getlight = I3C_REQUEST(AMPEL_CMD_GETLIGHT, 0);
+  uint8_t buf[I3C_STATUS_LEN];
+  unsigned int invalid = 0;
+
+  const uint64_t start = latency_now_us();
+
+  unsigned int r;
+  for (r = 0; r < rounds; r++) {
+    if (bus_transfer(I3C_ADDR_LEVER, NULL, 0, buf, I3C_STATUS_LEN) ||
+        (buf[I3C_STATUS_CHECKSUM] != i3c_checksum(buf, I3C_STATUS_CHECKSUM)))
+      invalid++;
+
+    if (bus_transfer(I3C_ADDR_AMPEL, &getlight, 1, buf, 2) ||
+        !I3C_REPLY_VALID(buf[0], buf[1]))
+      invalid++;
+  }
+
+  const double s = (latency_now_us() - start) / 1e6;
+
+  syslog(LOG_INFO, "Benchmark: %u transfers in %.3f s, %.0f transfers/s, %u invalid replies.",
+                   2 * rounds, s, (s > 0) ? 2 * rounds / s : 0, invalid);
+  latency_log(&metrics.transfer, "Transfer");
+
+  return invalid ? -1 : 0;
+}
+
+///// Main /////
+
+void signal_callback(struct evloop *loop, int fd,
+                     uint32_t signo, void *arg) {
+  if (signo == SIGUSR1)
+    metrics_log();
+  else
+    evloop_stop(loop);
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-s socket] [-n rounds]\n"
+          "  -s  socket path (default %s)\n"
+          "  -n  run a benchmark of n rounds and exit\n",
+          name, EMULATOR_SOCKET);
+}
+
+int main(int argc, char *argv[]) {
+  const char *socket_path = EMULATOR_SOCKET;
+  unsigned int rounds = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:h")) != -1) {
+    switch (opt) {
+      case 's': socket_path = optarg; break;
+      case 'n': rounds = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  // initialize the system logging
+  openlog("emulator", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+  syslog(LOG_INFO, "Starting I3C board emulator.");
+
+  metrics.start_us = latency_now_us();
+
+  unsigned int b;
+  for (b = 0; b < BOARDS; b++)
+    boards[b]->start();
+
+  if (rounds) {
+    const int ret = benchmark(rounds);
+    closelog();
+    return ret;
+  }
+
+  int i;
+  for (i = 0; i < EMULATOR_CLIENTS_MAX; i++)
+    clients[i] = -1;
+
+  const int listen_fd = listen_socket(socket_path);
+  if (listen_fd < 0) {
+    syslog(LOG_EMERG, "Error %d on socket %s!", errno, socket_path);
+    return -1;
+  }
+
+  struct evloop loop;
+  if (evloop_init(&loop) < 0) {
+    syslog(LOG_ERR, "Error %d on event loop initialization!", errno);
+    return -1;
+  }
+
+  static const int signals[] = { SIGINT, SIGTERM, SIGUSR1, 0 };
+  evloop_add_signals(&loop, signals, signal_callback, NULL);
+  evloop_add(&loop, listen_fd, EPOLLIN, listen_callback, NULL);
+  evloop_add(&loop, STDIN_FILENO, EPOLLIN, stdin_callback, NULL);
+  evloop_add_timer(&loop, 1, tick_callback, NULL);
+
+  syslog(LOG_INFO, "Serving the lever on 0x%02x and the Ampel on 0x%02x at %s.",
+                   I3C_ADDR_LEVER, I3C_ADDR_AMPEL, socket_path);
+
+  evloop_run(&loop);
+  evloop_close(&loop);
+
+  metrics_log();
+
+  for (i = 0; i < EMULATOR_CLIENTS_MAX; i++)
+    if (clients[i] >= 0)
+      close(clients[i]);
+  close(listen_fd);
+  unlink(socket_path);
+
+  syslog(LOG_INFO, "I3C board emulator finished.");
+  closelog();
+
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef _EMU_AVR_INTERRUPT_H_
+#define _EMU_AVR_INTERRUPT_H_
+
+/*
+ * The board calls the vectors between the steps of the firmware, so an
+ * interrupt never preempts the firmware and cli()/sei() have nothing to do.
+ */
+
+#define ISR(vector, ...) void vector(void)
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+#define EMPTY_INTERRUPT(vector) void vector(void) {}
+
+#define sei() do {} while (0)
+#define cli() do {} while (0)
+
+#endif
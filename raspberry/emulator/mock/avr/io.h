@@ -0,0 +1,137 @@
+#ifndef _EMU_AVR_IO_H_
+#define _EMU_AVR_IO_H_
+
+#include <stdint.h>
+
+/*
+ * ATtiny85 registers for the firmware compiled on the host. The registers
+ * are plain variables of the board (emu_board.c), the board steps the
+ * peripherals between the calls into the firmware.
+ *
+ * Interrupt flags are not write-one-to-clear: the firmware only clears
+ * them during init, the board clears them after main() has returned.
+ */
+
+#define EMU_REG(name) extern volatile uint8_t name;
+
+EMU_REG(PINB)
+EMU_REG(DDRB)
+EMU_REG(PORTB)
+
+EMU_REG(SREG)
+EMU_REG(CLKPR)
+EMU_REG(PRR)
+EMU_REG(ACSR)
+EMU_REG(MCUCR)
+EMU_REG(GIMSK)
+EMU_REG(GIFR)
+EMU_REG(PCMSK)
+EMU_REG(TIMSK)
+EMU_REG(TIFR)
+EMU_REG(GTCCR)
+
+EMU_REG(TCCR0A)
+EMU_REG(TCCR0B)
+EMU_REG(TCNT0)
+EMU_REG(OCR0A)
+EMU_REG(OCR0B)
+
+EMU_REG(TCCR1)
+EMU_REG(TCNT1)
+EMU_REG(OCR1A)
+EMU_REG(OCR1B)
+EMU_REG(OCR1C)
+
+EMU_REG(USIDR)
+EMU_REG(USISR)
+EMU_REG(USICR)
+
+EMU_REG(EECR)
+extern volatile uint16_t EEAR;
+
+// EEDR is the addressed EEPROM cell, a write takes effect at once
+#define EMU_EEPROM_SIZE 512
+extern volatile uint8_t emu_eeprom[EMU_EEPROM_SIZE];
+#define EEDR (emu_eeprom[EEAR & (EMU_EEPROM_SIZE - 1)])
+
+// Port B
+#define PB0	0
+#define PB1	1
+#define PB2	2
+#define PB3	3
+#define PB4	4
+#define PB5	5
+
+// PRR
+#define PRADC	0
+#define PRUSI	1
+#define PRTIM0	2
+#define PRTIM1	3
+
+// ACSR
+#define ACD	7
+
+// CLKPR
+#define CLKPCE	7
+
+// GIMSK, GIFR, PCMSK
+#define PCIE	5
+#define INT0	6
+#define PCIF	5
+#define PCINT0	0
+#define PCINT1	1
+#define PCINT2	2
+#define PCINT3	3
+#define PCINT4	4
+#define PCINT5	5
+
+// TIMSK, TIFR
+#define TOIE0	1
+#define OCIE0B	3
+#define OCIE0A	4
+#define TOIE1	2
+#define OCIE1B	5
+#define OCIE1A	6
+#define TOV0	1
+#define OCF0B	3
+#define OCF0A	4
+#define TOV1	2
+#define OCF1B	5
+#define OCF1A	6
+
+// TCCR0A, TCCR0B
+#define WGM00	0
+#define WGM01	1
+#define CS00	0
+#define CS01	1
+#define CS02	2
+#define WGM02	3
+
+// TCCR1, GTCCR
+#define CS10	0
+#define CS11	1
+#define CS12	2
+#define CS13	3
+#define COM1A0	4
+#define COM1A1	5
+#define PWM1A	6
+#define CTC1	7
+#define PSR1	1
+#define FOC1A	2
+#define FOC1B	3
+#define COM1B0	4
+#define COM1B1	5
+#define PWM1B	6
+#define TSM	7
+
+// EECR
+#define EERE	0
+#define EEPE	1
+#define EEMPE	2
+#define EERIE	3
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(reg, bit) ((reg) & _BV(bit))
+#define bit_is_clear(reg, bit) (!((reg) & _BV(bit)))
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _EMU_AVR_SLEEP_H_
+#define _EMU_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE		0
+#define SLEEP_MODE_PWR_DOWN	2
+
+#define set_sleep_mode(mode) do {} while (0)
+#define sleep_enable() do {} while (0)
+#define sleep_disable() do {} while (0)
+#define sleep_cpu() do {} while (0)
+#define sleep_mode() do {} while (0)
+
+#endif
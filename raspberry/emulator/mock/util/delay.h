@@ -0,0 +1,8 @@
+#ifndef _EMU_UTIL_DELAY_H_
+#define _EMU_UTIL_DELAY_H_
+
+// busy waits take no emulated time
+#define _delay_ms(ms) do {} while (0)
+#define _delay_us(us) do {} while (0)
+
+#endif
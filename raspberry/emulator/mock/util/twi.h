@@ -0,0 +1,6 @@
+#ifndef _EMU_UTIL_TWI_H_
+#define _EMU_UTIL_TWI_H_
+
+// the USI slave does not use the TWI status codes
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Check the arbiter against the emulated controllers: batch replies and
+ * the priority order. Run by check.sh, which starts the emulator and the
+ * arbiter and checks the metrics the arbiter logs afterwards.
+ *
+ * Usage: arbiter_check <arbiter socket> <arbiter pid>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "i2c_arbiter.h"
+#include "i3c_protocol.h"
+
+// nothing answers here on the emulated bus
+#define ADDR_NONE	0x50
+
+// low priority batches queued while the arbiter is stopped
+#define LOW_BATCHES	6
+
+#define REPLY_TIMEOUT_MS 2000
+
+int failures = 0;
+
+#define CHECK(cond, ...) do {			\
+    if (!(cond)) {				\
+      printf("FAIL: " __VA_ARGS__);		\
+      printf("\n");				\
+      failures++;				\
+    }						\
+  } while (0)
+
+int arbiter_connect(const char *path) {
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Add a v1 GetStatus read to a batch.
+ */
+void add_getstatus(struct i2c_arbiter_request *req, uint8_t addr) {
+  struct i2c_arbiter_xfer *x = &req->xfers[req->count++];
+
+  memset(x, 0, sizeof(*x));
+  x->addr = addr;
+  x->wlen = 1;
+  x->rlen = I3C_STATUS_LEN;
+  x->wbuf[0] = I3C_REQUEST(I3C_CMD_GETSTATUS, 0);
+}
+
+bool send_batch(int fd, const struct i2c_arbiter_request *req) {
+  const size_t len = I2C_ARBITER_REQUEST_SIZE(req->count);
+  return send(fd, req, len, 0) == (ssize_t)len;
+}
+
+bool recv_reply(int fd, struct i2c_arbiter_reply *rep) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+  if (poll(&pfd, 1, REPLY_TIMEOUT_MS) != 1)
+    return false;
+
+  return recv(fd, rep, sizeof(*rep), 0) >= (ssize_t)I2C_ARBITER_REPLY_SIZE(0);
+}
+
+/**
+ * @return true if the reply is a valid status block
+ */
+bool status_valid(const struct i2c_arbiter_result *r) {
+  uint8_t sum = 0;
+  int i;
+
+  if ((r->status != 0) || (r->rlen != I3C_STATUS_LEN) ||
+      (r->rbuf[I3C_STATUS_LENGTH] != I3C_STATUS_LEN))
+    return false;
+
+  for (i = 0; i < I3C_STATUS_CHECKSUM; i++)
+    sum += r->rbuf[i];
+
+  return r->rbuf[I3C_STATUS_CHECKSUM] == (uint8_t)~sum;
+}
+
+///// Batch replies /////
+
+/*
+ * One batch to the lever, to an address without a device and to the
+ * Ampel: one result per transfer, in order, the error does not stop the
+ * batch.
+ */
+void check_batch(const char *path) {
+  struct i2c_arbiter_request req;
+  struct i2c_arbiter_reply rep;
+
+  const int fd = arbiter_connect(path);
+  CHECK(fd >= 0, "cannot connect to %s", path);
+  if (fd < 0)
+    return;
+
+  memset(&req, 0, sizeof(req));
+  req.prio = I2C_PRIO_NORMAL;
+  add_getstatus(&req, I3C_ADDR_LEVER);
+  add_getstatus(&req, ADDR_NONE);
+  add_getstatus(&req, I3C_ADDR_AMPEL);
+
+  memset(&rep, 0, sizeof(rep));
+  CHECK(send_batch(fd, &req), "batch not sent");
+  CHECK(recv_reply(fd, &rep), "no batch reply");
+
+  CHECK(rep.count == 3, "batch reply with %u results instead of 3", rep.count);
+  CHECK(status_valid(&rep.results[0]), "no lever status in the batch reply (%d)",
+        rep.results[0].status);
+  CHECK(rep.results[1].status == -ENXIO, "transfer to 0x%02x: %d instead of -ENXIO",
+        ADDR_NONE, rep.results[1].status);
+  CHECK(status_valid(&rep.results[2]), "no Ampel status in the batch reply (%d)",
+        rep.results[2].status);
+
+  // a malformed batch gets an empty reply
+  req.count = 0;
+  CHECK(send(fd, &req, I2C_ARBITER_REQUEST_SIZE(1), 0) > 0, "empty batch not sent");
+  CHECK(recv_reply(fd, &rep) && (rep.count == 0), "empty batch not rejected");
+
+  close(fd);
+  printf("batch: %s\n", failures ? "failed" : "ok");
+}
+
+///// Priorities /////
+
+/*
+ * With the arbiter stopped, one client queues LOW_BATCHES full batches at
+ * low priority, then another one batch at high priority. The high batch
+ * must overtake all low batches but the one taken before it arrived.
+ */
+void check_priority(const char *path, pid_t arbiter) {
+  struct i2c_arbiter_request req;
+  struct i2c_arbiter_reply rep;
+  const int before = failures;
+  int i;
+
+  const int low = arbiter_connect(path);
+  const int high = arbiter_connect(path);
+  CHECK((low >= 0) && (high >= 0), "cannot connect to %s", path);
+  if ((low < 0) || (high < 0))
+    return;
+
+  CHECK(kill(arbiter, SIGSTOP) == 0, "cannot stop the arbiter");
+
+  memset(&req, 0, sizeof(req));
+  req.prio = I2C_PRIO_LOW;
+  while (req.count < I2C_ARBITER_BATCH_MAX)
+    add_getstatus(&req, I3C_ADDR_LEVER);
+  for (i = 0; i < LOW_BATCHES; i++)
+    CHECK(send_batch(low, &req), "low batch %d not sent", i);
+
+  memset(&req, 0, sizeof(req));
+  req.prio = I2C_PRIO_HIGH;
+  add_getstatus(&req, I3C_ADDR_AMPEL);
+  CHECK(send_batch(high, &req), "high batch not sent");
+
+  CHECK(kill(arbiter, SIGCONT) == 0, "cannot continue the arbiter");
+
+  // replies in the order they come
+  struct pollfd pfd[2] = {
+    { .fd = low,  .events = POLLIN },
+    { .fd = high, .events = POLLIN },
+  };
+  int lows = 0, lows_first = -1;
+  while ((lows < LOW_BATCHES) || (lows_first < 0)) {
+    if (poll(pfd, 2, REPLY_TIMEOUT_MS) < 1) {
+      CHECK(0, "replies missing: %d of %d low, high %s", lows, LOW_BATCHES,
+            (lows_first < 0) ? "missing" : "received");
+      break;
+    }
+    // the high reply first if both are there
+    if (pfd[1].revents & POLLIN) {
+      CHECK(recv_reply(high, &rep), "no high reply");
+      CHECK((rep.count == 1) && status_valid(&rep.results[0]), "bad high reply");
+      lows_first = lows;
+      pfd[1].fd = -1;
+    } else if (pfd[0].revents & POLLIN) {
+      CHECK(recv_reply(low, &rep), "no low reply");
+      CHECK(rep.count == I2C_ARBITER_BATCH_MAX, "low reply with %u results", rep.count);
+      for (i = 0; i < rep.count; i++)
+        CHECK(status_valid(&rep.results[i]), "bad low reply %d", i);
+      lows++;
+    }
+  }
+
+  CHECK((lows_first >= 0) && (lows_first <= 1),
+        "high batch behind %d low batches", lows_first);
+
+  close(low);
+  close(high);
+  printf("priority: %s, high reply after %d of %d low batches\n",
+         (failures == before) ? "ok" : "failed", lows_first, LOW_BATCHES);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s <arbiter socket> <arbiter pid>\n", argv[0]);
+    return 2;
+  }
+
+  check_batch(argv[1]);
+  check_priority(argv[1], atoi(argv[2]));
+
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Run the arbiter against the emulated controllers and check the batch
+# replies, the priority order and the metrics per device address.
+# Used by "make check", needs ../emulator/emulator.
+
+dir=$(mktemp -d)
+emu_sock=$dir/emulator.sock
+arb_sock=$dir/arbiter.sock
+emu=
+arb=
+
+cleanup() {
+  [ -n "$arb" ] && kill -TERM $arb 2>/dev/null
+  [ -n "$emu" ] && kill -TERM $emu 2>/dev/null
+  wait
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  echo "--- arbiter log"
+  cat $dir/arbiter.log
+  exit 1
+}
+
+wait_socket() {
+  i=0
+  while [ ! -S "$1" ]; do
+    i=$((i + 1))
+    [ $i -gt 50 ] && fail "no socket $1"
+    sleep 0.1
+  done
+}
+
+../emulator/emulator -s $emu_sock </dev/null 2>$dir/emulator.log &
+emu=$!
+wait_socket $emu_sock
+
+./i2carbiter -d unix:$emu_sock -s $arb_sock -v 2>$dir/arbiter.log &
+arb=$!
+wait_socket $arb_sock
+
+./arbiter_check $arb_sock $arb || fail "arbiter_check"
+
+# the metrics are logged on exit
+kill -TERM $arb
+wait $arb
+arb=
+
+# lever: 1 in the batch, 6 batches of 8 queued at low priority
+# Ampel: 1 in the batch, 1 at high priority
+# 0x50: nothing there
+grep -q "Device 0x24: 49 transfers, 0 errors, queue depth 0 (max" $dir/arbiter.log ||
+  fail "lever transfers"
+grep -q "Device 0x20: 2 transfers, 0 errors, queue depth 0 (max 1)" $dir/arbiter.log ||
+  fail "Ampel transfers"
+grep -q "Device 0x50: 1 transfers, 1 errors, queue depth 0 (max 1)" $dir/arbiter.log ||
+  fail "transfers to no device"
+
+max=$(sed -n 's/.*Device 0x24: .*(max \([0-9]*\)).*/\1/p' $dir/arbiter.log)
+[ "$max" -ge 8 ] || fail "lever queue depth max $max, a full batch is 8"
+
+grep -q "Device 0x24 wait: 49 samples" $dir/arbiter.log || fail "lever wait samples"
+grep -q "Device 0x20 wait: 2 samples" $dir/arbiter.log || fail "Ampel wait samples"
+
+echo "metrics: ok, lever queue depth max $max"
+grep "Device 0x.. wait:.*samples" $dir/arbiter.log | sed 's/^[^:]*: //'
@@ -0,0 +1,459 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <syslog.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+#include "i2c_transport.h"
+#include "i2c_arbiter.h"
+#include "evloop.h"
+#include "latency.h"
+
+/*
+ * The I2C bus arbiter owns the I2C bus and runs the transfers of all
+ * clients (statusswitch, ledcontrol, ...) one batch at a time. Pending
+ * batches are kept in a priority queue, so a lever read never waits behind
+ * a queue of light updates.
+ */
+
+const char* I2C_BUS		= "1";
+
+#define ARBITER_CLIENTS_MAX	8
+#define ARBITER_QUEUE_MAX	32
+
+///// Clients /////
+
+struct arbiter_client {
+  int      fd;		// -1 if the slot is free
+  uint32_t gen;		// generation, detects replies to a reused slot
+};
+
+struct arbiter_client clients[ARBITER_CLIENTS_MAX];
+
+///// Priority queue /////
+
+struct arbiter_batch {
+  uint8_t  client;
+  uint32_t gen;
+  uint32_t seq;		// arrival order for equal priorities
+  uint64_t enqueued_us;
+  struct i2c_arbiter_request req;
+};
+
+struct arbiter_queue {
+  int      count;
+  uint32_t seq;
+  struct arbiter_batch *heap[ARBITER_QUEUE_MAX];
+  struct arbiter_batch  slots[ARBITER_QUEUE_MAX];
+  struct arbiter_batch *free[ARBITER_QUEUE_MAX];
+  int      free_count;
+} queue;
+
+/**
+ * @return true if batch a has to run before batch b
+ */
+static bool batch_before(const struct arbiter_batch *a,
+                         const struct arbiter_batch *b) {
+  if (a->req.prio != b->req.prio)
+    return a->req.prio > b->req.prio;
+
+  // unsigned difference copes with wrap-around
+  return (int32_t)(a->seq - b->seq) < 0;
+}
+
+void queue_init(struct arbiter_queue *q) {
+  q->count = 0;
+  q->seq = 0;
+  q->free_count = ARBITER_QUEUE_MAX;
+
+  int i;
+  for (i = 0; i < ARBITER_QUEUE_MAX; i++)
+    q->free[i] = &q->slots[i];
+}
+
+struct arbiter_batch *queue_alloc(struct arbiter_queue *q) {
+  if (!q->free_count)
+    return NULL;
+
+  return q->free[--q->free_count];
+}
+
+void queue_push(struct arbiter_queue *q, struct arbiter_batch *b) {
+  b->seq = q->seq++;
+
+  // sift up
+  int i = q->count++;
+  while (i > 0) {
+    const int parent = (i - 1) / 2;
+    if (!batch_before(b, q->heap[parent]))
+      break;
+    q->heap[i] = q->heap[parent];
+    i = parent;
+  }
+  q->heap[i] = b;
+}
+
+struct arbiter_batch *queue_pop(struct arbiter_queue *q) {
+  if (!q->count)
+    return NULL;
+
+  struct arbiter_batch *top = q->heap[0];
+  struct arbiter_batch *last = q->heap[--q->count];
+
+  // sift down
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= q->count)
+      break;
+    if ((child + 1 < q->count) && batch_before(q->heap[child + 1], q->heap[child]))
+      child++;
+    if (!batch_before(q->heap[child], last))
+      break;
+    q->heap[i] = q->heap[child];
+    i = child;
+  }
+  if (q->count)
+    q->heap[i] = last;
+
+  return top;
+}
+
+void queue_free(struct arbiter_queue *q, struct arbiter_batch *b) {
+  q->free[q->free_count++] = b;
+}
+
+///// Metrics /////
+
+/**
+ * Metrics per device address
+ */
+struct device_metrics {
+  uint32_t depth;	// transfers currently queued
+  uint32_t max_depth;
+  uint32_t transfers;
+  uint32_t errors;
+  struct latency_hist wait;	// from arrival to start on the bus
+};
+
+struct device_metrics metrics[128];
+
+void metrics_log(void) {
+  char name[32];
+
+  syslog(LOG_INFO, "Queue: %d batches pending.", queue.count);
+
+  int addr;
+  for (addr = 0; addr < 128; addr++) {
+    const struct device_metrics *m = &metrics[addr];
+    if (!m->transfers && !m->depth)
+      continue;
+
+    syslog(LOG_INFO, "Device 0x%02x: %u transfers, %u errors, queue depth %u (max %u).",
+                     addr, m->transfers, m->errors, m->depth, m->max_depth);
+    snprintf(name, sizeof(name), "Device 0x%02x wait", addr);
+    latency_log(&m->wait, name);
+  }
+}
+
+///// Bus /////
+
+struct i2c_transport i2c_bus;
+
+/**
+ * Signalled while the queue is not empty, so that the loop runs one batch
+ * per round and still picks up new requests in between.
+ */
+int queue_event_fd;
+
+void queue_signal(void) {
+  const uint64_t one = 1;
+  if (write(queue_event_fd, &one, sizeof(one)) < 0)
+    syslog(LOG_ERR, "Error %d on queue signal!", errno);
+}
+
+void batch_run(struct arbiter_batch *b) {
+  struct i2c_arbiter_reply rep;
+  const uint64_t start = latency_now_us();
+
+  memset(&rep, 0, I2C_ARBITER_REPLY_SIZE(b->req.count));
+  rep.count = b->req.count;
+
+  int i;
+  for (i = 0; i < b->req.count; i++) {
+    const struct i2c_arbiter_xfer *x = &b->req.xfers[i];
+    struct device_metrics *m = &metrics[x->addr & 0x7f];
+
+    latency_record(&m->wait, start - b->enqueued_us);
+    m->depth--;
+    m->transfers++;
+
+    rep.results[i].rlen = x->rlen;
+    rep.results[i].status = i2c_transfer(&i2c_bus, x->addr,
+                                         x->wbuf, x->wlen,
+                                         rep.results[i].rbuf, x->rlen);
+    if (rep.results[i].status)
+      m->errors++;
+  }
+
+  // the client may be gone in the meantime
+  const struct arbiter_client *c = &clients[b->client];
+  if ((c->fd >= 0) && (c->gen == b->gen))
+    send(c->fd, &rep, I2C_ARBITER_REPLY_SIZE(rep.count), MSG_NOSIGNAL);
+}
+
+void queue_callback(struct evloop *loop, int fd,
+                    uint32_t events, void *arg) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0)
+    return;
+
+  struct arbiter_batch *b = queue_pop(&queue);
+  if (!b)
+    return;
+
+  batch_run(b);
+  queue_free(&queue, b);
+
+  if (queue.count)
+    queue_signal();
+}
+
+///// Client connections /////
+
+void client_close(struct evloop *loop, int idx) {
+  struct arbiter_client *c = &clients[idx];
+
+  evloop_del(loop, c->fd);
+  close(c->fd);
+  c->fd = -1;
+  c->gen++;
+}
+
+/**
+ * Answer a batch without running it.
+ */
+void client_reject(int fd, const struct i2c_arbiter_request *req, int status) {
+  struct i2c_arbiter_reply rep;
+  memset(&rep, 0, sizeof(rep));
+
+  rep.count = req->count;
+  int i;
+  for (i = 0; i < rep.count; i++)
+    rep.results[i].status = status;
+
+  send(fd, &rep, I2C_ARBITER_REPLY_SIZE(rep.count), MSG_NOSIGNAL);
+}
+
+void client_callback(struct evloop *loop, int fd,
+                     uint32_t events, void *arg) {
+  const int idx = (intptr_t)arg;
+  struct arbiter_client *c = &clients[idx];
+  struct i2c_arbiter_request req;
+
+  const ssize_t len = recv(fd, &req, sizeof(req), MSG_DONTWAIT);
+  if (len < 0) {
+    if ((errno != EAGAIN) && (errno != EINTR))
+      client_close(loop, idx);
+    return;
+  }
+  if (len == 0) {
+    // orderly shutdown
+    client_close(loop, idx);
+    return;
+  }
+
+  // reject malformed batches with an empty reply
+  if ((len < I2C_ARBITER_REQUEST_SIZE(1)) ||
+      (req.count < 1) ||
+      (req.count > I2C_ARBITER_BATCH_MAX) ||
+      (len < I2C_ARBITER_REQUEST_SIZE(req.count))) {
+    req.count = 0;
+    client_reject(fd, &req, -EINVAL);
+    return;
+  }
+
+  struct arbiter_batch *b = queue_alloc(&queue);
+  if (!b) {
+    syslog(LOG_WARNING, "Queue full, batch rejected!");
+    client_reject(fd, &req, -EBUSY);
+    return;
+  }
+
+  memcpy(&b->req, &req, len);
+
+  int i;
+  for (i = 0; i < b->req.count; i++) {
+    struct i2c_arbiter_xfer *x = &b->req.xfers[i];
+    if (x->wlen > I2C_TRANSFER_MAX)
+      x->wlen = I2C_TRANSFER_MAX;
+    if (x->rlen > I2C_TRANSFER_MAX)
+      x->rlen = I2C_TRANSFER_MAX;
+
+    struct device_metrics *m = &metrics[x->addr & 0x7f];
+    m->depth++;
+    if (m->depth > m->max_depth)
+      m->max_depth = m->depth;
+  }
+
+  b->client = idx;
+  b->gen = c->gen;
+  b->enqueued_us = latency_now_us();
+  queue_push(&queue, b);
+  queue_signal();
+}
+
+void listen_callback(struct evloop *loop, int fd,
+                     uint32_t events, void *arg) {
+  const int cfd = accept(fd, NULL, NULL);
+  if (cfd < 0)
+    return;
+
+  int idx;
+  for (idx = 0; idx < ARBITER_CLIENTS_MAX; idx++)
+    if (clients[idx].fd < 0)
+      break;
+
+  if ((idx == ARBITER_CLIENTS_MAX) ||
+      (evloop_add(loop, cfd, EPOLLIN, client_callback, (void *)(intptr_t)idx) < 0)) {
+    syslog(LOG_WARNING, "Too many clients, connection refused.");
+    close(cfd);
+    return;
+  }
+
+  clients[idx].fd = cfd;
+}
+
+int listen_socket(const char *path) {
+  const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_un sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+
+  // remove a stale socket of an earlier run
+  unlink(path);
+
+  if ((bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+      (listen(fd, ARBITER_CLIENTS_MAX) < 0)) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+///// Main /////
+
+void signal_callback(struct evloop *loop, int fd,
+                     uint32_t signo, void *arg) {
+  if (signo == SIGUSR1)
+    metrics_log();
+  else
+    evloop_stop(loop);
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d bus] [-s socket] [-v]\n"
+          "  -d  I2C bus number, \"fake\" or unix:<socket> of the emulator\n"
+          "      (default %s)\n"
+          "  -s  socket path (default %s)\n"
+          "  -v  log to stderr as well\n",
+          name, I2C_BUS, I2C_ARBITER_SOCKET);
+}
+
+int main(int argc, char *argv[]) {
+  const char *i2c_bus_spec = I2C_BUS;
+  const char *socket_path = I2C_ARBITER_SOCKET;
+  int log_options = LOG_CONS | LOG_PID;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:s:vh")) != -1) {
+    switch (opt) {
+      case 'd': i2c_bus_spec = optarg; break;
+      case 's': socket_path = optarg; break;
+      case 'v': log_options |= LOG_PERROR; break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  // initialize the system logging
+  openlog("i2carbiter", log_options, LOG_USER);
+  syslog(LOG_INFO, "Starting I2C bus arbiter.");
+
+  // the arbiter cannot forward to itself, but to the emulator
+  const char *backend = (strcmp(i2c_bus_spec, "arbiter") == 0) ? I2C_ARBITER_SOCKET :
+                        (strncmp(i2c_bus_spec, "unix:", 5) == 0) ? i2c_bus_spec + 5 : NULL;
+  if (backend && (strcmp(backend, socket_path) == 0)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  int ret = i2c_transport_open(&i2c_bus, i2c_bus_spec);
+  if (ret < 0) {
+    syslog(LOG_EMERG, "Error on I2C initialization of bus %s: %s!",
+                      i2c_bus_spec, strerror(-ret));
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < ARBITER_CLIENTS_MAX; i++)
+    clients[i].fd = -1;
+  queue_init(&queue);
+
+  const int listen_fd = listen_socket(socket_path);
+  if (listen_fd < 0) {
+    syslog(LOG_EMERG, "Error %d on socket %s!", errno, socket_path);
+    return -1;
+  }
+
+  queue_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  struct evloop loop;
+  if ((queue_event_fd < 0) || (evloop_init(&loop) < 0)) {
+    syslog(LOG_ERR, "Error %d on event loop initialization!", errno);
+    return -1;
+  }
+
+  static const int signals[] = { SIGINT, SIGTERM, SIGUSR1, 0 };
+  evloop_add_signals(&loop, signals, signal_callback, NULL);
+  evloop_add(&loop, listen_fd, EPOLLIN, listen_callback, NULL);
+  evloop_add(&loop, queue_event_fd, EPOLLIN, queue_callback, NULL);
+
+  syslog(LOG_INFO, "Serving bus %s on %s.", i2c_bus_spec, socket_path);
+
+  evloop_run(&loop);
+  evloop_close(&loop);
+
+  metrics_log();
+
+  for (i = 0; i < ARBITER_CLIENTS_MAX; i++)
+    if (clients[i].fd >= 0)
+      close(clients[i].fd);
+  close(listen_fd);
+  close(queue_event_fd);
+  unlink(socket_path);
+
+  i2c_transport_close(&i2c_bus);
+
+  syslog(LOG_INFO, "I2C bus arbiter finished.");
+  closelog();
+
+  return 0;
+}
@@ -0,0 +1,295 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "i3c_protocol.h"
+#include "command.h"
+
+///// Text form /////
+
+enum command_word {
+  WORD_NONE,
+  WORD_RED,
+  WORD_GREEN,
+  WORD_OFF,
+  WORD_BLINK,
+  WORD_LEVEL,
+  WORD_PATTERN
+};
+
+/**
+ * Look up a word by its length and, where lengths collide, its first
+ * character, so each word costs one memcmp at most.
+ */
+static int word_lookup(const char *s, size_t len) {
+  switch (len) {
+    case 3:
+      switch (s[0]) {
+        case 'r': return memcmp(s, "red", 3) ? WORD_NONE : WORD_RED;
+        case 'o': return memcmp(s, "off", 3) ? WORD_NONE : WORD_OFF;
+      }
+      break;
+    case 5:
+      switch (s[0]) {
+        case 'g': return memcmp(s, "green", 5) ? WORD_NONE : WORD_GREEN;
+        case 'b': return memcmp(s, "blink", 5) ? WORD_NONE : WORD_BLINK;
+        case 'l': return memcmp(s, "level", 5) ? WORD_NONE : WORD_LEVEL;
+      }
+      break;
+    case 7:
+      return memcmp(s, "pattern", 7) ? WORD_NONE : WORD_PATTERN;
+  }
+
+  return WORD_NONE;
+}
+
+/**
+ * A word of the payload, optionally with a value after '='
+ */
+struct token {
+  const char *text;		// the word without the value
+  size_t      len;
+  int         word;
+  const char *value;		// NULL without '='
+  size_t      value_len;
+};
+
+/**
+ * Take the next word.
+ *
+ * @param pos Read position, advanced past the word
+ * @return false at the end of the payload
+ */
+static bool token_next(const char **pos, const char *end, struct token *t) {
+  const char *p = *pos;
+
+  while ((p < end) && ((unsigned char)*p <= ' '))
+    p++;
+  if (p == end)
+    return false;
+
+  t->text = p;
+  while ((p < end) && ((unsigned char)*p > ' ') && (*p != '='))
+    p++;
+  t->len = p - t->text;
+  t->word = word_lookup(t->text, t->len);
+  t->value = NULL;
+  t->value_len = 0;
+
+  if ((p < end) && (*p == '=')) {
+    t->value = ++p;
+    while ((p < end) && ((unsigned char)*p > ' '))
+      p++;
+    t->value_len = p - t->value;
+  }
+
+  *pos = p;
+  return true;
+}
+
+/**
+ * Decimal number without sign, at most 5 digits.
+ */
+static int number_parse(const char *s, size_t len,
+                        unsigned int min, unsigned int max, unsigned int *val) {
+  if (!len || (len > 5))
+    return COMMAND_SYNTAX;
+
+  unsigned int n = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    if ((s[i] < '0') || (s[i] > '9'))
+      return COMMAND_SYNTAX;
+    n = n * 10 + (s[i] - '0');
+  }
+
+  if ((n < min) || (n > max))
+    return COMMAND_RANGE;
+
+  *val = n;
+  return COMMAND_OK;
+}
+
+/**
+ * A word that is known but not allowed here is a syntax error.
+ */
+static int token_error(const struct token *t) {
+  return (t->word == WORD_NONE) ? COMMAND_UNKNOWN : COMMAND_SYNTAX;
+}
+
+static int pattern_parse(const char *pos, const char *end,
+                         const struct token *first, struct ampel_command *cmd) {
+  struct token t;
+  const char *value = first->value;
+  size_t value_len = first->value_len;
+
+  // "pattern 3" or "pattern=3"
+  if (!value) {
+    if (!token_next(&pos, end, &t))
+      return COMMAND_SYNTAX;
+    if (t.value)
+      return COMMAND_SYNTAX;
+    value = t.text;
+    value_len = t.len;
+  }
+  if (token_next(&pos, end, &t))
+    return COMMAND_SYNTAX;
+
+  unsigned int slot;
+  const int ret = number_parse(value, value_len, 0, AMPEL_PATTERN_SLOTS, &slot);
+  if (ret != COMMAND_OK)
+    return ret;
+
+  cmd->kind = COMMAND_PATTERN;
+  cmd->slot = slot;
+  return COMMAND_OK;
+}
+
+static int text_parse(const char *pos, const char *end, struct ampel_command *cmd) {
+  struct token t;
+
+  if (!token_next(&pos, end, &t))
+    return COMMAND_SYNTAX;
+
+  switch (t.word) {
+    case WORD_PATTERN:
+      return pattern_parse(pos, end, &t, cmd);
+    case WORD_RED:   cmd->state.red   = true; break;
+    case WORD_GREEN: cmd->state.green = true; break;
+    case WORD_OFF:   break;
+    default:
+      return token_error(&t);
+  }
+  if (t.value)
+    return COMMAND_SYNTAX;
+
+  // options of the light
+  while (token_next(&pos, end, &t)) {
+    unsigned int val;
+    int ret;
+
+    switch (t.word) {
+      case WORD_BLINK:
+        if (!cmd->state.red && !cmd->state.green)
+          return COMMAND_SYNTAX;
+        val = COMMAND_BLINK_DEFAULT_MS;
+        if (t.value) {
+          ret = number_parse(t.value, t.value_len,
+                             COMMAND_BLINK_MIN_MS, UINT16_MAX, &val);
+          if (ret != COMMAND_OK)
+            return ret;
+        }
+        cmd->state.blink = true;
+        cmd->state.blink_ms = val;
+        break;
+      case WORD_LEVEL:
+        if (!t.value)
+          return COMMAND_SYNTAX;
+        ret = number_parse(t.value, t.value_len, 0, COMMAND_LEVEL_MAX, &val);
+        if (ret != COMMAND_OK)
+          return ret;
+        cmd->state.level = val;
+        break;
+      default:
+        return token_error(&t);
+    }
+  }
+
+  return COMMAND_OK;
+}
+
+///// Binary form /////
+
+static int binary_parse(const uint8_t *p, size_t len, struct ampel_command *cmd) {
+  switch (p[0]) {
+    case COMMAND_BINARY_LIGHT: {
+      if ((len != 2) && (len != 3) && (len != 5))
+        return COMMAND_LENGTH;
+
+      const uint8_t light = p[1];
+      const uint8_t color = light & AMPEL_VAL_COLOR;
+      if ((light & ~(AMPEL_VAL_COLOR | AMPEL_VAL_BLINK)) || (color > AMPEL_VAL_GREEN))
+        return COMMAND_RANGE;
+      if ((light & AMPEL_VAL_BLINK) && !color)
+        return COMMAND_RANGE;
+
+      cmd->state.red   = (color == AMPEL_VAL_RED);
+      cmd->state.green = (color == AMPEL_VAL_GREEN);
+      cmd->state.blink = light & AMPEL_VAL_BLINK;
+      if (len > 2)
+        cmd->state.level = p[2];
+
+      if (cmd->state.blink) {
+        const uint16_t period = (len > 3) ? (p[3] | (p[4] << 8)) : 0;
+        if (period && (period < COMMAND_BLINK_MIN_MS))
+          return COMMAND_RANGE;
+        cmd->state.blink_ms = period ? period : COMMAND_BLINK_DEFAULT_MS;
+      }
+      return COMMAND_OK;
+    }
+
+    case COMMAND_BINARY_PATTERN:
+      if (len != 2)
+        return COMMAND_LENGTH;
+      if (p[1] > AMPEL_PATTERN_SLOTS)
+        return COMMAND_RANGE;
+
+      cmd->kind = COMMAND_PATTERN;
+      cmd->slot = p[1];
+      return COMMAND_OK;
+  }
+
+  return COMMAND_UNKNOWN;
+}
+
+///// Interface /////
+
+int command_parse(const void *payload, size_t len, struct ampel_command *cmd) {
+  const uint8_t *p = payload;
+
+  memset(cmd, 0, sizeof(*cmd));
+  cmd->kind = COMMAND_LIGHT;
+  cmd->state.level = COMMAND_LEVEL_MAX;
+
+  // a cleared retained message switches off
+  if (!len)
+    return COMMAND_OK;
+
+  if (p[0] < ' ')
+    return binary_parse(p, len, cmd);
+
+  return text_parse(payload, (const char *)payload + len, cmd);
+}
+
+int command_parse_counted(struct command_stats *stats, const void *payload,
+                          size_t len, struct ampel_command *cmd) {
+  const int ret = command_parse(payload, len, cmd);
+
+  if (ret == COMMAND_OK)
+    stats->accepted++;
+  else
+    stats->rejected[ret]++;
+
+  return ret;
+}
+
+const char *command_strerror(int error) {
+  switch (error) {
+    case COMMAND_OK:      return "ok";
+    case COMMAND_UNKNOWN: return "unknown command";
+    case COMMAND_SYNTAX:  return "syntax error";
+    case COMMAND_RANGE:   return "value out of range";
+    case COMMAND_LENGTH:  return "wrong length";
+  }
+
+  return "unknown error";
+}
+
+void command_stats_log(const struct command_stats *stats) {
+  syslog(LOG_INFO, "Payloads: %u accepted, rejected %u unknown, %u syntax, "
+                   "%u range, %u length.",
+                   stats->accepted,
+                   stats->rejected[COMMAND_UNKNOWN], stats->rejected[COMMAND_SYNTAX],
+                   stats->rejected[COMMAND_RANGE], stats->rejected[COMMAND_LENGTH]);
+}
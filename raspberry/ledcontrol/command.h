@@ -0,0 +1,97 @@
+#ifndef _COMMAND_H_
+#define _COMMAND_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Commands for the Ampel as received on MQTT. The parser works on the
+ * payload as it is, without copying and without relying on a trailing
+ * NUL, and fills a fixed-size record for the actuator.
+ *
+ * Text form, words separated by blanks:
+ *	""			light off (a cleared retained message)
+ *	red|green|off		light
+ *	red blink		blinking with the default period
+ *	red level=128 blink=500	brightness 0..255, blink period in ms
+ *	pattern 3, pattern=3	start pattern 1..AMPEL_PATTERN_SLOTS, 0 stops
+ *
+ * Binary form, the first byte is below any printable character:
+ *	0x01 light [level [period_lo period_hi]]
+ *				light as AMPEL_VAL_*, a period of 0
+ *				keeps the default
+ *	0x02 slot		start a pattern
+ */
+
+#define COMMAND_LEVEL_MAX	255
+#define COMMAND_BLINK_MIN_MS	2
+#define COMMAND_BLINK_DEFAULT_MS 1280	// as in the Ampel firmware
+
+#define COMMAND_BINARY_LIGHT	0x01
+#define COMMAND_BINARY_PATTERN	0x02
+
+struct ampel_state_t {
+  bool     red;
+  bool     green;
+  bool     blink;
+  uint8_t  level;		// brightness
+  uint16_t blink_ms;		// period while blinking, else 0
+};
+
+enum command_kind {
+  COMMAND_LIGHT,
+  COMMAND_PATTERN,
+  COMMAND_LOG,			// log the actuator counters
+  COMMAND_STOP			// apply what is pending and end the thread
+};
+
+struct ampel_command {
+  uint8_t  kind;
+  uint8_t  slot;		// COMMAND_PATTERN
+  struct ampel_state_t state;	// COMMAND_LIGHT
+  uint16_t light;		// index in the device table, set by the router
+  uint64_t received_us;		// for the command latency
+};
+
+/**
+ * Why a payload was rejected
+ */
+enum command_error {
+  COMMAND_OK = 0,
+  COMMAND_UNKNOWN,		// unknown word or binary tag
+  COMMAND_SYNTAX,		// known words in a wrong order or form
+  COMMAND_RANGE,		// value out of range
+  COMMAND_LENGTH,		// binary payload of a wrong length
+  COMMAND_ERRORS
+};
+
+struct command_stats {
+  uint32_t accepted;
+  uint32_t rejected[COMMAND_ERRORS];
+};
+
+/**
+ * Parse an MQTT payload.
+ *
+ * @param payload The payload, need not be NUL-terminated
+ * @param len Its length in bytes
+ * @param cmd The command, undefined on errors
+ * @return COMMAND_OK or the reason for the rejection
+ */
+int command_parse(const void *payload, size_t len, struct ampel_command *cmd);
+
+/**
+ * Parse and count the result.
+ */
+int command_parse_counted(struct command_stats *stats, const void *payload,
+                          size_t len, struct ampel_command *cmd);
+
+const char *command_strerror(int error);
+
+/**
+ * Write the counters to syslog.
+ */
+void command_stats_log(const struct command_stats *stats);
+
+#endif
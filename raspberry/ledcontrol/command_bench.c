@@ -0,0 +1,293 @@
+/*
+ * Microbenchmark and fuzzer for the command parser, see "make bench" and
+ * "make fuzz". Runs on the host without bus or MQTT.
+ *
+ * The benchmark compares the parser with the strcmp chain it replaced,
+ * which needed a NUL-terminated copy of the payload. The fuzzer feeds
+ * mutated payloads in buffers of their exact size and checks every
+ * accepted command for consistency and by a round trip through its text
+ * form; build it with the sanitizers to catch reads past the payload.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i3c_protocol.h"
+#include "command.h"
+
+struct sample {
+  const char *name;
+  const char *payload;
+  size_t      len;
+};
+
+#define TEXT(name, s)	{ name, s, sizeof(s) - 1 }
+
+static const struct sample corpus[] = {
+  TEXT("off (empty)", ""),
+  TEXT("red", "red"),
+  TEXT("green blink", "green blink"),
+  TEXT("structured", "red level=128 blink=500"),
+  TEXT("pattern", "pattern 3"),
+  TEXT("binary light", "\x01\x0a\x80\xf4\x01"),
+  TEXT("binary pattern", "\x02\x03"),
+  TEXT("unknown", "purple"),
+  TEXT("out of range", "green level=300"),
+};
+
+#define CORPUS_SIZE	(sizeof(corpus) / sizeof(corpus[0]))
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+///// Benchmark /////
+
+/**
+ * The parser before, for comparison: copy, then try every string.
+ */
+static int legacy_parse(const void *payload, size_t len, struct ampel_command *cmd) {
+  char command[64];
+  unsigned int slot;
+
+  if (len >= sizeof(command))
+    len = sizeof(command) - 1;
+  memcpy(command, payload, len);
+  command[len] = 0;
+
+  memset(cmd, 0, sizeof(*cmd));
+  if (sscanf(command, "pattern %u", &slot) == 1) {
+    cmd->kind = COMMAND_PATTERN;
+    cmd->slot = slot;
+  } else if (strcmp(command, "red") == 0) {
+    cmd->state.red = true;
+  } else if (strcmp(command, "green") == 0) {
+    cmd->state.green = true;
+  } else if (strcmp(command, "red blink") == 0) {
+    cmd->state.red = true;
+    cmd->state.blink = true;
+  } else if (strcmp(command, "green blink") == 0) {
+    cmd->state.green = true;
+    cmd->state.blink = true;
+  }
+
+  return COMMAND_OK;
+}
+
+static double bench_one(int (*parse)(const void *, size_t, struct ampel_command *),
+                        const struct sample *s, unsigned int rounds) {
+  struct ampel_command cmd;
+  volatile uint8_t sink = 0;
+
+  const uint64_t start = now_ns();
+  unsigned int i;
+  for (i = 0; i < rounds; i++) {
+    sink += parse(s->payload, s->len, &cmd);
+    sink += cmd.state.red;
+  }
+
+  return (double)(now_ns() - start) / rounds;
+}
+
+static void bench(unsigned int rounds) {
+  printf("%-16s %10s %10s  %s\n", "payload", "ns/parse", "legacy", "result");
+
+  size_t i;
+  for (i = 0; i < CORPUS_SIZE; i++) {
+    struct ampel_command cmd;
+    const int ret = command_parse(corpus[i].payload, corpus[i].len, &cmd);
+
+    printf("%-16s %10.1f %10.1f  %s\n", corpus[i].name,
+           bench_one(command_parse, &corpus[i], rounds),
+           bench_one(legacy_parse, &corpus[i], rounds),
+           command_strerror(ret));
+  }
+}
+
+///// Fuzzer /////
+
+static uint32_t rng = 0x2545f491;
+
+static uint32_t xorshift(void) {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+/**
+ * Words and bytes the mutations splice in, so they reach deep into the
+ * grammar instead of failing at the first word.
+ */
+static const char *dictionary[] = {
+  "red", "green", "off", "blink", "level", "pattern", "=", " ", "\t",
+  "0", "2", "255", "256", "65535", "65536", "99999", "\x01", "\x02", "\x08",
+};
+
+#define DICTIONARY_SIZE	(sizeof(dictionary) / sizeof(dictionary[0]))
+#define FUZZ_MAXLEN	48
+
+static size_t mutate(uint8_t *buf, size_t len) {
+  const unsigned int n = 1 + xorshift() % 4;
+  unsigned int i;
+
+  for (i = 0; i < n; i++) {
+    const size_t pos = len ? xorshift() % (len + 1) : 0;
+
+    switch (xorshift() % 5) {
+      case 0:				// flip a bit
+        if (pos < len)
+          buf[pos] ^= 1 << (xorshift() % 8);
+        break;
+      case 1:				// random byte
+        if (pos < len)
+          buf[pos] = xorshift();
+        break;
+      case 2:				// truncate
+        len = pos;
+        break;
+      case 3: {				// insert a word
+        const char *w = dictionary[xorshift() % DICTIONARY_SIZE];
+        const size_t wlen = strlen(w);
+        if (len + wlen <= FUZZ_MAXLEN) {
+          memmove(buf + pos + wlen, buf + pos, len - pos);
+          memcpy(buf + pos, w, wlen);
+          len += wlen;
+        }
+        break;
+      }
+      case 4:				// delete a byte
+        if (pos < len) {
+          memmove(buf + pos, buf + pos + 1, len - pos - 1);
+          len--;
+        }
+        break;
+    }
+  }
+
+  return len;
+}
+
+static bool command_equal(const struct ampel_command *a, const struct ampel_command *b) {
+  return (a->kind == b->kind) && (a->slot == b->slot) &&
+         (a->state.red == b->state.red) && (a->state.green == b->state.green) &&
+         (a->state.blink == b->state.blink) && (a->state.level == b->state.level) &&
+         (a->state.blink_ms == b->state.blink_ms);
+}
+
+/**
+ * @return NULL if the command is consistent, else what is wrong
+ */
+static const char *check(const struct ampel_command *cmd) {
+  const struct ampel_state_t *s = &cmd->state;
+
+  if (cmd->kind == COMMAND_PATTERN)
+    return (cmd->slot <= AMPEL_PATTERN_SLOTS) ? NULL : "pattern slot";
+  if (cmd->kind != COMMAND_LIGHT)
+    return "kind";
+  if (s->red && s->green)
+    return "two colors";
+  if (s->blink && !s->red && !s->green)
+    return "blinking off";
+  if (s->blink ? (s->blink_ms < COMMAND_BLINK_MIN_MS) : (s->blink_ms != 0))
+    return "blink period";
+
+  // the text form must give the same command
+  char text[64];
+  if (!s->red && !s->green)
+    snprintf(text, sizeof(text), "off level=%u", s->level);
+  else if (s->blink)
+    snprintf(text, sizeof(text), "%s level=%u blink=%u",
+             s->red ? "red" : "green", s->level, s->blink_ms);
+  else
+    snprintf(text, sizeof(text), "%s level=%u", s->red ? "red" : "green", s->level);
+
+  struct ampel_command again;
+  if ((command_parse(text, strlen(text), &again) != COMMAND_OK) ||
+      !command_equal(cmd, &again))
+    return "round trip";
+
+  return NULL;
+}
+
+static int fuzz(unsigned int rounds) {
+  struct command_stats stats;
+  unsigned int failures = 0;
+
+  memset(&stats, 0, sizeof(stats));
+
+  unsigned int i;
+  for (i = 0; i < rounds; i++) {
+    uint8_t work[FUZZ_MAXLEN];
+    size_t len;
+
+    if (xorshift() % 8) {
+      const struct sample *s = &corpus[xorshift() % CORPUS_SIZE];
+      memcpy(work, s->payload, s->len);
+      len = mutate(work, s->len);
+    } else {
+      len = xorshift() % 8;
+      size_t j;
+      for (j = 0; j < len; j++)
+        work[j] = xorshift();
+    }
+
+    // exactly the payload, so the sanitizers see any read past it
+    uint8_t *payload = malloc(len ? len : 1);
+    memcpy(payload, work, len);
+
+    struct ampel_command cmd;
+    if (command_parse_counted(&stats, payload, len, &cmd) == COMMAND_OK) {
+      const char *error = check(&cmd);
+      if (error) {
+        failures++;
+        printf("FAIL %s: '%.*s'\n", error, (int)len, (char *)payload);
+      }
+    }
+    free(payload);
+  }
+
+  printf("%u payloads: %u accepted, rejected %u unknown, %u syntax, "
+         "%u range, %u length, %u failures\n",
+         rounds, stats.accepted,
+         stats.rejected[COMMAND_UNKNOWN], stats.rejected[COMMAND_SYNTAX],
+         stats.rejected[COMMAND_RANGE], stats.rejected[COMMAND_LENGTH],
+         failures);
+
+  return failures ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int bench_rounds = 1000000;
+  unsigned int fuzz_rounds = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "b:f:s:h")) != -1) {
+    switch (opt) {
+      case 'b': bench_rounds = strtoul(optarg, NULL, 0); break;
+      case 'f': fuzz_rounds = strtoul(optarg, NULL, 0); break;
+      case 's': rng = strtoul(optarg, NULL, 0) | 1; break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-b rounds] [-f rounds] [-s seed]\n"
+                "  -b  benchmark rounds per payload, 0 skips (default 1000000)\n"
+                "  -f  fuzz with this many payloads (default 0)\n"
+                "  -s  seed of the fuzzer\n",
+                argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  if (bench_rounds)
+    bench(bench_rounds);
+
+  return fuzz_rounds ? fuzz(fuzz_rounds) : 0;
+}
@@ -10,22 +10,65 @@
 #include <time.h>
 #include <syslog.h>
 
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
+#include <ctype.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
 
 #include <mosquitto.h>
 
-#define I2C_ADDR_AMPEL		0x20
+#include <signal.h>
+
+#include "i3c.h"
+#include "evloop.h"
+#include "mqtt_evloop.h"
+#include "latency.h"
+#include "bus_telemetry.h"
+#include "spsc_ring.h"
+#include "topic_trie.h"
+#include "snapshot.h"
+
+#include "command.h"
+
+const char* I2C_BUS		= "1";
 
 const char* MQTT_HOST 		= "platon.n39.eu";
 const int   MQTT_PORT 		= 1883;
+const int   MQTT_KEEPALIVE	= 30;
 const char* MQTT_AMPEL_TOPIC	= "Netz39/Things/Ampel/Light";
+const char* MQTT_TELEMETRY_TOPIC = "Netz39/Things/Ampel/Telemetry";
 
-struct ampel_state_t {
-  bool red;
-  bool green;
-  bool blink;
-};
+/**
+ * Fade time for light changes in ms, 0 switches hard
+ */
+unsigned int fade_ms = 0;
+
+/**
+ * Light writes per second on the bus and the burst allowed on top
+ */
+#define AMPEL_WRITE_RATE	20
+#define AMPEL_WRITE_BURST	5
+
+/**
+ * The applied light is written again after this time even if unchanged,
+ * in case the controller has been reset in between
+ */
+#define AMPEL_CACHE_MS		60000
+
+/**
+ * Records in the ring between MQTT intake and the actuator thread
+ */
+#define COMMAND_RING_SIZE	256
+
+/**
+ * Commands per second of the flood benchmark
+ */
+#define FLOOD_RATE		10000
+
+/**
+ * The applied lights, restored on the next start
+ */
+#define SNAPSHOT_FILE		"/var/tmp/ledcontrol.state"
+#define SNAPSHOT_MAGIC		0x414d5031	// "AMP1"
 
 /**
  * Get the milliseconds since epoch.
@@ -37,127 +80,858 @@ long current_millis() {
   return tv.tv_sec*1000L + tv.tv_usec/1000L;
 }
 
-///// I2C stuff /////
+///// Lights /////
 
-/**
-  * This record contains the I2C file descriptors we use in this program
-  */
-struct I2C_descriptors {
-  int ampel;
-} I2C_fd;
+/*
+ * The lights driven by this process: the device table given with -c, or
+ * the Ampel on the default topic. Every line of the table is
+ *
+ *	name type address topic [telemetry-topic]
+ *
+ * A name given again adds another topic to the same light, and several
+ * lights may share a topic, e.g. a group or "all". The topics may
+ * contain the MQTT wildcards.
+ */
+
+#define LIGHTS_MAX		112	// the 7-bit addresses of one bus
+#define LIGHT_TOPICS_MAX	256
+#define LIGHT_NAME_MAX		16
+
+enum light_type {
+  LIGHT_AMPEL			// Ampel controller, also on the Ampel2 board
+};
+
+static const char *light_type_names[] = {
+  [LIGHT_AMPEL] = "ampel",
+};
+
+struct light {
+  char     name[LIGHT_NAME_MAX];
+  uint8_t  type;
+  uint8_t  addr;
+  char    *telemetry_topic;	// NULL without telemetry
+  struct i3c_ampel ampel;
+
+  // actuator thread
+  struct ampel_command pending;
+  bool     has_pending;
+  bool     ready;		// in the ready queue of the actuator
+  struct ampel_state_t applied;	// write-through cache
+  bool     applied_valid;
+  uint64_t applied_us;
+  uint16_t blink_ms;		// blink period set on the controller, 0 if unknown
+  struct bus_telemetry telemetry;
+
+  // main thread
+  struct ampel_command held;	// waiting for space in the ring
+  bool     has_held;
+  uint32_t routed;		// last message routed to the light
+};
 
-#define I2C_FD_AMPEL (I2C_fd.ampel)
+struct light lights[LIGHTS_MAX];
+unsigned int light_count = 0;
 
 /**
-  * Initialize an I2C channel to the specified address. Exits with an error
-  * message if the initialization fails,
-  *
-  * @param addr The target address.
-  * @return File Descriptor for the I2C channel
-  */
-int I2C_setup_fd(const int addr) {
-  const int fd = wiringPiI2CSetup(addr);
-  if (!fd) {
-    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
-    exit(-1);
-  }
-  return fd;
+ * The distinct topics to subscribe to, and the trie routing them
+ */
+char *light_topics[LIGHT_TOPICS_MAX];
+unsigned int light_topic_count = 0;
+struct topic_trie light_routes;
+
+struct light *light_find(const char *name) {
+  unsigned int i;
+  for (i = 0; i < light_count; i++)
+    if (strcmp(lights[i].name, name) == 0)
+      return &lights[i];
+
+  return NULL;
 }
 
 /**
-  * Initialize all I2C channels and store the file descriptors.
-  */
-void I2C_init(void) {
-  I2C_fd.ampel = I2C_setup_fd(I2C_ADDR_AMPEL);
-}
+ * Add a light, or a topic to a light of the same name.
+ *
+ * @return 0 on success, -1 on an invalid or conflicting entry
+ */
+int light_add(const char *name, const char *type, unsigned long addr,
+              const char *topic, const char *telemetry_topic) {
+  int t;
+  for (t = 0; t < sizeof(light_type_names) / sizeof(light_type_names[0]); t++)
+    if (strcmp(light_type_names[t], type) == 0)
+      break;
+  if (t == sizeof(light_type_names) / sizeof(light_type_names[0])) {
+    syslog(LOG_ERR, "Light %s has the unknown type %s.", name, type);
+    return -1;
+  }
+  if ((addr < 0x08) || (addr > 0x77)) {
+    syslog(LOG_ERR, "Light %s has the invalid address 0x%lx.", name, addr);
+    return -1;
+  }
 
-#define I2C_ERR_INVALIDARGUMENT -2
+  struct light *l = light_find(name);
+  if (l) {
+    if ((l->type != t) || (l->addr != addr)) {
+      syslog(LOG_ERR, "Light %s is given with different devices.", name);
+      return -1;
+    }
+  } else {
+    if ((light_count == LIGHTS_MAX) || (strlen(name) >= LIGHT_NAME_MAX)) {
+      syslog(LOG_ERR, "Too many lights or name too long: %s", name);
+      return -1;
+    }
+    unsigned int i;
+    for (i = 0; i < light_count; i++)
+      if (lights[i].addr == addr) {
+        syslog(LOG_ERR, "Lights %s and %s have the same address.", lights[i].name, name);
+        return -1;
+      }
 
-  union I2C_result {
-    unsigned char c[2];
-    unsigned short r;
-  };
+    l = &lights[light_count++];
+    memset(l, 0, sizeof(*l));
+    strcpy(l->name, name);
+    l->type = t;
+    l->addr = addr;
+  }
 
+  if (telemetry_topic && !l->telemetry_topic)
+    l->telemetry_topic = strdup(telemetry_topic);
 
-int I2C_command(const int fd, const char command, const char data) {
-  // check parameter range
-  if ((command < 0) || (command > 0x07))
-    return I2C_ERR_INVALIDARGUMENT;
-  if ((data < 0) || (data > 0x0f))
-    return I2C_ERR_INVALIDARGUMENT;
-  
-  // TODO check fd
-  
-    
-  // build the I2C data byte
-  // arguments have been checked, 
-  // this cannot be negative or more than 8 bits
-  unsigned char send = (command << 4) + data; 
-  
-  // calculate the parity
-  char v = send;
-  char c;
-  for (c = 0; v; c++) 
-    v &= v-1;
-  c &= 1;
-
-  // set parity bit  
-  send += (c << 7);
-  
-  union I2C_result result;
-  result.r = 0;
+  if (topic_trie_add(&light_routes, topic, l) < 0) {
+    syslog(LOG_ERR, "Invalid topic %s for light %s.", topic, name);
+    return -1;
+  }
 
-  // maximal number of tries
-  int hops=20;
+  unsigned int i;
+  for (i = 0; i < light_topic_count; i++)
+    if (strcmp(light_topics[i], topic) == 0)
+      return 0;
+  if (light_topic_count == LIGHT_TOPICS_MAX) {
+    syslog(LOG_ERR, "Too many topics, %s is not subscribed.", topic);
+    return -1;
+  }
+  light_topics[light_topic_count++] = strdup(topic);
 
-  // try for hops times until the result is not zero
-  while (!result.c[0] && --hops) {
-    // send command
-    result.r = wiringPiI2CReadReg16(fd, send);
+  return 0;
+}
 
-    // check for transmission errors: 2nd byte is inverted 1st byte
-    const unsigned char c = ~result.c[0];
-    if (result.c[1] != c) 
-      // if no match, reset the result
-      result.r = 0;
+/**
+ * Read the device table.
+ *
+ * @return 0 on success, -1 on errors, which are logged
+ */
+int lights_load(const char *file) {
+  FILE *f = fopen(file, "r");
+  if (!f) {
+    syslog(LOG_ERR, "Cannot open the device table %s: %s", file, strerror(errno));
+    return -1;
   }
-  
-  if (!hops)
-    syslog(LOG_DEBUG, "Giving up transmission!\n");
-  
-  return result.c[0];
+
+  char line[512];
+  unsigned int n = 0;
+  int ret = 0;
+  while (fgets(line, sizeof(line), f)) {
+    char name[LIGHT_NAME_MAX + 1], type[16], topic[256], telemetry[256];
+    unsigned long addr;
+    char *p = line;
+    n++;
+
+    while (isspace((unsigned char)*p))
+      p++;
+    if (!*p || (*p == '#'))
+      continue;
+
+    telemetry[0] = 0;
+    if (sscanf(p, "%16s %15s %li %255s %255s", name, type, &addr, topic, telemetry) < 4) {
+      syslog(LOG_ERR, "%s:%u: expected name type address topic [telemetry-topic]", file, n);
+      ret = -1;
+      continue;
+    }
+    if (light_add(name, type, addr, topic, telemetry[0] ? telemetry : NULL) < 0)
+      ret = -1;
+  }
+  fclose(f);
+
+  if (!light_count) {
+    syslog(LOG_ERR, "No lights in %s.", file);
+    ret = -1;
+  }
+
+  return ret;
 }
 
 ///// I3C stuff /////
 
-#define AMPEL_CMD_RESET		0x00
-#define AMPEL_CMD_GETLIGHT	0x01
-#define AMPEL_CMD_SETLIGHT	0x02
+/**
+  * The I2C bus shared by all lights
+  */
+struct i2c_transport i2c_bus;
 
-#define AMPEL_VAL_BLINK		0x8
-#define AMPEL_VAL_RED		0x1
-#define AMPEL_VAL_GREEN		0x2
+/**
+  * Initialize the I3C devices. Exits with an error message if the
+  * initialization fails.
+  *
+  * @param bus The I2C bus number or "fake"
+  */
+void I3C_init(const char *bus) {
+  if (i3c_bus_open(&i2c_bus, bus) != I3C_OK)
+    exit(-1);
+  // light updates are cosmetic, let state reads go first
+  i2c_bus.prio = I2C_PRIO_LOW;
 
-void I3C_reset_ampel() {
-  I2C_command(I2C_FD_AMPEL, AMPEL_CMD_RESET, 0x0);
+  unsigned int i;
+  for (i = 0; i < light_count; i++)
+    i3c_ampel_open_at(&lights[i].ampel, &i2c_bus, lights[i].addr, lights[i].name);
 }
 
 ///// Ampel /////
 
-uint8_t ampel_set_color(struct ampel_state_t color) {
+int ampel_set_color(struct light *l, struct ampel_state_t color) {
   uint8_t val = 0;
   val |= color.red   ? AMPEL_VAL_RED   : 0;
   val |= color.green ? AMPEL_VAL_GREEN : 0;
   val |= color.blink ? AMPEL_VAL_BLINK : 0;
- 
-  uint8_t ret;
-  ret = I2C_command(I2C_FD_AMPEL,
-                    AMPEL_CMD_SETLIGHT, val);
+
+  // brightness and blink period need the light engine, else full and default
+  const bool engine = i3c_ampel_has_fade(&l->ampel);
+  int ret;
+
+  // the period first, the light restarts the blinking
+  if (engine && color.blink && (color.blink_ms != l->blink_ms)) {
+    ret = i3c_ampel_blink(&l->ampel, color.blink_ms, 128);
+    l->blink_ms = (ret == I3C_OK) ? color.blink_ms : 0;
+    if (ret != I3C_OK)
+      syslog(LOG_ERR, "Cannot set the blink period of %s: %s", l->name, i3c_strerror(ret));
+  }
+
+  // one command for the whole transition, if the firmware can fade
+  ret = (engine && (fade_ms || (color.level != COMMAND_LEVEL_MAX)))
+      ? i3c_ampel_fade(&l->ampel, val, color.level, fade_ms)
+      : i3c_ampel_setlight(&l->ampel, val);
+  if (ret != I3C_OK)
+    syslog(LOG_ERR, "Cannot set the light of %s: %s", l->name, i3c_strerror(ret));
 
   return ret;
 }
 
-///// Command events
+int ampel_select_pattern(struct light *l, unsigned int slot) {
+  const int ret = (slot <= AMPEL_PATTERN_SLOTS) ? i3c_ampel_pattern(&l->ampel, slot)
+                                                : I3C_ERR_INVALIDARGUMENT;
+  if (ret != I3C_OK)
+    syslog(LOG_ERR, "Cannot start pattern %u on %s: %s", slot, l->name, i3c_strerror(ret));
+
+  return ret;
+}
+
+/**
+ * Write a pattern file with raw bytecode to the controller EEPROM.
+ *
+ * @param spec slot:file
+ */
+int ampel_upload_pattern(struct light *l, const char *spec) {
+  uint8_t code[AMPEL_PATTERN_SIZE + 1];
+  char *file;
+  const unsigned long slot = strtoul(spec, &file, 0);
+
+  if (*file != ':') {
+    syslog(LOG_ERR, "Invalid pattern %s, expected slot:file", spec);
+    return I3C_ERR_INVALIDARGUMENT;
+  }
+  file++;
+
+  FILE *f = fopen(file, "rb");
+  if (!f) {
+    syslog(LOG_ERR, "Cannot open pattern file %s: %s", file, strerror(errno));
+    return I3C_ERR_INVALIDARGUMENT;
+  }
+  const size_t len = fread(code, 1, sizeof(code), f);
+  fclose(f);
+
+  if (len > AMPEL_PATTERN_SIZE) {
+    syslog(LOG_ERR, "Pattern file %s is longer than %d bytes", file, AMPEL_PATTERN_SIZE);
+    return I3C_ERR_INVALIDARGUMENT;
+  }
+
+  const int ret = i3c_ampel_pattern_write(&l->ampel, slot, code, len);
+  if (ret == I3C_OK)
+    syslog(LOG_INFO, "Pattern %s written to slot %lu of %s.", file, slot, l->name);
+  else
+    syslog(LOG_ERR, "Cannot write pattern %s to slot %lu of %s: %s",
+                    file, slot, l->name, i3c_strerror(ret));
+
+  return ret;
+}
+
+///// Commands /////
+
+/*
+ * The MQTT side only routes and parses messages into fixed-size command
+ * records (see command.h) and pushes them through a lock-free ring to the
+ * actuator thread, which owns the bus once the event loops run. A slow
+ * I2C transaction thus delays neither the keep-alives nor the intake of
+ * later messages.
+ */
+
+/**
+ * Time from the MQTT socket becoming readable until the light is set
+ */
+struct latency_hist command_latency;
+
+///// Token bucket /////
+
+struct token_bucket {
+  double   tokens;
+  double   rate;		// tokens per second
+  double   burst;		// bucket size
+  uint64_t last_us;
+};
+
+void bucket_init(struct token_bucket *b, double rate, double burst) {
+  b->rate = rate;
+  b->burst = burst;
+  b->tokens = burst;
+  b->last_us = latency_now_us();
+}
+
+/**
+ * Take a token.
+ *
+ * @return 0 if there was one, else the milliseconds until the next
+ */
+unsigned int bucket_take(struct token_bucket *b) {
+  const uint64_t now = latency_now_us();
+
+  b->tokens += (now - b->last_us) * b->rate / 1e6;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->last_us = now;
+
+  if (b->tokens >= 1) {
+    b->tokens -= 1;
+    return 0;
+  }
+
+  return (unsigned int)((1 - b->tokens) * 1000 / b->rate) + 1;
+}
+
+///// State snapshot /////
+
+/*
+ * The last command applied to every light, saved by the actuator after
+ * each successful write. On a restart the lights get it back before the
+ * broker is connected; the retained messages delivered on subscription
+ * then go the normal way, and the write cache drops those that match.
+ * Records are matched by name and address, so the table may change.
+ */
+
+struct light_record {
+  char     name[LIGHT_NAME_MAX];
+  uint8_t  addr;		// 0 for an unused record
+  uint8_t  kind;		// COMMAND_LIGHT or COMMAND_PATTERN
+  uint8_t  slot;
+  uint8_t  reserved;
+  struct ampel_state_t state;
+};
+
+struct lights_snapshot {
+  struct light_record lights[LIGHTS_MAX];
+};
+
+struct snapshot lights_snap;
+struct lights_snapshot lights_saved;
+
+/**
+ * Save the command just applied to a light.
+ */
+void light_save(const struct light *l, const struct ampel_command *cmd) {
+  struct light_record *r = &lights_saved.lights[l - lights];
+
+  strcpy(r->name, l->name);
+  r->addr  = l->addr;
+  r->kind  = cmd->kind;
+  r->slot  = cmd->slot;
+  r->state = cmd->state;
+
+  snapshot_save(&lights_snap, &lights_saved);
+}
+
+int light_apply(struct light *l);
+
+/**
+ * Apply the saved commands to the lights. Must run before the actuator
+ * takes over the bus.
+ *
+ * @return Number of lights restored
+ */
+unsigned int lights_restore(void) {
+  const struct lights_snapshot *file = snapshot_load(&lights_snap);
+  unsigned int i, j, restored = 0;
+
+  if (!file)
+    return 0;
+
+  // Carry the records of the lights in the table over to their current
+  // index first, only those of lights removed from it are dropped. A
+  // light whose write fails below keeps its record.
+  for (i = 0; i < light_count; i++)
+    for (j = 0; j < LIGHTS_MAX; j++) {
+      const struct light_record *r = &file->lights[j];
+      if ((r->addr == lights[i].addr) &&
+          !strncmp(r->name, lights[i].name, LIGHT_NAME_MAX)) {
+        lights_saved.lights[i] = *r;
+        break;
+      }
+    }
+
+  for (i = 0; i < light_count; i++) {
+    struct light *l = &lights[i];
+    const struct light_record *r = &lights_saved.lights[i];
+
+    if (!r->addr)
+      continue;
+
+    memset(&l->pending, 0, sizeof(l->pending));
+    l->pending.kind  = r->kind;
+    l->pending.slot  = r->slot;
+    l->pending.state = r->state;
+    l->pending.light = i;
+    l->pending.received_us = latency_now_us();
+
+    if (light_apply(l) == I3C_OK)
+      restored++;
+  }
+
+  return restored;
+}
+
+///// Actuator /////
+
+/*
+ * The actuator drains the ring into one pending slot per light: a command
+ * replaces the one still waiting (last writer wins), so a burst ends in
+ * one write of the final state instead of replaying every step.
+ *
+ * A write-through cache of the applied light skips writes that would not
+ * change anything, and a token bucket limits the writes on the bus. The
+ * lights with a pending command wait in a FIFO, so one busy light cannot
+ * starve the others of tokens.
+ */
+
+struct actuator {
+  pthread_t     thread;
+  struct evloop loop;
+
+  struct spsc_ring ring;
+  int      ring_fd;		// signalled after a push
+  int      timer_fd;		// fires when the bucket has a token again
+  int      mqtt_fd;		// wakes the main loop to flush a publish
+
+  struct mosquitto *mosq;
+
+  // lights with a pending command
+  uint16_t ready[LIGHTS_MAX];
+  unsigned int ready_first, ready_count;
+  bool     waiting;		// for a token, the timer is armed
+
+  struct token_bucket bucket;
+
+  uint32_t received;
+  uint32_t coalesced;		// replaced before they were applied
+  uint32_t skipped;		// same as the applied light
+  uint32_t throttled;		// waits for a token
+  uint32_t written;
+  uint32_t failed;
+};
+
+struct actuator actuator;
+
+bool state_equal(struct ampel_state_t a, struct ampel_state_t b) {
+  return (a.red == b.red) && (a.green == b.green) && (a.blink == b.blink) &&
+         (a.level == b.level) && (a.blink_ms == b.blink_ms);
+}
+
+void event_signal(int fd) {
+  const uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0)
+    syslog(LOG_ERR, "Error %d on event signal!", errno);
+}
+
+/**
+ * Put a command into the pending slot of its light, a waiting one is
+ * dropped.
+ */
+void actuator_take(const struct ampel_command *cmd) {
+  struct light *l = &lights[cmd->light];
+
+  actuator.received++;
+
+  if (l->has_pending)
+    actuator.coalesced++;
+
+  l->pending = *cmd;
+  l->has_pending = true;
+
+  if (!l->ready) {
+    l->ready = true;
+    actuator.ready[(actuator.ready_first + actuator.ready_count++) % LIGHTS_MAX] = cmd->light;
+  }
+}
+
+/**
+ * Apply the pending command of a light.
+ *
+ * @return I3C_OK or the error of the write
+ */
+int light_apply(struct light *l) {
+  const struct ampel_command *cmd = &l->pending;
+  int ret;
+
+  l->has_pending = false;
+
+  if (cmd->kind == COMMAND_PATTERN) {
+    // the pattern changes the light on its own
+    l->applied_valid = false;
+    ret = ampel_select_pattern(l, cmd->slot);
+  } else {
+    ret = ampel_set_color(l, cmd->state);
+
+    // after an error the light on the controller is unknown
+    l->applied = cmd->state;
+    l->applied_valid = (ret == I3C_OK);
+    l->applied_us = latency_now_us();
+  }
+
+  if (ret == I3C_OK) {
+    actuator.written++;
+    light_save(l, cmd);
+  } else
+    actuator.failed++;
+
+  latency_record(&command_latency, latency_now_us() - cmd->received_us);
+  return ret;
+}
+
+/**
+ * Apply the pending commands in order, unless they have no effect, until
+ * the bus budget is used up.
+ *
+ * @param force Ignore the bus budget
+ */
+void actuator_run(bool force) {
+  while (actuator.ready_count) {
+    struct light *l = &lights[actuator.ready[actuator.ready_first]];
+    const struct ampel_command *cmd = &l->pending;
+    const uint64_t now = latency_now_us();
+
+    if ((cmd->kind == COMMAND_LIGHT) && l->applied_valid &&
+        state_equal(cmd->state, l->applied) &&
+        (now - l->applied_us < AMPEL_CACHE_MS * 1000ULL)) {
+      actuator.skipped++;
+      l->has_pending = false;
+      latency_record(&command_latency, now - cmd->received_us);
+    } else {
+      // keep the command, the timer brings it back
+      const unsigned int wait_ms = bucket_take(&actuator.bucket);
+      if (wait_ms && !force) {
+        actuator.throttled++;
+        actuator.waiting = true;
+        evloop_timer_set(actuator.timer_fd, wait_ms, 0);
+        return;
+      }
+
+      light_apply(l);
+    }
+
+    l->ready = false;
+    actuator.ready_first = (actuator.ready_first + 1) % LIGHTS_MAX;
+    actuator.ready_count--;
+  }
+}
+
+void actuator_log(void) {
+  syslog(LOG_INFO, "Commands: %u received, %u coalesced, %u skipped, "
+                   "%u throttled, %u written, %u failed.",
+                   actuator.received, actuator.coalesced, actuator.skipped,
+                   actuator.throttled, actuator.written, actuator.failed);
+  spsc_ring_log(&actuator.ring, "Command ring");
+  latency_log(&command_latency, "Command latency");
+
+  unsigned int i;
+  for (i = 0; i < light_count; i++)
+    i3c_stats_log(&lights[i].ampel.dev);
+}
+
+void actuator_ring_callback(struct evloop *loop, int fd,
+                            uint32_t events, void *arg) {
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0)
+    return;
+
+  bool stop = false;
+  struct ampel_command cmd;
+  while (spsc_ring_pop(&actuator.ring, &cmd)) {
+    switch (cmd.kind) {
+      case COMMAND_LIGHT:
+      case COMMAND_PATTERN: actuator_take(&cmd); break;
+      case COMMAND_LOG: actuator_log(); break;
+      case COMMAND_STOP: stop = true; break;
+    }
+  }
+
+  // the last state is written even without a token
+  if (stop) {
+    actuator_run(true);
+    evloop_stop(loop);
+  } else if (!actuator.waiting)
+    actuator_run(false);
+}
+
+void actuator_timer_callback(struct evloop *loop, int fd,
+                             uint32_t events, void *arg) {
+  actuator.waiting = false;
+  actuator_run(false);
+}
+
+/**
+ * A telemetry publish from this thread may leave bytes for the main
+ * loop, which writes only while it knows that mosquitto wants to.
+ */
+void actuator_prepare(struct evloop *loop, void *arg) {
+  if (actuator.mosq && mosquitto_want_write(actuator.mosq))
+    event_signal(actuator.mqtt_fd);
+}
+
+void *actuator_main(void *arg) {
+  evloop_run(&actuator.loop);
+  return NULL;
+}
+
+/**
+ * Set up the actuator and start its thread. The bus belongs to the
+ * thread afterwards.
+ *
+ * @param mqtt_fd Signalled when a publish waits in mosquitto
+ * @return 0 on success, -errno on failure
+ */
+int actuator_start(double rate, struct mosquitto *mosq, int mqtt_fd,
+                   unsigned int telemetry_ms) {
+  memset(&actuator, 0, sizeof(actuator));
+  actuator.mosq = mosq;
+  actuator.mqtt_fd = mqtt_fd;
+  bucket_init(&actuator.bucket, rate, AMPEL_WRITE_BURST);
+  latency_reset(&command_latency);
+
+  int ret = spsc_ring_init(&actuator.ring, sizeof(struct ampel_command),
+                           COMMAND_RING_SIZE);
+  if (ret < 0)
+    return ret;
+
+  ret = evloop_init(&actuator.loop);
+  if (ret < 0)
+    return ret;
+
+  actuator.ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (actuator.ring_fd < 0)
+    return -errno;
+
+  ret = evloop_add(&actuator.loop, actuator.ring_fd, EPOLLIN,
+                   actuator_ring_callback, NULL);
+  if (ret < 0)
+    return ret;
+
+  // one-shot, armed while a command waits for a token
+  actuator.timer_fd = evloop_add_timer(&actuator.loop, 1000,
+                                       actuator_timer_callback, NULL);
+  if (actuator.timer_fd < 0)
+    return actuator.timer_fd;
+  evloop_timer_set(actuator.timer_fd, 0, 0);
+
+  unsigned int i;
+  for (i = 0; i < light_count; i++) {
+    struct light *l = &lights[i];
+    if (l->telemetry_topic &&
+        (bus_telemetry_attach(&l->telemetry, &actuator.loop, &l->ampel.dev, mosq,
+                              l->telemetry_topic, telemetry_ms) < 0))
+      syslog(LOG_ERR, "No telemetry for %s, too many timers.", l->name);
+  }
+  evloop_set_prepare(&actuator.loop, actuator_prepare, NULL);
+
+  // the signals stay blocked in the thread, the main loop takes them
+  return -pthread_create(&actuator.thread, NULL, actuator_main, NULL);
+}
+
+///// Intake /////
+
+/*
+ * Runs in the main thread, the producer side of the ring. If the ring is
+ * full, the newest command of a light is held back and pushed as soon as
+ * there is space again; it replaces a command held back for the same
+ * light.
+ */
+
+struct intake {
+  struct command_stats parsed;
+  uint32_t unrouted;		// messages on a topic of no light
+  uint32_t messages;		// routed, also the routing generation
+
+  unsigned int held;		// lights with a held back command
+  int      retry_fd;		// one-shot timer while a command is held
+  uint32_t replaced;		// held back commands replaced by newer ones
+} intake;
+
+/**
+ * Push a record for the actuator.
+ *
+ * @return false if the ring is full
+ */
+bool command_post(const struct ampel_command *cmd) {
+  if (!spsc_ring_push(&actuator.ring, cmd))
+    return false;
+
+  event_signal(actuator.ring_fd);
+  return true;
+}
+
+/**
+ * Push the held back command of a light.
+ *
+ * @return false if it is still held back
+ */
+bool command_flush(struct light *l) {
+  if (l->has_held && command_post(&l->held)) {
+    l->has_held = false;
+    intake.held--;
+  }
+
+  return !l->has_held;
+}
+
+/**
+ * Send a light or pattern command to the actuator.
+ */
+void command_send(const struct ampel_command *cmd) {
+  struct light *l = &lights[cmd->light];
+
+  // nothing may overtake the held back command
+  if (command_flush(l) && command_post(cmd))
+    return;
+
+  if (l->has_held)
+    intake.replaced++;
+  else
+    intake.held++;
+  l->held = *cmd;
+  l->has_held = true;
+  evloop_timer_set(intake.retry_fd, 1, 0);
+}
+
+void intake_retry_callback(struct evloop *loop, int fd,
+                           uint32_t events, void *arg) {
+  unsigned int i;
+  for (i = 0; (i < light_count) && intake.held; i++)
+    if (!command_flush(&lights[i]))
+      break;
+
+  if (intake.held)
+    evloop_timer_set(intake.retry_fd, 1, 0);
+}
+
+void intake_mqtt_callback(struct evloop *loop, int fd,
+                          uint32_t events, void *arg) {
+  uint64_t count;
+
+  // nothing else to do, the prepare hook updates the MQTT registration
+  if (read(fd, &count, sizeof(count)) < 0)
+    return;
+}
+
+/**
+ * Ask the actuator to log its counters.
+ */
+void command_log(void) {
+  const struct ampel_command cmd = { .kind = COMMAND_LOG };
+
+  if (!command_post(&cmd))
+    syslog(LOG_INFO, "Command ring full, no statistics.");
+}
+
+/**
+ * Let the actuator apply what is pending and wait for its end.
+ */
+void actuator_stop(void) {
+  const struct ampel_command cmd = { .kind = COMMAND_STOP };
+
+  unsigned int i;
+  for (i = 0; i < light_count; i++)
+    while (!command_flush(&lights[i]))
+      usleep(1000);
+  while (!command_post(&cmd))
+    usleep(1000);
+
+  pthread_join(actuator.thread, NULL);
+  evloop_close(&actuator.loop);
+  close(actuator.ring_fd);
+}
+
+///// Command events /////
+
+/**
+ * The MQTT session as driven by the event loop
+ */
+struct mqtt_evloop mqtt_ev;
+
+/**
+ * The lights a message goes to
+ */
+struct route_result {
+  uint16_t lights[LIGHTS_MAX];
+  unsigned int count;
+};
+
+void route_callback(void *value, void *arg) {
+  struct light *l = value;
+  struct route_result *r = arg;
+
+  // once per message, even if several topics of the light match
+  if (l->routed == intake.messages)
+    return;
+  l->routed = intake.messages;
+  r->lights[r->count++] = l - lights;
+}
+
+/**
+ * Route a message to its lights and send them the command.
+ *
+ * @return Number of lights
+ */
+unsigned int command_dispatch(const char *topic, const void *payload,
+                              size_t len, uint64_t received_us) {
+  struct route_result route;
+
+  route.count = 0;
+  intake.messages++;
+  topic_trie_match(&light_routes, topic, strlen(topic), route_callback, &route);
+  if (!route.count) {
+    intake.unrouted++;
+    return 0;
+  }
+
+  // rejected payloads leave the lights as they are
+  struct ampel_command cmd;
+  const int ret = command_parse_counted(&intake.parsed, payload, len, &cmd);
+  if (ret != COMMAND_OK) {
+    syslog(LOG_DEBUG, "Rejected Ampel command '%.*s': %s",
+                      (int)len, (const char *)payload, command_strerror(ret));
+    return 0;
+  }
+  cmd.received_us = received_us;
+
+  unsigned int i;
+  for (i = 0; i < route.count; i++) {
+    cmd.light = route.lights[i];
+    command_send(&cmd);
+  }
+
+  return route.count;
+}
 
 void mqtt_message_callback(struct mosquitto *mosq,
                            void *obj, 
@@ -168,48 +942,176 @@ void mqtt_message_callback(struct mosquitto *mosq,
   else
     printf("Got empty message for topic '%s'\n", message->topic);
 
-  bool match = false;
-  mosquitto_topic_matches_sub(MQTT_AMPEL_TOPIC, message->topic, &match);
-  if (match) {
-    const char* command = message->payload;
-
-    struct ampel_state_t state = { .red = false, .green = false, .blink = false };
-
-    if (!command)
-    {
-      // nop
-    } else if (strcmp(command, "red") == 0) {
-      state.red = true;
-    } else if (strcmp(command, "green") == 0) {
-      state.green = true;
-    } else if (strcmp(command, "red blink") == 0) {
-      state.red = true;
-      state.blink = true;
-    } else if (strcmp(command, "green blink") == 0) {
-      state.green = true;
-      state.blink = true;
-    }
+  command_dispatch(message->topic, message->payload, message->payloadlen,
+                   mqtt_ev.wakeup_us);
+}
+
+///// Flood benchmark /////
+
+/*
+ * Feed commands at FLOOD_RATE per second through the same path as the
+ * MQTT messages, e.g. against "-d fake" or the board emulator, and log
+ * what reached the bus. The messages go to the topics of the device
+ * table that have no wildcards.
+ */
+
+struct flood {
+  unsigned int left;
+  uint64_t     start_us;
+  uint64_t     sent;
+
+  const char  *topics[LIGHT_TOPICS_MAX];
+  unsigned int topic_count;
+} flood;
+
+void flood_callback(struct evloop *loop, int fd,
+                    uint32_t events, void *arg) {
+  static const char *commands[] = {
+    "red", "green", "red blink", "green blink", "off", "red",
+    "green level=64", "red blink=400", "\x01\x0a\x80\xf4\x01", "pattern 0"
+  };
+  const unsigned int count = sizeof(commands) / sizeof(commands[0]);
+  const uint64_t now = latency_now_us();
+
+  // catch up with the rate, the timer may be late
+  uint64_t due = (now - flood.start_us) * FLOOD_RATE / 1000000;
+  if (due > flood.sent + flood.left)
+    due = flood.sent + flood.left;
 
-    // Set the traffic light state
-    ampel_set_color(state);
+  for (; flood.sent < due; flood.sent++, flood.left--) {
+    const char *payload = commands[rand() % count];
+    command_dispatch(flood.topics[rand() % flood.topic_count],
+                     payload, strlen(payload), now);
   }
+
+  // the actuator applies the last command when it stops
+  if (!flood.left && !intake.held)
+    evloop_stop(loop);
+}
+
+void mqtt_connect_callback(struct mosquitto *mosq,
+                           void *obj,
+                           int result)
+{
+  // subscribe on every connect, the session is not persistent
+  if (result == 0) {
+    unsigned int i;
+    for (i = 0; i < light_topic_count; i++) {
+      syslog(LOG_INFO, "MQTT connected, subscribing to %s.", light_topics[i]);
+      mosquitto_subscribe(mosq, NULL, light_topics[i], 0);
+    }
+  }
+}
+
+void signal_callback(struct evloop *loop, int fd,
+                     uint32_t signo, void *arg)
+{
+  if (signo == SIGUSR1) {
+    command_stats_log(&intake.parsed);
+    syslog(LOG_INFO, "Messages: %u, %u on no light's topic.", intake.messages, intake.unrouted);
+    command_log();
+  } else
+    evloop_stop(loop);
 }
 
 
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d bus] [-c file] [-f ms] [-r n] [-T s] [-P slot:file]... [-s file] [-F n]\n"
+          "  -d  I2C bus number, \"fake\", \"arbiter\" or unix:<socket>\n"
+          "      (default %s)\n"
+          "  -c  device table, lines of \"name type address topic [telemetry-topic]\"\n"
+          "      (default: the Ampel at 0x%02x on %s)\n"
+          "  -f  fade time for light changes in ms (default 0)\n"
+          "  -r  light writes per second on the bus (default %u)\n"
+          "  -T  period of the bus telemetry in s, 0 disables it (default %u)\n"
+          "  -P  write a pattern file (bytecode) to a slot 1..%d of every light,\n"
+          "      started with the MQTT message \"pattern <slot>\"\n"
+          "  -s  state file for a fast restart, \"\" disables it (default %s,\n"
+          "      none with -F)\n"
+          "  -F  flood benchmark: n commands at %u/s without MQTT, then exit\n",
+          name, I2C_BUS, I3C_ADDR_AMPEL, MQTT_AMPEL_TOPIC, AMPEL_WRITE_RATE, BUS_TELEMETRY_MS / 1000,
+          AMPEL_PATTERN_SLOTS, SNAPSHOT_FILE, FLOOD_RATE);
+}
+
 int main(int argc, char *argv[]) {
+  const uint64_t start_us = latency_now_us();
+  const char *i2c_bus_spec = I2C_BUS;
+  const char *device_table = NULL;
+  const char *snapshot_file = NULL;
+  const char *patterns[AMPEL_PATTERN_SLOTS];
+  int pattern_count = 0;
+  unsigned int telemetry_ms = BUS_TELEMETRY_MS;
+  double write_rate = AMPEL_WRITE_RATE;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:c:f:r:T:P:s:F:h")) != -1) {
+    switch (opt) {
+      case 'd': i2c_bus_spec = optarg; break;
+      case 'c': device_table = optarg; break;
+      case 'f': fade_ms = strtoul(optarg, NULL, 0); break;
+      case 'r': write_rate = strtod(optarg, NULL); break;
+      case 'F': flood.left = strtoul(optarg, NULL, 0); break;
+      case 'T': telemetry_ms = strtoul(optarg, NULL, 0) * 1000; break;
+      case 's': snapshot_file = optarg; break;
+      case 'P':
+        if (pattern_count < AMPEL_PATTERN_SLOTS)
+          patterns[pattern_count++] = optarg;
+        break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
   // initialize the system logging
-  openlog("ampel", LOG_CONS | LOG_PID, LOG_USER);
+  openlog("ampel", LOG_CONS | LOG_PID | (flood.left ? LOG_PERROR : 0), LOG_USER);
   syslog(LOG_INFO, "Starting Ampel controller.");
 
-  // initialize I2C
-  I2C_init();
+  // the lights and the routes to them
+  if (topic_trie_init(&light_routes) < 0)
+    return -1;
+  if (device_table ? (lights_load(device_table) < 0)
+                   : (light_add("ampel", "ampel", I3C_ADDR_AMPEL,
+                                MQTT_AMPEL_TOPIC, MQTT_TELEMETRY_TOPIC) < 0))
+    return -1;
+  topic_trie_compile(&light_routes);
+  syslog(LOG_INFO, "%u lights on %u topics.", light_count, light_topic_count);
+
+  // initialize I3C
+  I3C_init(i2c_bus_spec);
+
+  int i, j;
+  for (i = 0; i < pattern_count; i++)
+    for (j = 0; j < light_count; j++)
+      ampel_upload_pattern(&lights[j], patterns[i]);
+
+  // the lights as before the restart, ahead of the broker connection
+  // a benchmark must not touch the state of the service
+  if (!snapshot_file)
+    snapshot_file = flood.left ? "" : SNAPSHOT_FILE;
+  lights_snap.fd = -1;
+  if (*snapshot_file) {
+    const int ret = snapshot_open(&lights_snap, snapshot_file, SNAPSHOT_MAGIC,
+                                  sizeof(struct lights_snapshot));
+    if (ret < 0)
+      syslog(LOG_ERR, "Cannot open the state file %s: %s",
+                      snapshot_file, strerror(-ret));
+    else {
+      const unsigned int restored = lights_restore();
+      syslog(LOG_INFO, "%u of %u lights restored %llu us after start.",
+                       restored, light_count,
+                       (unsigned long long)(latency_now_us() - start_us));
+    }
+  }
   
   // initialize MQTT
   mosquitto_lib_init();
   
   void *mqtt_obj;
-  struct mosquitto *mosq;
-  mosq = mosquitto_new("ampel", true, mqtt_obj);
+  struct mosquitto *mosq = NULL;
+  if (!flood.left)
+    mosq = mosquitto_new("ampel", true, mqtt_obj);
   if (((int)mosq == ENOMEM) || ((int)mosq == EINVAL)) {
         syslog(LOG_ERR, "MQTT error %d (%s)!", 
                         (int)mosq,
@@ -220,7 +1122,7 @@ int main(int argc, char *argv[]) {
   if (mosq) {
     int ret;
     
-    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 30);
+    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, MQTT_KEEPALIVE);
     if (ret == MOSQ_ERR_SUCCESS)
       syslog(LOG_INFO, "MQTT connection to %s established.", MQTT_HOST);
     else {
@@ -234,27 +1136,75 @@ int main(int argc, char *argv[]) {
   
   // subscribe to Ampel topic
   if (mosq) {
+    mosquitto_connect_callback_set(mosq, mqtt_connect_callback);
     mosquitto_message_callback_set(mosq, mqtt_message_callback);
-    mosquitto_subscribe(mosq, NULL, MQTT_AMPEL_TOPIC, 0);
-  }
-
-  char run=1;
-  int i=0;
-  while(run) {
-    // call the mosquitto loop to process messages
-    if (mosq) {
-      int ret;
-      ret = mosquitto_loop(mosq, 100, 1);
-      // if failed, try to reconnect
-      if (ret) {
-        syslog(LOG_ERR, "MQTT reconnect.");
-        mosquitto_reconnect(mosq);
-      }
+  }
+
+  // everything happens in the event loop
+  struct evloop loop;
+  if (evloop_init(&loop) < 0) {
+    syslog(LOG_ERR, "Error %d on event loop initialization!", errno);
+    return -1;
+  }
+
+  static const int signals[] = { SIGINT, SIGTERM, SIGUSR1, 0 };
+  evloop_add_signals(&loop, signals, signal_callback, NULL);
+
+  // the actuator thread wakes the MQTT side after a publish
+  const int mqtt_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((mqtt_fd < 0) ||
+      (evloop_add(&loop, mqtt_fd, EPOLLIN, intake_mqtt_callback, NULL) < 0)) {
+    syslog(LOG_ERR, "Error %d on event loop initialization!", errno);
+    return -1;
+  }
+
+  // one-shot, armed while the ring is full
+  intake.retry_fd = evloop_add_timer(&loop, 1000, intake_retry_callback, NULL);
+  evloop_timer_set(intake.retry_fd, 0, 0);
+
+  // the bus belongs to the actuator from here on
+  const int ret = actuator_start(write_rate, mosq, mqtt_fd,
+                                 flood.left ? 0 : telemetry_ms);
+  if (ret < 0) {
+    syslog(LOG_ERR, "Error %d on actuator start!", -ret);
+    return -1;
+  }
+
+  if (mosq)
+    mqtt_evloop_attach(&mqtt_ev, &loop, mosq, MQTT_KEEPALIVE * 1000 / 2);
+
+  if (flood.left) {
+    for (i = 0; i < light_topic_count; i++)
+      if (!strpbrk(light_topics[i], "+#"))
+        flood.topics[flood.topic_count++] = light_topics[i];
+    if (!flood.topic_count) {
+      syslog(LOG_ERR, "No topic without wildcards to flood.");
+      return -1;
     }
-    
-    if (sleep(1)) 
-      break;
+
+    flood.start_us = latency_now_us();
+    evloop_add_timer(&loop, 1, flood_callback, NULL);
+  }
+
+  evloop_run(&loop);
+  actuator_stop();
+  evloop_close(&loop);
+  close(mqtt_fd);
+
+  if (flood.sent) {
+    const double s = (latency_now_us() - flood.start_us) / 1e6;
+    syslog(LOG_INFO, "Flood: %llu commands in %.2f s (%.0f/s), %u bus writes.",
+                     (unsigned long long)flood.sent, s, flood.sent / s,
+                     actuator.written);
   }
+  if (intake.replaced)
+    syslog(LOG_INFO, "Command ring overflows: %u commands replaced.",
+                     intake.replaced);
+  command_stats_log(&intake.parsed);
+  syslog(LOG_INFO, "Messages: %u, %u on no light's topic.", intake.messages, intake.unrouted);
+  actuator_log();
+  i2c_transport_close(&i2c_bus);
+  snapshot_close(&lights_snap);
 
   // clean-up MQTT
   if (mosq) {
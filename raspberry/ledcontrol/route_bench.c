@@ -0,0 +1,195 @@
+/*
+ * Routing benchmark for the device table, see "make bench". Builds tables
+ * of hundreds of lights and routes messages through the topic trie and,
+ * for comparison, through a scan of all subscriptions as ledcontrol did
+ * with mosquitto_topic_matches_sub.
+ *
+ * Every light has its own topic and is in a group of eight with a '#'
+ * subscription; a quarter of the messages go to a group, a quarter to no
+ * light at all.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "topic_trie.h"
+
+#define GROUP_SIZE	8
+#define MESSAGES	4096
+
+struct subscription {
+  char pattern[64];
+  unsigned int light;
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * MQTT topic matching, one subscription at a time
+ */
+static bool topic_matches(const char *sub, const char *topic) {
+  if ((topic[0] == '$') && ((sub[0] == '+') || (sub[0] == '#')))
+    return false;
+
+  for (;;) {
+    if ((sub[0] == '#') && !sub[1])
+      return true;
+
+    const char *sub_end = strchrnul(sub, '/');
+    const char *topic_end = strchrnul(topic, '/');
+
+    if (!((sub[0] == '+') && (sub_end == sub + 1)) &&
+        (((sub_end - sub) != (topic_end - topic)) ||
+         memcmp(sub, topic, sub_end - sub)))
+      return false;
+
+    if (!*sub_end && !*topic_end)
+      return true;
+    if (!*topic_end)
+      // "a/#" matches "a"
+      return (sub_end[0] == '/') && (sub_end[1] == '#') && !sub_end[2];
+    if (!*sub_end)
+      return false;
+
+    sub = sub_end + 1;
+    topic = topic_end + 1;
+  }
+}
+
+static void count_cb(void *value, void *arg) {
+  (*(unsigned int *)arg)++;
+}
+
+static void bench(unsigned int lights, unsigned int rounds) {
+  const unsigned int count = lights + lights / GROUP_SIZE;
+  struct subscription *subs = calloc(count, sizeof(*subs));
+  struct topic_trie trie;
+  unsigned int i, n = 0;
+
+  topic_trie_init(&trie);
+  for (i = 0; i < lights; i++) {
+    snprintf(subs[n].pattern, sizeof(subs[n].pattern), "Netz39/Things/Light%u/Set", i);
+    subs[n].light = i;
+    topic_trie_add(&trie, subs[n].pattern, &subs[n]);
+    n++;
+  }
+  for (i = 0; i < lights / GROUP_SIZE; i++) {
+    snprintf(subs[n].pattern, sizeof(subs[n].pattern), "Netz39/Groups/%u/#", i);
+    subs[n].light = i * GROUP_SIZE;
+    topic_trie_add(&trie, subs[n].pattern, &subs[n]);
+    n++;
+  }
+  topic_trie_compile(&trie);
+
+  static char topics[MESSAGES][64];
+  for (i = 0; i < MESSAGES; i++) {
+    const unsigned int r = rand();
+    switch (r % 4) {
+      case 0:
+        snprintf(topics[i], 64, "Netz39/Groups/%u/Set", (r / 4) % (lights / GROUP_SIZE));
+        break;
+      case 1:
+        snprintf(topics[i], 64, "Netz39/Other/Light%u/Set", (r / 4) % lights);
+        break;
+      default:
+        snprintf(topics[i], 64, "Netz39/Things/Light%u/Set", (r / 4) % lights);
+    }
+  }
+
+  unsigned int trie_matches = 0, scan_matches = 0;
+  uint64_t start = now_ns();
+  for (i = 0; i < rounds; i++) {
+    const char *topic = topics[i % MESSAGES];
+    topic_trie_match(&trie, topic, strlen(topic), count_cb, &trie_matches);
+  }
+  const double trie_ns = (double)(now_ns() - start) / rounds;
+
+  // fewer rounds, the scan is slow
+  const unsigned int scan_rounds = rounds / 16;
+  start = now_ns();
+  for (i = 0; i < scan_rounds; i++) {
+    const char *topic = topics[i % MESSAGES];
+    unsigned int j;
+    for (j = 0; j < count; j++)
+      if (topic_matches(subs[j].pattern, topic))
+        scan_matches++;
+  }
+  const double scan_ns = (double)(now_ns() - start) / scan_rounds;
+
+  printf("%6u %6u %10.1f %10.1f %9.2f\n", lights, count, trie_ns, scan_ns,
+         (double)trie_matches / rounds);
+
+  // both must find the same
+  if ((double)trie_matches / rounds - (double)scan_matches / scan_rounds > 0.01 ||
+      (double)scan_matches / scan_rounds - (double)trie_matches / rounds > 0.01)
+    printf("MISMATCH: trie %u/%u, scan %u/%u\n",
+           trie_matches, rounds, scan_matches, scan_rounds);
+
+  topic_trie_free(&trie);
+  free(subs);
+}
+
+static int check(void) {
+  static const struct {
+    const char *pattern, *topic;
+  } cases[] = {
+    { "a/b", "a/b" }, { "a/b", "a/c" }, { "a/+", "a/b" }, { "a/+", "a/b/c" },
+    { "a/#", "a" }, { "a/#", "a/b/c" }, { "#", "a/b" }, { "+/b", "a/b" },
+    { "+", "$SYS" }, { "#", "$SYS/x" }, { "$SYS/#", "$SYS/x" }, { "a//b", "a//b" },
+    { "a/+/c", "a//c" }, { "+/+", "a" }, { "a", "a/" }, { "a/", "a/" },
+  };
+  unsigned int i, failures = 0;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    struct topic_trie trie;
+    unsigned int found = 0;
+
+    topic_trie_init(&trie);
+    topic_trie_add(&trie, cases[i].pattern, NULL);
+    topic_trie_compile(&trie);
+    topic_trie_match(&trie, cases[i].topic, strlen(cases[i].topic), count_cb, &found);
+
+    if (found != topic_matches(cases[i].pattern, cases[i].topic)) {
+      printf("FAIL %s on %s: trie %u\n", cases[i].pattern, cases[i].topic, found);
+      failures++;
+    }
+    topic_trie_free(&trie);
+  }
+
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int rounds = 1000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:h")) != -1) {
+    switch (opt) {
+      case 'r': rounds = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-r rounds]\n", argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  if (check())
+    return 1;
+
+  printf("%6s %6s %10s %10s %9s\n", "lights", "subs", "trie ns", "scan ns", "matches");
+  static const unsigned int sizes[] = { 8, 64, 112, 256, 512, 1024 };
+  unsigned int i;
+  for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    bench(sizes[i], rounds);
+
+  return 0;
+}
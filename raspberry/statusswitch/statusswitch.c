@@ -10,19 +10,46 @@
 #include <time.h>
 #include <syslog.h>
 
-#include <wiringPi.h>
-#include <wiringPiI2C.h>
-
 #include <mosquitto.h>
 
-#define I2C_ADDR_LEVER	    0x24
+#include <signal.h>
+
+#include "i3c.h"
+#include "gpio_event.h"
+#include "evloop.h"
+#include "mqtt_evloop.h"
+#include "bus_telemetry.h"
+#include "snapshot.h"
+#include "latency.h"
+
+/*
+ * The lever controller pulls the I3C INT line low on state changes.
+ * Defaults for the GPIO line, can be changed on the command line.
+ */
+#define I2C_BUS		    "1"
+
+#define GPIO_INT_BACKEND    "cdev"
+#define GPIO_INT_CHIP	    "gpiochip0"
+#define GPIO_INT_LINE	    22
+
+// poll interval if there is no INT line
+#define LEVER_POLL_MS	    1000
+
+// the last published lever state, survives restarts
+#define SNAPSHOT_FILE	    "/var/tmp/statusswitch.state"
+#define SNAPSHOT_MAGIC	    0x4c565231	// "LVR1"
 
 const char* MQTT_HOST 	= "platon";
 const int   MQTT_PORT 	= 1883;
+const int   MQTT_KEEPALIVE	= 30;
 const char* MQTT_TOPIC_STATE 	= "Netz39/Things/StatusSwitch/Lever/State";
 const char* MQTT_TOPIC_EVENTS 	= "Netz39/Things/StatusSwitch/Lever/Events";
+const char* MQTT_TOPIC_TRANSITIONS = "Netz39/Things/StatusSwitch/Lever/Transitions";
+const char* MQTT_TOPIC_TELEMETRY = "Netz39/Things/StatusSwitch/Lever/Telemetry";
 
 #define MQTT_MSG_MAXLEN		  16
+// state and milliseconds since epoch
+#define MQTT_TRANSITION_MAXLEN	  40
 const char* MQTT_MSG_LEVEROPEN    = "open";
 const char* MQTT_MSG_LEVERCLOSED  = "closed";
 const char* MQTT_MSG_LEVERNEUTRAL = "neutral";
@@ -39,6 +66,17 @@ struct lever_state_t {
   bool lever_closed;	// Lever is in state closed
 };
 
+/**
+ * The snapshot payload
+ */
+struct lever_snapshot {
+  uint8_t status;	// status byte of the last published state
+  uint8_t reserved[7];
+  int64_t millis;	// time of that transition, milliseconds since epoch
+};
+
+struct snapshot lever_snap;
+
 /**
  * Get the milliseconds since epoch.
  */
@@ -49,141 +87,431 @@ long current_millis() {
   return tv.tv_sec*1000L + tv.tv_usec/1000L;
 }
 
-///// I2C stuff /////
+///// I3C stuff /////
 
 /**
-  * This record contains the I2C file descriptors we use in this program
+  * The I2C bus and the lever controller
   */
-struct I2C_descriptors {
-  int lever;
-} I2C_fd;
-
-#define I2C_FD_LEVER (I2C_fd.lever)
+struct i2c_transport i2c_bus;
+struct i3c_lever lever;
 
 /**
-  * Initialize an I2C channel to the specified address. Exits with an error
-  * message if the initialization fails,
+  * Initialize the I3C devices. Exits with an error message if the
+  * initialization fails.
   *
-  * @param addr The target address.
-  * @return File Descriptor for the I2C channel
+  * @param bus The I2C bus number or "fake"
   */
-int I2C_setup_fd(const int addr) {
-  const int fd = wiringPiI2CSetup(addr);
-  if (!fd) {
-    syslog(LOG_EMERG, "Error %d on I2C initialization!", errno);
+void I3C_init(const char *bus) {
+  if (i3c_bus_open(&i2c_bus, bus) != I3C_OK)
     exit(-1);
-  }
-  return fd;
+  // lever reads go before light updates on a shared bus
+  i2c_bus.prio = I2C_PRIO_HIGH;
+  i3c_lever_open(&lever, &i2c_bus);
 }
 
+///// Status Lever /////
+
 /**
-  * Initialize all I2C channels and store the file descriptors.
-  */
-void I2C_init(void) {
-  I2C_fd.lever = I2C_setup_fd(I2C_ADDR_LEVER);
+ * @param state The status byte, unchanged on failure
+ * @return I3C_OK or an error code, a failed read is no lever state
+ */
+int lever_reset_getstate(uint8_t *state) {
+  // send the command
+  const int ret = i3c_lever_reset_getstate(&lever, state);
+  if (ret != I3C_OK)
+    syslog(LOG_DEBUG, "Cannot read lever state: %s", i3c_strerror(ret));
+
+  // return result
+  return ret;
 }
 
-#define I2C_ERR_INVALIDARGUMENT -2
+void decode_lever_state(uint8_t state,
+                        struct lever_state_t *ls)
+{
+  // see http://www.netz39.de/wiki/projects:2014:gatekeeper
+  ls->lever_open   = (state & LEVER_STATE_OPEN);
+  ls->lever_closed = (state & LEVER_STATE_CLOSED);
+}                        
 
-  union I2C_result {
-    unsigned char c[2];
-    unsigned short r;
-  };
+/**
+ * @return The State message for a lever state
+ */
+const char *lever_state_msg(const struct lever_state_t *ls) {
+  if (ls->lever_open == ls->lever_closed)
+    return MQTT_MSG_LEVERNEUTRAL;
+  return ls->lever_open ? MQTT_MSG_LEVEROPEN : MQTT_MSG_LEVERCLOSED;
+}
 
+/**
+ * Publish the retained State message without a transition, e.g. to
+ * restore or correct what the broker holds.
+ *
+ * @param mosq The MQTT session, may be NULL
+ */
+void lever_publish_state(struct mosquitto *mosq, const struct lever_state_t *ls) {
+  const char *msg = lever_state_msg(ls);
+  int mid;
+
+  if (!mosq)
+    return;
+
+  // QoS 2 is queued while the connection is not up yet
+  const int ret = mosquitto_publish(mosq, &mid, MQTT_TOPIC_STATE,
+                                    strlen(msg), msg, 2, true);
+  if (ret != MOSQ_ERR_SUCCESS)
+    syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)",
+                    msg, ret, mosquitto_strerror(ret));
+  else
+    syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.", msg, mid);
+}
+                        
 
-int I2C_command(const int fd, const char command, const char data) {
-  // check parameter range
-  if ((command < 0) || (command > 0x07))
-    return I2C_ERR_INVALIDARGUMENT;
-  if ((data < 0) || (data > 0x0f))
-    return I2C_ERR_INVALIDARGUMENT;
-  
-  // TODO check fd
-  
+/**
+ * Compare the lever state with the known state and emit the MQTT messages
+ * for any change.
+ *
+ * @param mosq The MQTT session, may be NULL
+ * @param before The known lever state, will be updated
+ * @param status The status byte read from the lever
+ * @param millis When the lever has been moved, milliseconds since epoch
+ * @return true if the state has changed
+ */
+bool lever_update(struct mosquitto *mosq,
+                  struct lever_state_t *before,
+                  uint8_t status,
+                  long millis)
+{
+  char mqtt_payload[MQTT_MSG_MAXLEN];
+
+  struct lever_state_t ls;
+  decode_lever_state(status, &ls);
+
+  printf("Lever status byte: 0x%02x\n", status);
+  printf("Open:\t%s\n", (ls.lever_open ? "yes" : "no"));
+  printf("Closed:\t%s\n", (ls.lever_closed ? "yes" : "no"));
+  printf("\n");
+
+  // Check door status for changes and emit MQTT messages
+  mqtt_payload[0] = 0;
+
+  // lever close state changed
+  if (before->lever_closed != ls.lever_closed) {
+    if (ls.lever_closed && !ls.lever_open) {
+      syslog(LOG_INFO, "Lever has been switched to closed.");
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LEVERCLOSED);
+    } else if (ls.lever_closed == ls.lever_open) {
+      syslog(LOG_INFO, "Lever has been switched to neutral state.");
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LEVERNEUTRAL);      
+    }
     
-  // build the I2C data byte
-  // arguments have been checked, 
-  // this cannot be negative or more than 8 bits
-  unsigned char send = (command << 4) + data; 
-  
-  // calculate the parity
-  char v = send;
-  char c;
-  for (c = 0; v; c++) 
-    v &= v-1;
-  c &= 1;
-
-  // set parity bit  
-  send += (c << 7);
-  
-  union I2C_result result;
-  result.r = 0;
-
-  // maximal number of tries
-  int hops=20;
-
-  // try for hops times until the result is not zero
-  while (!result.c[0] && --hops) {
-    // send command
-    result.r = wiringPiI2CReadReg16(fd, send);
-
-    // check for transmission errors: 2nd byte is inverted 1st byte
-    const unsigned char c = ~result.c[0];
-    if (result.c[1] != c) 
-      // if no match, reset the result
-      result.r = 0;
+    before->lever_closed = ls.lever_closed;
   }
-  
-  if (!hops)
-    syslog(LOG_DEBUG, "Giving up transmission!\n");
-  
-  return result.c[0];
+
+  // lever open state changed
+  if (before->lever_open != ls.lever_open) {
+    if (ls.lever_open && !ls.lever_closed) {
+      syslog(LOG_INFO, "Lever has been switched to open.");
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LEVEROPEN);
+    } else if (ls.lever_closed == ls.lever_open) {
+      syslog(LOG_INFO, "Lever has been switched to neutral state.");
+      //MQTT message
+      strcpy(mqtt_payload, MQTT_MSG_LEVERNEUTRAL);      
+    }
+    
+    before->lever_open = ls.lever_open;
+  }
+
+  if (!mqtt_payload[0])
+    return false;
+
+  // remember what has been published for the next start
+  const struct lever_snapshot saved = { .status = status, .millis = millis };
+  snapshot_save(&lever_snap, &saved);
+
+  // send MQTT messages
+  if (mosq) {
+    int ret;
+    int mid;
+    // state message
+    ret = mosquitto_publish(
+                      mosq, 
+                      &mid,
+                      MQTT_TOPIC_STATE,
+                      strlen(mqtt_payload), mqtt_payload,
+                      2, /* qos */
+                      true /* retain */
+                     );
+    if (ret != MOSQ_ERR_SUCCESS)
+      syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)", 
+                      mqtt_payload, 
+                      ret,
+                      mosquitto_strerror(ret));
+    else
+      syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.", 
+                       mqtt_payload, mid);
+
+    // state with the time of the transition
+    char transition[MQTT_TRANSITION_MAXLEN];
+    snprintf(transition, sizeof(transition), "%s %ld", mqtt_payload, millis);
+    ret = mosquitto_publish(
+                      mosq, 
+                      &mid,
+                      MQTT_TOPIC_TRANSITIONS,
+                      strlen(transition), transition,
+                      2, /* qos */
+                      false /* don't retain */
+                     );
+    if (ret != MOSQ_ERR_SUCCESS)
+      syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)", 
+                      transition, 
+                      ret,
+                      mosquitto_strerror(ret));
+                       
+    // change event
+    strcpy(mqtt_payload, MQTT_MSG_LEVERCHANGE);
+    ret = mosquitto_publish(
+                      mosq, 
+                      &mid,
+                      MQTT_TOPIC_EVENTS,
+                      strlen(mqtt_payload), mqtt_payload,
+                      2, /* qos */
+                      false /* don't retain */
+                     );
+    if (ret != MOSQ_ERR_SUCCESS)
+      syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)", 
+                      mqtt_payload, 
+                      ret,
+                      mosquitto_strerror(ret));
+    else
+      syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.", 
+                       mqtt_payload, mid);
+    
+  }
+
+  return true;
 }
 
-///// I3C stuff /////
+///// Event handling /////
 
-#define LEVER_CMD_RESET		0x00
-#define LEVER_CMD_GETSTATE	0x01
-#define LEVER_CMD_SETSTATE	0x02
+/**
+ * Everything the event callbacks work on
+ */
+struct lever_observer {
+  struct mosquitto    *mosq;
+  struct mqtt_evloop   mqtt_ev;
+  struct gpio_line     int_line;
+  struct lever_state_t before;	// the known lever status
+  unsigned int         i;
+
+  bool    events;		// the lever records its transitions
+  uint8_t next_event;		// sequence number of the next event
+  uint8_t events_lost;		// last lost events counter of the lever
+};
 
-void I3C_reset_lever() {
-  I2C_command(I2C_FD_LEVER, LEVER_CMD_RESET, 0x0);
+/**
+ * Read the transition FIFO of the lever until it is empty, which also
+ * releases the INT line.
+ *
+ * @param publish Publish the transitions, otherwise just drop them
+ */
+void lever_drain(struct lever_observer *obs, bool publish) {
+  struct i3c_lever_events ev;
+
+  do {
+    const int ret = i3c_lever_events(&lever, obs->next_event, &ev);
+    if (ret != I3C_OK) {
+      syslog(LOG_DEBUG, "Cannot read lever events: %s", i3c_strerror(ret));
+      return;
+    }
+
+    const long now = current_millis();
+
+    int i;
+    for (i = 0; publish && (i < ev.count); i++)
+      lever_update(obs->mosq, &obs->before, ev.events[i].state,
+                   now - ev.events[i].age_ms);
+
+    // acknowledged with the next read
+    obs->next_event = ev.first + ev.count;
+  } while (ev.count);
+
+  if (publish && (ev.lost != obs->events_lost)) {
+    syslog(LOG_WARNING, "The lever has lost %u transitions.",
+                        (uint8_t)(ev.lost - obs->events_lost));
+
+    // the FIFO kept the older transitions, get the current state
+    uint8_t state;
+    if (i3c_lever_getstate(&lever, &state) == I3C_OK)
+      lever_update(obs->mosq, &obs->before, state, current_millis());
+  }
+  obs->events_lost = ev.lost;
 }
 
-///// Status Lever /////
+/**
+ * Read the lever and publish changes.
+ */
+void lever_observe(struct lever_observer *obs) {
+  printf("****** %u\n", obs->i++);
+
+  if (obs->events)
+    lever_drain(obs, true);
+  else {
+    // Reset with the read: a change after the read triggers another edge.
+    uint8_t state;
+    if (lever_reset_getstate(&state) == I3C_OK)
+      lever_update(obs->mosq, &obs->before, state, current_millis());
+  }
 
-char lever_getstate() {
-  // send the command    
-  const char state = I2C_command(I2C_FD_LEVER,
-                                 LEVER_CMD_GETSTATE, 0);
-  
-  // return result
-  return state;  
+  // publish right away instead of waiting for the next wakeup
+  if (obs->mosq)
+    mqtt_evloop_update(&obs->mqtt_ev);
 }
 
-void decode_lever_state(uint8_t state,
-                        struct lever_state_t *ls)
+void int_line_callback(struct evloop *loop, int fd,
+                       uint32_t events, void *arg) {
+  struct lever_observer *obs = arg;
+
+  const int ret = gpio_line_events(&obs->int_line);
+  if (ret < 0)
+    syslog(LOG_ERR, "Error reading INT line events: %s", strerror(-ret));
+
+  if (ret > 0)
+    lever_observe(obs);
+}
+
+void poll_timer_callback(struct evloop *loop, int fd,
+                         uint32_t events, void *arg) {
+  lever_observe(arg);
+}
+
+void mqtt_connect_callback(struct mosquitto *mosq,
+                           void *obj,
+                           int result)
 {
-  // see http://www.netz39.de/wiki/projects:2014:gatekeeper
-  ls->lever_open   = (state & 0x02);
-  ls->lever_closed = (state & 0x01);
-}                        
-                        
+  // the broker sends its retained state on subscription
+  if (result == 0)
+    mosquitto_subscribe(mosq, NULL, MQTT_TOPIC_STATE, 2);
+}
+
+/**
+ * Reconcile the retained State with the lever, which is the authority.
+ */
+void mqtt_message_callback(struct mosquitto *mosq,
+                           void *obj,
+                           const struct mosquitto_message *message)
+{
+  struct lever_observer *obs = obj;
+
+  // live messages are our own publishes coming back
+  if (!message->retain)
+    return;
+
+  const char *msg = lever_state_msg(&obs->before);
+  if ((message->payloadlen == (int)strlen(msg)) &&
+      !memcmp(message->payload, msg, message->payloadlen))
+    return;
+
+  syslog(LOG_INFO, "Retained state \"%.*s\" is stale, publishing \"%s\".",
+                   (message->payloadlen < MQTT_MSG_MAXLEN) ? message->payloadlen
+                                                            : MQTT_MSG_MAXLEN,
+                   (const char *)message->payload, msg);
+  lever_publish_state(mosq, &obs->before);
+}
+
+void signal_callback(struct evloop *loop, int fd,
+                     uint32_t signo, void *arg) {
+  if (signo == SIGUSR1)
+    i3c_stats_log(&lever.dev);
+  else
+    evloop_stop(loop);
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-d bus] [-b backend] [-c chip] [-l line] [-t ms] [-T s] [-s file]\n"
+          "  -d  I2C bus number, \"fake\", \"arbiter\" or unix:<socket>\n"
+          "      (default %s)\n"
+          "  -b  GPIO backend for the I3C INT line: cdev, none (default %s)\n"
+          "      With \"none\" the lever is polled every second.\n"
+          "  -c  GPIO chip path, name or label (default %s)\n"
+          "  -l  GPIO line offset of the INT line (default %u)\n"
+          "  -t  debounce time of the lever in ms, 4..60\n"
+          "      (default: keep the firmware setting)\n"
+          "  -T  period of the bus telemetry in s, 0 disables it (default %u)\n"
+          "  -s  state file for a fast restart, \"\" disables it (default %s)\n",
+          name, I2C_BUS, GPIO_INT_BACKEND, GPIO_INT_CHIP, GPIO_INT_LINE,
+          BUS_TELEMETRY_MS / 1000, SNAPSHOT_FILE);
+}
 
 int main(int argc, char *argv[]) {
+  const uint64_t start_us = latency_now_us();
+  const char *i2c_bus_spec = I2C_BUS;
+  const char *gpio_backend_name = GPIO_INT_BACKEND;
+  const char *gpio_chip = GPIO_INT_CHIP;
+  unsigned int gpio_offset = GPIO_INT_LINE;
+  unsigned int debounce_ms = 0;
+  unsigned int telemetry_ms = BUS_TELEMETRY_MS;
+  const char *snapshot_file = SNAPSHOT_FILE;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:b:c:l:t:T:s:h")) != -1) {
+    switch (opt) {
+      case 'd': i2c_bus_spec = optarg; break;
+      case 'b': gpio_backend_name = optarg; break;
+      case 'c': gpio_chip = optarg; break;
+      case 'l': gpio_offset = strtoul(optarg, NULL, 0); break;
+      case 't': debounce_ms = strtoul(optarg, NULL, 0); break;
+      case 'T': telemetry_ms = strtoul(optarg, NULL, 0) * 1000; break;
+      case 's': snapshot_file = optarg; break;
+      default:
+        usage(argv[0]);
+        return (opt == 'h') ? 0 : -1;
+    }
+  }
+
+  int ret;
+  const struct gpio_backend *gpio_backend = gpio_backend_by_name(gpio_backend_name);
+  if (!gpio_backend) {
+    usage(argv[0]);
+    return -1;
+  }
+
   // initialize the system logging
   openlog("statusswitch", LOG_CONS | LOG_PID, LOG_USER);
   syslog(LOG_INFO, "Starting statusswitch observer.");
 
-  // initialize I2C
-  I2C_init();
+  // initialize I3C
+  I3C_init(i2c_bus_spec);
+
+  lever_snap.fd = -1;
+  if (*snapshot_file) {
+    ret = snapshot_open(&lever_snap, snapshot_file, SNAPSHOT_MAGIC,
+                        sizeof(struct lever_snapshot));
+    if (ret < 0)
+      syslog(LOG_ERR, "Cannot open the state file %s: %s",
+                      snapshot_file, strerror(-ret));
+  }
   
+  static struct lever_observer obs;
+
+  // initialize the INT line, fall back to polling if not available
+  ret = gpio_line_open(&obs.int_line, gpio_backend,
+                           gpio_chip, gpio_offset, "statusswitch");
+  if (ret < 0) {
+    syslog(LOG_ERR, "Cannot request INT line %s:%u: %s, falling back to polling.",
+                    gpio_chip, gpio_offset, strerror(-ret));
+    gpio_line_open(&obs.int_line, &gpio_backend_none,
+                   gpio_chip, gpio_offset, "statusswitch");
+  }
+
   // initialize MQTT
   mosquitto_lib_init();
   
-  void *mqtt_obj;
   struct mosquitto *mosq;
-  mosq = mosquitto_new("statusswitch", true, mqtt_obj);
+  mosq = mosquitto_new("statusswitch", true, &obs);
   if ((int)mosq == ENOMEM) {
     syslog(LOG_ERR, "Not enough memory to create a new mosquitto session.");
     mosq = NULL;
@@ -193,126 +521,93 @@ int main(int argc, char *argv[]) {
     return -1;
   }
   
+  if (debounce_ms) {
+    ret = i3c_lever_setdebounce(&lever, debounce_ms);
+    if (ret != I3C_OK)
+      syslog(LOG_ERR, "Cannot set the lever debounce time to %u ms: %d", debounce_ms, ret);
+  }
+
+  obs.mosq = mosq;
+
+  // Transitions from before the start are history already. Drained right
+  // before the read, later ones are published from the event loop, also
+  // those during the broker connect.
+  obs.events = i3c_lever_has_events(&lever);
+  if (obs.events)
+    lever_drain(&obs, false);
+
+  // the known lever status
+  // Reset with reading, so that a change after the read pulls INT again.
+  uint8_t status = 0;
+  const int read_ret = lever_reset_getstate(&status);
+  if (read_ret != I3C_OK)
+    syslog(LOG_ERR, "Cannot read the lever at start: %s", i3c_strerror(read_ret));
+
+  // Restore the state before the broker is connected: a lever moved
+  // while we were down is a transition, otherwise the State is refreshed.
+  // Without a reading the restored state stands and the file is kept.
+  const struct lever_snapshot *saved = snapshot_load(&lever_snap);
+  if (saved) {
+    decode_lever_state(saved->status, &obs.before);
+    if ((read_ret != I3C_OK) ||
+        !lever_update(mosq, &obs.before, status, current_millis()))
+      lever_publish_state(mosq, &obs.before);
+  } else {
+    decode_lever_state(status, &obs.before);
+    if (read_ret == I3C_OK) {
+      const struct lever_snapshot first = { .status = status, .millis = current_millis() };
+      snapshot_save(&lever_snap, &first);
+      lever_publish_state(mosq, &obs.before);
+    }
+  }
+  syslog(LOG_INFO, "Lever state \"%s\" %s %llu us after start.",
+                   lever_state_msg(&obs.before),
+                   saved ? "restored" : ((read_ret == I3C_OK) ? "read" : "unknown"),
+                   (unsigned long long)(latency_now_us() - start_us));
+
   if (mosq) {
-    int ret;
-    
-    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, 30);
+    mosquitto_connect_callback_set(mosq, mqtt_connect_callback);
+    mosquitto_message_callback_set(mosq, mqtt_message_callback);
+
+    ret = mosquitto_connect(mosq, MQTT_HOST, MQTT_PORT, MQTT_KEEPALIVE);
     if (ret == MOSQ_ERR_SUCCESS)
       syslog(LOG_INFO, "MQTT connection to %s established.", MQTT_HOST);
       
     // TODO error handling
   }
-  
-  char mqtt_payload[MQTT_MSG_MAXLEN];
-  
-  // the known lever status
-  struct lever_state_t before;
-  decode_lever_state(lever_getstate(), &before);
-  
-  char run=1;
-  int i=0;
-  while(run) {
-    printf("****** %u\n", i++);
-
-    uint8_t status = lever_getstate();
-    struct lever_state_t ls;
-    decode_lever_state(status, &ls);
-    
-    printf("Lever status byte: 0x%02x\n", status);
-    printf("Open:\t%s\n", (ls.lever_open ? "yes" : "no"));
-    printf("Closed:\t%s\n", (ls.lever_closed ? "yes" : "no"));
-    printf("\n");
-
-    // Check door status for changes and emit MQTT messages
-    mqtt_payload[0] = 0;
-
-    // lever close state changed
-    if (before.lever_closed != ls.lever_closed) {
-      if (ls.lever_closed && !ls.lever_open) {
-        syslog(LOG_INFO, "Lever has been switched to closed.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LEVERCLOSED);
-      } else if (ls.lever_closed == ls.lever_open) {
-        syslog(LOG_INFO, "Lever has been switched to neutral state.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LEVERNEUTRAL);      
-      }
-      
-      before.lever_closed = ls.lever_closed;
-    }
 
-    // lever open state changed
-    if (before.lever_open != ls.lever_open) {
-      if (ls.lever_open && !ls.lever_closed) {
-        syslog(LOG_INFO, "Lever has been switched to open.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LEVEROPEN);
-      } else if (ls.lever_closed == ls.lever_open) {
-        syslog(LOG_INFO, "Lever has been switched to neutral state.");
-        //MQTT message
-        strcpy(mqtt_payload, MQTT_MSG_LEVERNEUTRAL);      
-      }
-      
-      before.lever_open = ls.lever_open;
-    }
+  // everything happens in the event loop
+  struct evloop loop;
+  if (evloop_init(&loop) < 0) {
+    syslog(LOG_ERR, "Error %d on event loop initialization!", errno);
+    return -1;
+  }
 
-    // send MQTT messages if there is payload
-    if (mqtt_payload[0] && mosq) {
-      int ret;
-      int mid;
-      // state message
-      ret = mosquitto_publish(
-                        mosq, 
-                        &mid,
-                        MQTT_TOPIC_STATE,
-                        strlen(mqtt_payload), mqtt_payload,
-                        2, /* qos */
-                        true /* retain */
-                       );
-      if (ret != MOSQ_ERR_SUCCESS)
-        syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)", 
-                        mqtt_payload, 
-                        ret,
-                        mosquitto_strerror(ret));
-      else
-        syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.", 
-                         mqtt_payload, mid);
-                         
-      // change event
-      strcpy(mqtt_payload, MQTT_MSG_LEVERCHANGE);
-      ret = mosquitto_publish(
-                        mosq, 
-                        &mid,
-                        MQTT_TOPIC_EVENTS,
-                        strlen(mqtt_payload), mqtt_payload,
-                        2, /* qos */
-                        false /* don't retain */
-                       );
-      if (ret != MOSQ_ERR_SUCCESS)
-        syslog(LOG_ERR, "MQTT error on message \"%s\": %d (%s)", 
-                        mqtt_payload, 
-                        ret,
-                        mosquitto_strerror(ret));
-      else
-        syslog(LOG_INFO, "MQTT message \"%s\" sent with id %d.", 
-                         mqtt_payload, mid);
-      
-    }
-    
-    // call the mosquitto loop to process messages
-    if (mosq) {
-      int ret;
-      ret = mosquitto_loop(mosq, 100, 1);
-      // if failed, try to reconnect
-      if (ret)
-        mosquitto_reconnect(mosq);
-    }
+  static const int signals[] = { SIGINT, SIGTERM, SIGUSR1, 0 };
+  evloop_add_signals(&loop, signals, signal_callback, NULL);
 
-    I3C_reset_lever();
-    
-    if (sleep(1)) 
-      break;
-  }
+  if (obs.int_line.fd >= 0) {
+    syslog(LOG_INFO, "Waiting for lever changes on INT line %s:%u.",
+                     gpio_chip, gpio_offset);
+    evloop_add(&loop, obs.int_line.fd, EPOLLIN, int_line_callback, &obs);
+  } else
+    evloop_add_timer(&loop, LEVER_POLL_MS, poll_timer_callback, &obs);
+
+  if (mosq)
+    mqtt_evloop_attach(&obs.mqtt_ev, &loop, mosq, MQTT_KEEPALIVE * 1000 / 2);
+
+  static struct bus_telemetry telemetry;
+  bus_telemetry_attach(&telemetry, &loop, &lever.dev, mosq,
+                       MQTT_TOPIC_TELEMETRY, telemetry_ms);
+
+  evloop_run(&loop);
+  evloop_close(&loop);
+
+  gpio_line_close(&obs.int_line);
+
+  i3c_stats_log(&lever.dev);
+  i2c_transport_close(&i2c_bus);
+  snapshot_close(&lever_snap);
 
   // clean-up MQTT
   if (mosq) {